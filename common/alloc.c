@@ -156,6 +156,9 @@ alloc_handle_continue(void *drcontext);
 static bool
 malloc_lock_held_by_self(void);
 
+static bool
+malloc_stripe_held_by_self(void);
+
 static void
 malloc_wrap_init(void);
 
@@ -2700,7 +2703,8 @@ get_size_from_app_routine(IF_WINDOWS_(reg_t auxarg) app_pc real_base,
     ASSERT(alloc_ops.get_padded_size ||
            is_realloc_routine(routine->type), /* called on realloc(,0) */
            "should not get here");
-    ASSERT(!malloc_lock_held_by_self(), "should not hold lock here");
+    ASSERT(!malloc_lock_held_by_self() && !malloc_stripe_held_by_self(),
+           "should not hold lock here");
 #ifdef WINDOWS
     if (is_rtl_routine(routine->type)) {
         /* auxarg is heap */
@@ -2937,12 +2941,20 @@ event_post_call_entry_added(app_pc postcall)
  * insertions and deletions), so sticking with a hashtable!
  */
 #define ALLOC_TABLE_HASH_BITS 12
-static hashtable_t malloc_table;
+/* The table is split into stripes, each a separate hashtable with its own lock,
+ * so that mallocs and frees of unrelated chunks do not serialize.  An entry's
+ * stripe is picked by malloc_stripe().  malloc_lock() acquires every stripe.
+ */
+#define MALLOC_TABLE_STRIPE_BITS 4
+#define MALLOC_TABLE_STRIPES (1 << MALLOC_TABLE_STRIPE_BITS)
+static hashtable_t malloc_table[MALLOC_TABLE_STRIPES];
 /* we could switch to a full-fledged known-owner lock, or a recursive lock.
  * xref i#129.
  */
 #define THREAD_ID_INVALID ((thread_id_t)0) /* invalid thread id on Linux+Windows */
 static thread_id_t malloc_lock_owner = THREAD_ID_INVALID;
+/* Owner of each stripe lock, for self-recursion support */
+static volatile thread_id_t malloc_stripe_owner[MALLOC_TABLE_STRIPES];
 
 /* PR 525807: to handle malloc-based stacks we need an interval tree
  * for large mallocs.  Putting all mallocs in a tree instead of a table
@@ -2962,6 +2974,8 @@ enum {
     MALLOC_LIBC_INTERNAL_ALLOC = MALLOC_RESERVED_7,
     MALLOC_CONTAINS_LIBC_ALLOC = MALLOC_RESERVED_8,
     MALLOC_HAS_REDZONE         = MALLOC_RESERVED_9,
+    /* A free of the chunk is underway, running without the entry's stripe */
+    MALLOC_BEING_FREED         = MALLOC_RESERVED_10,
     /* The rest are reserved for future use */
 };
 
@@ -3017,8 +3031,22 @@ malloc_hash(void *v)
 {
     uint hash = (uint)(ptr_uint_t) v;
     ASSERT(MALLOC_CHUNK_ALIGNMENT == 8, "update hash func please");
-    /* Many mallocs are larger than 8 and we get fewer collisions w/ >> 5 */
-    return (hash >> 5);
+    /* Many mallocs are larger than 8 and we get fewer collisions w/ >> 5.
+     * The next bits select the stripe and are constant within each table.
+     */
+    return (hash >> (5 + MALLOC_TABLE_STRIPE_BITS));
+}
+
+static inline uint
+malloc_stripe(app_pc start)
+{
+    return (uint)(((ptr_uint_t)start >> 5) & (MALLOC_TABLE_STRIPES - 1));
+}
+
+static inline hashtable_t *
+malloc_table_for(app_pc start)
+{
+    return &malloc_table[malloc_stripe(start)];
 }
 
 static size_t
@@ -3146,8 +3174,11 @@ alloc_exit(void)
         alloc_replace_exit();
 
     if (alloc_ops.track_allocs) {
-        if (!alloc_ops.replace_malloc)
-            hashtable_delete_with_stats(&malloc_table, "malloc table");
+        if (!alloc_ops.replace_malloc) {
+            uint i;
+            for (i = 0; i < MALLOC_TABLE_STRIPES; i++)
+                hashtable_delete_with_stats(&malloc_table[i], "malloc table");
+        }
         rb_tree_destroy(large_malloc_tree);
         dr_mutex_destroy(large_malloc_lock);
 #ifdef USE_DRSYMS
@@ -3773,6 +3804,12 @@ malloc_iterate(malloc_iter_cb_t cb, void *iter_data)
     malloc_interface.malloc_iterate(cb, iter_data);
 }
 
+void
+malloc_iterate_parallel(malloc_iter_cb_t cb, void *iter_data)
+{
+    malloc_interface.malloc_iterate_parallel(cb, iter_data);
+}
+
 /***************************************************************************
  * Per-malloc API for wrapping
  */
@@ -3793,20 +3830,54 @@ malloc_lock_held_by_self(void)
     return (dr_get_thread_id(drcontext) == malloc_lock_owner);
 }
 
+static thread_id_t
+malloc_lock_self_id(void)
+{
+    void *drcontext = dr_get_current_drcontext();
+    if (drcontext == NULL) /* paranoid even w/ PR 536058 */
+        return THREAD_ID_INVALID;
+    return dr_get_thread_id(drcontext);
+}
+
+static bool
+malloc_stripe_held_by_self(void)
+{
+    thread_id_t self = malloc_lock_self_id();
+    uint i;
+    for (i = 0; i < MALLOC_TABLE_STRIPES; i++) {
+        if (malloc_stripe_owner[i] == self)
+            return true;
+    }
+    return false;
+}
+
+/* Stripes are only ever acquired in increasing order, all at once: a thread that
+ * holds a stripe never goes on to acquire another (see malloc_stripes_lock()).
+ * No thread holding a stripe calls out to the client or to code that might
+ * take every stripe.
+ */
 static void
 malloc_lock_internal(void)
 {
-    void *drcontext = dr_get_current_drcontext();
-    hashtable_lock(&malloc_table);
-    if (drcontext != NULL) /* paranoid even w/ PR 536058 */
-        malloc_lock_owner = dr_get_thread_id(drcontext);
+    thread_id_t self = malloc_lock_self_id();
+    uint i;
+    ASSERT(!malloc_stripe_held_by_self(), "cannot upgrade a stripe lock");
+    for (i = 0; i < MALLOC_TABLE_STRIPES; i++) {
+        hashtable_lock(&malloc_table[i]);
+        malloc_stripe_owner[i] = self;
+    }
+    malloc_lock_owner = self;
 }
 
 static void
 malloc_unlock_internal(void)
 {
+    uint i;
     malloc_lock_owner = THREAD_ID_INVALID;
-    hashtable_unlock(&malloc_table);
+    for (i = MALLOC_TABLE_STRIPES; i > 0; i--) {
+        malloc_stripe_owner[i - 1] = THREAD_ID_INVALID;
+        hashtable_unlock(&malloc_table[i - 1]);
+    }
 }
 
 static bool
@@ -3825,6 +3896,66 @@ malloc_unlock_if_locked_by_me(bool by_me)
         malloc_unlock_internal();
 }
 
+static void
+malloc_entry_unlock(uint locked)
+{
+    uint s;
+    for (s = 0; s < MALLOC_TABLE_STRIPES; s++) {
+        if (TEST(1 << s, locked)) {
+            malloc_stripe_owner[s] = THREAD_ID_INVALID;
+            hashtable_unlock(&malloc_table[s]);
+        }
+    }
+}
+
+/* Acquires the stripe of each of the up to two keys, in stripe order, unless this
+ * thread already holds it.  Stripe locks never nest: other than through
+ * malloc_lock(), which holds them all, a thread holding a stripe may only
+ * re-enter that same stripe.  Client callbacks and reports therefore run with
+ * no stripe held.  *locked holds the stripes to pass to malloc_entry_unlock().
+ */
+static void
+malloc_stripes_lock(app_pc key1, app_pc key2, uint *locked OUT)
+{
+    thread_id_t self = malloc_lock_self_id();
+    uint stripe[2], i, s;
+    bool holding = malloc_stripe_held_by_self();
+    stripe[0] = malloc_stripe(key1);
+    stripe[1] = malloc_stripe(key2);
+    if (stripe[1] < stripe[0]) {
+        uint tmp = stripe[0];
+        stripe[0] = stripe[1];
+        stripe[1] = tmp;
+    }
+    *locked = 0;
+    for (i = 0; i < 2; i++) {
+        s = stripe[i];
+        if (malloc_stripe_owner[s] == self)
+            continue;
+        ASSERT(!holding, "malloc table stripe locks must not nest");
+        hashtable_lock(&malloc_table[s]);
+        malloc_stripe_owner[s] = self;
+        *locked |= (1 << s);
+    }
+}
+
+/* Synchronizes operations on the entry for start */
+static void
+malloc_entry_lock(app_pc start, uint *locked OUT)
+{
+    malloc_stripes_lock(start, start, locked);
+}
+
+/* Like malloc_entry_lock() but also covers removing start's entry, which on
+ * Windows may remove a second entry (i#1072).
+ */
+static void
+malloc_entry_lock_for_remove(app_pc start, uint *locked OUT)
+{
+    malloc_stripes_lock(start, IF_WINDOWS_ELSE(start + DBGCRT_PRE_REDZONE_SIZE,
+                                               start), locked);
+}
+
 /* For wrapping, alloc_ops.global_lock is essentially always on. */
 static void
 malloc_wrap__lock(void)
@@ -3852,8 +3983,9 @@ malloc_add_common(app_pc start, app_pc end, app_pc real_end,
 {
     malloc_entry_t *e = (malloc_entry_t *) global_alloc(sizeof(*e), HEAPSTAT_WRAP);
     malloc_entry_t *old_e;
-    bool locked_by_me;
+    uint locked;
     malloc_info_t info;
+    bool native;
     ASSERT((alloc_ops.redzone_size > 0 && TEST(MALLOC_PRE_US, flags)) ||
            alloc_ops.record_allocs,
            "internal inconsistency on when doing detailed malloc tracking");
@@ -3869,43 +4001,45 @@ malloc_add_common(app_pc start, app_pc end, app_pc real_end,
     e->flags |= alloc_type;
     LOG(3, "%s: type=%x\n", __FUNCTION__, alloc_type);
     e->flags |= (client_flags & MALLOC_POSSIBLE_CLIENT_FLAGS);
-    /* grab lock around client call and hashtable operations */
-    locked_by_me = malloc_lock_if_not_held_by_me();
+    native = malloc_entry_is_native(e);
 
     e->data = NULL;
     malloc_entry_to_info(e, &info);
 
-    if (!malloc_entry_is_native(e)) { /* don't show internal allocs to client */
+    /* The client is called before the entry is in the table, and without its
+     * stripe held, as the callback may query other entries.
+     */
+    if (!native) { /* don't show internal allocs to client */
         e->data = client_add_malloc_pre(&info, mc, post_call);
     } else
         e->data = NULL;
 
+    malloc_entry_lock(start, &locked);
     ASSERT(is_entirely_in_heap_region(start, end), "heap data struct inconsistency");
     /* We invalidate rather than remove on a free and finalize the remove
      * when the free succeeds, so a race can hit a conflict.
      * Update: we no longer do this but leaving code for now
      */
-    old_e = hashtable_add_replace(&malloc_table, (void *) start, (void *)e);
+    old_e = hashtable_add_replace(malloc_table_for(start), (void *) start, (void *)e);
 
-    if (!malloc_entry_is_native(e) && end - start >= LARGE_MALLOC_MIN_SIZE) {
-        malloc_large_add(e->start, e->end - e->start);
-    }
-
-    if (!malloc_entry_is_native(e)) { /* don't show internal allocs to client */
-        /* PR 567117: client event with entry in hashtable */
-        client_add_malloc_post(&info);
-    }
+    if (!native && end - start >= LARGE_MALLOC_MIN_SIZE)
+        malloc_large_add(start, end - start);
 
 #ifdef STATISTICS
-    if (!malloc_entry_is_native(e))
+    if (!native)
         STATS_INC(num_mallocs);
     if (num_mallocs % 10000 == 0) {
-        hashtable_cluster_stats(&malloc_table, "malloc table");
+        hashtable_cluster_stats(malloc_table_for(start), "malloc table stripe");
         LOG(1, "malloc table stats after %u malloc calls\n", num_mallocs);
     }
 #endif
 
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
+
+    if (!native) { /* don't show internal allocs to client */
+        /* PR 567117: client event with entry in hashtable */
+        client_add_malloc_post(&info);
+    }
     if (old_e != NULL) {
         ASSERT(!TEST(MALLOC_VALID, old_e->flags), "internal error in malloc tracking");
         malloc_entry_free(old_e);
@@ -3924,44 +4058,64 @@ malloc_wrap__add(app_pc start, app_pc end, app_pc real_end,
                       client_flags, mc, post_call, 0);
 }
 
-/* up to caller to lock and unlock */
+/* up to caller to lock and unlock, via malloc_entry_lock() */
 static malloc_entry_t *
 malloc_lookup(app_pc start)
 {
-    return hashtable_lookup(&malloc_table, (void *) start);
+    return hashtable_lookup(malloc_table_for(start), (void *) start);
 }
 
-/* Note that this also frees the entry.  Caller should be holding lock. */
+/* Removes and frees e, which the caller looked up holding the stripes from
+ * malloc_entry_lock_for_remove() in locked.  Returns with those released.
+ * Client callbacks may query other entries, so we call the client without a
+ * stripe held: we claim e with MALLOC_BEING_FREED, which makes a racing free
+ * see it as already freed, and look it up again to remove it.
+ */
 static void
-malloc_entry_remove(malloc_entry_t *e)
+malloc_entry_remove_and_unlock(malloc_entry_t *e, uint locked)
 {
     malloc_info_t info;
     bool native = malloc_entry_is_native(e);
+    app_pc start;
+#ifdef WINDOWS
+    bool contains_libc;
+#endif
     ASSERT(e != NULL, "invalid arg");
+    start = e->start;
     malloc_entry_to_info(e, &info);
     if (!native) {
+        e->flags |= MALLOC_BEING_FREED;
+        malloc_entry_unlock(locked);
         client_remove_malloc_pre(&info);
-        if (e->end - e->start >= LARGE_MALLOC_MIN_SIZE) {
-            malloc_large_remove(e->start);
-        }
+        if (info.request_size >= LARGE_MALLOC_MIN_SIZE)
+            malloc_large_remove(start);
+        malloc_entry_lock_for_remove(start, &locked);
+        if (malloc_lookup(start) != e || !TEST(MALLOC_BEING_FREED, e->flags))
+            e = NULL; /* a racing app call already replaced it */
     }
+    if (e != NULL) {
 #ifdef WINDOWS
-    /* If we were wrong about this containing a missed-alloc inner libc alloc,
-     * we should remove the fake inner entry now (i#1072).
-     * If we were right, the inner entry will already be gone and this will be
-     * a nop.
-     */
-    if (TEST(MALLOC_CONTAINS_LIBC_ALLOC, e->flags)) {
-        ASSERT(e->start + DBGCRT_PRE_REDZONE_SIZE < e->end, "invalid internal alloc");
-        hashtable_remove(&malloc_table, e->start + DBGCRT_PRE_REDZONE_SIZE);
-    }
+        contains_libc = TEST(MALLOC_CONTAINS_LIBC_ALLOC, e->flags);
+        /* If we were wrong about this containing a missed-alloc inner libc alloc,
+         * we should remove the fake inner entry now (i#1072).
+         * If we were right, the inner entry will already be gone and this will be
+         * a nop.
+         */
+        if (contains_libc) {
+            ASSERT(start + DBGCRT_PRE_REDZONE_SIZE < start + info.request_size,
+                   "invalid internal alloc");
+            hashtable_remove(malloc_table_for(start + DBGCRT_PRE_REDZONE_SIZE),
+                             start + DBGCRT_PRE_REDZONE_SIZE);
+        }
 #endif
-    if (hashtable_remove(&malloc_table, e->start)) {
+        if (hashtable_remove(malloc_table_for(start), start)) {
 #ifdef STATISTICS
-        if (!native)
-            STATS_INC(num_frees);
+            if (!native)
+                STATS_INC(num_frees);
 #endif
+        }
     }
+    malloc_entry_unlock(locked);
     if (!native) {
         /* PR 567117: client event with entry removed from hashtable */
         client_remove_malloc_post(&info);
@@ -3973,11 +4127,13 @@ static void
 malloc_remove(app_pc start)
 {
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
+    uint locked;
+    malloc_entry_lock_for_remove(start, &locked);
     e = malloc_lookup(start);
     if (e != NULL)
-        malloc_entry_remove(e);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+        malloc_entry_remove_and_unlock(e, locked);
+    else
+        malloc_entry_unlock(locked);
 }
 #endif
 
@@ -3995,58 +4151,62 @@ malloc_entry_usable_extra(malloc_entry_t *e)
 }
 #endif
 
-/* caller must hold lock */
+/* Marks the entry for start valid or invalid.  Like adds and removes, the client
+ * is called without the stripe held.
+ */
 static void
-malloc_entry_set_valid(malloc_entry_t *e, bool valid)
+malloc_set_valid(app_pc start, bool valid)
 {
+    malloc_entry_t *e;
+    uint locked;
+    malloc_info_t info;
+    void *data = NULL;
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
+    if (e == NULL) {
+        /* ok to be NULL: a race where re-used in malloc and then freed already */
+        malloc_entry_unlock(locked);
+        return;
+    }
+    ASSERT((TEST(MALLOC_VALID, e->flags) && !valid) ||
+           (!TEST(MALLOC_VALID, e->flags) && valid),
+           "internal error in malloc tracking");
+    /* cache values for post-event */
+    malloc_entry_to_info(e, &info);
+    malloc_entry_unlock(locked);
+    /* FIXME: should we tell client whether undoing false call failure prediction? */
+    /* Call client BEFORE updating hashtable, to be consistent w/
+     * other add/remove calls, so that any hashtable iteration will
+     * NOT find the changes yet (PR 560824)
+     */
+    if (valid)
+        data = client_add_malloc_pre(&info, NULL, NULL);
+    else
+        client_remove_malloc_pre(&info);
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     if (e != NULL) {
-        /* cache values for post-event */
-        malloc_info_t info;
-        malloc_entry_to_info(e, &info);
-        /* FIXME: should we tell client whether undoing false call failure prediction? */
-        /* Call client BEFORE updating hashtable, to be consistent w/
-         * other add/remove calls, so that any hashtable iteration will
-         * NOT find the changes yet (PR 560824)
-         */
-        if (valid) {
-            e->data = client_add_malloc_pre(&info, NULL, NULL);
-        } else {
-            client_remove_malloc_pre(&info);
-        }
-        ASSERT((TEST(MALLOC_VALID, e->flags) && !valid) ||
-               (!TEST(MALLOC_VALID, e->flags) && valid),
-               "internal error in malloc tracking");
         if (valid) {
+            e->data = data;
             e->flags |= MALLOC_VALID;
-            if (e->end - e->start >= LARGE_MALLOC_MIN_SIZE) {
-                /* large malloc tree removes and re-adds rather than marking invalid
-                 * b/c can recover data from hashtable on failure
-                 */
-                malloc_large_add(e->start, e->end - e->start);
-            }
-            /* PR 567117: client event with entry in hashtable */
-            client_add_malloc_post(&info);
-        } else {
+        } else
             e->flags &= ~MALLOC_VALID;
-            if (e->end - e->start >= LARGE_MALLOC_MIN_SIZE) {
-                /* large malloc tree removes and re-adds rather than marking invalid */
-                malloc_large_remove(e->start);
-            }
-            /* PR 567117: client event with entry removed from hashtable */
-            client_remove_malloc_post(&info);
-        }
-    } /* ok to be NULL: a race where re-used in malloc and then freed already */
-}
-
-static void
-malloc_set_valid(app_pc start, bool valid)
-{
-    malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
-    if (e != NULL)
-        malloc_entry_set_valid(e, valid);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    }
+    if (info.request_size >= LARGE_MALLOC_MIN_SIZE) {
+        /* large malloc tree removes and re-adds rather than marking invalid
+         * b/c can recover data from hashtable on failure
+         */
+        if (valid)
+            malloc_large_add(start, info.request_size);
+        else
+            malloc_large_remove(start);
+    }
+    malloc_entry_unlock(locked);
+    /* PR 567117: client event with entry in, or removed from, hashtable */
+    if (valid)
+        client_add_malloc_post(&info);
+    else
+        client_remove_malloc_post(&info);
 }
 
 static bool
@@ -4088,12 +4248,13 @@ static uint
 malloc_alloc_type(byte *start)
 {
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
+    uint locked;
     uint res = 0;
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     if (e != NULL)
         res = malloc_alloc_entry_type(e);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
     return res;
 }
 
@@ -4102,11 +4263,12 @@ malloc_wrap__is_pre_us_ex(app_pc start, bool ok_if_invalid)
 {
     bool res = false;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    uint locked;
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     if (e != NULL)
         res = malloc_entry_is_pre_us(e, ok_if_invalid);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
     return res;
 }
 
@@ -4141,10 +4303,11 @@ malloc_is_native(app_pc start, cls_alloc_t *pt, bool consider_being_freed)
 #ifdef WINDOWS
     bool res = false;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    uint locked;
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     res = malloc_entry_is_native_ex(e, start, pt, consider_being_freed);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
     return res;
 #else
     /* optimization: currently nothing in the table */
@@ -4159,7 +4322,7 @@ malloc_is_native(app_pc start, cls_alloc_t *pt, bool consider_being_freed)
 static bool
 malloc_entry_exists_racy_nolock(app_pc start)
 {
-    malloc_entry_t *e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_entry_t *e = malloc_lookup(start);
     return (e != NULL && MALLOC_VISIBLE(e->flags));
 }
 #endif
@@ -4169,11 +4332,12 @@ malloc_wrap__end(app_pc start)
 {
     app_pc end = NULL;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    uint locked;
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     if (e != NULL && MALLOC_VISIBLE(e->flags))
         end = e->end;
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
     return end;
 }
 
@@ -4183,11 +4347,12 @@ malloc_wrap__size(app_pc start)
 {
     ssize_t sz = -1;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    uint locked;
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     if (e != NULL && MALLOC_VISIBLE(e->flags))
         sz = (e->end - start);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
     return sz;
 }
 
@@ -4197,11 +4362,12 @@ malloc_wrap__size_invalid_only(app_pc start)
 {
     ssize_t sz = -1;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    uint locked;
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     if (e != NULL && !TEST(MALLOC_VALID, e->flags))
         sz = (e->end - start);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
     return sz;
 }
 
@@ -4210,11 +4376,12 @@ malloc_wrap__get_client_data(app_pc start)
 {
     void *res = NULL;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    uint locked;
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     if (e != NULL)
         res = e->data;
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
     return res;
 }
 
@@ -4223,11 +4390,12 @@ malloc_wrap__get_client_flags(app_pc start)
 {
     uint res = 0;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    uint locked;
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     if (e != NULL)
         res = (e->flags & MALLOC_POSSIBLE_CLIENT_FLAGS);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
     return res;
 }
 
@@ -4236,13 +4404,14 @@ malloc_wrap__set_client_flag(app_pc start, uint client_flag)
 {
     malloc_entry_t *e;
     bool found = false;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    uint locked;
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     if (e != NULL) {
         e->flags |= (client_flag & MALLOC_POSSIBLE_CLIENT_FLAGS);
         found = true;
     }
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
     return found;
 }
 
@@ -4251,13 +4420,14 @@ malloc_wrap__clear_client_flag(app_pc start, uint client_flag)
 {
     malloc_entry_t *e;
     bool found = false;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    uint locked;
+    malloc_entry_lock(start, &locked);
+    e = malloc_lookup(start);
     if (e != NULL) {
         e->flags &= ~(client_flag & MALLOC_POSSIBLE_CLIENT_FLAGS);
         found = true;
     }
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_entry_unlock(locked);
     return found;
 }
 
@@ -4270,19 +4440,22 @@ malloc_iterate_internal(bool include_native, malloc_iter_cb_t cb, void *iter_dat
      */
     bool locked_by_me = malloc_lock_if_not_held_by_me();
     malloc_info_t info;
-    for (i = 0; i < HASHTABLE_SIZE(malloc_table.table_bits); i++) {
-        hash_entry_t *he, *nxt;
-        for (he = malloc_table.table[i]; he != NULL; he = nxt) {
-            malloc_entry_t *e = (malloc_entry_t *) he->payload;
-            /* support malloc_remove() while iterating */
-            nxt = he->next;
-            if (MALLOC_VISIBLE(e->flags) &&
-                (include_native || !malloc_entry_is_native(e))) {
-                malloc_entry_to_info(e, &info);
-                if (include_native)
-                    info.client_flags = e->flags; /* all of them */
-                if (!cb(&info, iter_data)) {
-                    goto malloc_iterate_done;
+    uint s;
+    for (s = 0; s < MALLOC_TABLE_STRIPES; s++) {
+        for (i = 0; i < HASHTABLE_SIZE(malloc_table[s].table_bits); i++) {
+            hash_entry_t *he, *nxt;
+            for (he = malloc_table[s].table[i]; he != NULL; he = nxt) {
+                malloc_entry_t *e = (malloc_entry_t *) he->payload;
+                /* support malloc_remove() while iterating */
+                nxt = he->next;
+                if (MALLOC_VISIBLE(e->flags) &&
+                    (include_native || !malloc_entry_is_native(e))) {
+                    malloc_entry_to_info(e, &info);
+                    if (include_native)
+                        info.client_flags = e->flags; /* all of them */
+                    if (!cb(&info, iter_data)) {
+                        goto malloc_iterate_done;
+                    }
                 }
             }
         }
@@ -4337,15 +4510,19 @@ malloc_wrap_init(void)
 {
     if (alloc_ops.track_allocs) {
         hashtable_config_t hashconfig = {sizeof(hashconfig),};
-        hashtable_init_ex(&malloc_table, ALLOC_TABLE_HASH_BITS, HASH_INTPTR,
-                          false/*!str_dup*/, false/*!synch*/, malloc_entry_free,
-                          malloc_hash, NULL);
+        uint i;
         /* hash lookup can be a bottleneck so it's worth taking some extra space
          * to reduce the collision chains
          */
         hashconfig.resizable = true;
         hashconfig.resize_threshold = 50; /* default is 75 */
-        hashtable_configure(&malloc_table, &hashconfig);
+        for (i = 0; i < MALLOC_TABLE_STRIPES; i++) {
+            hashtable_init_ex(&malloc_table[i],
+                              ALLOC_TABLE_HASH_BITS - MALLOC_TABLE_STRIPE_BITS,
+                              HASH_INTPTR, false/*!str_dup*/, false/*!synch*/,
+                              malloc_entry_free, malloc_hash, NULL);
+            hashtable_configure(&malloc_table[i], &hashconfig);
+        }
     }
 
     malloc_interface.malloc_lock = malloc_wrap__lock;
@@ -4361,6 +4538,8 @@ malloc_wrap_init(void)
     malloc_interface.malloc_set_client_flag = malloc_wrap__set_client_flag;
     malloc_interface.malloc_clear_client_flag = malloc_wrap__clear_client_flag;
     malloc_interface.malloc_iterate = malloc_wrap__iterate;
+    /* We have no index of the app's heap to divide up */
+    malloc_interface.malloc_iterate_parallel = malloc_wrap__iterate;
     malloc_interface.malloc_intercept = malloc_wrap__intercept;
     malloc_interface.malloc_unintercept = malloc_wrap__unintercept;
     malloc_interface.malloc_set_init = malloc_wrap__set_init;
@@ -5309,16 +5488,16 @@ record_allocator(void *drcontext, cls_alloc_t *pt, alloc_routine_entry_t *routin
  */
 static bool
 handle_free_check_mismatch(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
-                           alloc_routine_entry_t *routine, malloc_entry_t *entry)
+                           alloc_routine_entry_t *routine, bool have_entry,
+                           uint entry_type)
 {
     /* XXX: safe_read */
 #ifdef WINDOWS
     routine_type_t type = routine->type;
 #endif
     app_pc base = (app_pc) drwrap_get_arg(wrapcxt, ARGNUM_FREE_PTR(type));
-    /* We pass in entry to avoid an extra hashtable lookup */
-    uint alloc_type = (entry == NULL) ? malloc_alloc_type(base) :
-        malloc_alloc_entry_type(entry);
+    /* We pass in the entry's type to avoid an extra hashtable lookup */
+    uint alloc_type = have_entry ? entry_type : malloc_alloc_type(base);
     uint free_type = malloc_allocator_type(routine);
     LOG(3, "alloc/free match test: alloc %x vs free %x %s\n",
         alloc_type, free_type, routine->name);
@@ -5333,7 +5512,7 @@ handle_free_check_mismatch(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     if (type == RTL_ROUTINE_FREE_STRING)
         return true;
 #endif
-    if (entry == NULL && alloc_type == MALLOC_ALLOCATOR_UNKNOWN) {
+    if (!have_entry && alloc_type == MALLOC_ALLOCATOR_UNKNOWN) {
         /* try 4 bytes back, in case this is an array w/ size passed to delete */
         alloc_type = malloc_alloc_type(base - sizeof(int));
         if (alloc_type != MALLOC_ALLOCATOR_UNKNOWN)
@@ -5402,9 +5581,18 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     bool size_in_zone = (redzone_size(routine) > 0 && alloc_ops.size_in_redzone);
     size_t size = 0;
     malloc_entry_t *entry;
+    uint locked;
+    bool claimed = false, have_entry, pre_us = false;
+    uint entry_type = 0;
+    malloc_info_t info;
+    app_pc free_base;
+#ifdef DEBUG
+    ushort usable_extra = 0;
+#endif
 
     base = (app_pc)arg;
     real_base = base;
+    free_base = base;
     pt->alloc_being_freed = base;
 
     if (check_recursive_same_sequence(drcontext, &pt, routine, (ptr_int_t) base,
@@ -5434,7 +5622,7 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     /* We must have synchronized access to avoid races and ensure we report
      * an error on the 2nd free to the same base
      */
-    malloc_lock();
+    malloc_entry_lock_for_remove(base, &locked);
     entry = malloc_lookup(base);
     if (entry != NULL &&
         (malloc_entry_is_native_ex(entry, base, pt, false)
@@ -5446,10 +5634,38 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
          || (malloc_entry_is_libc_internal(entry) && !is_rtl_routine(routine->type))
 #endif
          )) {
-        malloc_entry_remove(entry);
-        malloc_unlock();
+        malloc_entry_remove_and_unlock(entry, locked);
         return;
     }
+    /* A chunk another thread is already freeing is a double free */
+    if (entry != NULL && TEST(MALLOC_BEING_FREED, entry->flags))
+        entry = NULL;
+    have_entry = (entry != NULL);
+    if (entry != NULL) {
+        pre_us = malloc_entry_is_pre_us(entry, false);
+        if (pt->in_heap_routine == 1 IF_WINDOWS(&& !pt->ignore_next_mismatch))
+            entry_type = malloc_alloc_entry_type(entry);
+        /* call will fail if heap handle does not match.
+         * it will not fail if flags are invalid.
+         * instead of tracking the heap handle we could call RtlValidateHeap here?
+         */
+        if (IF_WINDOWS_ELSE(type != RTL_ROUTINE_FREE ||
+                            heap_region_get_heap(base) == heap, true)) {
+            /* Error reports iterate the malloc table and client callbacks may
+             * query it, so neither can run holding a stripe.  We claim the
+             * entry instead, cache what we need, and look it up again to
+             * remove it.
+             */
+            entry->flags |= MALLOC_BEING_FREED;
+            claimed = true;
+            malloc_entry_to_info(entry, &info);
+            size = malloc_entry_size(entry);
+            IF_DEBUG(usable_extra = malloc_entry_usable_extra(entry);)
+        }
+    }
+    malloc_entry_unlock(locked);
+    entry = NULL;
+
     if (pt->in_heap_routine == 1/*alread incremented, so outer*/) {
         /* N.B.: should be called even if not reporting mismatches as it also
          * records the outer layer (i#913)
@@ -5459,22 +5675,17 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
             pt->ignore_next_mismatch = false;
         else
 #endif
-            handle_free_check_mismatch(drcontext, pt, wrapcxt, routine, entry);
+            handle_free_check_mismatch(drcontext, pt, wrapcxt, routine,
+                                       have_entry, entry_type);
     }
 #ifdef WINDOWS
     else if (pt->ignore_next_mismatch)
         pt->ignore_next_mismatch = false;
 #endif
 
-    if (entry != NULL && redzone_size(routine) > 0 &&
-        !malloc_entry_is_pre_us(entry, false))
+    if (have_entry && redzone_size(routine) > 0 && !pre_us)
         real_base = base - redzone_size(routine);
-    if (entry == NULL
-        /* call will fail if heap handle does not match.
-         * it will not fail if flags are invalid.
-         * instead of tracking the heap handle we could call RtlValidateHeap here?
-         */
-        IF_WINDOWS(|| (type == RTL_ROUTINE_FREE && heap_region_get_heap(base) != heap))) {
+    if (!claimed) {
         if (pt->in_realloc) {
             /* when realloc calls free we've already invalidated the heap */
             ASSERT(pt->in_heap_routine > 1, "realloc calling free inconsistent");
@@ -5491,15 +5702,12 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
 #endif
         app_pc top_pc;
         dr_mcontext_t *mc = drwrap_get_mcontext_ex(wrapcxt, DR_MC_GPR);
-        malloc_info_t info;
-        /* i#858, we obtain the real_size from entry instead of size + redzone */
-        malloc_entry_to_info(entry, &info);
 
         pt->expect_lib_to_fail = false;
         if (redzone_size(routine) > 0) {
             ASSERT(redzone_size(routine) >= sizeof(size_t),
                    "redzone < 4 not supported");
-            if (malloc_entry_is_pre_us(entry, false)) {
+            if (pre_us) {
                 /* was allocated before we took control, so no redzone */
                 size_in_zone = false;
                 LOG(2, "free of pre-control "PFX"-"PFX"\n", base, base+size);
@@ -5520,8 +5728,7 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
         if (size_in_zone)
             size = *((size_t *)(base - redzone_size(routine)));
         else {
-            /* since we have hashtable, we can use it to retrieve the app size */
-            size = malloc_entry_size(entry);
+            /* since we have hashtable, we used it to retrieve the app size */
             ASSERT((ssize_t)size != -1, "error determining heap block size");
         }
         DOLOG(2, {
@@ -5530,7 +5737,7 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
             if (base != real_base) {
                 ASSERT(base - real_base == alloc_ops.redzone_size, "redzone mismatch");
                 /* usable_extra includes trailing redzone */
-                real_size = (base - real_base) + size + malloc_entry_usable_extra(entry);
+                real_size = (base - real_base) + size + usable_extra;
             } else {
                 /* A pre-us alloc or msvcrtdbg alloc (i#26) w/ no redzone */
                 real_size = size;
@@ -5575,9 +5782,14 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
             size = 0;
         }
 
-        malloc_entry_remove(entry);
+        /* A racing app call may have removed the entry meanwhile */
+        malloc_entry_lock_for_remove(free_base, &locked);
+        entry = malloc_lookup(free_base);
+        if (entry != NULL && TEST(MALLOC_BEING_FREED, entry->flags))
+            malloc_entry_remove_and_unlock(entry, locked);
+        else
+            malloc_entry_unlock(locked);
     }
-    malloc_unlock();
 
     set_handling_heap_layer(pt, base, size);
 #ifdef WINDOWS
@@ -6029,6 +6241,7 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     size_t size = (size_t) drwrap_get_arg(wrapcxt, ARGNUM_REALLOC_SIZE(type));
     app_pc base = (app_pc) drwrap_get_arg(wrapcxt, ARGNUM_REALLOC_PTR(type));
     malloc_entry_t *entry;
+    uint locked;
     if (base == NULL) {
         /* realloc(NULL, size) == malloc(size) (PR 416535) */
         /* call_site for call;jmp will be jmp, so retaddr better even if post-call */
@@ -6045,11 +6258,10 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
         LOG(2, "realloc-pre "PFX" new size %d\n", base, pt->realloc_replace_size);
         return;
     }
-    malloc_lock();
+    malloc_entry_lock_for_remove(base, &locked);
     entry = malloc_lookup(base);
     if (entry != NULL && malloc_entry_is_native_ex(entry, base, pt, true)) {
-        malloc_entry_remove(entry);
-        malloc_unlock();
+        malloc_entry_remove_and_unlock(entry, locked);
         return;
     }
 #ifdef WINDOWS
@@ -6059,7 +6271,7 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
 #endif
     if (check_recursive_same_sequence(drcontext, &pt, routine, pt->alloc_size,
                                       size - redzone_size(routine)*2)) {
-        malloc_unlock();
+        malloc_entry_unlock(locked);
         return;
     }
     set_handling_heap_layer(pt, base, size);
@@ -6068,10 +6280,19 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
 #endif
     pt->in_realloc = true;
     real_base = pt->alloc_base;
+    if (entry != NULL && TEST(MALLOC_BEING_FREED, entry->flags))
+        entry = NULL; /* racing with a free of the same chunk */
+    if (entry == NULL) {
+        /* The error report iterates the malloc table, so we must not hold a
+         * stripe.  There is no entry for us to protect.
+         */
+        malloc_entry_unlock(locked);
+        locked = 0;
+    }
     if (!check_valid_heap_block(entry == NULL, pt->alloc_base, pt, wrapcxt,
                                 routine->name, is_free_routine(type))) {
         pt->expect_lib_to_fail = true;
-        malloc_unlock();
+        malloc_entry_unlock(locked);
         return;
     }
     ASSERT(entry != NULL, "shouldn't get here: tangent or invalid checked above");
@@ -6082,8 +6303,9 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
         if (malloc_entry_is_pre_us(entry, false)) {
             /* was allocated before we took control, so no redzone */
             /* if we wait until post-free to check failure, we'll have
-             * races, so we invalidate here: see comments for free */
-            malloc_entry_set_valid(entry, false);
+             * races, so we invalidate here: see comments for free.
+             * We do so below, once we no longer hold the stripe.
+             */
             invalidated = true;
             LOG(2, "realloc of pre-control "PFX"-"PFX"\n",
                 pt->alloc_base, pt->alloc_base + pt->realloc_old_info.request_size);
@@ -6120,9 +6342,9 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
         " base="PFX" oldsz="PIFX" newsz="PIFX"\n",
         IF_WINDOWS_(drwrap_get_arg(wrapcxt, 0))
         pt->alloc_base, pt->realloc_old_info.request_size, pt->alloc_size);
-    if (alloc_ops.record_allocs && !invalidated)
-        malloc_entry_set_valid(entry, false);
-    malloc_unlock();
+    malloc_entry_unlock(locked);
+    if (invalidated || alloc_ops.record_allocs)
+        malloc_set_valid(base, false);
 }
 
 static void
@@ -6766,7 +6988,8 @@ handle_alloc_pre_ex(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
                 /* N.B.: should be called even if not reporting mismatches as it also
                  * records the outer layer (i#913)
                  */
-                handle_free_check_mismatch(drcontext, pt, wrapcxt, routine, NULL);
+                handle_free_check_mismatch(drcontext, pt, wrapcxt, routine,
+                                           false, 0);
 #ifdef WINDOWS
                 pt->ignore_next_mismatch = false; /* just in case */
 #endif
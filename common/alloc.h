@@ -77,6 +77,12 @@ typedef struct _alloc_options_t {
     bool shared_redzones;
     uint delay_frees;
     uint delay_frees_maxsz;
+    /* Segment delayed frees by size class */
+    bool delay_frees_by_size;
+    /* Minimum delayed frees to release at once when a threshold is hit */
+    uint delay_frees_batch;
+    /* Limit on delayed bytes summed over all arenas: 0 means none */
+    uint delay_frees_global_maxsz;
 
     bool skip_msvc_importers;
 
@@ -100,6 +106,40 @@ typedef struct _alloc_options_t {
      */
     bool replace_nosy_allocs;
 
+    /* i#948: only used with -replace_malloc: how many free chunks of each small
+     * size to cache per thread, and how many frees to batch before appending
+     * them to the shared delay list.  0 disables the per-thread caches.
+     * Ignored when global_lock is set.
+     */
+    uint magazine_size;
+
+    /* i#948: only used with -replace_malloc on Linux: how many independent
+     * arenas to spread threads across.  0 or 1 means a single arena.
+     */
+    uint arena_shards;
+
+    /* Only used with -replace_malloc on Linux: whether to back arenas with
+     * transparent huge pages.
+     */
+    bool arena_huge_pages;
+
+    /* Only used with -replace_malloc on Linux: free chunks at least this large
+     * have their interior pages returned to the OS.  0 disables.  Must be 0 when
+     * freed memory is filled with a pattern.
+     */
+    uint heap_release_threshold;
+
+    /* Only used with -replace_malloc: keep a lazily rebuilt index of each
+     * arena's chunks for malloc_iterate().
+     */
+    bool chunk_index;
+
+    /* Only used with -replace_malloc: the number of threads, including the
+     * caller, that malloc_iterate_parallel() uses.  Values above 1 create a
+     * pool of worker threads at init time.
+     */
+    uint iterate_threads;
+
     /* Add new options here */
 } alloc_options_t;
 
@@ -120,6 +160,7 @@ enum {
     MALLOC_RESERVED_9 = 0x1000,
     MALLOC_RESERVED_10= 0x2000,
     MALLOC_CLIENT_5 =   0x4000,
+    MALLOC_RESERVED_11= 0x8000,
     MALLOC_POSSIBLE_CLIENT_FLAGS = (MALLOC_CLIENT_1 | MALLOC_CLIENT_2 |
                                     MALLOC_CLIENT_3 | MALLOC_CLIENT_4 |
                                     MALLOC_CLIENT_5),
@@ -231,6 +272,14 @@ malloc_clear_client_flag(app_pc start, uint client_flag);
 void
 malloc_iterate(malloc_iter_cb_t cb, void *iter_data);
 
+/* Like malloc_iterate() but, with -replace_malloc and iterate_threads > 1,
+ * may invoke cb concurrently from several threads, so cb must be thread-safe.
+ * Allocations and frees block until the iteration completes.  Usable while
+ * all other threads are suspended.
+ */
+void
+malloc_iterate_parallel(malloc_iter_cb_t cb, void *iter_data);
+
 typedef size_t (*alloc_size_func_t)(void *);
 
 #ifdef UNIX
@@ -436,6 +485,16 @@ client_handle_mremap(app_pc old_base, size_t old_size, app_pc new_base, size_t n
                      bool image);
 #endif
 
+#ifdef LINUX
+/* For replacing:
+ *   Called when the physical pages of [start, end), which lies inside a free
+ *   chunk, have been returned to the OS.  The range remains mapped and its
+ *   contents are undefined.
+ */
+void
+client_handle_heap_release(app_pc start, app_pc end);
+#endif
+
 #ifdef WINDOWS
 void
 client_handle_heap_destroy(void *drcontext, HANDLE heap, void *client_data);
@@ -323,6 +323,7 @@ typedef struct _malloc_interface_t {
     bool (*malloc_set_client_flag)(app_pc start, uint client_flag);
     bool (*malloc_clear_client_flag)(app_pc start, uint client_flag);
     void (*malloc_iterate)(malloc_iter_cb_t cb, void *iter_data);
+    void (*malloc_iterate_parallel)(malloc_iter_cb_t cb, void *iter_data);
     void (*malloc_intercept)(app_pc pc, routine_type_t type, alloc_routine_entry_t *e,
                              bool check_mismatch, bool check_winapi_match);
     void (*malloc_unintercept)(app_pc pc, routine_type_t type, alloc_routine_entry_t *e,
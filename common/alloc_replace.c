@@ -51,7 +51,8 @@
  *
  * Design:
  * + for !alloc_ops.external_headers, header sits inside redzone;
- *   for alloc_ops.external_headers, header is in a hashtable
+ *   for alloc_ops.external_headers, header is in a side table indexed by
+ *   the chunk address (i#879), so the redzone can be small or even empty
  * + redzones are shared among adjacent allocs and are centered to
  *   reduce the likelihood of corruption from over/underflow:
  *
@@ -72,9 +73,12 @@
  *   take the first fit.
  *   we can add fancier algorithms in the future.
  * + for alloc_ops.external_headers, free list entries use headers that
- *   are co-located with the chunk headers
+ *   are co-located with the chunk headers in the side table
  * + for !alloc_ops.external_headers, free list entry headers begin where
  *   regular headers begin, in the middle of the redzone.
+ * + with alloc_ops.magazine_size, each thread caches free chunks of the small
+ *   buckets and batches its frees, taking the arena lock only to refill or
+ *   flush (i#948).
  */
 
 #include "dr_api.h"
@@ -85,8 +89,14 @@
 #include "alloc.h"
 #include "alloc_private.h"
 #include "heap.h"
+#include "redblack.h"
 #include "drsymcache.h"
 #include <string.h> /* memcpy */
+#include <stddef.h> /* offsetof */
+#ifdef LINUX
+# include "sysnum_linux.h"
+# include <sys/mman.h>
+#endif
 
 #ifdef MACOS
 # include <sys/syscall.h>
@@ -118,6 +128,21 @@
 #define ARENA_INITIAL_COMMIT  CHUNK_MIN_MMAP
 #define ARENA_INITIAL_SIZE  4*1024*1024
 
+#ifdef LINUX
+/* With alloc_ops.arena_huge_pages, mmapped arenas are aligned to this and all
+ * arenas grow by multiples of it so the kernel can back them with transparent
+ * huge pages.
+ */
+# define ARENA_HUGE_PAGE_SIZE (2*1024*1024)
+/* Older headers lack these */
+# ifndef MADV_HUGEPAGE
+#  define MADV_HUGEPAGE 14
+# endif
+# ifndef MADV_FREE
+#  define MADV_FREE 8
+# endif
+#endif
+
 #define REQUEST_DIFF_MAX USHRT_MAX
 
 /* we only support allocation sizes under 4GB */
@@ -131,6 +156,8 @@ static const uint free_list_sizes[] = {
     4096, 8192, 16384, 32768,
 };
 #define NUM_FREE_LISTS (sizeof(free_list_sizes)/sizeof(free_list_sizes[0]))
+/* The final bucket holds all larger sizes, and is indexed by size */
+#define VAR_BUCKET (NUM_FREE_LISTS - 1)
 
 /* Values stored in chunk header flags */
 enum {
@@ -142,12 +169,17 @@ enum {
     CHUNK_DELAY_FREE  = MALLOC_RESERVED_7,          /* 0x0400 */
 #ifdef WINDOWS
     CHUNK_LAYER_RTL   = MALLOC_RESERVED_8,          /* 0x0800 */
+#else
+    /* A true free chunk whose interior pages were returned to the OS */
+    CHUNK_PAGES_RELEASED = MALLOC_RESERVED_8,       /* 0x0800 */
 #endif
     /* i#1532: only check for non-static libc.  This is Windows-only but it's
      * cleaner to avoid all the ifdefs down below.
      */
     CHUNK_LAYER_NOCHECK = MALLOC_RESERVED_9,
     CHUNK_SKIP_ITER   =   MALLOC_RESERVED_10,
+    /* i#948: a free chunk sitting in a per-thread magazine */
+    CHUNK_MAGAZINE    =   MALLOC_RESERVED_11,       /* 0x8000 */
 
     /* meta-flags */
 #ifdef WINDOWS
@@ -256,22 +288,114 @@ typedef struct _free_header_t {
     struct _free_header_t *next;
 } free_header_t;
 
+/* For alloc_ops.external_headers (i#879), each chunk's header lives in one of
+ * these, which never moves while the chunk exists.  ext_table maps a chunk's
+ * user address to its entry.
+ */
+typedef struct _ext_header_t {
+    byte *base;
+    free_header_t fh;
+} ext_header_t;
+
+#define EXT_HEADER(head) \
+    ((ext_header_t *)((byte *)(head) - offsetof(ext_header_t, fh)))
+
+/* With -delay_frees_by_size, delayed frees are segmented into these size
+ * classes, each its own FIFO, and we release from whichever class holds the most
+ * of the resource that is over its limit.  A few huge frees then only push
+ * out other large chunks, rather than flushing every small chunk.
+ * Without it, everything goes into class 0, giving a single FIFO.
+ */
+#define NUM_DELAY_CLASSES 3
+static const heapsz_t delay_class_max[NUM_DELAY_CLASSES - 1] = { 256, 8192 };
+static uint num_delay_classes = 1;
+
+typedef struct _delay_list_t {
+    free_header_t *front;
+    free_header_t *last;
+    uint chunks;
+    size_t bytes;
+} delay_list_t;
+
 typedef struct _free_lists_t {
     /* Delayed frees are kept here for more fair delaying across sizes
      * than if we put them into the per-size lists.
      */
-    free_header_t *delay_front;
-    free_header_t *delay_last;
-    /* The delay threshold is per-arena */
+    delay_list_t delay[NUM_DELAY_CLASSES];
+    /* The delay threshold is per-arena.  These are the totals across classes. */
     uint delayed_chunks;
     size_t delayed_bytes;
     /* A normal free list can be LIFO, but for more effective delayed frees
      * we want FIFO.  FIFO-per-bucket-size is sufficient.
+     * front[VAR_BUCKET] and last[VAR_BUCKET] are unused: see var_sizes.
      */
     free_header_t *front[NUM_FREE_LISTS];
     free_header_t *last[NUM_FREE_LISTS];
+    /* Bit i is set iff bucket i is non-empty, so we can bit-scan for a fit */
+    uint nonempty;
+    /* The var-size bucket is a tree keyed by chunk size, with one node per
+     * distinct size whose client field is the front of a FIFO list of the chunks
+     * of that size.  In that list the front's prev field points at the last entry.
+     */
+    rb_tree_t *var_sizes;
+    uint num_var_sizes;
+    /* Bumped whenever a chunk boundary moves in any arena sharing these lists,
+     * which invalidates those arenas' chunk indices.
+     */
+    uint layout_gen;
 } free_lists_t;
 
+/* i#948: per-thread magazines of truly-free chunks for the small buckets of
+ * cur_arena, so that the common-case malloc and free do not need the arena lock.
+ * A magazine is refilled in one batch from the front of its bucket (falling back
+ * to carving new chunks), and frees are batched in a pending array that is
+ * appended to the arena's delay list in order, preserving its FIFO.
+ * Magazine chunks are marked CHUNK_FREED | CHUNK_MAGAZINE and are never
+ * coalesced with while in a magazine.
+ */
+#define MAGAZINE_MAX_CHUNK 2048
+#define MAGAZINE_MAX_SIZE 64 /* must match the -magazine_size maximum */
+
+typedef struct _magazine_t {
+    free_header_t *front;
+    free_header_t *last;
+    uint count;
+    /* How many chunks at the front came off the free list rather than being
+     * freshly carved.  A refill takes from the free list before carving, and
+     * only happens once the magazine is empty, so these are always a prefix.
+     */
+    uint reused;
+} magazine_t;
+
+/* Buckets with size <= MAGAZINE_MAX_CHUNK: set at init */
+static uint num_magazines;
+
+/* Set at exit to stop thread exits from touching freed arenas */
+static bool magazines_exited;
+
+/* The magazine fast paths call the client without the arena lock.  They hold
+ * this for read across those calls, and malloc_lock() holds it for write, so
+ * that a malloc_lock() holder sees no concurrent alloc or free callbacks.
+ * Only created when magazines are enabled.
+ */
+static void *magazine_rwlock;
+
+static int cls_idx_replace = -1;
+
+typedef struct _cls_replace_t {
+#ifdef WINDOWS
+    uint in_nosy_heap_region; /* are we inside RtlGetThreadPreferredUILanguages */
+#endif
+    /* The arena this thread's magazines belong to: cur_arena, or the
+     * thread's shard with -arena_shards.
+     */
+    struct _arena_header_t *arena;
+    magazine_t mag[NUM_FREE_LISTS];
+    /* Frees not yet added to the delay list */
+    chunk_header_t *pending[MAGAZINE_MAX_SIZE];
+    uint num_pending;
+} cls_replace_t;
+
 #ifdef LINUX
 /* we assume we're the sole users of the brk (after pre-us allocs) */
 static byte *pre_us_brk;
@@ -332,6 +456,14 @@ typedef struct _arena_header_t {
 #endif
     /* we need to iterate arenas belonging to one (non-default) Heap */
     struct _arena_header_t *next_arena;
+    /* For alloc_ops.chunk_index: address-ordered headers of every chunk in this
+     * arena, freed or not.  Rebuilt lazily when index_gen is behind
+     * free_list->layout_gen.
+     */
+    chunk_header_t **index;
+    uint index_num;
+    uint index_cap;
+    uint index_gen;
     /* for main arena of each Heap, we inline free_lists_t here */
 } arena_header_t;
 
@@ -368,6 +500,14 @@ static HANDLE process_heap;
  */
 static arena_header_t *cur_arena;
 
+/* i#948: for -arena_shards on Linux, threads are spread across this many
+ * independent main arenas, each with its own lock, free lists, and delay list.
+ * cur_arena (which owns the brk) is always shard 0.  Elsewhere num_shards is 1.
+ */
+#define MAX_ARENA_SHARDS 64 /* must match the -arena_shards maximum */
+static arena_header_t *shard_arenas[MAX_ARENA_SHARDS];
+static uint num_shards = 1;
+
 /* For handling pre-us mallocs for non-earliest injection or delayed/attach
  * instrumentation.  Contains chunk_header_t entries.
  * We assume this table is only added to at init and only removed from
@@ -397,8 +537,22 @@ static uint num_coalesces;
 static uint num_dealloc;
 static uint dbgcrt_mismatch;
 static uint allocs_left_native;
+static uint magazine_hits;
+static uint magazine_refills;
+static uint magazine_flushes;
+static uint shard_cross_ops;
+static uint delay_batches;
+static uint pages_released;
+static uint page_release_calls;
+static uint zero_fills_avoided;
+static uint realloc_in_place_grows;
+static uint chunk_index_rebuilds;
+static uint parallel_iterations;
 #endif
 
+/* Total delayed bytes across all arenas, for -delay_frees_global_maxsz */
+static volatile int global_delayed_bytes;
+
 #ifdef DEBUG
 /* used to allow use of app stack on abort */
 static bool aborting;
@@ -555,9 +709,9 @@ app_heap_unlock(void *drcontext, void *recur_lock)
 static void
 arena_lock(void *drcontext, arena_header_t *arena, bool app_synch)
 {
-    /* XXX i#948: use per-thread free lists to avoid lock in common case,
-     * for Linux or Windows libc at least (where heap synch is not part
-     * of app API), and when !alloc_ops.global_lock.
+    /* i#948: with alloc_ops.magazine_size, most small allocs and frees of
+     * cur_arena are served by per-thread magazines and never reach here.
+     * XXX: extend the magazines to non-default arenas.
      */
     if (app_synch)
         app_heap_lock(drcontext, arena->lock);
@@ -629,6 +783,13 @@ iterator_unlock(arena_header_t *arena, bool in_alloc)
 #endif
 }
 
+/* Called whenever a chunk is added, removed, or resized within arena */
+static inline void
+arena_layout_changed(arena_header_t *arena)
+{
+    arena->free_list->layout_gen++;
+}
+
 #if defined(WINDOWS) && defined(X64)
 static app_pc
 get_replace_native_caller(void *drcontext)
@@ -761,12 +922,87 @@ os_large_free(byte *map, size_t map_size)
 #endif
 }
 
+#ifdef LINUX
+/* DR has no madvise routine.  madvise only changes how the kernel backs our
+ * own anonymous pages, so DR's view of the address space is unaffected.
+ */
+static bool
+os_madvise(byte *start, size_t size, int advice)
+{
+    ptr_int_t res = raw_syscall(SYS_madvise, 3, (ptr_int_t)start, (ptr_int_t)size,
+                                (ptr_int_t)advice);
+    LOG(3, "%s "PFX" size="PIFX" advice=%d => %d\n", __FUNCTION__, start, size,
+        advice, (int)res);
+    return res == 0;
+}
+
+/* Returns a new mapping of commit_size aligned to ARENA_HUGE_PAGE_SIZE by
+ * over-allocating and trimming both ends.
+ */
+static byte *
+os_large_alloc_huge(size_t commit_size)
+{
+    size_t map_size = commit_size + ARENA_HUGE_PAGE_SIZE;
+    byte *map = os_large_alloc(map_size);
+    byte *start;
+    if (map == NULL)
+        return NULL;
+    start = (byte *) ALIGN_FORWARD(map, ARENA_HUGE_PAGE_SIZE);
+    if (start > map)
+        os_large_free(map, start - map);
+    if (start + commit_size < map + map_size)
+        os_large_free(start + commit_size, map + map_size - (start + commit_size));
+    if (!os_madvise(start, commit_size, MADV_HUGEPAGE))
+        LOG(1, "transparent huge pages unavailable for "PFX"\n", start);
+    return start;
+}
+
+/* Returns the physical pages backing [start, end) to the OS without unmapping
+ * them.  The contents become undefined (MADV_FREE) or zero (MADV_DONTNEED).
+ */
+static void
+os_release_pages(byte *start, byte *end)
+{
+    /* MADV_FREE is cheaper but needs Linux 4.5: fall back on older kernels */
+    static bool madv_free_works = true;
+    if (madv_free_works && !os_madvise(start, end - start, MADV_FREE))
+        madv_free_works = false;
+    if (!madv_free_works)
+        os_madvise(start, end - start, MADV_DONTNEED);
+}
+#endif
+
 static inline heapsz_t
 chunk_request_size(chunk_header_t *head)
 {
     return (head->alloc_size - head->u.unfree.request_diff);
 }
 
+typedef union _chunk_flags_word_t {
+    int word;
+    struct {
+        ushort flags;
+        ushort magic;
+    } s;
+} chunk_flags_word_t;
+
+/* i#948: with per-thread magazines, a chunk's owning thread updates its flags
+ * without holding the arena lock, racing with a neighbor setting or clearing
+ * CHUNK_PREV_FREE while holding the lock.  Those updates thus go through here,
+ * which uses a compare-and-swap on the 4-byte word holding flags and magic.
+ */
+static inline void
+chunk_flags_update(chunk_header_t *head, uint set, uint clear)
+{
+    volatile int *word = (volatile int *) &head->flags;
+    chunk_flags_word_t cur, upd;
+    do {
+        cur.word = *word;
+        upd.word = cur.word;
+        upd.s.flags = (ushort) ((cur.s.flags | set) & ~clear);
+    } while (!atomic_compare_exchange32(word, cur.word, upd.word));
+}
+
 static void
 notify_client_alloc(void *drcontext, byte *ptr, chunk_header_t *head,
                     alloc_flags_t flags, dr_mcontext_t *mc, app_pc caller)
@@ -786,6 +1022,192 @@ notify_client_alloc(void *drcontext, byte *ptr, chunk_header_t *head,
     }
 }
 
+/***************************************************************************
+ * external headers (i#879)
+ */
+
+/* An open-addressed, linear-probing table of ext_header_t pointers keyed by
+ * chunk user address.  Lookups vastly outnumber updates, so we use read-write
+ * locks.  The table is split into stripes by address, each with its own lock,
+ * slots, and entries, so that threads working on unrelated chunks do not all
+ * share one lock.  Entries come from per-stripe slabs and are recycled via a
+ * free list threaded through fh.next, all under the stripe's write lock.
+ */
+#define EXT_TABLE_STRIPE_BITS 4
+#define EXT_TABLE_STRIPES (1 << EXT_TABLE_STRIPE_BITS)
+#define EXT_TABLE_INITIAL_BITS 8 /* per stripe */
+#define EXT_SLAB_ENTRIES 256
+
+typedef struct _ext_slab_t {
+    struct _ext_slab_t *next;
+    ext_header_t entries[EXT_SLAB_ENTRIES];
+} ext_slab_t;
+
+typedef struct _ext_stripe_t {
+    void *lock;
+    ext_header_t **table;
+    uint bits;
+    uint entries;
+    ext_slab_t *slabs;
+    ext_header_t *free_entries;
+} ext_stripe_t;
+
+static ext_stripe_t ext_table[EXT_TABLE_STRIPES];
+
+/* Adjacent chunks land in different stripes */
+static inline ext_stripe_t *
+ext_table_stripe(const void *ptr)
+{
+    return &ext_table[((ptr_uint_t)ptr / CHUNK_ALIGNMENT) & (EXT_TABLE_STRIPES - 1)];
+}
+
+static inline uint
+ext_table_slot(const void *ptr, uint bits)
+{
+    /* Multiplicative hashing of the chunk-aligned address, minus the stripe bits */
+    return (uint)((((ptr_uint_t)ptr / (CHUNK_ALIGNMENT * EXT_TABLE_STRIPES)) *
+                   2654435761U) & ((1U << bits) - 1));
+}
+
+/* Caller must hold the stripe's lock for writing */
+static void
+ext_table_insert(ext_header_t **table, uint bits, ext_header_t *e)
+{
+    uint mask = (1U << bits) - 1;
+    uint i;
+    for (i = ext_table_slot(e->base, bits); table[i] != NULL; i = (i + 1) & mask)
+        ASSERT(table[i]->base != e->base, "duplicate external header");
+    table[i] = e;
+}
+
+/* Caller must hold the stripe's lock for writing */
+static void
+ext_table_grow(ext_stripe_t *stripe)
+{
+    uint new_bits = stripe->bits + 1;
+    size_t new_size = sizeof(*stripe->table) << new_bits;
+    ext_header_t **new_table = (ext_header_t **) global_alloc(new_size, HEAPSTAT_WRAP);
+    uint i;
+    memset(new_table, 0, new_size);
+    for (i = 0; i < (1U << stripe->bits); i++) {
+        if (stripe->table[i] != NULL)
+            ext_table_insert(new_table, new_bits, stripe->table[i]);
+    }
+    global_free(stripe->table, sizeof(*stripe->table) << stripe->bits, HEAPSTAT_WRAP);
+    stripe->table = new_table;
+    stripe->bits = new_bits;
+    LOG(2, "%s: resized stripe %d to %d entries\n", __FUNCTION__,
+        (int)(stripe - ext_table), 1U << stripe->bits);
+}
+
+/* Returns the new header for a chunk whose user memory starts at base */
+static chunk_header_t *
+ext_header_create(byte *base)
+{
+    ext_stripe_t *stripe = ext_table_stripe(base);
+    ext_header_t *e;
+    dr_rwlock_write_lock(stripe->lock);
+    if (stripe->free_entries == NULL) {
+        ext_slab_t *slab = (ext_slab_t *) global_alloc(sizeof(*slab), HEAPSTAT_WRAP);
+        uint i;
+        slab->next = stripe->slabs;
+        stripe->slabs = slab;
+        for (i = 0; i < EXT_SLAB_ENTRIES; i++) {
+            slab->entries[i].fh.next = (free_header_t *) stripe->free_entries;
+            stripe->free_entries = &slab->entries[i];
+        }
+    }
+    e = stripe->free_entries;
+    stripe->free_entries = (ext_header_t *) e->fh.next;
+    memset(e, 0, sizeof(*e));
+    e->base = base;
+    /* Keep the load factor at or below 1/2 */
+    if ((stripe->entries + 1) * 2 > (1U << stripe->bits))
+        ext_table_grow(stripe);
+    ext_table_insert(stripe->table, stripe->bits, e);
+    stripe->entries++;
+    dr_rwlock_write_unlock(stripe->lock);
+    return &e->fh.head;
+}
+
+static void
+ext_header_destroy(chunk_header_t *head)
+{
+    ext_header_t *e = EXT_HEADER(head);
+    ext_stripe_t *stripe = ext_table_stripe(e->base);
+    ext_header_t **table;
+    uint mask, i, j;
+    dr_rwlock_write_lock(stripe->lock);
+    table = stripe->table;
+    mask = (1U << stripe->bits) - 1;
+    for (i = ext_table_slot(e->base, stripe->bits); table[i] != e; i = (i + 1) & mask)
+        ASSERT(table[i] != NULL, "external header not found");
+    /* Backward-shift deletion keeps probe sequences intact without tombstones */
+    for (j = (i + 1) & mask; table[j] != NULL; j = (j + 1) & mask) {
+        uint home = ext_table_slot(table[j]->base, stripe->bits);
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i] = NULL;
+    stripe->entries--;
+    e->fh.next = (free_header_t *) stripe->free_entries;
+    stripe->free_entries = e;
+    dr_rwlock_write_unlock(stripe->lock);
+}
+
+static chunk_header_t *
+ext_header_lookup(const void *ptr)
+{
+    ext_stripe_t *stripe = ext_table_stripe(ptr);
+    chunk_header_t *res = NULL;
+    uint mask, i;
+    dr_rwlock_read_lock(stripe->lock);
+    mask = (1U << stripe->bits) - 1;
+    for (i = ext_table_slot(ptr, stripe->bits); stripe->table[i] != NULL;
+         i = (i + 1) & mask) {
+        if (stripe->table[i]->base == (byte *)ptr) {
+            res = &stripe->table[i]->fh.head;
+            break;
+        }
+    }
+    dr_rwlock_read_unlock(stripe->lock);
+    return res;
+}
+
+static void
+ext_table_init(void)
+{
+    uint s;
+    for (s = 0; s < EXT_TABLE_STRIPES; s++) {
+        ext_stripe_t *stripe = &ext_table[s];
+        stripe->lock = dr_rwlock_create();
+        stripe->bits = EXT_TABLE_INITIAL_BITS;
+        stripe->table = (ext_header_t **)
+            global_alloc(sizeof(*stripe->table) << stripe->bits, HEAPSTAT_WRAP);
+        memset(stripe->table, 0, sizeof(*stripe->table) << stripe->bits);
+    }
+}
+
+static void
+ext_table_exit(void)
+{
+    uint s;
+    for (s = 0; s < EXT_TABLE_STRIPES; s++) {
+        ext_stripe_t *stripe = &ext_table[s];
+        while (stripe->slabs != NULL) {
+            ext_slab_t *next = stripe->slabs->next;
+            global_free(stripe->slabs, sizeof(*stripe->slabs), HEAPSTAT_WRAP);
+            stripe->slabs = next;
+        }
+        global_free(stripe->table, sizeof(*stripe->table) << stripe->bits,
+                    HEAPSTAT_WRAP);
+        dr_rwlock_destroy(stripe->lock);
+    }
+}
+
 /***************************************************************************
  * core allocation routines
  */
@@ -794,9 +1216,7 @@ static inline chunk_header_t *
 header_from_ptr(const void *ptr)
 {
     if (alloc_ops.external_headers) {
-        /* XXX i#879: hashtable lookup */
-        ASSERT(false, "NYI");
-        return NULL;
+        return ext_header_lookup(ptr);
     } else {
         if ((ptr_uint_t)ptr < header_size)
             return NULL;
@@ -809,30 +1229,44 @@ header_from_ptr(const void *ptr)
 static inline byte *
 ptr_from_header(chunk_header_t *head)
 {
-    if (alloc_ops.external_headers) {
-        /* XXX i#879: hashtable lookup */
-        ASSERT(false, "NYI");
-        return NULL;
-    } else {
-        ASSERT(!TEST(CHUNK_PRE_US, head->flags), "caller must handle pre-us");
+    ASSERT(!TEST(CHUNK_PRE_US, head->flags), "caller must handle pre-us");
+    if (alloc_ops.external_headers)
+        return EXT_HEADER(head)->base;
+    else
         return (byte *)head + redzone_beyond_header + header_size;
-    }
+}
+
+/* Returns the header to use for a new chunk whose user memory starts at ptr.
+ * The caller fills in the fields.
+ */
+static inline chunk_header_t *
+header_create(byte *ptr)
+{
+    if (alloc_ops.external_headers)
+        return ext_header_create(ptr);
+    else
+        return (chunk_header_t *) (ptr - redzone_beyond_header - header_size);
+}
+
+/* Called when a chunk ceases to exist, either by being merged into a neighbor
+ * or by its memory being returned to the OS.
+ */
+static inline void
+header_destroy(chunk_header_t *head)
+{
+    if (alloc_ops.external_headers)
+        ext_header_destroy(head);
 }
 
 static inline chunk_header_t *
 header_from_mmap_base(void *map)
 {
-    if (alloc_ops.external_headers) {
-        /* XXX i#879: hashtable lookup */
-        ASSERT(false, "NYI");
+    /* The mmap header is at the base even for alloc_ops.external_headers */
+    if ((ptr_uint_t)map < header_size)
         return NULL;
-    } else {
-        if ((ptr_uint_t)map < header_size)
-            return NULL;
-        else {
-            mmap_header_t *mhead = (mmap_header_t *) map;
-            return mhead->head;
-        }
+    else {
+        mmap_header_t *mhead = (mmap_header_t *) map;
+        return mhead->head;
     }
 }
 
@@ -865,7 +1299,7 @@ is_valid_chunk(const void *ptr, chunk_header_t *head)
      * + could have client_ callout that checks shadow memory
      */
     if (alloc_ops.external_headers) {
-        /* XXX i#879: need to look in delay free rbtree too */
+        /* Every chunk, live or free, is in the table */
         return head != NULL;
     } else {
         /* Unlike a regular malloc library, we cannot afford to crash on
@@ -918,7 +1352,7 @@ is_live_alloc(void *ptr, arena_header_t *arena, chunk_header_t *head)
 {
     bool live = false;
     if (alloc_ops.external_headers) {
-        live = (head != NULL);
+        live = (head != NULL && !TEST(CHUNK_FREED, head->flags));
     } else {
         live = (is_valid_chunk(ptr, head) &&
                 !TEST(CHUNK_FREED, head->flags));
@@ -928,6 +1362,31 @@ is_live_alloc(void *ptr, arena_header_t *arena, chunk_header_t *head)
             (TEST(CHUNK_MMAP, head->flags) || ptr_is_in_arena(ptr, arena)));
 }
 
+/* With -arena_shards a chunk can be freed or queried by a thread other than
+ * the one that allocated it.  Returns the shard containing ptr, or arena if
+ * ptr is in no shard (mmapped, pre-us, or invalid: left to the caller).
+ */
+static arena_header_t *
+arena_owning_ptr(arena_header_t *arena, byte *ptr)
+{
+    byte *start;
+    uint flags, i;
+    if (num_shards <= 1 || arena == NULL || ptr_is_in_arena(ptr, arena))
+        return arena;
+    if (heap_region_bounds(ptr, &start, NULL, &flags) &&
+        TEST(HEAP_ARENA, flags) && !TEST(HEAP_PRE_US, flags)) {
+        /* Sub-arenas share their main arena's free lists */
+        free_lists_t *free_list = ((arena_header_t *)start)->free_list;
+        for (i = 0; i < num_shards; i++) {
+            if (shard_arenas[i]->free_list == free_list) {
+                STATS_INC(shard_cross_ops);
+                return shard_arenas[i];
+            }
+        }
+    }
+    return arena;
+}
+
 /* returns NULL if an invalid ptr, but will return a freed chunk */
 static inline chunk_header_t *
 header_from_ptr_include_pre_us(void *ptr)
@@ -998,6 +1457,7 @@ arena_init(arena_header_t *arena, arena_header_t *parent)
          */
         arena->free_list = (free_lists_t *) ((byte *)arena + header_size);
         header_size += sizeof(*arena->free_list);
+        arena->free_list->var_sizes = rb_tree_create(NULL);
 #ifdef WINDOWS
         arena->alloc_set_member = NULL;
         arena->modbase = NULL;
@@ -1029,6 +1489,11 @@ arena_init(arena_header_t *arena, arena_header_t *parent)
 static void
 arena_deallocate(arena_header_t *arena)
 {
+    if (arena->index != NULL) {
+        global_free(arena->index, arena->index_cap * sizeof(*arena->index),
+                    HEAPSTAT_WRAP);
+        arena->index = NULL;
+    }
 #ifdef LINUX
     if (arena->reserve_end != cur_brk)
 #elif defined(WINDOWS)
@@ -1045,6 +1510,7 @@ static void
 arena_free(arena_header_t *arena)
 {
     if (TEST(ARENA_MAIN, arena->flags)) {
+        rb_tree_destroy(arena->free_list->var_sizes);
         dr_recurlock_destroy(arena->lock);
 #ifdef WINDOWS
         if (!alloc_ops.global_lock)
@@ -1058,9 +1524,16 @@ static arena_header_t *
 arena_create(arena_header_t *parent, size_t initial_size)
 {
     size_t init_size = (initial_size == 0) ? ARENA_INITIAL_SIZE : initial_size;
-    arena_header_t *new_arena = (arena_header_t *)
-        os_large_alloc(IF_WINDOWS_(ARENA_INITIAL_COMMIT) init_size
-                       _IF_WINDOWS(arena_page_prot(parent->flags)));
+    arena_header_t *new_arena;
+#ifdef LINUX
+    if (alloc_ops.arena_huge_pages) {
+        init_size = ALIGN_FORWARD(init_size, ARENA_HUGE_PAGE_SIZE);
+        new_arena = (arena_header_t *) os_large_alloc_huge(init_size);
+    } else
+#endif
+        new_arena = (arena_header_t *)
+            os_large_alloc(IF_WINDOWS_(ARENA_INITIAL_COMMIT) init_size
+                           _IF_WINDOWS(arena_page_prot(parent->flags)));
     if (new_arena == NULL)
         return NULL;
 #ifdef UNIX
@@ -1074,27 +1547,32 @@ arena_create(arena_header_t *parent, size_t initial_size)
     return new_arena;
 }
 
-/* Either extends arena in-place and returns it, or allocates a new arena
- * and returns that.  Returns NULL on failure to do either.
- * Expects to be passed the final sub-arena, not the master arena.
+/* Extends the committed end of arena by at least add_size without moving it.
+ * Returns whether successful.
  */
-static arena_header_t *
-arena_extend(arena_header_t *arena, heapsz_t add_size)
+static bool
+arena_extend_in_place(arena_header_t *arena, heapsz_t add_size)
 {
     heapsz_t aligned_add = (heapsz_t) ALIGN_FORWARD(add_size, PAGE_SIZE);
-    arena_header_t *new_arena;
 #ifdef LINUX
+    if (alloc_ops.arena_huge_pages)
+        aligned_add = (heapsz_t) ALIGN_FORWARD(add_size, ARENA_HUGE_PAGE_SIZE);
     if (arena->commit_end == cur_brk) {
         byte *new_brk = set_brk(cur_brk + aligned_add);
         if (new_brk >= cur_brk + add_size) {
             LOG(2, "\tincreased brk from "PFX" to "PFX"\n", cur_brk, new_brk);
+            /* The brk is not huge-page-aligned but the kernel can still use huge
+             * pages for whichever aligned 2MB ranges fall inside it.
+             */
+            if (alloc_ops.arena_huge_pages)
+                os_madvise(cur_brk, new_brk - cur_brk, MADV_HUGEPAGE);
             STATS_ADD(heap_capacity, (uint)(new_brk - cur_brk));
             STATS_PEAK(heap_capacity);
             cur_brk = new_brk;
             arena->commit_end = new_brk;
             arena->reserve_end = arena->commit_end;
             heap_region_adjust((byte *)arena, new_brk);
-            return arena;
+            return true;
         } else {
             LOG(1, "brk @"PFX"-"PFX" cannot expand: switching to mmap\n",
                 pre_us_brk, cur_brk);
@@ -1116,9 +1594,22 @@ arena_extend(arena_header_t *arena, heapsz_t add_size)
             arena->reserve_end = arena->commit_end;
             heap_region_adjust((byte *)arena, (byte *)arena + new_size);
 #endif
-            return arena;
+            return true;
         }
     }
+    return false;
+}
+
+/* Either extends arena in-place and returns it, or allocates a new arena
+ * and returns that.  Returns NULL on failure to do either.
+ * Expects to be passed the final sub-arena, not the master arena.
+ */
+static arena_header_t *
+arena_extend(arena_header_t *arena, heapsz_t add_size)
+{
+    arena_header_t *new_arena;
+    if (arena_extend_in_place(arena, add_size))
+        return arena;
 #ifdef WINDOWS
     if (!TEST(HEAP_GROWABLE, arena->flags))
         return NULL;
@@ -1137,6 +1628,50 @@ arena_delayed_list_full(arena_header_t *arena)
             arena->free_list->delayed_bytes >= alloc_ops.delay_frees_maxsz);
 }
 
+/* Returns how many bytes must be released to bring the delayed frees of all
+ * arenas back under -delay_frees_global_maxsz.
+ */
+static inline uint
+delay_global_overage(void)
+{
+    int total = global_delayed_bytes;
+    if (alloc_ops.delay_frees_global_maxsz == 0 || total < 0 ||
+        (uint)total < alloc_ops.delay_frees_global_maxsz)
+        return 0;
+    return (uint)total - alloc_ops.delay_frees_global_maxsz + 1;
+}
+
+static inline uint
+delay_class(chunk_header_t *head)
+{
+    uint i;
+    for (i = 0; i < num_delay_classes - 1; i++) {
+        if (head->alloc_size <= delay_class_max[i])
+            return i;
+    }
+    return num_delay_classes - 1;
+}
+
+/* Returns the class holding the most chunks if we are over the count limit, or
+ * else the most bytes.  Returns UINT_MAX if nothing is delayed.
+ */
+static uint
+delay_class_to_release(arena_header_t *arena)
+{
+    free_lists_t *lists = arena->free_list;
+    bool by_count = (lists->delayed_chunks >= alloc_ops.delay_frees);
+    uint i, victim = UINT_MAX;
+    for (i = 0; i < num_delay_classes; i++) {
+        if (lists->delay[i].front == NULL)
+            continue;
+        if (victim == UINT_MAX ||
+            (by_count ? lists->delay[i].chunks > lists->delay[victim].chunks :
+             lists->delay[i].bytes > lists->delay[victim].bytes))
+            victim = i;
+    }
+    return victim;
+}
+
 static inline chunk_header_t *
 next_chunk_forward(arena_header_t *arena, chunk_header_t *head,
                    arena_header_t **container_out OUT)
@@ -1169,9 +1704,10 @@ set_prev_size_field(arena_header_t *arena, chunk_header_t *head)
     chunk_header_t *next = next_chunk_forward(arena, head, &container);
     ASSERT(!TEST(CHUNK_DELAY_FREE, head->flags), "no need/room for prev size for delay");
     if (next != NULL) {
-        ASSERT(!TEST(CHUNK_FREED, next->flags) || TEST(CHUNK_DELAY_FREE, next->flags),
+        ASSERT(!TEST(CHUNK_FREED, next->flags) ||
+               TESTANY(CHUNK_DELAY_FREE | CHUNK_MAGAZINE, next->flags),
                "can't set prev size on true free");
-        next->flags |= CHUNK_PREV_FREE;
+        chunk_flags_update(next, CHUNK_PREV_FREE, 0);
         if (head->alloc_size / CHUNK_MIN_SIZE <= USHRT_MAX) {
             next->u.unfree.prev_size_shr = head->alloc_size / CHUNK_MIN_SIZE;
             LOG(3, "set prev_size_shr of "PFX" to "PIFX"\n",
@@ -1181,7 +1717,7 @@ set_prev_size_field(arena_header_t *arena, chunk_header_t *head)
              * in the prev chunk.  This takes away one slot from pattern
              * mode but we can live with that.
              */
-            byte *redzone_start = (byte *)next - inter_chunk_space();
+            byte *redzone_start = ptr_from_header(next) - inter_chunk_space();
             next->u.unfree.prev_size_shr = 0;
             LOG(3, "writing prev size "PIFX" to "PFX"\n", head->alloc_size,
                 redzone_start - sizeof(heapsz_t));
@@ -1198,7 +1734,7 @@ get_prev_size_field(chunk_header_t *head)
 {
     ASSERT(TEST(CHUNK_PREV_FREE, head->flags), "only call if prev free exists");
     if (head->u.unfree.prev_size_shr == 0) {
-        byte *redzone_start = (byte *)head - inter_chunk_space();
+        byte *redzone_start = ptr_from_header(head) - inter_chunk_space();
         LOG(3, "reading prev size "PIFX" from "PFX"\n",
             *(heapsz_t*)(redzone_start - sizeof(heapsz_t)),
             redzone_start - sizeof(heapsz_t));
@@ -1232,15 +1768,88 @@ bucket_index(chunk_header_t *head)
     return bucket;
 }
 
+static inline byte *
+var_size_key(heapsz_t size)
+{
+    return (byte *)(ptr_uint_t) size;
+}
+
+static void
+remove_from_var_bucket(arena_header_t *arena, free_header_t *target)
+{
+    free_lists_t *lists = arena->free_list;
+    rb_node_t *node = rb_find(lists->var_sizes, var_size_key(target->head.alloc_size));
+    free_header_t *front;
+    ASSERT(node != NULL, "var-size free tree corrupted");
+#ifdef LINUX
+    /* Whoever takes the chunk will touch its pages again */
+    if (TEST(CHUNK_PAGES_RELEASED, target->head.flags))
+        chunk_flags_update(&target->head, 0, CHUNK_PAGES_RELEASED);
+#endif
+    rb_node_fields(node, NULL, NULL, (void **)&front);
+    if (target == front) {
+        if (target->next == NULL) {
+            rb_delete(lists->var_sizes, node);
+            ASSERT(lists->num_var_sizes > 0, "var-size count off");
+            lists->num_var_sizes--;
+            if (lists->num_var_sizes == 0)
+                lists->nonempty &= ~(1U << VAR_BUCKET);
+        } else {
+            /* Pass along the pointer to the last entry */
+            target->next->head.u.prev = target->head.u.prev;
+            rb_node_set_client(node, target->next);
+        }
+    } else {
+        target->head.u.prev->next = target->next;
+        if (target->next != NULL)
+            target->next->head.u.prev = target->head.u.prev;
+        else
+            front->head.u.prev = target->head.u.prev;
+    }
+}
+
+static void
+add_to_var_bucket(arena_header_t *arena, free_header_t *cur)
+{
+    free_lists_t *lists = arena->free_list;
+    byte *key = var_size_key(cur->head.alloc_size);
+    rb_node_t *node = rb_find(lists->var_sizes, key);
+    cur->next = NULL;
+    if (node == NULL) {
+        cur->head.u.prev = cur;
+        rb_insert(lists->var_sizes, key, 1, cur);
+        lists->num_var_sizes++;
+        lists->nonempty |= (1U << VAR_BUCKET);
+    } else {
+        free_header_t *front, *last;
+        rb_node_fields(node, NULL, NULL, (void **)&front);
+        last = front->head.u.prev;
+        last->next = cur;
+        cur->head.u.prev = last;
+        front->head.u.prev = cur;
+    }
+}
+
 /* Pass UINT_MAX if the bucket is not known */
 static void
 remove_from_free_list(arena_header_t *arena, free_header_t *target, uint bucket)
 {
+    if (bucket == VAR_BUCKET ||
+        (bucket == UINT_MAX && target->head.alloc_size >= free_list_sizes[VAR_BUCKET])) {
+        remove_from_var_bucket(arena, target);
+        return;
+    }
+#ifdef LINUX
+    if (TEST(CHUNK_PAGES_RELEASED, target->head.flags))
+        chunk_flags_update(&target->head, 0, CHUNK_PAGES_RELEASED);
+#endif
     if (target->head.u.prev == NULL) {
         if (bucket == UINT_MAX)
             bucket = bucket_index(&target->head);
         ASSERT(target == arena->free_list->front[bucket], "free list corrupted");
         arena->free_list->front[bucket] = target->next;
+        if (target->next == NULL)
+            arena->free_list->nonempty &= ~(1U << bucket);
     } else {
         target->head.u.prev->next = target->next;
     }
@@ -1259,7 +1868,14 @@ add_to_free_list(arena_header_t *arena, chunk_header_t *head)
 {
     free_header_t *cur = (free_header_t *) head;
     uint bucket = bucket_index(head);
+    if (bucket == VAR_BUCKET) {
+        add_to_var_bucket(arena, cur);
+        LOG(3, "%s: arena "PFX" var-size bucket size %d\n", __FUNCTION__,
+            arena, head->alloc_size);
+        return;
+    }
     cur->next = NULL;
+    arena->free_list->nonempty |= (1U << bucket);
     if (arena->free_list->last[bucket] == NULL) {
         ASSERT(arena->free_list->front[bucket] == NULL, "inconsistent free list");
         arena->free_list->front[bucket] = cur;
@@ -1274,8 +1890,51 @@ add_to_free_list(arena_header_t *arena, chunk_header_t *head)
         arena->free_list->last[bucket]);
 }
 
+#ifdef LINUX
+/* Sets [*start, *end) to the pages in the interior of the true free chunk head
+ * that can be returned to the OS.  We preserve the free list links at the start
+ * and the large prev-size slot at the end (see set_prev_size_field()).
+ */
+static void
+free_chunk_release_bounds(chunk_header_t *head, byte **start OUT, byte **end OUT)
+{
+    byte *ptr = ptr_from_header(head);
+    /* Partially releasing a huge page would split it */
+    size_t align = alloc_ops.arena_huge_pages ? ARENA_HUGE_PAGE_SIZE : PAGE_SIZE;
+    *start = (byte *) ALIGN_FORWARD(ptr + sizeof(free_header_t), align);
+    *end = (byte *) ALIGN_BACKWARD(ptr + head->alloc_size - sizeof(heapsz_t), align);
+}
+
+/* Returns the interior pages of the true free chunk head to the OS while
+ * keeping it mapped.  When head was just coalesced from chunks that were
+ * already released, pages below released_below and from released_above on
+ * (either may be NULL) are skipped, as they have not been touched since.
+ */
+static void
+release_free_pages(chunk_header_t *head, byte *released_below, byte *released_above)
+{
+    byte *start, *end;
+    free_chunk_release_bounds(head, &start, &end);
+    if (released_below != NULL && released_below > start)
+        start = released_below;
+    if (released_above != NULL && released_above < end)
+        end = released_above;
+    chunk_flags_update(head, CHUNK_PAGES_RELEASED, 0);
+    if (start >= end)
+        return;
+    LOG(3, "releasing pages "PFX"-"PFX" of free chunk "PFX"\n", start, end,
+        ptr_from_header(head));
+    os_release_pages(start, end);
+    STATS_ADD(pages_released, (uint)((end - start) / PAGE_SIZE));
+    STATS_INC(page_release_calls);
+    client_handle_heap_release(start, end);
+}
+#endif
+
+/* released_below and released_above are as for release_free_pages() */
 static free_header_t *
-consider_giving_back_memory(arena_header_t *arena, chunk_header_t *tofree)
+consider_giving_back_memory(arena_header_t *arena, chunk_header_t *tofree,
+                            byte *released_below, byte *released_above)
 {
     /* If we've accumulated enough, consider giving it back to the OS.
      * We won't give back a new arena in which we haven't allocated at
@@ -1293,6 +1952,9 @@ consider_giving_back_memory(arena_header_t *arena, chunk_header_t *tofree)
                 if (new_brk <= cur_brk) {
                     LOG(2, "shrinking brk "PFX"-"PFX" to "PFX"-"PFX"\n",
                         pre_us_brk, cur_brk, pre_us_brk, new_brk);
+                    /* Keep everything past next_chunk zeroed for calloc */
+                    if (new_brk > ptr)
+                        memset(ptr, 0, new_brk - ptr);
                     STATS_ADD(heap_capacity, (int)(new_brk - cur_brk));
                     STATS_INC(num_dealloc);
                     heap_region_remove(new_brk, cur_brk, NULL);
@@ -1301,6 +1963,8 @@ consider_giving_back_memory(arena_header_t *arena, chunk_header_t *tofree)
                     arena->reserve_end = new_brk;
                     arena->next_chunk = ptr;
                     arena->prev_free_sz = 0; /* can't end in free: would be coalesced */
+                    arena_layout_changed(arena);
+                    header_destroy(tofree);
                     return NULL;
                 } else {
                     LOG(1, "brk @"PFX"-"PFX" failed to shrink to "PFX"\n",
@@ -1325,11 +1989,18 @@ consider_giving_back_memory(arena_header_t *arena, chunk_header_t *tofree)
                     STATS_DEC(num_arenas);
                     heap_region_remove((byte *)sub, sub->reserve_end, NULL);
                     arena_deallocate(sub);
+                    header_destroy(tofree);
                     return NULL;
                 }
             }
         }
     }
+#ifdef LINUX
+    /* We can't unmap the middle of an arena, but we can drop its pages */
+    if (alloc_ops.heap_release_threshold > 0 &&
+        tofree->alloc_size >= alloc_ops.heap_release_threshold)
+        release_free_pages(tofree, released_below, released_above);
+#endif
     return (free_header_t *) tofree;
 }
 
@@ -1340,6 +2011,8 @@ static free_header_t *
 coalesce_adjacent_frees(arena_header_t *arena, free_header_t *cur)
 {
     chunk_header_t *tofree = &cur->head, *next;
+    /* Pages of already-released neighbors that we need not release again */
+    byte *released_below = NULL, *released_above = NULL;
     if (TEST(CHUNK_PREV_FREE, cur->head.flags)) {
         /* Coalesce with prior block */
         size_t prev_sz = get_prev_size_field(&cur->head);
@@ -1357,6 +2030,12 @@ coalesce_adjacent_frees(arena_header_t *arena, free_header_t *cur)
          * on always coalescing).
          */
         ASSERT(!TEST(CHUNK_DELAY_FREE, prev->head.flags), "prev free must be true free");
+#ifdef LINUX
+        if (TEST(CHUNK_PAGES_RELEASED, prev->head.flags)) {
+            byte *unused;
+            free_chunk_release_bounds(&prev->head, &unused, &released_below);
+        }
+#endif
         /* Remove prev from free list and merge w/ head.  We'll add the
          * newly combined chunk to the delay list below.  Yes, this delays
          * re-use of the no-longer-delayed prev, but the size delay
@@ -1372,6 +2051,7 @@ coalesce_adjacent_frees(arena_header_t *arena, free_header_t *cur)
         }
         tofree = &prev->head;
         tofree->alloc_size += cur->head.alloc_size + inter_chunk_space();
+        arena_layout_changed(arena);
         iterator_unlock(arena, true/*in alloc*/);
         LOG(3, "coalescing with prev chunk "PFX" => "PFX"-"PFX"\n",
             prev, prev_ptr, prev_ptr + tofree->alloc_size);
@@ -1380,14 +2060,21 @@ coalesce_adjacent_frees(arena_header_t *arena, free_header_t *cur)
          * next is free, so we wait until we've possibly merged w/ next
          */
         /* Let client fill/mark midpoint header, if desired */
-        if (!alloc_ops.shared_redzones)
+        if (!alloc_ops.shared_redzones && !alloc_ops.external_headers)
             client_new_redzone((byte *)cur, header_size);
+        header_destroy(&cur->head);
     }
     next = next_chunk_forward(arena, tofree, NULL);
     if (next != NULL && TEST(CHUNK_FREED, next->flags) &&
-        !TEST(CHUNK_DELAY_FREE, next->flags) ) {
+        !TESTANY(CHUNK_DELAY_FREE | CHUNK_MAGAZINE, next->flags)) {
         /* Synchronize with iterators (i#949) */
         iterator_lock(arena, true/*in alloc*/);
+#ifdef LINUX
+        if (TEST(CHUNK_PAGES_RELEASED, next->flags)) {
+            byte *unused;
+            free_chunk_release_bounds(next, &released_above, &unused);
+        }
+#endif
         /* Coalesce with next block */
         remove_from_free_list(arena, (free_header_t *)next, UINT_MAX);
         if (next->user_data != NULL)
@@ -1398,38 +2085,51 @@ coalesce_adjacent_frees(arena_header_t *arena, free_header_t *cur)
             tofree->user_data = NULL;
         }
         tofree->alloc_size += next->alloc_size + inter_chunk_space();
+        arena_layout_changed(arena);
         LOG(3, "coalescing with next chunk "PFX" => "PFX"-"PFX"\n",
             next, ptr_from_header(tofree), ptr_from_header(tofree) +
             tofree->alloc_size);
         STATS_INC(num_coalesces);
         /* Let client fill/mark midpoint header, if desired */
-        if (!alloc_ops.shared_redzones)
+        if (!alloc_ops.shared_redzones && !alloc_ops.external_headers)
             client_new_redzone((byte *)next, header_size);
+        header_destroy(next);
         set_prev_size_field(arena, tofree); /* update */
         iterator_unlock(arena, true/*in alloc*/);
     } else if (tofree != &cur->head) {
         /* Delayed from above: see comment in merge-prev */
         set_prev_size_field(arena, tofree); /* update */
     }
-    return consider_giving_back_memory(arena, tofree);
+    return consider_giving_back_memory(arena, tofree, released_below, released_above);
 }
 
 static bool
 shift_from_delay_list_to_free_list(arena_header_t *arena)
 {
-    free_header_t *cur = arena->free_list->delay_front;
-    if (cur == NULL)
+    uint cls = delay_class_to_release(arena);
+    delay_list_t *delay;
+    free_header_t *cur;
+    if (cls == UINT_MAX)
         return false;
-    LOG(3, "%s: shifting "PFX" to regular free list\n", __FUNCTION__, cur);
-    cur->head.flags &= ~CHUNK_DELAY_FREE;
-    arena->free_list->delay_front = cur->next;
-    if (cur == arena->free_list->delay_last)
-        arena->free_list->delay_last = NULL;
-    ASSERT(arena->free_list->delayed_chunks > 0, "delay counter off");
+    delay = &arena->free_list->delay[cls];
+    cur = delay->front;
+    LOG(3, "%s: shifting "PFX" from class %d to regular free list\n", __FUNCTION__,
+        cur, cls);
+    chunk_flags_update(&cur->head, 0, CHUNK_DELAY_FREE);
+    delay->front = cur->next;
+    if (cur == delay->last)
+        delay->last = NULL;
+    ASSERT(delay->chunks > 0 && arena->free_list->delayed_chunks > 0,
+           "delay counter off");
+    delay->chunks--;
     arena->free_list->delayed_chunks--;
-    ASSERT(arena->free_list->delayed_bytes >= cur->head.alloc_size,
+    ASSERT(delay->bytes >= cur->head.alloc_size &&
+           arena->free_list->delayed_bytes >= cur->head.alloc_size,
            "delay bytes counter off");
+    delay->bytes -= cur->head.alloc_size;
     arena->free_list->delayed_bytes -= cur->head.alloc_size;
+    if (alloc_ops.delay_frees_global_maxsz > 0)
+        ATOMIC_ADD32(global_delayed_bytes, -(int)cur->head.alloc_size);
     LOG(3, "%s: updated delayed chunks=%d, bytes="PIFX"\n", __FUNCTION__,
         arena->free_list->delayed_chunks, arena->free_list->delayed_bytes);
 
@@ -1454,53 +2154,70 @@ static void
 add_to_delay_list(arena_header_t *arena, chunk_header_t *head)
 {
     free_header_t *cur = (free_header_t *) head;
+    delay_list_t *delay = &arena->free_list->delay[delay_class(head)];
+    uint released = 0, released_bytes = 0, overage;
     /* add to the end for delayed free FIFO */
     cur->next = NULL;
-    head->flags |= CHUNK_DELAY_FREE;
-    if (arena->free_list->delay_last == NULL) {
-        ASSERT(arena->free_list->delay_front == NULL, "inconsistent free list");
-        arena->free_list->delay_front = cur;
+    chunk_flags_update(head, CHUNK_DELAY_FREE, 0);
+    if (delay->last == NULL) {
+        ASSERT(delay->front == NULL, "inconsistent free list");
+        delay->front = cur;
     } else
-        arena->free_list->delay_last->next = cur;
-    arena->free_list->delay_last = cur;
+        delay->last->next = cur;
+    delay->last = cur;
 
+    delay->chunks++;
+    delay->bytes += head->alloc_size;
     arena->free_list->delayed_chunks++;
     arena->free_list->delayed_bytes += head->alloc_size;
+    if (alloc_ops.delay_frees_global_maxsz > 0)
+        ATOMIC_ADD32(global_delayed_bytes, head->alloc_size);
     LOG(3, "%s: updated delayed chunks=%d, bytes="PIFX"\n", __FUNCTION__,
         arena->free_list->delayed_chunks, arena->free_list->delayed_bytes);
 
-    while (arena_delayed_list_full(arena)) {
-        /* Keep shifting first delayed entry to the free lists, until we're
-         * below both thresholds.
-         */
+    /* Over the global budget, each arena releases from its own list on its next
+     * free: but only the overage, rather than its whole list.
+     */
+    overage = delay_global_overage();
+    if (!arena_delayed_list_full(arena) && overage == 0)
+        return;
+    /* Keep shifting delayed entries to the free lists until we're below all
+     * thresholds.  With -delay_frees_batch we release a larger batch at once so
+     * that the frees that follow do not each pay for a shift and its coalescing.
+     */
+    while (arena_delayed_list_full(arena) || released < alloc_ops.delay_frees_batch ||
+           released_bytes < overage) {
+        heapsz_t delayed_bytes = arena->free_list->delayed_bytes;
         if (!shift_from_delay_list_to_free_list(arena))
             break;
+        released++;
+        released_bytes += delayed_bytes - arena->free_list->delayed_bytes;
     }
+    STATS_INC(delay_batches);
 }
 
+/* Best fit from the var-size bucket: the oldest chunk of the smallest size
+ * that is large enough.
+ */
 static chunk_header_t *
 search_free_list_bucket(arena_header_t *arena, heapsz_t aligned_size, uint bucket)
 {
-    /* search for large enough chunk */
-    free_header_t *cur;
-    chunk_header_t *head = NULL;
+    free_header_t *cur = NULL;
+    rb_node_t *node;
 #ifdef UNIX
     /* On Windows we have HEAP_NO_SERIALIZE.  Not worth passing the flags in. */
     ASSERT(dr_recurlock_self_owns(arena->lock), "caller must hold lock");
 #endif
-    ASSERT(bucket < NUM_FREE_LISTS, "invalid param");
-    for (cur = arena->free_list->front[bucket];
-         cur != NULL && cur->head.alloc_size < aligned_size;
-         cur = cur->next)
-        ; /* nothing */
-    if (cur != NULL) {
-        remove_from_free_list(arena, cur, bucket);
-        head = (chunk_header_t *) cur;
+    ASSERT(bucket == VAR_BUCKET, "invalid param");
+    /* Our nodes are [size, size+1) so this finds the smallest size >= aligned_size */
+    node = rb_next_higher_node(arena->free_list->var_sizes, var_size_key(aligned_size));
+    if (node != NULL) {
+        rb_node_fields(node, NULL, NULL, (void **)&cur);
+        ASSERT(cur->head.alloc_size >= aligned_size, "var-size free tree corrupted");
+        remove_from_var_bucket(arena, cur);
     }
-    LOG(3, "arena "PFX" taking cur="PFX" => bucket %d free front="PFX" last="PFX"\n",
-        arena, cur, bucket, arena->free_list->front[bucket],
-        arena->free_list->last[bucket]);
-    return head;
+    LOG(3, "arena "PFX" taking cur="PFX" from var-size bucket\n", arena, cur);
+    return (chunk_header_t *) cur;
 }
 
 /* Caller needs only to point free_hdr at the right point: this routine will fill it in.
@@ -1516,6 +2233,7 @@ split_piece_for_free_list(arena_header_t *arena, chunk_header_t *head,
     iterator_lock(arena, true/*in alloc*/);
 
     head->alloc_size = head_new_sz;
+    arena_layout_changed(arena);
 
     free_hdr->head.user_data = client_malloc_data_free_split(head->user_data);
     free_hdr->head.u.unfree.request_diff = 0;
@@ -1547,11 +2265,31 @@ split_piece_for_free_list(arena_header_t *arena, chunk_header_t *head,
     iterator_unlock(arena, true/*in alloc*/);
 }
 
+/* Takes head, a free chunk already removed from the free lists, and if there's a
+ * lot of extra room beyond aligned_size, splits it off as a separate free entry.
+ */
+static void
+split_free_chunk(arena_header_t *arena, chunk_header_t *head, heapsz_t aligned_size)
+{
+    if (head->alloc_size > aligned_size + CHUNK_MIN_SIZE + inter_chunk_space()) {
+        byte *split = ptr_from_header(head) + aligned_size +
+            (alloc_ops.shared_redzones ? 0 : alloc_ops.redzone_size);
+        size_t rest_size = head->alloc_size - (aligned_size + inter_chunk_space());
+        byte *chunk2_start = split + inter_chunk_space() -
+            (alloc_ops.shared_redzones ? 0 : alloc_ops.redzone_size);
+        free_header_t *rest = (free_header_t *) header_create(chunk2_start);
+        ASSERT(!TEST(CHUNK_MMAP, head->flags), "mmap not expected on free list");
+        STATS_INC(num_splits);
+        split_piece_for_free_list(arena, head, rest, rest_size, aligned_size);
+        ASSERT(is_valid_chunk(chunk2_start, &rest->head), "rest chunk inconsistent");
+    }
+}
+
 static chunk_header_t *
 find_free_list_entry(arena_header_t *arena, heapsz_t request_size, heapsz_t aligned_size)
 {
     chunk_header_t *head = NULL;
-    uint bucket;
+    uint bucket, nonempty;
 #ifdef UNIX
     /* On Windows we have HEAP_NO_SERIALIZE.  Not worth passing the flags in. */
     ASSERT(dr_recurlock_self_owns(arena->lock), "caller must hold lock");
@@ -1562,7 +2300,7 @@ find_free_list_entry(arena_header_t *arena, heapsz_t request_size, heapsz_t alig
      * before searching the maybe-big-enough bucket.
      */
     for (bucket = 0;
-         bucket < NUM_FREE_LISTS - 1 && aligned_size > free_list_sizes[bucket];
+         bucket < VAR_BUCKET && aligned_size > free_list_sizes[bucket];
          bucket++)
         ; /* nothing */
 
@@ -1577,29 +2315,21 @@ find_free_list_entry(arena_header_t *arena, heapsz_t request_size, heapsz_t alig
      * up (delayed_chunks or delayed_bytes at 2x the threshold) but
      * it seems worth doing every time, even at the risk of fragmentation,
      * since we have coalescing in place.
+     * The nonempty bitmap gives us the first candidate bucket in one step.
      */
-    if (head == NULL && arena->free_list->front[bucket] == NULL) {
-        while (bucket < NUM_FREE_LISTS - 1 && arena->free_list->front[bucket] == NULL)
-            bucket++;
-    }
-
-    if (head == NULL && arena->free_list->front[bucket] != NULL) {
+    nonempty = arena->free_list->nonempty & ~((1U << bucket) - 1);
+    if (nonempty != 0) {
+        bucket = lowest_set_bit(nonempty);
         LOG(2, "\tallocating from larger bucket size to reduce delayed frees\n");
-        if (bucket == NUM_FREE_LISTS - 1) {
+        if (bucket == VAR_BUCKET) {
             /* var-size bucket: have to search */
             head = search_free_list_bucket(arena, aligned_size, bucket);
         } else {
             /* guaranteed to be big enough so take from front */
             ASSERT(aligned_size <= free_list_sizes[bucket], "logic error");
             head = (chunk_header_t *) arena->free_list->front[bucket];
-            arena->free_list->front[bucket] = arena->free_list->front[bucket]->next;
-            if (head == (chunk_header_t *) arena->free_list->last[bucket])
-                arena->free_list->last[bucket] = arena->free_list->front[bucket];
-            else {
-                free_header_t *cur = (free_header_t *) head;
-                ASSERT(cur->next != NULL, "free list corrupted");
-                cur->next->head.u.prev = NULL;
-            }
+            ASSERT(head != NULL, "free list bitmap inconsistent");
+            remove_from_free_list(arena, (free_header_t *) head, bucket);
             LOG(3, "arena "PFX" bucket %d taking "PFX" => free front="PFX" last="PFX"\n",
                 arena, bucket, head, arena->free_list->front[bucket],
                 arena->free_list->last[bucket]);
@@ -1612,35 +2342,278 @@ find_free_list_entry(arena_header_t *arena, heapsz_t request_size, heapsz_t alig
         LOG(2, "\tusing free list size=%d for request=%d align=%d from bucket %d\n",
             head->alloc_size, request_size, aligned_size, bucket);
 
-        /* if there's a lot of extra room, split it off as a separate free entry */
-        if (head->alloc_size > aligned_size + CHUNK_MIN_SIZE + inter_chunk_space()) {
-            byte *split = ptr_from_header(head) + aligned_size +
-                (alloc_ops.shared_redzones ? 0 : alloc_ops.redzone_size);
-            size_t rest_size = head->alloc_size - (aligned_size + inter_chunk_space());
-            byte *chunk2_start = split + inter_chunk_space() -
-                (alloc_ops.shared_redzones ? 0 : alloc_ops.redzone_size);
-            free_header_t *rest = (free_header_t *) header_from_ptr(chunk2_start);
-            ASSERT(!TEST(CHUNK_MMAP, head->flags), "mmap not expected on free list");
-            STATS_INC(num_splits);
-            split_piece_for_free_list(arena, head, rest, rest_size, aligned_size);
-            ASSERT(is_valid_chunk(chunk2_start, &rest->head), "rest chunk inconsistent");
-        }
+        split_free_chunk(arena, head, aligned_size);
 
         if (head->user_data != NULL) {
             client_malloc_data_free(head->user_data);
             head->user_data = NULL;
         }
-        head->flags &= ~(CHUNK_FREED | ALLOCATOR_TYPE_FLAGS);
+        chunk_flags_update(head, 0, CHUNK_FREED | ALLOCATOR_TYPE_FLAGS);
 
         next = next_chunk_forward(arena, head, &container);
         if (next != NULL)
-            next->flags &= ~CHUNK_PREV_FREE;
+            chunk_flags_update(next, 0, CHUNK_PREV_FREE);
         else if (container != NULL)
             container->prev_free_sz = 0;
     }
     return head;
 }
 
+/* Carves a new chunk from arena->next_chunk.  The caller must ensure there is room
+ * for aligned_size plus inter_chunk_space() below arena->commit_end.
+ * Sets the alloc_size, magic, user_data, and flags header fields.
+ */
+static chunk_header_t *
+carve_new_chunk(arena_header_t *arena, heapsz_t aligned_size)
+{
+    heapsz_t add_size = aligned_size + inter_chunk_space();
+    byte *orig_next_chunk;
+    /* remember that arena->next_chunk always has a redzone preceding it */
+    chunk_header_t *head = header_create(arena->next_chunk);
+    ASSERT(arena->next_chunk + add_size <= arena->commit_end, "no room to carve");
+    head->alloc_size = aligned_size;
+    head->magic = HEADER_MAGIC;
+    head->user_data = NULL; /* b/c we pass the old to client */
+    head->flags = 0;
+    LOG(2, "\tcarving out new chunk @"PFX" => head="PFX", res="PFX"\n",
+        arena->next_chunk - alloc_ops.redzone_size, head, ptr_from_header(head));
+    orig_next_chunk = arena->next_chunk;
+    arena->next_chunk += add_size;
+    arena_layout_changed(arena);
+    if (arena->prev_free_sz != 0) {
+        /* There's a prior free, so we need to mark this new chunk with
+         * prev-free info.
+         */
+        byte *prev_ptr = orig_next_chunk - inter_chunk_space() -
+            arena->prev_free_sz;
+        chunk_header_t *prev = header_from_ptr(prev_ptr);
+        ASSERT(is_valid_chunk(prev_ptr, prev), "arena prev free corrupted");
+        ASSERT(TEST(CHUNK_FREED, prev->flags), "arena prev free inconsistent");
+        set_prev_size_field(arena, prev);
+        arena->prev_free_sz = 0;
+    }
+    return head;
+}
+
+/***************************************************************************
+ * per-thread magazines (i#948)
+ */
+
+static inline bool
+magazine_enabled(void *drcontext, arena_header_t *arena)
+{
+    cls_replace_t *data;
+    if (alloc_ops.magazine_size == 0 || magazines_exited)
+        return false;
+    /* Magazines only hold chunks from the thread's own arena */
+    data = (cls_replace_t *) drmgr_get_cls_field(drcontext, cls_idx_replace);
+    return (data != NULL && arena == data->arena);
+}
+
+/* Returns UINT_MAX if aligned_size is too large for a magazine */
+static inline uint
+magazine_bucket(heapsz_t aligned_size)
+{
+    uint bucket;
+    if (aligned_size > MAGAZINE_MAX_CHUNK)
+        return UINT_MAX;
+    /* Like find_free_list_entry(), use the guaranteed-size bucket */
+    for (bucket = 0; aligned_size > free_list_sizes[bucket]; bucket++)
+        ; /* nothing */
+    ASSERT(bucket < num_magazines, "magazine bucket out of range");
+    return bucket;
+}
+
+/* Caller must hold the arena lock */
+static void
+magazine_refill(arena_header_t *arena, magazine_t *mag, uint bucket)
+{
+    heapsz_t add_size = free_list_sizes[bucket] + inter_chunk_space();
+    STATS_INC(magazine_refills);
+    while (mag->count < alloc_ops.magazine_size) {
+        free_header_t *cur = arena->free_list->front[bucket];
+        if (cur != NULL) {
+            chunk_header_t *next;
+            arena_header_t *container = NULL;
+            /* Take from the front to preserve the FIFO from the delay list.
+             * We do not split: the bucket bounds the wasted space.
+             */
+            remove_from_free_list(arena, cur, bucket);
+            if (cur->head.user_data != NULL) {
+                client_malloc_data_free(cur->head.user_data);
+                cur->head.user_data = NULL;
+            }
+            ASSERT(mag->reused == mag->count, "reused chunks must be a prefix");
+            mag->reused++;
+            /* The next chunk must not try to coalesce with a magazine chunk */
+            next = next_chunk_forward(arena, &cur->head, &container);
+            if (next != NULL)
+                chunk_flags_update(next, 0, CHUNK_PREV_FREE);
+            else if (container != NULL)
+                container->prev_free_sz = 0;
+        } else {
+            /* Pre-carve from whatever committed space is left.  We leave arena
+             * extension to the regular path.
+             */
+            arena_header_t *sub;
+            for (sub = arena; sub != NULL; sub = sub->next_arena) {
+                if (sub->next_chunk + add_size <= sub->commit_end)
+                    break;
+            }
+            if (sub == NULL)
+                break;
+            cur = (free_header_t *) carve_new_chunk(sub, free_list_sizes[bucket]);
+        }
+        chunk_flags_update(&cur->head, CHUNK_FREED | CHUNK_MAGAZINE, 0);
+        cur->next = NULL;
+        if (mag->last == NULL)
+            mag->front = cur;
+        else
+            mag->last->next = cur;
+        mag->last = cur;
+        mag->count++;
+    }
+    LOG(3, "%s: arena "PFX" bucket %d => %d chunks\n", __FUNCTION__, arena, bucket,
+        mag->count);
+}
+
+/* Returns NULL if the request cannot be satisfied from a magazine.
+ * Only acquires the arena lock if the magazine needs to be refilled.
+ * Sets *reused to whether the chunk was previously freed by the app.
+ * The chunk is still marked CHUNK_FREED | CHUNK_MAGAZINE on return.
+ */
+static chunk_header_t *
+magazine_alloc(void *drcontext, arena_header_t *arena, heapsz_t aligned_size,
+               alloc_flags_t flags, bool *reused OUT)
+{
+    cls_replace_t *data;
+    magazine_t *mag;
+    free_header_t *cur;
+    uint bucket = magazine_bucket(aligned_size);
+    if (bucket == UINT_MAX)
+        return NULL;
+    data = (cls_replace_t *) drmgr_get_cls_field(drcontext, cls_idx_replace);
+    mag = &data->mag[bucket];
+    if (mag->front == NULL) {
+        arena_lock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
+        magazine_refill(arena, mag, bucket);
+        arena_unlock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
+        if (mag->front == NULL)
+            return NULL;
+    } else
+        STATS_INC(magazine_hits);
+    cur = mag->front;
+    mag->front = cur->next;
+    if (mag->front == NULL)
+        mag->last = NULL;
+    mag->count--;
+    *reused = (mag->reused > 0);
+    if (*reused)
+        mag->reused--;
+    /* We leave CHUNK_FREED | CHUNK_MAGAZINE set so that a malloc_lock() holder
+     * iterating right now skips the chunk: the caller clears them once it
+     * holds magazine_rwlock.
+     */
+    LOG(3, "%s: bucket %d taking "PFX"\n", __FUNCTION__, bucket, cur);
+    return &cur->head;
+}
+
+/* Caller must hold the arena lock.  Puts the magazine's chunks back on the free
+ * lists, coalescing with any neighbors that were freed in the meantime.
+ */
+static void
+magazine_return(arena_header_t *arena, magazine_t *mag)
+{
+    while (mag->front != NULL) {
+        free_header_t *cur = mag->front;
+        mag->front = cur->next;
+        chunk_flags_update(&cur->head, 0, CHUNK_MAGAZINE);
+        cur = coalesce_adjacent_frees(arena, cur);
+        if (cur != NULL) {
+            set_prev_size_field(arena, &cur->head);
+            add_to_free_list(arena, &cur->head);
+        }
+    }
+    mag->last = NULL;
+    mag->count = 0;
+    mag->reused = 0;
+}
+
+/* Caller must hold the arena lock */
+static void
+magazine_flush_pending(arena_header_t *arena, cls_replace_t *data)
+{
+    uint i;
+    STATS_INC(magazine_flushes);
+    for (i = 0; i < data->num_pending; i++)
+        add_to_delay_list(arena, data->pending[i]);
+    data->num_pending = 0;
+}
+
+/* The caller has already marked head as CHUNK_FREED | CHUNK_DELAY_FREE.
+ * Only acquires the arena lock once a full batch of frees has accumulated.
+ */
+static void
+magazine_free(void *drcontext, arena_header_t *arena, chunk_header_t *head,
+              alloc_flags_t flags)
+{
+    cls_replace_t *data = (cls_replace_t *)
+        drmgr_get_cls_field(drcontext, cls_idx_replace);
+    ASSERT(data->num_pending < alloc_ops.magazine_size, "pending frees overflow");
+    data->pending[data->num_pending++] = head;
+    if (data->num_pending >= alloc_ops.magazine_size) {
+        arena_lock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
+        magazine_flush_pending(arena, data);
+        arena_unlock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
+    }
+}
+
+static void
+magazine_flush_all(void *drcontext, cls_replace_t *data)
+{
+    uint i;
+    bool any = (data->num_pending > 0);
+    for (i = 0; i < num_magazines; i++)
+        any = any || (data->mag[i].front != NULL);
+    if (!any || !magazine_enabled(drcontext, data->arena))
+        return;
+    arena_lock(drcontext, data->arena, true/*app synch*/);
+    magazine_flush_pending(data->arena, data);
+    for (i = 0; i < num_magazines; i++)
+        magazine_return(data->arena, &data->mag[i]);
+    arena_unlock(drcontext, data->arena, true/*app synch*/);
+}
+
+static void
+replace_context_init(void *drcontext, bool new_depth)
+{
+    cls_replace_t *data;
+    if (new_depth) {
+        data = (cls_replace_t *) thread_alloc(drcontext, sizeof(*data), HEAPSTAT_WRAP);
+        drmgr_set_cls_field(drcontext, cls_idx_replace, data);
+    } else
+        data = (cls_replace_t *) drmgr_get_cls_field(drcontext, cls_idx_replace);
+    memset(data, 0, sizeof(*data));
+    /* Keyed by thread id so every callback depth of a thread uses the same shard */
+    if (num_shards > 1)
+        data->arena = shard_arenas[dr_get_thread_id(drcontext) % num_shards];
+    else
+        data->arena = cur_arena;
+}
+
+static void
+replace_context_exit(void *drcontext, bool thread_exit)
+{
+    cls_replace_t *data = (cls_replace_t *)
+        drmgr_get_cls_field(drcontext, cls_idx_replace);
+    /* We flush on a callback return too, as the struct is zeroed for re-use */
+    if (alloc_ops.magazine_size > 0)
+        magazine_flush_all(drcontext, data);
+    if (thread_exit)
+        thread_free(drcontext, data, sizeof(*data), HEAPSTAT_WRAP);
+    /* else, we leave the struct for re-use on next callback */
+}
+
 /* i#1581: to avoid retaddr local vars from callstack walks messing up app
  * callstacks, we invoke the 2nd layer on a clean dstack (this lets us keep
  * just the outer layer as stdcall, and avoids complicating drwrap further).
@@ -1669,6 +2642,11 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, size_t alignmen
     heapsz_t aligned_size;
     byte *res = NULL;
     chunk_header_t *head = NULL;
+    bool locked = false;
+    /* Whether head's memory is untouched since the kernel zeroed it */
+    bool fresh = false;
+    bool reused = false;
+    bool from_magazine = false;
     ASSERT((alloc_type & ~(ALLOCATOR_TYPE_FLAGS)) == 0, "invalid type flags");
 
     if (request_size > UINT_MAX ||
@@ -1703,7 +2681,25 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, size_t alignmen
     if (aligned_size < CHUNK_MIN_SIZE)
         aligned_size = CHUNK_MIN_SIZE;
 
+    /* i#948: try the per-thread magazine first, which usually needs no lock */
+    if (alignment == CHUNK_ALIGNMENT && magazine_enabled(drcontext, arena))
+        head = magazine_alloc(drcontext, arena, aligned_size, flags, &reused);
+    if (head != NULL) {
+        /* Exclude malloc_lock() holders while we call the client */
+        dr_rwlock_read_lock(magazine_rwlock);
+        from_magazine = true;
+        chunk_flags_update(head, 0, CHUNK_FREED | CHUNK_MAGAZINE | ALLOCATOR_TYPE_FLAGS);
+        /* A freshly carved chunk was never freed, so there is nothing to reuse */
+        if (reused) {
+            malloc_info_t info;
+            header_to_info(head, &info, NULL, 0);
+            client_handle_free_reuse(drcontext, &info, mc);
+        }
+        goto replace_alloc_common_have_chunk;
+    }
+
     arena_lock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
+    locked = true;
 
     /* for large requests we do direct mmap with own redzones.
      * we use the large malloc table to track them for iteration.
@@ -1723,29 +2719,27 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, size_t alignmen
             client_handle_alloc_failure(request_size, caller, mc);
             goto replace_alloc_common_done;
         }
-        ASSERT(!alloc_ops.external_headers, "NYI");
         mhead = (mmap_header_t *) map;
         mhead->map_size = map_size;
-        head = (chunk_header_t *)
-            ((byte *)map + sizeof(mmap_header_t) + alloc_ops.redzone_size +
-             header_beyond_redzone - redzone_beyond_header - header_size);
-        res = ptr_from_header(head);
-        if (!ALIGNED(res, alignment)) {
+        res = (byte *)map + sizeof(mmap_header_t) + alloc_ops.redzone_size +
+            header_beyond_redzone;
+        if (!ALIGNED(res, alignment))
             res = (byte *) ALIGN_FORWARD(res, alignment);
-            head = header_from_ptr(res);
-        }
-        dist_to_map = (byte *)head - map;
+        dist_to_map = res - map;
         if (dist_to_map > USHRT_MAX) {
             os_large_free(map, map_size);
             client_handle_alloc_failure(request_size, caller, mc);
             goto replace_alloc_common_done;
         }
+        head = header_create(res);
+        memset(head, 0, sizeof(*head));
         head->u.unfree.prev_size_shr = dist_to_map;
         mhead->head = head;
         head->flags |= CHUNK_MMAP;
         head->magic = HEADER_MAGIC;
         head->alloc_size = (map + map_size - alloc_ops.redzone_size - res);
         heap_region_add(map, map + map_size, HEAP_MMAP, mc);
+        fresh = true;
     } else {
         /* look for free list entry */
         head = find_free_list_entry(arena, request_size, aligned_size);
@@ -1768,7 +2762,6 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, size_t alignmen
          * so I'm sticking with this simple design for now.
          */
         arena_header_t *last_arena = arena;
-        byte *orig_next_chunk;
         while (arena != NULL) {
             if (arena->next_chunk + add_size <= arena->commit_end)
                 break;
@@ -1798,38 +2791,22 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, size_t alignmen
             }
         }
         if (head == NULL) {
-            /* remember that arena->next_chunk always has a redzone preceding it */
-            head = (chunk_header_t *)
-                (arena->next_chunk - redzone_beyond_header - header_size);
-            head->alloc_size = aligned_size;
-            head->magic = HEADER_MAGIC;
-            head->user_data = NULL; /* b/c we pass the old to client */
-            head->flags = 0;
-            LOG(2, "\tcarving out new chunk @"PFX" => head="PFX", res="PFX"\n",
-                arena->next_chunk - alloc_ops.redzone_size, head, ptr_from_header(head));
-            orig_next_chunk = arena->next_chunk;
-            arena->next_chunk += add_size;
-            if (arena->prev_free_sz != 0) {
-                /* There's a prior free, so we need to mark this new chunk with
-                 * prev-free info.
-                 */
-                byte *prev_ptr = orig_next_chunk - inter_chunk_space() -
-                    arena->prev_free_sz;
-                chunk_header_t *prev = header_from_ptr(prev_ptr);
-                ASSERT(is_valid_chunk(prev_ptr, prev), "arena prev free corrupted");
-                ASSERT(TEST(CHUNK_FREED, prev->flags), "arena prev free inconsistent");
-                set_prev_size_field(arena, prev);
-                arena->prev_free_sz = 0;
-            }
+            head = carve_new_chunk(arena, aligned_size);
+            /* Memory past next_chunk has never been handed out and is kept
+             * zeroed, except where a pre-us heap already used it.
+             */
+            fresh = IF_WINDOWS_ELSE(!TEST(ARENA_PRE_US_MAPPED, arena->flags), true);
         }
     }
 
+ replace_alloc_common_have_chunk:
     /* head->alloc_size, head->magic, and head->flags (except type) are already set */
     ASSERT(head->magic == HEADER_MAGIC, "corrupted header");
     ASSERT(head->alloc_size - request_size <= REQUEST_DIFF_MAX,
            "illegally large chunk padding");
     head->u.unfree.request_diff = head->alloc_size - request_size;
-    head->flags |= alloc_type;
+    /* We may not hold the lock if from a magazine */
+    chunk_flags_update(head, alloc_type, 0);
     res = ptr_from_header(head);
     if (!ALIGNED(res, alignment)) {
         /* Place the pre-aligned padding onto the free list */
@@ -1839,9 +2816,9 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, size_t alignmen
         size_t pre_sz;
         res += CHUNK_MIN_SIZE + inter_chunk_space();
         res = (byte *) ALIGN_FORWARD(res, alignment);
-        head = header_from_ptr(res);
+        head = header_create(res);
         *head = *orig;
-        pre_sz = (byte *)head - (byte *)orig - inter_chunk_space();
+        pre_sz = res - orig_res - inter_chunk_space();
         LOG(2, "\torig alloc %d bytes, shrinking by %d to align\n",
             head->alloc_size, res - orig_res);
         split_piece_for_free_list(arena, head, pre, pre_sz,
@@ -1852,8 +2829,12 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, size_t alignmen
     LOG(2, "\treplace_alloc_common arena="PFX" flags=0x%x request=%d, align=%d alloc=%d "
         "=> "PFX"\n", arena, head->flags,
         chunk_request_size(head), alignment, head->alloc_size, res);
-    if (TEST(ALLOC_ZERO, flags))
-        memset(res, 0, request_size);
+    if (TEST(ALLOC_ZERO, flags)) {
+        if (fresh)
+            STATS_INC(zero_fills_avoided);
+        else
+            memset(res, 0, request_size);
+    }
 
     ASSERT(head->alloc_size >= request_size, "chunk too small");
 
@@ -1865,7 +2846,10 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, size_t alignmen
         STATS_INC(num_mallocs);
 
  replace_alloc_common_done:
-    arena_unlock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
+    if (locked)
+        arena_unlock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
+    else if (from_magazine)
+        dr_rwlock_read_unlock(magazine_rwlock);
 
     return res;
 }
@@ -1934,7 +2918,9 @@ replace_free_common(arena_header_t *arena, void *ptr, alloc_flags_t flags,
 {
     chunk_header_t *head = header_from_ptr(ptr);
     malloc_info_t info;
+    bool use_magazine;
 
+    arena = arena_owning_ptr(arena, (byte *)ptr);
     if (!is_live_alloc(ptr, arena, head)) { /* including NULL */
         /* w/o early inject, or w/ delayed instru, there are allocs in place
          * before we took over
@@ -2020,7 +3006,16 @@ replace_free_common(arena_header_t *arena, void *ptr, alloc_flags_t flags,
         }
     }
 
-    arena_lock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
+    /* i#948: with a per-thread magazine we batch up the delay list additions
+     * and need no arena lock here.  We still exclude malloc_lock() holders
+     * across the client callbacks below.
+     */
+    use_magazine = magazine_enabled(drcontext, arena) &&
+        !TESTANY(CHUNK_MMAP | CHUNK_PRE_US, head->flags);
+    if (use_magazine)
+        dr_rwlock_read_lock(magazine_rwlock);
+    else
+        arena_lock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
 
     check_type_match(ptr, head, free_type, flags, mc, caller);
 
@@ -2040,8 +3035,11 @@ replace_free_common(arena_header_t *arena, void *ptr, alloc_flags_t flags,
 
     /* Mark this after client_remove_malloc_pre so client can iterate
      * and see the alloc as currently-live, matching wrapping behavior.
+     * Even if CHUNK_MMAP, so a client iter will skip.
+     * A pending magazine free is marked delayed right away so nobody
+     * coalesces with it.
      */
-    head->flags |= CHUNK_FREED; /* even if CHUNK_MMAP, so a client iter will skip */
+    chunk_flags_update(head, CHUNK_FREED | (use_magazine ? CHUNK_DELAY_FREE : 0), 0);
 
     if (TEST(ALLOC_INVOKE_CLIENT_DATA, flags))
         client_remove_malloc_post(&info);
@@ -2058,13 +3056,18 @@ replace_free_common(arena_header_t *arena, void *ptr, alloc_flags_t flags,
     if (!TESTANY(CHUNK_MMAP | CHUNK_PRE_US, head->flags)) {
         LOG(2, "\treplace_free_common "PFX" == request=%d, alloc=%d, arena="PFX"\n",
             ptr, chunk_request_size(head), head->alloc_size, arena);
-        add_to_delay_list(arena, head);
+        if (use_magazine) {
+            /* magazine_free() may take the arena lock, which must come first */
+            dr_rwlock_read_unlock(magazine_rwlock);
+            magazine_free(drcontext, arena, head, flags);
+        } else
+            add_to_delay_list(arena, head);
         /* At this point head may be invalid to de-ref, if coalesced or freed (this
          * will only happen if -delay_frees is 0)
          */
     } else if (TEST(CHUNK_MMAP, head->flags)) {
         /* see comments in alloc routine about not delaying the free */
-        byte *map = (byte *)head - head->u.unfree.prev_size_shr;
+        byte *map = ptr_from_header(head) - head->u.unfree.prev_size_shr;
         mmap_header_t *mhead = (mmap_header_t *) map;
         size_t map_size = mhead->map_size;
         ASSERT(mhead->head == head, "mmap header corrupted");
@@ -2072,14 +3075,84 @@ replace_free_common(arena_header_t *arena, void *ptr, alloc_flags_t flags,
         heap_region_remove(map, map + map_size, mc);
         if (!os_large_free(map, map_size))
             ASSERT(false, "munmap failed");
+        header_destroy(head);
     }
 
     STATS_INC(num_frees);
 
-    arena_unlock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
+    if (!use_magazine)
+        arena_unlock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
     return true;
 }
 
+/* Tries to grow the live chunk head in place to hold request_size bytes, either
+ * by absorbing the true free chunk that follows it or, if head is the last chunk
+ * in its arena, by moving the arena's next_chunk.  Caller must hold the lock.
+ * Leaves head's request_diff stale.
+ */
+static bool
+realloc_grow_in_place(arena_header_t *arena, chunk_header_t *head, size_t request_size)
+{
+    arena_header_t *container = NULL;
+    chunk_header_t *next;
+    heapsz_t need, aligned_size;
+    /* With pattern fills the absorbed redzone would still hold the pattern */
+    if (TESTANY(CHUNK_PRE_US | CHUNK_MMAP, head->flags) || !alloc_ops.shared_redzones)
+        return false;
+    if (request_size > UINT_MAX || ALIGN_FORWARD(request_size, PAGE_SIZE) < request_size)
+        return false;
+    /* Make sure the padding we may end up with fits in request_diff */
+    if (2*(CHUNK_MIN_SIZE + inter_chunk_space()) + CHUNK_ALIGNMENT > REQUEST_DIFF_MAX)
+        return false;
+    aligned_size = (heapsz_t) ALIGN_FORWARD(request_size, CHUNK_ALIGNMENT);
+    ASSERT(aligned_size > head->alloc_size, "only for growing");
+    need = aligned_size - head->alloc_size;
+    next = next_chunk_forward(arena, head, &container);
+    if (next != NULL) {
+        /* We can't take a delayed free without losing its quarantine */
+        heapsz_t piece;
+        if (!TEST(CHUNK_FREED, next->flags) ||
+            TESTANY(CHUNK_DELAY_FREE | CHUNK_MAGAZINE, next->flags) ||
+            next->alloc_size + inter_chunk_space() < need)
+            return false;
+        /* Synchronize with iterators (i#949) */
+        iterator_lock(arena, true/*in alloc*/);
+        remove_from_free_list(arena, (free_header_t *)next, UINT_MAX);
+        /* We absorb next's redzone and header and then piece bytes of it */
+        piece = (need > inter_chunk_space()) ? need - inter_chunk_space() : 0;
+        if (piece < CHUNK_MIN_SIZE)
+            piece = CHUNK_MIN_SIZE;
+        split_free_chunk(arena, next, piece);
+        if (next->user_data != NULL)
+            client_malloc_data_free(next->user_data);
+        head->alloc_size += next->alloc_size + inter_chunk_space();
+        arena_layout_changed(arena);
+        LOG(3, "realloc absorbing next chunk "PFX" => "PFX"-"PFX"\n", next,
+            ptr_from_header(head), ptr_from_header(head) + head->alloc_size);
+        header_destroy(next);
+        iterator_unlock(arena, true/*in alloc*/);
+        /* Whatever follows now has a live chunk before it */
+        next = next_chunk_forward(arena, head, &container);
+        if (next != NULL)
+            chunk_flags_update(next, 0, CHUNK_PREV_FREE);
+        else if (container != NULL)
+            container->prev_free_sz = 0;
+        return true;
+    } else if (container != NULL) {
+        ASSERT(container->prev_free_sz == 0, "arena tail is live");
+        if (container->next_chunk + need > container->commit_end &&
+            !arena_extend_in_place(container, need))
+            return false;
+        LOG(3, "realloc extending arena tail chunk "PFX" by "PIFX"\n",
+            ptr_from_header(head), need);
+        head->alloc_size += need;
+        container->next_chunk += need;
+        arena_layout_changed(container);
+        return true;
+    }
+    return false;
+}
+
 /* See i#1581 notes above */
 #define ONDSTACK_REPLACE_REALLOC_COMMON(arena, ptr, size, flags, dc, mc, caller, type) \
     dr_call_on_clean_stack(dc, (void* (*)(void)) replace_realloc_common, arena, ptr,   \
@@ -2100,6 +3173,8 @@ replace_realloc_common(arena_header_t *arena, byte *ptr, size_t size,
     malloc_info_t new_info;
     alloc_flags_t sub_flags = flags;
     LOG(2, "  %s: "PFX" %d bytes arena="PFX"\n", __FUNCTION__, ptr, size, arena);
+    if (ptr != NULL)
+        arena = arena_owning_ptr(arena, ptr);
     if (ptr == NULL) {
         if (TEST(ALLOC_ALLOW_NULL, flags)) {
             client_handle_realloc_null(caller, mc);
@@ -2140,16 +3215,20 @@ replace_realloc_common(arena_header_t *arena, byte *ptr, size_t size,
     check_type_match(ptr, head, alloc_type, flags, mc, caller);
 #endif
     header_to_info(head, &old_info, ptr, 0);
+    /* Growing in place avoids both the copy and the client's shadow copy */
+    if (head->alloc_size < size && realloc_grow_in_place(arena, head, size))
+        STATS_INC(realloc_in_place_grows);
     if (head->alloc_size >= size &&
         head->alloc_size - size <= REQUEST_DIFF_MAX &&
         !TEST(CHUNK_PRE_US, head->flags)) {
+        /* If we just grew the chunk its request_diff is stale so we use old_info */
         LOG(2, "\t%s: in-place realloc from %d to %d bytes\n", __FUNCTION__,
-            chunk_request_size(head), size);
+            old_info.request_size, size);
         /* XXX: if shrinking a lot, should free and re-malloc, or split, to save space */
-        if (chunk_request_size(head) >= LARGE_MALLOC_MIN_SIZE)
+        if (old_info.request_size >= LARGE_MALLOC_MIN_SIZE)
             malloc_large_remove(ptr);
-        if (chunk_request_size(head) < size && TEST(ALLOC_ZERO, flags))
-            memset(ptr + chunk_request_size(head), 0, size - chunk_request_size(head));
+        if (old_info.request_size < size && TEST(ALLOC_ZERO, flags))
+            memset(ptr + old_info.request_size, 0, size - old_info.request_size);
         head->u.unfree.request_diff = head->alloc_size - size;
         if (chunk_request_size(head) >= LARGE_MALLOC_MIN_SIZE)
             malloc_large_add(ptr, chunk_request_size(head));
@@ -2157,12 +3236,11 @@ replace_realloc_common(arena_header_t *arena, byte *ptr, size_t size,
         header_to_info(head, &new_info, NULL, flags | ALLOC_IS_REALLOC);
         client_handle_realloc(drcontext, &old_info, &new_info, false, mc);
     } else if (!TEST(ALLOC_IN_PLACE_ONLY, flags) || head->alloc_size >= size) {
-        size_t old_request_size = chunk_request_size(head);
+        size_t old_request_size = old_info.request_size;
         bool was_mmap = TEST(CHUNK_MMAP, head->flags);
         LOG(2, "\t%s: malloc-and-free realloc from %d to %d bytes\n", __FUNCTION__,
             old_request_size, size);
         /* XXX: use mremap for mmapped alloc! */
-        /* XXX: if final chunk in arena, extend in-place */
         res = (void *) replace_alloc_common(arena, size, 0,
                                             sub_flags | ALLOC_IS_REALLOC /*no client*/,
                                             drcontext, mc, caller, alloc_type);
@@ -2173,7 +3251,7 @@ replace_realloc_common(arena_header_t *arena, byte *ptr, size_t size,
              * seeing the new alloc and complaining that it has not yet had
              * client_add_malloc_{pre,post} called on it yet.
              */
-            head->flags |= CHUNK_SKIP_ITER;
+            chunk_flags_update(head, CHUNK_SKIP_ITER, 0);
             replace_free_common(arena, ptr,
                                 sub_flags | ALLOC_IS_REALLOC |
                                 /* we do want client_remove_malloc_{pre,post} as they
@@ -2183,7 +3261,7 @@ replace_realloc_common(arena_header_t *arena, byte *ptr, size_t size,
                                 ALLOC_INVOKE_CLIENT_DATA /* not _ACTION */ |
                                 ALLOC_IGNORE_MISMATCH,
                                 drcontext, mc, caller, alloc_type);
-            head->flags &= ~CHUNK_SKIP_ITER;
+            chunk_flags_update(head, 0, CHUNK_SKIP_ITER);
             header_to_info(head, &new_info, NULL, flags | ALLOC_IS_REALLOC);
             /* We delay client_add_malloc_{pre,post} until here, to avoid a client
              * iterating inside the event and seeing both the new and old allocs!
@@ -2209,6 +3287,7 @@ replace_size_common(arena_header_t *arena, byte *ptr, alloc_flags_t flags,
 {
     chunk_header_t *head = header_from_ptr(ptr);
     size_t res;
+    arena = arena_owning_ptr(arena, ptr);
     LOG(2, "%s: "PFX", flags 0x%x, arena "PFX"\n", __FUNCTION__, ptr, flags, arena);
     arena_lock(drcontext, arena, TEST(ALLOC_SYNCHRONIZE, flags));
     if (!is_live_alloc(ptr, arena, head)) {
@@ -2240,6 +3319,33 @@ replace_size_common(arena_header_t *arena, byte *ptr, alloc_flags_t flags,
 }
 
 #if defined(WINDOWS) || defined(MACOS)
+/* Drops every delayed free of the family whose lists are in arena->free_list,
+ * taking its bytes back out of the -delay_frees_global_maxsz total, which is
+ * otherwise only reduced as chunks shift to the free lists.
+ */
+static void
+discard_delay_lists(arena_header_t *arena)
+{
+    free_lists_t *lists = arena->free_list;
+    free_header_t *cur;
+    uint cls;
+    if (alloc_ops.delay_frees_global_maxsz > 0)
+        ATOMIC_ADD32(global_delayed_bytes, -(int)lists->delayed_bytes);
+    for (cls = 0; cls < NUM_DELAY_CLASSES; cls++) {
+        for (cur = lists->delay[cls].front; cur != NULL; cur = cur->next) {
+            chunk_flags_update(&cur->head, 0, CHUNK_DELAY_FREE);
+            /* The client data is kept for delayed frees until they shift */
+            if (cur->head.user_data != NULL) {
+                client_malloc_data_free(cur->head.user_data);
+                cur->head.user_data = NULL;
+            }
+        }
+        memset(&lists->delay[cls], 0, sizeof(lists->delay[cls]));
+    }
+    lists->delayed_chunks = 0;
+    lists->delayed_bytes = 0;
+}
+
 /* Caller should hold any required locks, though we are probably assuming
  * no synch is needed here.
  */
@@ -2250,13 +3356,16 @@ destroy_arena_family(arena_header_t *arena, dr_mcontext_t *mc, bool free_chunks,
     arena_header_t *a, *next_a;
     chunk_header_t *head;
     malloc_info_t info;
+    /* The sub-arenas share the family's lists, so this covers them all */
+    discard_delay_lists(arena);
     for (a = arena; a != NULL; a = next_a) {
         next_a = a->next_arena;
-        if (free_chunks) {
+        if (free_chunks || alloc_ops.external_headers) {
             byte *cur = a->start_chunk;
             while (cur < a->next_chunk) {
                 head = header_from_ptr(cur);
-                if (!TEST(CHUNK_FREED, head->flags)) {
+                cur += head->alloc_size + inter_chunk_space();
+                if (free_chunks && !TEST(CHUNK_FREED, head->flags)) {
                     /* XXX: like mmaps for large allocs, we assume the OS
                      * re-using the memory won't be immediate, so we go w/
                      * a simple no-delay policy on the frees
@@ -2269,7 +3378,7 @@ destroy_arena_family(arena_header_t *arena, dr_mcontext_t *mc, bool free_chunks,
                     client_handle_free(&info, info.base, mc, caller, NULL,
                                        true/*not delayed*/ _IF_WINDOWS((HANDLE)arena));
                 }
-                cur += head->alloc_size + inter_chunk_space();
+                header_destroy(head);
             }
         }
         heap_region_remove((byte *)a, a->reserve_end, mc);
@@ -2295,6 +3404,106 @@ skip_chunk_in_iter(alloc_iter_data_t *data, chunk_header_t *head)
         TEST(CHUNK_SKIP_ITER, head->flags);
 }
 
+/* Number of index entries handed to a worker at a time by alloc_iterate_parallel() */
+#define ITER_SLICE_CHUNKS 4096
+#define CHUNK_INDEX_INITIAL_CAP 256
+
+typedef struct _iter_slice_t {
+    arena_header_t *arena;
+    uint start;
+    uint end;
+} iter_slice_t;
+
+/* Worker pool for alloc_iterate_parallel(), sized by alloc_ops.iterate_threads.
+ * iter_pool_lock serializes parallel iterations; the remaining fields are only
+ * written by its owner while the workers are idle.
+ */
+static void *iter_pool_lock;
+static uint num_iter_workers;
+static void **iter_start_event;
+static void **iter_done_event;
+static volatile bool iter_pool_exit;
+static alloc_iter_data_t *iter_pool_data;
+static iter_slice_t *iter_slices;
+static uint num_iter_slices;
+static uint iter_slices_cap;
+static volatile int iter_next_slice;
+static volatile bool iter_stop;
+
+/* Caller must hold iterator_lock(arena).  The index holds every chunk header
+ * rather than just live ones so that plain mallocs and frees, which only flip
+ * flags, leave it valid.
+ */
+static void
+arena_index_refresh(arena_header_t *arena)
+{
+    uint gen = arena->free_list->layout_gen;
+    byte *cur;
+    if (arena->index != NULL && arena->index_gen == gen)
+        return;
+    arena->index_num = 0;
+    for (cur = arena->start_chunk; cur < arena->next_chunk; ) {
+        chunk_header_t *head = header_from_ptr(cur);
+        if (arena->index_num == arena->index_cap) {
+            uint new_cap = (arena->index_cap == 0) ? CHUNK_INDEX_INITIAL_CAP :
+                arena->index_cap * 2;
+            chunk_header_t **grown = (chunk_header_t **)
+                global_alloc(new_cap * sizeof(*grown), HEAPSTAT_WRAP);
+            if (arena->index != NULL) {
+                memcpy(grown, arena->index, arena->index_num * sizeof(*grown));
+                global_free(arena->index, arena->index_cap * sizeof(*grown),
+                            HEAPSTAT_WRAP);
+            }
+            arena->index = grown;
+            arena->index_cap = new_cap;
+        }
+        arena->index[arena->index_num++] = head;
+        cur += head->alloc_size + inter_chunk_space();
+    }
+    if (arena->index == NULL) {
+        arena->index = (chunk_header_t **)
+            global_alloc(CHUNK_INDEX_INITIAL_CAP * sizeof(*arena->index), HEAPSTAT_WRAP);
+        arena->index_cap = CHUNK_INDEX_INITIAL_CAP;
+    }
+    arena->index_gen = gen;
+    STATS_INC(chunk_index_rebuilds);
+    LOG(3, "%s: "PFX" has %d chunks\n", __FUNCTION__, arena, arena->index_num);
+}
+
+/* Caller must hold iterator_lock(arena) and have refreshed its index */
+static bool
+alloc_iter_index_range(alloc_iter_data_t *data, arena_header_t *arena,
+                       uint start, uint end)
+{
+    uint i;
+    malloc_info_t info;
+    for (i = start; i < end; i++) {
+        chunk_header_t *head = arena->index[i];
+        if (!skip_chunk_in_iter(data, head)) {
+            header_to_info(head, &info, NULL, 0);
+            if (!data->cb(&info, data->data))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool
+alloc_iter_mmap_chunk(alloc_iter_data_t *data, byte *map_base)
+{
+    chunk_header_t *head = header_from_mmap_base(map_base);
+    malloc_info_t info;
+    if (!skip_chunk_in_iter(data, head)) {
+        header_to_info(head, &info, NULL, 0);
+        ASSERT(TEST(CHUNK_MMAP, head->flags), "mmap chunk inconsistent");
+        LOG(2, "%s: "PFX"-"PFX"\n", __FUNCTION__, info.base,
+            info.base + chunk_request_size(head));
+        if (!data->cb(&info, data->data))
+            return false;
+    }
+    return true;
+}
+
 static bool
 alloc_iter_own_arena(byte *iter_arena_start, byte *iter_arena_end, uint flags
                      _IF_WINDOWS(HANDLE heap), void *iter_data)
@@ -2310,15 +3519,8 @@ alloc_iter_own_arena(byte *iter_arena_start, byte *iter_arena_end, uint flags
      */
     /* We rely on the heap region lock to avoid races accessing this */
     if (TEST(HEAP_MMAP, flags)) {
-        chunk_header_t *head = header_from_mmap_base(iter_arena_start);
-        if (!skip_chunk_in_iter(data, head)) {
-            header_to_info(head, &info, NULL, 0);
-            ASSERT(TEST(CHUNK_MMAP, head->flags), "mmap chunk inconsistent");
-            LOG(2, "%s: "PFX"-"PFX"\n", __FUNCTION__, info.base,
-                info.base + chunk_request_size(head));
-            if (!data->cb(&info, data->data))
-                return false;
-        }
+        if (!alloc_iter_mmap_chunk(data, iter_arena_start))
+            return false;
     }
 
     if (TEST(HEAP_PRE_US, flags) || !TEST(HEAP_ARENA, flags))
@@ -2327,6 +3529,13 @@ alloc_iter_own_arena(byte *iter_arena_start, byte *iter_arena_end, uint flags
     LOG(2, "%s: "PFX"-"PFX"\n", __FUNCTION__, iter_arena_start, iter_arena_end);
     /* Synchronize with splits or coalesces (i#949) */
     iterator_lock(arena, false/*!in alloc*/);
+    if (alloc_ops.chunk_index) {
+        bool keep_going;
+        arena_index_refresh(arena);
+        keep_going = alloc_iter_index_range(data, arena, 0, arena->index_num);
+        iterator_unlock(arena, false/*!in alloc*/);
+        return keep_going;
+    }
     cur = arena->start_chunk;
     while (cur < arena->next_chunk) {
         head = header_from_ptr(cur);
@@ -2345,6 +3554,32 @@ alloc_iter_own_arena(byte *iter_arena_start, byte *iter_arena_end, uint flags
     return true;
 }
 
+static void
+alloc_iterate_pre_us(alloc_iter_data_t *data)
+{
+    uint i;
+    malloc_info_t info;
+    LOG(3, "%s: iterating pre-us allocs\n", __FUNCTION__);
+    /* XXX: should add hashtable_iterate() to drcontainers */
+    /* See notes at top: this table is only modified at init or teardown
+     * and thus needs no external lock.
+     */
+    for (i = 0; i < HASHTABLE_SIZE(pre_us_table.table_bits); i++) {
+        hash_entry_t *he;
+        for (he = pre_us_table.table[i]; he != NULL; he = he->next) {
+            chunk_header_t *head = (chunk_header_t *) he->payload;
+            byte *start = he->key;
+            if (!skip_chunk_in_iter(data, head)) {
+                LOG(3, "\tpre-us "PFX"-"PFX"-"PFX"\n",
+                    start, start + chunk_request_size(head), start + head->alloc_size);
+                header_to_info(head, &info, start, 0);
+                if (!data->cb(&info, data->data))
+                    return;
+            }
+        }
+    }
+}
+
 /* This will end up grabbing DR locks (iterator_lock()) but that's fine even
  * in an app context, as it's not while we're marked safe-to-suspend and
  * it's only in our own code.
@@ -2360,35 +3595,193 @@ alloc_iterate(malloc_iter_cb_t cb, void *iter_data, bool only_live)
      * + ignore pre-us arenas and instead iterate pre_us_table
      */
     alloc_iter_data_t data = {only_live, cb, iter_data};
-    uint i;
-    malloc_info_t info;
 
     LOG(2, "%s\n", __FUNCTION__);
 
-    ASSERT(!alloc_ops.external_headers, "NYI: walk malloc table");
-
     LOG(3, "%s: iterating heap regions\n", __FUNCTION__);
     heap_region_iterate(alloc_iter_own_arena, &data);
 
-    LOG(3, "%s: iterating pre-us allocs\n", __FUNCTION__);
-    /* XXX: should add hashtable_iterate() to drcontainers */
-    /* See notes at top: this table is only modified at init or teardown
-     * and thus needs no external lock.
+    alloc_iterate_pre_us(&data);
+}
+
+static void
+iter_slice_add(arena_header_t *arena, uint start, uint end)
+{
+    if (num_iter_slices == iter_slices_cap) {
+        uint new_cap = (iter_slices_cap == 0) ? 64 : iter_slices_cap * 2;
+        iter_slice_t *grown = (iter_slice_t *)
+            global_alloc(new_cap * sizeof(*grown), HEAPSTAT_WRAP);
+        if (iter_slices != NULL) {
+            memcpy(grown, iter_slices, num_iter_slices * sizeof(*grown));
+            global_free(iter_slices, iter_slices_cap * sizeof(*grown), HEAPSTAT_WRAP);
+        }
+        iter_slices = grown;
+        iter_slices_cap = new_cap;
+    }
+    iter_slices[num_iter_slices].arena = arena;
+    iter_slices[num_iter_slices].start = start;
+    iter_slices[num_iter_slices].end = end;
+    num_iter_slices++;
+}
+
+/* Locks each arena and cuts its index into slices.  The locks are held until
+ * alloc_iterate_parallel() is done with the slices.  Every locked arena gets at
+ * least one slice, whose start is 0, even if it has no chunks.
+ */
+static bool
+alloc_iter_collect_arena(byte *iter_arena_start, byte *iter_arena_end, uint flags
+                         _IF_WINDOWS(HANDLE heap), void *iter_data)
+{
+    alloc_iter_data_t *data = (alloc_iter_data_t *) iter_data;
+    arena_header_t *arena = (arena_header_t *) iter_arena_start;
+    uint i;
+
+    /* mmap chunks are single chunks: not worth handing to a worker */
+    if (TEST(HEAP_MMAP, flags)) {
+        if (!alloc_iter_mmap_chunk(data, iter_arena_start)) {
+            iter_stop = true;
+            return false;
+        }
+    }
+    if (TEST(HEAP_PRE_US, flags) || !TEST(HEAP_ARENA, flags))
+        return true;
+
+    iterator_lock(arena, false/*!in alloc*/);
+    arena_index_refresh(arena);
+    for (i = 0; ; i += ITER_SLICE_CHUNKS) {
+        uint end = (arena->index_num - i > ITER_SLICE_CHUNKS) ?
+            i + ITER_SLICE_CHUNKS : arena->index_num;
+        iter_slice_add(arena, i, end);
+        if (end == arena->index_num)
+            break;
+    }
+    return true;
+}
+
+static void
+alloc_iter_claim_slices(void)
+{
+    while (!iter_stop) {
+        int idx = atomic_add32_return_sum(&iter_next_slice, 1) - 1;
+        iter_slice_t *slice;
+        if (idx >= (int)num_iter_slices)
+            break;
+        slice = &iter_slices[idx];
+        if (!alloc_iter_index_range(iter_pool_data, slice->arena,
+                                    slice->start, slice->end))
+            iter_stop = true;
+    }
+}
+
+static void
+iter_worker_run(void *arg)
+{
+    uint idx = (uint)(ptr_uint_t) arg;
+    /* We serve iterations made while all other threads are suspended (e.g.,
+     * leak scans) so we must keep running during synchall.  We only touch
+     * heap state whose arena locks our requester holds.
      */
-    for (i = 0; i < HASHTABLE_SIZE(pre_us_table.table_bits); i++) {
-        hash_entry_t *he;
-        for (he = pre_us_table.table[i]; he != NULL; he = he->next) {
-            chunk_header_t *head = (chunk_header_t *) he->payload;
-            byte *start = he->key;
-            if (!skip_chunk_in_iter(&data, head)) {
-                LOG(3, "\tpre-us "PFX"-"PFX"-"PFX"\n",
-                    start, start + chunk_request_size(head), start + head->alloc_size);
-                header_to_info(head, &info, start, 0);
-                if (!cb(&info, iter_data))
-                    break;
-            }
+    dr_client_thread_set_suspendable(false);
+    while (true) {
+        dr_event_wait(iter_start_event[idx]);
+        dr_event_reset(iter_start_event[idx]);
+        if (iter_pool_exit)
+            break;
+        alloc_iter_claim_slices();
+        dr_event_signal(iter_done_event[idx]);
+    }
+}
+
+/* Like alloc_iterate(cb, iter_data, true) but, with alloc_ops.iterate_threads > 1,
+ * divides the arena chunks among the worker pool and this thread, invoking cb
+ * concurrently.  Each arena stays locked for the whole iteration.  A false
+ * return from cb stops all threads, though others may still complete the
+ * callback they are in.
+ */
+static void
+alloc_iterate_parallel(malloc_iter_cb_t cb, void *iter_data)
+{
+    alloc_iter_data_t data = {true/*live only*/, cb, iter_data};
+    uint i;
+
+    if (num_iter_workers == 0) {
+        alloc_iterate(cb, iter_data, true/*live only*/);
+        return;
+    }
+    LOG(2, "%s\n", __FUNCTION__);
+    dr_mutex_lock(iter_pool_lock);
+    iter_pool_data = &data;
+    num_iter_slices = 0;
+    iter_next_slice = 0;
+    iter_stop = false;
+    heap_region_iterate(alloc_iter_collect_arena, &data);
+    LOG(3, "%s: %d slices for %d workers\n", __FUNCTION__, num_iter_slices,
+        num_iter_workers + 1);
+    if (!iter_stop) {
+        for (i = 0; i < num_iter_workers; i++)
+            dr_event_signal(iter_start_event[i]);
+        alloc_iter_claim_slices();
+        for (i = 0; i < num_iter_workers; i++) {
+            dr_event_wait(iter_done_event[i]);
+            dr_event_reset(iter_done_event[i]);
+        }
+    }
+    for (i = 0; i < num_iter_slices; i++) {
+        if (iter_slices[i].start == 0)
+            iterator_unlock(iter_slices[i].arena, false/*!in alloc*/);
+    }
+    iter_pool_data = NULL;
+    STATS_INC(parallel_iterations);
+    if (!iter_stop)
+        alloc_iterate_pre_us(&data);
+    dr_mutex_unlock(iter_pool_lock);
+}
+
+static void
+iter_pool_init(void)
+{
+    uint i;
+    if (alloc_ops.iterate_threads <= 1)
+        return;
+    iter_pool_lock = dr_mutex_create();
+    iter_start_event = (void **)
+        global_alloc((alloc_ops.iterate_threads - 1) * sizeof(void *), HEAPSTAT_WRAP);
+    iter_done_event = (void **)
+        global_alloc((alloc_ops.iterate_threads - 1) * sizeof(void *), HEAPSTAT_WRAP);
+    for (i = 0; i < alloc_ops.iterate_threads - 1; i++) {
+        iter_start_event[i] = dr_event_create();
+        iter_done_event[i] = dr_event_create();
+        if (!dr_create_client_thread(iter_worker_run, (void *)(ptr_uint_t) i)) {
+            LOG(1, "failed to create heap iteration worker #%d\n", i);
+            dr_event_destroy(iter_start_event[i]);
+            dr_event_destroy(iter_done_event[i]);
+            break;
         }
+        num_iter_workers++;
+    }
+}
+
+static void
+iter_pool_exit_all(void)
+{
+    uint i;
+    if (iter_pool_lock == NULL)
+        return;
+    /* DR synchs and terminates client threads before our exit event (i#297),
+     * so the workers are gone and we cannot wait for them.
+     */
+    iter_pool_exit = true;
+    for (i = 0; i < num_iter_workers; i++) {
+        dr_event_destroy(iter_start_event[i]);
+        dr_event_destroy(iter_done_event[i]);
     }
+    global_free(iter_start_event, (alloc_ops.iterate_threads - 1) * sizeof(void *),
+                HEAPSTAT_WRAP);
+    global_free(iter_done_event, (alloc_ops.iterate_threads - 1) * sizeof(void *),
+                HEAPSTAT_WRAP);
+    if (iter_slices != NULL)
+        global_free(iter_slices, iter_slices_cap * sizeof(*iter_slices), HEAPSTAT_WRAP);
+    dr_mutex_destroy(iter_pool_lock);
 }
 
 static bool
@@ -2475,7 +3868,6 @@ alloc_replace_overlaps_region(byte *start, byte *end,
             /* XXX: make a shared internal iterator for this? */
             arena_header_t *arena = (arena_header_t *) found_arena_start;
             byte *cur = arena->start_chunk;
-            ASSERT(!alloc_ops.external_headers, "NYI: walk malloc table");
             /* Synchronize with splits or coalesces (i#949) */
             iterator_lock(arena, false/*!in alloc*/);
             while (cur < arena->next_chunk) {
@@ -2568,6 +3960,12 @@ arena_for_libc_alloc(void *drcontext)
     return arena;
 #else
     /* we assume that pre-us (which doesn't use cur_arena) is checked by caller */
+    if (num_shards > 1) {
+        cls_replace_t *data = (cls_replace_t *)
+            drmgr_get_cls_field(drcontext, cls_idx_replace);
+        if (data != NULL && data->arena != NULL)
+            return data->arena;
+    }
     return cur_arena;
 #endif
 }
@@ -3525,13 +4923,6 @@ replace_RtlDestroyHeap(HANDLE heap)
  * have to be contingent on this recent ntdll.dll.
  */
 
-/* If we add more fields, we should move this up top-level */
-static int cls_idx_replace = -1;
-
-typedef struct _cls_replace_t {
-    uint in_nosy_heap_region; /* are we inside RtlGetThreadPreferredUILanguages */
-} cls_replace_t;
-
 typedef NTSYSAPI PVOID (NTAPI *RtlAllocateHeap_t)(HANDLE, ULONG, SIZE_T);
 static RtlAllocateHeap_t native_RtlAllocateHeap;
 
@@ -3549,29 +4940,6 @@ static app_pc ntdll_end;
 #define NOSY_TABLE_HASH_BITS 8
 static hashtable_t nosy_table;
 
-static void
-replace_context_init(void *drcontext, bool new_depth)
-{
-    cls_replace_t *data;
-    if (new_depth) {
-        data = (cls_replace_t *) thread_alloc(drcontext, sizeof(*data), HEAPSTAT_WRAP);
-        drmgr_set_cls_field(drcontext, cls_idx_replace, data);
-    } else
-        data = (cls_replace_t *) drmgr_get_cls_field(drcontext, cls_idx_replace);
-    memset(data, 0, sizeof(*data));
-}
-
-static void
-replace_context_exit(void *drcontext, bool thread_exit)
-{
-    if (thread_exit) {
-        cls_replace_t *data = (cls_replace_t *)
-            drmgr_get_cls_field(drcontext, cls_idx_replace);
-        thread_free(drcontext, data, sizeof(*data), HEAPSTAT_WRAP);
-    }
-    /* else, nothing to do: we leave the struct for re-use on next callback */
-}
-
 static void
 replace_start_nosy_sequence(void *wrapcxt, OUT void **user_data)
 {
@@ -3638,10 +5006,6 @@ replace_nosy_init(void)
     ASSERT(native_RtlFreeHeap != NULL, "failed to find RtlFreeHeap");
     dr_free_module_data(ntdll);
 
-    cls_idx_replace =
-        drmgr_register_cls_field(replace_context_init, replace_context_exit);
-    ASSERT(cls_idx_replace > -1, "unable to reserve CLS field");
-
     hashtable_init(&nosy_table, NOSY_TABLE_HASH_BITS, HASH_INTPTR, false/*!strdup*/);
 }
 
@@ -3658,8 +5022,6 @@ replace_nosy_exit(void)
                            replace_start_nosy_sequence, replace_stop_nosy_sequence))
             ASSERT(false, "failed to unwrap");
     }
-    drmgr_unregister_cls_field(replace_context_init, replace_context_exit,
-                               cls_idx_replace);
     hashtable_delete_with_stats(&nosy_table, "nosy");
 }
 
@@ -4687,8 +6049,13 @@ alloc_replace_orig_brk(void)
 bool
 alloc_replace_in_cur_arena(byte *addr)
 {
+    uint i;
     ASSERT(alloc_ops.replace_malloc, "shouldn't call");
-    return ptr_is_in_arena(addr, cur_arena);
+    for (i = 0; i < num_shards; i++) {
+        if (ptr_is_in_arena(addr, shard_arenas[i]))
+            return true;
+    }
+    return false;
 }
 
 bool
@@ -5177,7 +6544,7 @@ malloc_replace__set_client_flag(app_pc start, uint client_flag)
     chunk_header_t *head = header_from_ptr_include_pre_us(start);
     if (head == NULL)
         return false;
-    head->flags |= (client_flag & MALLOC_POSSIBLE_CLIENT_FLAGS);
+    chunk_flags_update(head, client_flag & MALLOC_POSSIBLE_CLIENT_FLAGS, 0);
     return true;
 }
 
@@ -5187,7 +6554,7 @@ malloc_replace__clear_client_flag(app_pc start, uint client_flag)
     chunk_header_t *head = header_from_ptr_include_pre_us(start);
     if (head == NULL)
         return false;
-    head->flags &= ~(client_flag & MALLOC_POSSIBLE_CLIENT_FLAGS);
+    chunk_flags_update(head, 0, client_flag & MALLOC_POSSIBLE_CLIENT_FLAGS);
     return true;
 }
 
@@ -5197,6 +6564,13 @@ malloc_replace__iterate(bool (*cb)(malloc_info_t *info, void *iter_data), void *
     alloc_iterate(cb, iter_data, true/*live only*/);
 }
 
+static void
+malloc_replace__iterate_parallel(bool (*cb)(malloc_info_t *info, void *iter_data),
+                                 void *iter_data)
+{
+    alloc_iterate_parallel(cb, iter_data);
+}
+
 static void
 malloc_replace__lock(void)
 {
@@ -5211,19 +6585,31 @@ malloc_replace__lock(void)
     ASSERT(alloc_ops.global_lock, "must set global_lock to use malloc_lock()");
     dr_recurlock_lock(cur_arena->dr_lock);
 #else
-    dr_recurlock_lock(cur_arena->lock);
+    uint i;
+    /* Always in shard order, to avoid deadlock */
+    for (i = 0; i < num_shards; i++)
+        dr_recurlock_lock(shard_arenas[i]->lock);
 #endif
+    /* i#948: wait out any magazine alloc or free that is calling the client.
+     * This is after the arena locks, matching the magazine paths' order.
+     */
+    if (magazine_rwlock != NULL)
+        dr_rwlock_write_lock(magazine_rwlock);
 }
 
 static void
 malloc_replace__unlock(void)
 {
+    if (magazine_rwlock != NULL)
+        dr_rwlock_write_unlock(magazine_rwlock);
 #ifdef WINDOWS
     /* i#949: see comments above */
     ASSERT(alloc_ops.global_lock, "must set global_lock to use malloc_lock()");
     dr_recurlock_unlock(cur_arena->dr_lock);
 #else
-    dr_recurlock_unlock(cur_arena->lock);
+    uint i;
+    for (i = num_shards; i > 0; i--)
+        dr_recurlock_unlock(shard_arenas[i - 1]->lock);
 #endif
 }
 
@@ -5251,7 +6637,11 @@ alloc_replace_init(void)
     if (!drmgr_register_bb_app2app_event(bb_event, NULL))
         ASSERT(false, "drmgr registration failed");
 
-    if (alloc_ops.shared_redzones) {
+    if (alloc_ops.external_headers) {
+        /* Nothing but the redzone sits between chunks */
+        header_size = 0;
+        ext_table_init();
+    } else if (alloc_ops.shared_redzones) {
         /* For x64 we have to add 8 extra bytes to align this */
         header_size = ALIGN_FORWARD(sizeof(chunk_header_t), CHUNK_ALIGNMENT);
     } else {
@@ -5261,8 +6651,8 @@ alloc_replace_init(void)
         header_size = ALIGN_FORWARD(sizeof(free_header_t), CHUNK_ALIGNMENT);
     }
 
-    ASSERT(sizeof(free_header_t) <=
-           (alloc_ops.external_headers ? 0 : sizeof(chunk_header_t)) + CHUNK_MIN_SIZE,
+    ASSERT(alloc_ops.external_headers ||
+           sizeof(free_header_t) <= sizeof(chunk_header_t) + CHUNK_MIN_SIZE,
            "min size too small");
     /* we could pad but it's simpler to have struct already have right size */
     ASSERT(ALIGNED(header_size, CHUNK_ALIGNMENT), "alignment off");
@@ -5277,6 +6667,15 @@ alloc_replace_init(void)
 
     ASSERT(USHRT_MAX*CHUNK_ALIGNMENT >= CHUNK_MIN_MMAP, "prev_size_shr field too small");
 
+    ASSERT(NUM_FREE_LISTS <= sizeof(uint)*8, "too many buckets for nonempty bitmap");
+
+    if (alloc_ops.delay_frees_by_size)
+        num_delay_classes = NUM_DELAY_CLASSES;
+
+    ASSERT(offsetof(chunk_header_t, magic) == offsetof(chunk_header_t, flags) +
+           sizeof(ushort) && ALIGNED(offsetof(chunk_header_t, flags), sizeof(int)),
+           "chunk_flags_update() requires flags and magic to share a word");
+
     if (!alloc_ops.shared_redzones) {
         header_beyond_redzone = header_size;
         redzone_beyond_header = alloc_ops.redzone_size;
@@ -5291,6 +6690,23 @@ alloc_replace_init(void)
 
     hashtable_init(&pre_us_table, PRE_US_TABLE_HASH_BITS, HASH_INTPTR, false/*!strdup*/);
 
+    /* i#948: global_lock users need malloc_lock() to cover all frees */
+    if (alloc_ops.global_lock || alloc_ops.external_headers)
+        alloc_ops.magazine_size = 0;
+    if (alloc_ops.magazine_size > MAGAZINE_MAX_SIZE)
+        alloc_ops.magazine_size = MAGAZINE_MAX_SIZE;
+    for (num_magazines = 0; num_magazines < NUM_FREE_LISTS - 1 &&
+             free_list_sizes[num_magazines] <= MAGAZINE_MAX_CHUNK; num_magazines++)
+        ; /* nothing */
+    ASSERT(free_list_sizes[num_magazines - 1] == MAGAZINE_MAX_CHUNK,
+           "magazine max must be a bucket size");
+    if (alloc_ops.magazine_size > 0)
+        magazine_rwlock = dr_rwlock_create();
+
+    cls_idx_replace =
+        drmgr_register_cls_field(replace_context_init, replace_context_exit);
+    ASSERT(cls_idx_replace > -1, "unable to reserve CLS field");
+
 #ifdef WINDOWS
     if (alloc_ops.global_lock)
         global_lock = dr_recurlock_create();
@@ -5316,6 +6732,21 @@ alloc_replace_init(void)
     LOG(2, "heap orig brk="PFX"\n", pre_us_brk);
     heap_region_add((byte *)cur_arena, cur_arena->reserve_end, HEAP_ARENA, NULL);
     arena_init(cur_arena, NULL);
+
+    /* The other shards are mmapped: only cur_arena can use the brk.  Their
+     * chunks are covered by alloc_iterate() and alloc_replace_overlaps_region()
+     * via their heap regions like any other arena.
+     */
+    if (alloc_ops.arena_shards > MAX_ARENA_SHARDS)
+        alloc_ops.arena_shards = MAX_ARENA_SHARDS;
+    for (num_shards = 1; num_shards < alloc_ops.arena_shards; num_shards++) {
+        shard_arenas[num_shards] = arena_create(NULL, 0/*default*/);
+        if (shard_arenas[num_shards] == NULL) {
+            ASSERT(false, "can't allocate arena shard");
+            break;
+        }
+        LOG(2, "arena shard %d="PFX"\n", num_shards, shard_arenas[num_shards]);
+    }
 #elif defined(MACOS)
     cur_arena = arena_create(NULL, 0/*default*/);
     ASSERT(cur_arena != NULL, "can't allocate initial heap: fatal");
@@ -5341,6 +6772,8 @@ alloc_replace_init(void)
     heap_iterator(NULL, NULL _IF_WINDOWS(pre_existing_heap_init));
 #endif
 
+    shard_arenas[0] = cur_arena;
+
     /* set up pointers for per-malloc API */
     malloc_interface.malloc_lock = malloc_replace__lock;
     malloc_interface.malloc_unlock = malloc_replace__unlock;
@@ -5355,10 +6788,13 @@ alloc_replace_init(void)
     malloc_interface.malloc_set_client_flag = malloc_replace__set_client_flag;
     malloc_interface.malloc_clear_client_flag = malloc_replace__clear_client_flag;
     malloc_interface.malloc_iterate = malloc_replace__iterate;
+    malloc_interface.malloc_iterate_parallel = malloc_replace__iterate_parallel;
     malloc_interface.malloc_intercept = malloc_replace__intercept;
     malloc_interface.malloc_unintercept = malloc_replace__unintercept;
     malloc_interface.malloc_set_init = malloc_replace__set_init;
     malloc_interface.malloc_set_exit = malloc_replace__set_exit;
+
+    iter_pool_init();
 }
 
 static bool
@@ -5403,6 +6839,17 @@ alloc_replace_exit(void)
     LOG(1, "  deallocs:           %9d\n", num_dealloc);
     LOG(1, "  dbgcrt mismatches:  %9d\n", dbgcrt_mismatch);
     LOG(1, "  allocs left native: %9d\n", allocs_left_native);
+    LOG(1, "  magazine hits:      %9d\n", magazine_hits);
+    LOG(1, "  magazine refills:   %9d\n", magazine_refills);
+    LOG(1, "  magazine flushes:   %9d\n", magazine_flushes);
+    LOG(1, "  cross-shard ops:    %9d\n", shard_cross_ops);
+    LOG(1, "  delay releases:     %9d\n", delay_batches);
+    LOG(1, "  pages released:     %9d\n", pages_released);
+    LOG(1, "  page release calls: %9d\n", page_release_calls);
+    LOG(1, "  zero fills avoided: %9d\n", zero_fills_avoided);
+    LOG(1, "  in-place reallocs:  %9d\n", realloc_in_place_grows);
+    LOG(1, "  index rebuilds:     %9d\n", chunk_index_rebuilds);
+    LOG(1, "  parallel iterations:%9d\n", parallel_iterations);
 #endif
 
     /* On Win10 at process exit, RtlLockHeap is called but the private
@@ -5414,6 +6861,11 @@ alloc_replace_exit(void)
         app_heap_unlock(dr_get_current_drcontext(), cur_arena->lock);
     }
 
+    /* Pending and magazine chunks are marked free and are covered below */
+    magazines_exited = true;
+    drmgr_unregister_cls_field(replace_context_init, replace_context_exit,
+                               cls_idx_replace);
+
     alloc_iterate(free_user_data_at_exit, NULL, false/*free too*/);
     /* XXX: should add hashtable_iterate() to drcontainers */
     for (i = 0; i < HASHTABLE_SIZE(pre_us_table.table_bits); i++) {
@@ -5444,8 +6896,14 @@ alloc_replace_exit(void)
     }
 #endif
 
+    iter_pool_exit_all();
     heap_region_iterate(free_arena_at_exit, NULL);
 
+    if (alloc_ops.external_headers)
+        ext_table_exit();
+    if (magazine_rwlock != NULL)
+        dr_rwlock_destroy(magazine_rwlock);
+
 #ifdef WINDOWS
     if (alloc_ops.global_lock)
         dr_recurlock_destroy(global_lock);
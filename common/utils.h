@@ -675,6 +675,16 @@ atomic_add32_return_sum(volatile int *x, int val)
                          : "1" (val) : "memory");
     return (cur + val);
 }
+
+/* Returns whether *x held expected and was thus replaced with val */
+static inline bool
+atomic_compare_exchange32(volatile int *x, int expected, int val)
+{
+    int prev;
+    __asm__ __volatile__("lock cmpxchgl %2, %1" : "=a" (prev), "+m" (*x)
+                         : "r" (val), "0" (expected) : "memory");
+    return (prev == expected);
+}
 # elif defined(ARM)
 /* XXX: should DR export these for us? */
 #  define ATOMIC_INC32(x)                                   \
@@ -728,6 +738,25 @@ atomic_add32_return_sum(volatile int *x, int val)
     ATOMIC_ADD_EXCHANGE32(x, val, temp);
     return (temp + val);
 }
+
+/* Returns whether *x held expected and was thus replaced with val */
+static inline bool
+atomic_compare_exchange32(volatile int *x, int expected, int val)
+{
+    int prev;
+    __asm__ __volatile__(
+       "1: ldrex %0, %1         \n\t"
+       "   cmp   %0, %2         \n\t"
+       "   bne   2f             \n\t"
+       "   strex r3, %3, %1     \n\t"
+       "   cmp   r3, #0         \n\t"
+       "   bne   1b             \n\t"
+       "2:"
+       : "=&r" (prev), "+Q" (*x)
+       : "r" (expected), "r" (val)
+       : "cc", "memory", "r3");
+    return (prev == expected);
+}
 # endif
 #else
 # define ATOMIC_INC32(x) _InterlockedIncrement((volatile LONG *)&(x))
@@ -739,6 +768,13 @@ atomic_add32_return_sum(volatile int *x, int val)
 {
     return (ATOMIC_ADD32(*x, val) + val);
 }
+
+/* Returns whether *x held expected and was thus replaced with val */
+static inline bool
+atomic_compare_exchange32(volatile int *x, int expected, int val)
+{
+    return (_InterlockedCompareExchange((volatile LONG *)x, val, expected) == expected);
+}
 #endif
 
 /* racy: should be used only for diagnostics */
@@ -753,6 +789,19 @@ atomic_add32_return_sum(volatile int *x, int val)
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
 
+/* Returns the index of the least significant set bit.  mask must be non-zero. */
+static inline uint
+lowest_set_bit(uint mask)
+{
+#ifdef WINDOWS
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return (uint) idx;
+#else
+    return (uint) __builtin_ctz(mask);
+#endif
+}
+
 /* IS_ASCII excludes null char */
 #define IS_ASCII(c) ((byte)(c) < 0x80 && (byte)(c) != 0)
 #define IS_WCHAR_AT(ptr) \
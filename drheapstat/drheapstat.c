@@ -1022,6 +1022,13 @@ client_handle_mremap(app_pc old_base, size_t old_size, app_pc new_base, size_t n
 }
 #endif
 
+#ifdef LINUX
+void
+client_handle_heap_release(app_pc start, app_pc end)
+{
+}
+#endif
+
 void *
 client_add_malloc_routine(app_pc pc)
 {
@@ -2319,6 +2326,8 @@ dr_init(client_id_t client_id)
     alloc_ops.global_lock = true; /* we want to serialize w/ our snapshots */
     alloc_ops.replace_malloc = true;
     alloc_ops.use_symcache = options.use_symcache;
+    alloc_ops.iterate_threads = options.iterate_threads;
+    alloc_ops.chunk_index = (options.iterate_threads > 1);
     alloc_init(&alloc_ops, sizeof(alloc_ops));
 
     /* must be after heap_region_init and snapshot_init */
@@ -135,6 +135,9 @@ OPTION_CLIENT_BOOL(client, stale_ignore_sp, true,
 OPTION_CLIENT_BOOL(internal/*undocumented perf option*/, stale_blind_store, false,
                    "Disables checking before storing to shadow mem",
                    "Disables checking before storing to shadow mem")
+OPTION_CLIENT(internal, iterate_threads, uint, 1, 1, 64,
+              "Number of threads used for each staleness sweep",
+              "The number of threads, including the sideline thread, that divide up the heap on each staleness sweep.  Values above 1 create a pool of worker threads at startup and keep an index of each heap arena's chunks.")
 
 /* Different default and different descr from Dr. Memory */
 OPTION_CLIENT(client, callstack_max_frames, uint, 150, 0, 4096,
@@ -195,6 +195,23 @@ shadow_val_in_range(byte *start, byte *end, byte val)
     return found;
 }
 
+/* Returns whether any shadow byte for [start, end) is not val */
+static bool
+shadow_val_not_in_range(byte *start, byte *end, byte val)
+{
+    bool found;
+    if (umbra_different_value_in_shadow_memory(umbra_map,
+                                               (app_pc *)&start,
+                                               end - start,
+                                               val,
+                                               SHADOW_DEFAULT_VALUE_SIZE,
+                                               &found) != DRMF_SUCCESS) {
+        ASSERT(false, "failed to check value in shadow memory");
+        return true;
+    }
+    return found;
+}
+
 /* Returns a pointer to an always-bitlevel shadow block */
 byte *
 shadow_bitlevel_addr(void)
@@ -263,7 +280,7 @@ slow_path_for_staleness(void *drcontext, dr_mcontext_t *mc, instr_t *inst,
 bool
 handle_mem_ref(uint flags, app_loc_t *loc, byte *addr, size_t sz, dr_mcontext_t *mc)
 {
-    byte *ptr;
+    byte *start, *end;
     /* We're piggybacking on Dr. Memory syscall, etc. code.  For reads
      * and writes we want to mark the shadow byte to indicate the
      * memory was accessed.  For an addressability check we do
@@ -272,11 +289,15 @@ handle_mem_ref(uint flags, app_loc_t *loc, byte *addr, size_t sz, dr_mcontext_t
     if (TEST(MEMREF_CHECK_ADDRESSABLE, flags))
         return true;
     /* We ignore MEMREF_MOVS, etc.: we don't propagate anything */
-    for (ptr = (byte *) ALIGN_BACKWARD(addr, SHADOW_GRANULARITY);
-         ptr < (byte *) ALIGN_FORWARD(addr + sz, SHADOW_GRANULARITY);
-         ptr += SHADOW_GRANULARITY) {
-        shadow_set_byte(ptr, 1);
-    }
+    start = (byte *) ALIGN_BACKWARD(addr, SHADOW_GRANULARITY);
+    end = (byte *) ALIGN_FORWARD(addr + sz, SHADOW_GRANULARITY);
+    if (end <= start)
+        return true;
+    /* Like the fastpath, only write if something is not yet marked, so that
+     * memory accessed by many threads does not keep its shadow lines dirty.
+     */
+    if (shadow_val_not_in_range(start, end, 1))
+        shadow_set_range(start, end, 1);
     return true;
 }
 
@@ -441,7 +462,8 @@ staleness_sweep(uint64 stamp)
     *iter_data = stamp;
     ASSERT(options.staleness, "should not get here");
     LOG(2, "\nSTALENESS SWEEP @%"INT64_FORMAT"u\n", stamp);
-    malloc_iterate(alloc_itercb_sweep, (void *) iter_data);
+    /* alloc_itercb_sweep touches only its own chunk so it can run in parallel */
+    malloc_iterate_parallel(alloc_itercb_sweep, (void *) iter_data);
     global_free(iter_data, sizeof(*iter_data), HEAPSTAT_STALENESS);
 }
 
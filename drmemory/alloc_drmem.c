@@ -196,10 +196,20 @@ alloc_drmem_init(void)
     alloc_ops.conservative = options.conservative;
     /* replace vs wrap */
     alloc_ops.replace_malloc = options.replace_malloc;
-    alloc_ops.external_headers = false; /* i#879: NYI */
+    alloc_ops.external_headers = options.external_headers;
     alloc_ops.shared_redzones = (options.pattern == 0);
     alloc_ops.delay_frees = options.delay_frees;
     alloc_ops.delay_frees_maxsz = options.delay_frees_maxsz;
+    alloc_ops.delay_frees_by_size = options.delay_frees_by_size;
+    alloc_ops.delay_frees_batch = options.delay_frees_batch;
+    alloc_ops.delay_frees_global_maxsz = options.delay_frees_global_maxsz;
+    alloc_ops.magazine_size = options.magazine_size;
+    alloc_ops.arena_shards = options.arena_shards;
+    alloc_ops.arena_huge_pages = options.arena_huge_pages;
+    /* Released pages lose the pattern fill of freed memory */
+    alloc_ops.heap_release_threshold =
+        (options.pattern == 0) ? options.heap_release_threshold : 0;
+    alloc_ops.chunk_index = options.chunk_index;
 #ifdef WINDOWS
     alloc_ops.skip_msvc_importers = options.skip_msvc_importers;
 #endif
@@ -1138,6 +1148,8 @@ client_handle_mmap(void *drcontext, app_pc base, size_t size, bool anon)
 void
 client_handle_munmap(app_pc base, size_t size, bool anon)
 {
+    if (options.shadowing)
+        shadow_reclaim_note_release(size);
 #ifdef WINDOWS
     if (options.shadowing) {
         if (anon)
@@ -1191,6 +1203,7 @@ client_handle_mremap(app_pc old_base, size_t old_size, app_pc new_base, size_t n
         if (shrink) {
             shadow_set_range(old_base+new_size, old_base+old_size,
                              SHADOW_UNADDRESSABLE);
+            shadow_reclaim_note_release(old_size - new_size);
         } else {
             shadow_set_range(new_base+old_size, new_base+new_size,
                              image ? SHADOW_DEFINED : SHADOW_UNDEFINED);
@@ -1204,6 +1217,16 @@ client_handle_mremap(app_pc old_base, size_t old_size, app_pc new_base, size_t n
 }
 #endif
 
+#ifdef LINUX
+void
+client_handle_heap_release(app_pc start, app_pc end)
+{
+    /* The range is inside a free chunk so it is already unaddressable */
+    if (options.shadowing)
+        shadow_release_range(start, end);
+}
+#endif
+
 #ifdef WINDOWS
 static void
 handle_Ki(void *drcontext, app_pc pc, byte *new_xsp, bool is_cb)
@@ -2530,6 +2553,15 @@ static byte *
 end_of_defined_region(byte *start, byte *end)
 {
     byte *res;
+    /* Skip whole defined dwords a cache line at a time and only go byte by
+     * byte through the first dword that is not entirely defined.
+     */
+    if (ALIGNED(start, 4)) {
+        byte *dword = shadow_next_non_matching_dword(start, end, SHADOW_DEFINED);
+        if (dword == NULL)
+            return end;
+        start = dword;
+    }
     if (shadow_check_range(start, end - start, SHADOW_DEFINED, &res, NULL, NULL))
         res = end;
     return res;
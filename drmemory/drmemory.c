@@ -268,6 +268,13 @@ dump_statistics(void)
                num_slowpath_faults);
     dr_fprintf(f_global, "app mallocs: %8u, frees: %8u, large mallocs: %6u\n",
                num_mallocs, num_frees, num_large_mallocs);
+    if (options.shadowing) {
+        dr_fprintf(f_global, "shadow reclamation passes: %6u, blocks freed: %6u (%uKB)\n",
+                   shadow_reclaim_passes, shadow_blocks_reclaimed, shadow_kb_reclaimed);
+        if (options.share_shadow_blocks)
+            dr_fprintf(f_global, "shadow blocks shared: %6u\n", shadow_blocks_shared);
+        shadow_dump_footprint(f_global);
+    }
     dr_fprintf(f_global, "unique malloc stacks: %8u\n", alloc_stack_count);
     callstack_dump_statistics(f_global);
 #ifdef USE_DRSYMS
@@ -283,6 +290,9 @@ dump_statistics(void)
     dr_fprintf(f_global, "delayed free bytes: %8u\n", delayed_free_bytes);
     dr_fprintf(f_global, "app heap regions: %8u\n", heap_regions);
     dr_fprintf(f_global, "addr checks elided: %8u\n", addressable_checks_elided);
+    dr_fprintf(f_global, "overlapping checks elided: %8u\n", overlap_checks_elided);
+    dr_fprintf(f_global, "rep string ranges checked: %8u, ok: %8u\n",
+               repstr_ranges_checked, repstr_ranges_ok);
     dr_fprintf(f_global, "aflags saved at top: %8u\n", aflags_saved_at_top);
     dr_fprintf(f_global, "xl8 sharing: %8u shared, %6u not:conflict, %6u not:disp-sz\n",
                xl8_shared, xl8_not_shared_reg_conflict, xl8_not_shared_disp_too_big);
@@ -294,6 +304,7 @@ dump_statistics(void)
                xl8_not_shared_scratch_conflict);
     dr_fprintf(f_global, "\t%6u instrs slowpath, %6u count slowpath\n",
                xl8_shared_slowpath_instrs, xl8_shared_slowpath_count);
+    dr_fprintf(f_global, "adaptive slowpath demotions: %6u\n", slowpath_demotions);
 #ifdef WINDOWS
     dr_fprintf(f_global,
                "encoded pointers: total: %5u, seen during leak scan: %5u\n",
@@ -442,6 +453,7 @@ event_exit(void)
 #ifdef STATISTICS
     dump_statistics();
 #endif
+    slowpath_profile_report(f_global);
 
     instrument_exit();
 
@@ -1614,7 +1626,12 @@ nudge_leak_scan(void *drcontext)
 #endif
 #ifdef STATISTICS
     dump_statistics();
+#else
+    /* dump_statistics() includes the shadow footprint */
+    if (options.shadowing)
+        shadow_dump_footprint(f_global);
 #endif
+    slowpath_profile_report(f_global);
     STATS_INC(num_nudges);
     if (options.perturb_only)
         return;
@@ -1957,8 +1974,11 @@ dr_init(client_id_t id)
     dr_log(NULL, LOG_ALL, 1, "client = Dr. Memory version %s\n", VERSION_STRING);
 
 #ifdef USE_DRSYMS
-    if (options.use_symcache)
+    if (options.use_symcache) {
         drsymcache_init(client_id, options.symcache_dir, options.symcache_minsize);
+        if (options.fork_share_state)
+            drsymcache_share_across_fork(true);
+    }
 #endif
 
     if (!options.perturb_only)
@@ -136,6 +136,338 @@ slow_path_xl8_sharing(app_loc_t *loc, size_t inst_sz, opnd_t memop, dr_mcontext_
      */
 }
 
+/* -adaptive_slowpath: an instr with a fastpath whose fastpath keeps failing pays
+ * for both paths, so once it has entered the slowpath -adaptive_slowpath times
+ * we flush it and re-instrument it to go straight to the slowpath.
+ *
+ * Counts are a rate rather than a lifetime total: after every window of
+ * ADAPTIVE_WINDOW_SCALE * -adaptive_slowpath slowpath entries across all instrs
+ * we halve every count.  An instr thus only reaches the threshold if it makes up
+ * a steady share of the slowpath traffic, rather than by slowly accumulating
+ * occasional failures over a long run.
+ *
+ * slowpath_hits_table maps an app pc to its slowpath count, or to
+ * ADAPTIVE_DEMOTED|epoch once demoted.  The epoch numbers demotions from 1 and
+ * each bb records the latest one when it is built (bb_info_t.demotion_epoch),
+ * so a bb recreated for translation applies exactly the demotions it was first
+ * built with.  Epoch 0 marks instrs that have no fastpath to skip.
+ */
+#define ADAPTIVE_DEMOTED 0x80000000
+#define ADAPTIVE_IGNORE  ADAPTIVE_DEMOTED /* epoch 0 */
+#define ADAPTIVE_WINDOW_SCALE 64
+
+static uint adaptive_num_demotions;
+/* Slowpath entries counted since the last decay.  Protected by the table lock. */
+static uint64 adaptive_window_entries;
+
+/* Caller must hold the slowpath_hits_table lock */
+static void
+adaptive_decay_counts(void)
+{
+    uint i;
+    for (i = 0; i < HASHTABLE_SIZE(slowpath_hits_table.table_bits); i++) {
+        hash_entry_t *he, *next;
+        for (he = slowpath_hits_table.table[i]; he != NULL; he = next) {
+            ptr_uint_t val = (ptr_uint_t) he->payload;
+            next = he->next;
+            if (TEST(ADAPTIVE_DEMOTED, val))
+                continue;
+            if (val / 2 == 0)
+                hashtable_remove(&slowpath_hits_table, he->key);
+            else
+                he->payload = (void *)(val / 2);
+        }
+    }
+}
+
+uint
+adaptive_current_epoch(void)
+{
+    return adaptive_num_demotions;
+}
+
+void
+slow_path_adaptive(app_loc_t *loc)
+{
+    app_pc pc;
+    ptr_uint_t val;
+    uint epoch;
+    if (options.adaptive_slowpath == 0 ||
+        adaptive_num_demotions >= options.adaptive_max_flushes ||
+        /* see instru_event_bb_analysis(): no demotions w/o whole-bb spills */
+        !whole_bb_spills_enabled())
+        return;
+    ASSERT(loc != NULL && loc->type == APP_LOC_PC, "invalid param");
+    pc = loc_to_pc(loc);
+    hashtable_lock(&slowpath_hits_table);
+    val = (ptr_uint_t) hashtable_lookup(&slowpath_hits_table, pc);
+    if (TEST(ADAPTIVE_DEMOTED, val) ||
+        /* we checked without the lock above */
+        adaptive_num_demotions >= options.adaptive_max_flushes) {
+        hashtable_unlock(&slowpath_hits_table);
+        return;
+    }
+    if (++adaptive_window_entries >=
+        (uint64)options.adaptive_slowpath * ADAPTIVE_WINDOW_SCALE) {
+        LOG(3, "slow_path_adaptive: decaying slowpath counts\n");
+        adaptive_decay_counts();
+        adaptive_window_entries = 0;
+        val /= 2;
+    }
+    if (val + 1 < options.adaptive_slowpath) {
+        hashtable_add_replace(&slowpath_hits_table, pc, (void *)(val + 1));
+        hashtable_unlock(&slowpath_hits_table);
+        return;
+    }
+    epoch = ++adaptive_num_demotions;
+    hashtable_add_replace(&slowpath_hits_table, pc,
+                          (void *)(ptr_uint_t)(ADAPTIVE_DEMOTED | epoch));
+    hashtable_unlock(&slowpath_hits_table);
+    STATS_INC(slowpath_demotions);
+    LOG(2, "slow_path_adaptive: demoting "PFX" (#%d)\n", pc, epoch);
+    if (epoch == options.adaptive_max_flushes)
+        LOG(1, "reached %d adaptive slowpath flushes: no longer demoting\n", epoch);
+    /* As with xl8 sharing, we do not need a synchronous flush */
+    dr_unlink_flush_region(pc, 1);
+}
+
+bool
+instr_demoted_to_slowpath(bb_info_t *bi, app_pc pc)
+{
+    ptr_uint_t val;
+    uint epoch;
+    if (options.adaptive_slowpath == 0 || bi->demotion_epoch == 0)
+        return false;
+    hashtable_lock(&slowpath_hits_table);
+    val = (ptr_uint_t) hashtable_lookup(&slowpath_hits_table, pc);
+    hashtable_unlock(&slowpath_hits_table);
+    if (!TEST(ADAPTIVE_DEMOTED, val))
+        return false;
+    epoch = (uint)(val & ~ADAPTIVE_DEMOTED);
+    return (epoch != 0 && epoch <= bi->demotion_epoch);
+}
+
+/* Called at bb creation for an instr without a fastpath, whose slowpath entries
+ * should not count toward a demotion.
+ */
+void
+adaptive_ignore_instr(app_pc pc)
+{
+    ptr_uint_t val;
+    if (options.adaptive_slowpath == 0)
+        return;
+    hashtable_lock(&slowpath_hits_table);
+    val = (ptr_uint_t) hashtable_lookup(&slowpath_hits_table, pc);
+    if (!TEST(ADAPTIVE_DEMOTED, val))
+        hashtable_add_replace(&slowpath_hits_table, pc, (void *)(ptr_uint_t)
+                              ADAPTIVE_IGNORE);
+    hashtable_unlock(&slowpath_hits_table);
+}
+
+/* Called on fragment deletion.  Demotions are kept, as the flush that demotes
+ * an instr deletes its own bb.
+ */
+void
+adaptive_remove_range(app_pc start, size_t size)
+{
+    size_t i;
+    if (options.adaptive_slowpath == 0)
+        return;
+    hashtable_lock(&slowpath_hits_table);
+    for (i = 0; i < size; i++) {
+        ptr_uint_t val = (ptr_uint_t)
+            hashtable_lookup(&slowpath_hits_table, (void *)(start + i));
+        if (val != 0 && (val == ADAPTIVE_IGNORE || !TEST(ADAPTIVE_DEMOTED, val)))
+            hashtable_remove(&slowpath_hits_table, (void *)(start + i));
+    }
+    hashtable_unlock(&slowpath_hits_table);
+}
+
+#ifdef TOOL_DR_MEMORY
+/***************************************************************************
+ * Overlapping check elision
+ */
+
+/* -elide_overlap: with -no_check_uninitialized the only thing the fastpath does
+ * for a memory reference is check its addressability, which cannot change within
+ * a bb unless the stack pointer moves (for -check_stack_bounds).  So, as
+ * -pattern_opt_elide_overlap does for pattern mode, we skip the checks for
+ * [base+disp] references that are covered by earlier checks via the same
+ * unmodified base register.  We keep the two most recent checked ranges per
+ * base in bi->reg_cover, and a reference is covered if it lies inside one of them
+ * or inside the hull of both when that hull is no larger than a redzone: an
+ * unaddressable gap between two addressable bytes is at least a redzone wide.
+ */
+
+static inline bool
+elide_overlap_ref(opnd_t opnd, OUT reg_id_t *base, OUT int *disp, OUT uint *size)
+{
+    if (!opnd_is_near_base_disp(opnd) || opnd_get_index(opnd) != DR_REG_NULL)
+        return false;
+    *base = opnd_get_base(opnd);
+    if (!IF_X64_ELSE(reg_is_64bit(*base), reg_is_32bit(*base)) ||
+        *base - REG_START >= NUM_LIVENESS_REGS)
+        return false;
+    *disp = opnd_get_disp(opnd);
+    *size = opnd_size_in_bytes(opnd_get_size(opnd));
+    return *size > 0;
+}
+
+static inline bool
+elide_range_covers(elide_ref_check_info_t *check, int disp, uint size)
+{
+    return (disp >= check->disp &&
+            (ptr_int_t)disp + size <= (ptr_int_t)check->disp + check->size);
+}
+
+static bool
+elide_overlap_covered(bb_info_t *bi, opnd_t opnd)
+{
+    elide_reg_cover_info_t *cover;
+    reg_id_t base;
+    int disp;
+    uint size;
+    ptr_int_t hull_end;
+    if (!elide_overlap_ref(opnd, &base, &disp, &size))
+        return false;
+    cover = &bi->reg_cover[base - REG_START];
+    if (cover->status == ELIDE_REG_COVER_STATUS_NONE)
+        return false;
+    if (elide_range_covers(&cover->left, disp, size))
+        return true;
+    if (cover->status != ELIDE_REG_COVER_STATUS_BOTH)
+        return false;
+    if (elide_range_covers(&cover->right, disp, size))
+        return true;
+    hull_end = (ptr_int_t)cover->right.disp + cover->right.size;
+    return (hull_end - cover->left.disp <= (ptr_int_t)options.redzone_size &&
+            disp >= cover->left.disp && (ptr_int_t)disp + size <= hull_end);
+}
+
+/* Returns whether all of inst's memory references that we would check are
+ * covered by earlier checks in this bb.
+ */
+bool
+elide_overlap_instr_covered(bb_info_t *bi, instr_t *inst)
+{
+    int i;
+    bool any = false;
+    if (!options.elide_overlap || options.check_uninitialized ||
+        options.pattern != 0)
+        return false;
+    /* string ops have implicit and repeated refs */
+    if (opc_is_stringop(instr_get_opcode(inst)) || bi->is_repstr_to_loop)
+        return false;
+    for (i = 0; i < instr_num_srcs(inst); i++) {
+        opnd_t opnd = instr_get_src(inst, i);
+        if (!opnd_uses_nonignorable_memory(opnd))
+            continue;
+        if (!elide_overlap_covered(bi, opnd))
+            return false;
+        any = true;
+    }
+    for (i = 0; i < instr_num_dsts(inst); i++) {
+        opnd_t opnd = instr_get_dst(inst, i);
+        if (!opnd_uses_nonignorable_memory(opnd))
+            continue;
+        if (!elide_overlap_covered(bi, opnd))
+            return false;
+        any = true;
+    }
+    return any;
+}
+
+static void
+elide_overlap_add_check(bb_info_t *bi, opnd_t opnd)
+{
+    elide_reg_cover_info_t *cover;
+    elide_ref_check_info_t check;
+    reg_id_t base;
+    uint size;
+    if (!elide_overlap_ref(opnd, &base, &check.disp, &size))
+        return;
+    check.size = size;
+    check.start = NULL;
+    check.end = NULL;
+    cover = &bi->reg_cover[base - REG_START];
+    if (cover->status == ELIDE_REG_COVER_STATUS_NONE) {
+        cover->status = ELIDE_REG_COVER_STATUS_LEFT;
+        cover->left = check;
+    } else if (cover->status == ELIDE_REG_COVER_STATUS_LEFT) {
+        cover->status = ELIDE_REG_COVER_STATUS_BOTH;
+        if (check.disp >= cover->left.disp)
+            cover->right = check;
+        else {
+            cover->right = cover->left;
+            cover->left = check;
+        }
+    } else if (check.disp < cover->left.disp) {
+        /* Keep whichever neighbor leaves the more useful pair: the far one
+         * if the hull stays within a redzone, else the near one.
+         */
+        if ((ptr_int_t)cover->right.disp + cover->right.size - check.disp >
+            (ptr_int_t)options.redzone_size)
+            cover->right = cover->left;
+        cover->left = check;
+    } else if (check.disp > cover->right.disp) {
+        if ((ptr_int_t)check.disp + check.size - cover->left.disp >
+            (ptr_int_t)options.redzone_size)
+            cover->left = cover->right;
+        cover->right = check;
+    } else if (check.disp - cover->left.disp >= cover->right.disp - check.disp) {
+        /* in between: replace the end nearer to it */
+        cover->right = check;
+    } else
+        cover->left = check;
+}
+
+/* Called after inst's memory references were checked */
+void
+elide_overlap_note_checks(bb_info_t *bi, instr_t *inst)
+{
+    int i;
+    if (!options.elide_overlap || options.check_uninitialized ||
+        options.pattern != 0)
+        return;
+    for (i = 0; i < instr_num_srcs(inst); i++) {
+        opnd_t opnd = instr_get_src(inst, i);
+        if (opnd_uses_nonignorable_memory(opnd))
+            elide_overlap_add_check(bi, opnd);
+    }
+    for (i = 0; i < instr_num_dsts(inst); i++) {
+        opnd_t opnd = instr_get_dst(inst, i);
+        if (opnd_uses_nonignorable_memory(opnd))
+            elide_overlap_add_check(bi, opnd);
+    }
+}
+
+/* Called for every app instr after it is instrumented, to drop the checks
+ * it invalidates.
+ */
+void
+elide_overlap_update_regs(bb_info_t *bi, instr_t *inst)
+{
+    int i;
+    bool invalidate_all;
+    if (!options.elide_overlap || options.check_uninitialized ||
+        options.pattern != 0)
+        return;
+    /* Syscalls and calls can change addressability (and end the bb anyway).
+     * Moving the stack pointer does for -check_stack_bounds.
+     */
+    invalidate_all = instr_is_syscall(inst) || instr_is_interrupt(inst) ||
+        instr_is_cti(inst) ||
+        (options.check_stack_bounds &&
+         instr_writes_to_reg(inst, DR_REG_XSP, DR_QUERY_INCLUDE_ALL));
+    for (i = 0; i < NUM_LIVENESS_REGS; i++) {
+        if (bi->reg_cover[i].status != ELIDE_REG_COVER_STATUS_NONE &&
+            (invalidate_all ||
+             instr_writes_to_reg(inst, REG_START + i, DR_QUERY_INCLUDE_ALL)))
+            bi->reg_cover[i].status = ELIDE_REG_COVER_STATUS_NONE;
+    }
+}
+#endif /* TOOL_DR_MEMORY */
+
 /***************************************************************************
  * Fault handling
  */
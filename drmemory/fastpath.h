@@ -146,6 +146,7 @@ typedef enum {
 /* information of instrumented check */
 typedef struct _elide_ref_check_info_t {
     int disp; /* disp of the ref [base + disp] */
+    uint size; /* size of the ref: only used by -elide_overlap */
     instr_t *start; /* start of the instrumented code for future removal. */
     instr_t *end;   /* end of the instrumented code for future removal. */
 } elide_ref_check_info_t;
@@ -168,6 +169,8 @@ struct _bb_info_t {
     bool eax_dead;
     bool eflags_used;
     bool is_repstr_to_loop;
+    /* -repstr_range_check applies to this repstr_to_loop bb */
+    bool repstr_range_check;
     scratch_reg_info_t reg1;
     scratch_reg_info_t reg2;
     /* the instr after which we should spill global regs */
@@ -212,6 +215,8 @@ struct _bb_info_t {
     app_pc fake_xl8_override_pc;
     /* i#826: share_xl8_max_diff changes over time, so save it. */
     uint share_xl8_max_diff;
+    /* -adaptive_slowpath demotions up to this one apply to this bb */
+    uint demotion_epoch;
     /* possible check coverage for memory references via reg */
     elide_reg_cover_info_t reg_cover[NUM_LIVENESS_REGS];
 };
@@ -239,6 +244,8 @@ typedef struct _bb_saved_info_t {
     app_pc last_instr;
     /* i#826: share_xl8_max_diff changes over time, so save it. */
     uint share_xl8_max_diff;
+    /* -adaptive_slowpath demotions change over time, so save it too */
+    uint demotion_epoch;
 } bb_saved_info_t;
 
 bool
@@ -288,6 +295,34 @@ fastpath_bottom_of_bb(void *drcontext, void *tag, instrlist_t *bb,
 void
 slow_path_xl8_sharing(app_loc_t *loc, size_t inst_sz, opnd_t memop, dr_mcontext_t *mc);
 
+/* -adaptive_slowpath: re-instrument fastpath instrs that keep hitting the slowpath */
+uint
+adaptive_current_epoch(void);
+
+void
+slow_path_adaptive(app_loc_t *loc);
+
+bool
+instr_demoted_to_slowpath(bb_info_t *bi, app_pc pc);
+
+void
+adaptive_ignore_instr(app_pc pc);
+
+void
+adaptive_remove_range(app_pc start, size_t size);
+
+#ifdef TOOL_DR_MEMORY
+/* -elide_overlap: skip addressability checks covered by earlier ones in a bb */
+bool
+elide_overlap_instr_covered(bb_info_t *bi, instr_t *inst);
+
+void
+elide_overlap_note_checks(bb_info_t *bi, instr_t *inst);
+
+void
+elide_overlap_update_regs(bb_info_t *bi, instr_t *inst);
+#endif
+
 /***************************************************************************
  * For stack.c: perhaps should move stack.c's fastpath code here and avoid
  * exporting these?
@@ -280,9 +280,9 @@ reg_ok_for_fastpath(int opc, opnd_t reg, bool dst)
             (reg_is_32bit(r) || reg_is_16bit(r) || reg_is_8bit(r) ||
              IF_X64(reg_is_64bit(r) ||)
              /* i#1453: we shadow xmm regs now
-              * XXX i#243: but not ymm regs
+              * i#243: and ymm regs on x64 (see reg_is_shadowed())
               */
-             (reg_is_xmm(r) && !reg_is_ymm(r)) ||
+             (reg_is_xmm(r) && IF_X64_ELSE(true, !reg_is_ymm(r))) ||
              /* i#1473: propagate mmx regs */
              reg_is_mmx(r)));
 }
@@ -296,7 +296,9 @@ memop_ok_for_fastpath(opnd_t memop, bool allow8plus)
              opnd_get_size(memop) == OPSZ_1 ||
              ((opnd_get_size(memop) == OPSZ_8 ||
                opnd_get_size(memop) == OPSZ_10 ||
-               opnd_get_size(memop) == OPSZ_16) && allow8plus) ||
+               opnd_get_size(memop) == OPSZ_16
+               /* i#243: a ymm's shadow only fits in a GPR on x64 */
+               IF_X64(|| opnd_get_size(memop) == OPSZ_32)) && allow8plus) ||
              opnd_get_size(memop) == OPSZ_lea) &&
             (!opnd_is_base_disp(memop) ||
              (addr_reg_ok_for_fastpath(opnd_get_base(memop)) &&
@@ -840,7 +842,8 @@ adjust_opnds_for_fastpath(instr_t *inst, fastpath_info_t *mi)
             ASSERT(mem2sz == mi->memsz, "load2x 2nd mem must be same size as 1st");
         }
         /* stack ops are the ones that vary and might reach 8+ */
-        if (!(((mi->memsz == 8 || mi->memsz == 16 || mi->memsz == 10) && !mi->pushpop) ||
+        if (!(((mi->memsz == 8 || mi->memsz == 16 || mi->memsz == 10
+                IF_X64(|| mi->memsz == 32)) && !mi->pushpop) ||
               mi->memsz == 4 || mi->memsz == 2 || mi->memsz == 1)) {
             return false; /* needs slowpath */
         }
@@ -910,6 +913,8 @@ shadow_reg_indir_size(opnd_info_t *info)
      */
     if (bytes > 8 && bytes < 16)
         bytes = 16;
+    else if (bytes > 16 && bytes < 32)
+        bytes = 32;
     return opnd_size_from_bytes(bytes/SHADOW_GRANULARITY);
 }
 
@@ -949,6 +954,10 @@ set_shadow_opnds(fastpath_info_t *mi)
             mi->dst[0].shadow = OPND_CREATE_MEM8(mi->reg1.reg, 0);
         else if (mi->memsz == 8)
             mi->dst[0].shadow = OPND_CREATE_MEM16(mi->reg1.reg, 0);
+#ifdef X64
+        else if (mi->memsz == 32)
+            mi->dst[0].shadow = OPND_CREATE_MEM64(mi->reg1.reg, 0);
+#endif
         else {
             ASSERT(mi->memsz == 16 || mi->memsz == 10, "invalid memsz");
             mi->dst[0].shadow = OPND_CREATE_MEM32(mi->reg1.reg, 0);
@@ -971,6 +980,10 @@ set_shadow_opnds(fastpath_info_t *mi)
                 mi->src[0].shadow = OPND_CREATE_MEM8(mi->reg1.reg, 0);
             else if (mi->memsz == 8)
                 mi->src[0].shadow = OPND_CREATE_MEM16(mi->reg1.reg, 0);
+#ifdef X64
+            else if (mi->memsz == 32)
+                mi->src[0].shadow = OPND_CREATE_MEM64(mi->reg1.reg, 0);
+#endif
             else {
                 ASSERT(mi->memsz == 16 || mi->memsz == 10, "invalid memsz");
                 mi->src[0].shadow = OPND_CREATE_MEM32(mi->reg1.reg, 0);
@@ -988,6 +1001,10 @@ set_shadow_opnds(fastpath_info_t *mi)
                 mi->src[0].shadow = opnd_create_reg(mi->reg2_8);
             else if (mi->memsz == 8)
                 mi->src[0].shadow = opnd_create_reg(mi->reg2_16);
+#ifdef X64
+            else if (mi->memsz == 32)
+                mi->src[0].shadow = opnd_create_reg(mi->reg2.reg);
+#endif
             else {
                 ASSERT(mi->memsz == 16 || mi->memsz == 10, "invalid memsz");
                 mi->src[0].shadow = opnd_create_reg(reg_ptrsz_to_32(mi->reg2.reg));
@@ -1068,6 +1085,17 @@ set_check_definedness_pre_regs(void *drcontext, instr_t *inst, fastpath_info_t *
     case OP_vpshufhw:     case OP_vpshuflw:
     case OP_vpshufd:      case OP_vpshufb:
     case OP_vpinsrb:      case OP_vpinsrw:    case OP_vpinsrd:
+    /* i#243: lane-crossing permutes, inserts, extracts, and broadcasts */
+    case OP_vpermilps:    case OP_vpermilpd:
+    case OP_vpermq:       case OP_vpermpd:
+    case OP_vpermd:       case OP_vpermps:
+    case OP_vperm2f128:   case OP_vperm2i128:
+    case OP_vextractf128: case OP_vextracti128:
+    case OP_vinsertf128:  case OP_vinserti128:
+    case OP_vbroadcastss: case OP_vbroadcastsd:
+    case OP_vbroadcastf128: case OP_vbroadcasti128:
+    case OP_vpbroadcastb: case OP_vpbroadcastw:
+    case OP_vpbroadcastd: case OP_vpbroadcastq:
     case OP_psrlw:        case OP_psrld:      case OP_psrlq:
     case OP_psraw:        case OP_psrad:
     case OP_psrldq:
@@ -1087,6 +1115,8 @@ set_check_definedness_pre_regs(void *drcontext, instr_t *inst, fastpath_info_t *
     case OP_cvtpd2ps:     case OP_cvtsd2ss:
     case OP_cvtdq2pd:
     case OP_cvttpd2dq:    case OP_cvtpd2dq:
+    case OP_vcvtpd2ps:    case OP_vcvttpd2dq:
+    case OP_vcvtpd2dq:
     /* blend and other complex operations */
     case OP_pblendvb:     case OP_blendvps:
     case OP_blendvpd:     case OP_blendps:
@@ -1117,6 +1147,9 @@ set_check_definedness_post_regs(void *drcontext, instr_t *inst, fastpath_info_t
     if (!opnd_is_null(mi->src[0].app) && mi->src_opsz < mi->opsz &&
         opc != OP_movzx && opc != OP_movsx)
         mi->check_definedness = true;
+    /* i#243: add_dst_shadow_write() can't narrow a ymm's shadow */
+    if (mi->src_opsz > 16 && mi->opsz > 0 && mi->src_opsz > mi->opsz)
+        mi->check_definedness = true;
     /* We support push-mem and call_ind and other mem2mem, but we can
      * only propagate if we don't need the 3rd scratch reg: i.e., if
      * they're word-sized
@@ -1858,6 +1891,16 @@ shadow_immed(uint memsz, uint shadow_val)
         return OPND_CREATE_INT8((char)val_to_dword[shadow_val]);
     else if (memsz == 8)
         return OPND_CREATE_INT16((short)val_to_qword[shadow_val]);
+#ifdef X64
+    else if (memsz == 32) {
+        /* There is no 8-byte immed: we rely on the 4-byte immed being
+         * sign-extended, which only produces the right qword for these.
+         */
+        ASSERT(shadow_val == SHADOW_DEFINED || shadow_val == SHADOW_UNDEFINED,
+               "no immed for this ymm shadow value");
+        return OPND_CREATE_INT32((int)val_to_dqword[shadow_val]);
+    }
+#endif
     else {
         ASSERT(memsz == 16 || memsz == 10, "invalid memsz");
         return OPND_CREATE_INT32((int)val_to_dqword[shadow_val]);
@@ -1994,6 +2037,12 @@ add_check_partial_undefined(void *drcontext, instrlist_t *bb, instr_t *inst,
         PRE(bb, inst,
             INSTR_CREATE_cmp(drcontext, OPND_CREATE_MEM16(mi->reg1.reg, 0),
                              OPND_CREATE_INT16((short)0x00ff)));
+#ifdef X64
+    } else if (sz == 32) {
+        /* XXX i#243: we do not look for partial-undef patterns for ymm */
+        PRE(bb, inst,
+            INSTR_CREATE_jcc(drcontext, OP_je_short, opnd_create_instr(ok_to_write)));
+#endif
     } else {
         ASSERT(sz == 16 || sz == 10, "unknown memsz");
         /* check for partial-undef to avoid slowpath */
@@ -2101,7 +2150,8 @@ add_shadow_table_lookup(void *drcontext, instrlist_t *bb, instr_t *inst,
             INSTR_CREATE_test(drcontext, opnd_create_reg(reg_ptrsz_to_8(reg1)),
                               OPND_CREATE_INT8(mi->memsz == 4 ? 0x3 :
                                                (mi->memsz == 8 ? 0x3 :
-                                                ((mi->memsz == 16 || mi->memsz == 10) ?
+                                                ((mi->memsz == 16 || mi->memsz == 10
+                                                  IF_X64(|| mi->memsz == 32)) ?
                                                  0xf : 0x1)))));
         /* i#1694: a short jcc doesn't always reach so we always use a long to
          * be on the safe side.
@@ -2151,13 +2201,20 @@ add_shadow_table_lookup(void *drcontext, instrlist_t *bb, instr_t *inst,
 
     if (get_value) {
         /* load value from shadow table to reg1 */
-        if (IF_X64_ELSE(false, mi->memsz == 16 || mi->memsz == 10)) {
+        if (mi->memsz == 16 || mi->memsz == 10 IF_X64(|| mi->memsz == 32)) {
+            /* i#243: on x64 a ymm's 8 bytes of shadow fill the reg.
+             * A dword load into the 32-bit sub-reg suffices for 16 bytes, and
+             * zeroes the top half of the reg on x64.
+             */
+            reg_id_t dst = value_in_reg2 ? reg2 : reg1;
+            if (mi->memsz != 32)
+                dst = reg_ptrsz_to_32(dst);
             /* all shadow de-refs need xl8 as Umbra uses page faults */
             PREXL8M(bb, inst, INSTR_XL8
-                    (INSTR_CREATE_mov_ld(drcontext,
-                                         opnd_create_reg(value_in_reg2 ? reg2 : reg1),
+                    (INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(dst),
                                          opnd_create_base_disp(reg1, REG_NULL, 0, 0,
-                                                               OPSZ_4)),
+                                                               mi->memsz == 32 ?
+                                                               OPSZ_8 : OPSZ_4)),
                      mi->xl8));
         } else {
             /* all shadow de-refs need xl8 as Umbra uses page faults */
@@ -2388,8 +2445,8 @@ add_dst_shadow_write(void *drcontext, instrlist_t *bb, instr_t *inst,
         src_opsz = dst_opsz;
     }
     ASSERT(src_opsz <= dst_opsz, "invalid opsz");
-    ASSERT(dst_opsz <= 4 || dst_opsz == 8 || dst_opsz == 10 || dst_opsz == 16,
-           "invalid opsz");
+    ASSERT(dst_opsz <= 4 || dst_opsz == 8 || dst_opsz == 10 || dst_opsz == 16
+           IF_X64(|| dst_opsz == 32), "invalid opsz");
     ASSERT(src_opsz == dst_opsz ||
            ((src_opsz == 1 || src_opsz == 2) && dst_opsz == 4),
            "mismatched sizes only supported for src==1 or 2 dst==4");
@@ -2412,9 +2469,10 @@ add_dst_shadow_write(void *drcontext, instrlist_t *bb, instr_t *inst,
         insert_shadow_op(drcontext, bb, mi, inst, opnd_get_reg(src.shadow), scratch, si);
     } else
         ASSERT(opnd_is_immed_int(src.shadow), "invalid shadow src");
-    ASSERT(dst.indir_size == OPSZ_NA || src_opsz == 4 || src_opsz == 8 || src_opsz == 16,
-           "unexpected shadow reg indir");
-    if (src_opsz == 4 || src_opsz == 8 || src_opsz == 10 || src_opsz == 16) {
+    ASSERT(dst.indir_size == OPSZ_NA || src_opsz == 4 || src_opsz == 8 || src_opsz == 16
+           IF_X64(|| src_opsz == 32), "unexpected shadow reg indir");
+    if (src_opsz == 4 || src_opsz == 8 || src_opsz == 10 || src_opsz == 16
+        IF_X64(|| src_opsz == 32)) {
         /* copy entire byte(s) (1, 2, or 4) shadowing the dword */
         /* write_shadow_eflags will convert src.shadow to single-byte size */
         if (process_eflags)
@@ -2449,7 +2507,9 @@ add_dst_shadow_write(void *drcontext, instrlist_t *bb, instr_t *inst,
                 }
             }
 #endif
-            ASSERT(opnd_get_size(dst.shadow) == opnd_get_size(src.shadow),
+            /* i#243: a ymm's qword of shadow takes a sign-extended 4-byte immed */
+            ASSERT(opnd_get_size(dst.shadow) == opnd_get_size(src.shadow) ||
+                   (src_opsz == 32 && opnd_is_immed_int(src.shadow)),
                    "shadow size mismatch");
             add_check_datastore(drcontext, bb, inst, mi, src.shadow, dst.shadow,
                                 skip_write_tgt);
@@ -3240,6 +3300,12 @@ instrument_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
     }
 #endif
 
+#ifdef TOOL_DR_MEMORY
+    /* i#243: shadow_immed() can't express UNADDR for a ymm's qword of shadow */
+    if (options.check_uninitialized && mi->memsz > 16)
+        check_ignore_unaddr = false;
+#endif
+
     /* PR 578892: fastpath heap routine unaddr accesses */
     if (check_ignore_unaddr && (mi->load || mi->store)) {
         LOG(4, "in heap routine: adding nop-if-mem-unaddr checks\n");
@@ -3494,22 +3560,29 @@ instrument_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
         }
 #else
         /* shadow lookup left reg3 holding address */
+        instr_t *src_marked = INSTR_CREATE_label(drcontext);
         if (!options.stale_blind_store) {
-            /* FIXME: measure perf to see which is better */
-            /* cmp and avoid store can be faster than blindly storing */
+            /* Only store if not already marked: a blind store dirties the
+             * shadow line, which for data touched by many threads bounces it
+             * between cores (see tests/stale_mt.c).
+             */
             /* all shadow de-refs need xl8 as Umbra uses page faults */
             PREXL8M(bb, inst, INSTR_XL8
                     (INSTR_CREATE_cmp(drcontext, OPND_CREATE_MEM8(mi->reg3.reg, 0),
                                       OPND_CREATE_INT8(0)),
                      mi->xl8));
             mark_eflags_used(drcontext, bb, mi->bb);
+            /* We still have the main memop to mark, so we skip just the store
+             * rather than going to fastpath_restore.
+             */
             PRE(bb, inst,
                 INSTR_CREATE_jcc(drcontext, OP_jnz_short,
-                                 opnd_create_instr(fastpath_restore)));
+                                 opnd_create_instr(src_marked)));
         }
         PRE(bb, inst,
             INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEM8(mi->reg3.reg, 0),
                                 OPND_CREATE_INT8(1)));
+        PRE(bb, inst, src_marked);
 #endif
     }
 
@@ -3810,7 +3883,8 @@ instrument_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
                          (IF_X64(true ||) check_ignore_unaddr) ?
                          OP_jne : OP_jne_short, mi);
     }
-    ASSERT(mi->memsz <= sizeof(void*) || mi->num_to_propagate == 0 || mi->memsz ==16,
+    ASSERT(mi->memsz <= sizeof(void*) || mi->num_to_propagate == 0 || mi->memsz ==16
+           IF_X64(|| mi->memsz == 32),
            "propagation not suported for odd-sized memops");
     /* optimization to avoid checks on jcc after cmp/test
      * we can't use mi->check_definedness b/c in fastpath it's used for "go
@@ -3886,7 +3960,9 @@ instrument_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
                     INSTR_CREATE_cmp(drcontext, opnd_create_reg(mi->reg2_16),
                                      OPND_CREATE_INT16((short)SHADOW_QWORD_DEFINED)));
             } else {
-                ASSERT(mi->memsz == 16 || mi->memsz == 10, "invalid memsz");
+                ASSERT(mi->memsz == 16 || mi->memsz == 10
+                       IF_X64(|| mi->memsz == 32), "invalid memsz");
+                /* i#243: for 32 bytes the immed is sign-extended to the full reg */
                 PRE(bb, inst,
                     INSTR_CREATE_cmp(drcontext, opnd_create_reg(mi->reg2.reg),
                                      OPND_CREATE_INT32(SHADOW_DQWORD_DEFINED)));
@@ -4024,6 +4100,7 @@ instrument_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
                 PRE(bb, inst, INSTR_CREATE_cmp
                     (drcontext, mi->memsz <= 4 ? OPND_CREATE_MEM8(mi->reg1.reg, 0) :
                      (mi->memsz == 8 ? OPND_CREATE_MEM16(mi->reg1.reg, 0) :
+                      IF_X64(mi->memsz == 32 ? OPND_CREATE_MEM64(mi->reg1.reg, 0) :)
                       OPND_CREATE_MEM32(mi->reg1.reg, 0)),
                      shadow_immed(mi->memsz, SHADOW_DEFINED)));
                 /* for slow_path we do not propagate src shadow vals to dst when
@@ -4044,6 +4121,7 @@ instrument_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
                     PRE(bb, inst, INSTR_CREATE_cmp
                         (drcontext, mi->memsz <= 4 ? OPND_CREATE_MEM8(mi->reg1.reg, 0) :
                          (mi->memsz == 8 ? OPND_CREATE_MEM16(mi->reg1.reg, 0) :
+                          IF_X64(mi->memsz == 32 ? OPND_CREATE_MEM64(mi->reg1.reg, 0) :)
                           OPND_CREATE_MEM32(mi->reg1.reg, 0)),
                          shadow_immed(mi->memsz, SHADOW_UNDEFINED)));
                     add_check_partial_undefined(drcontext, bb, inst, mi, false/*dst*/,
@@ -4091,17 +4169,20 @@ instrument_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
     if (opnd_uses_reg(mi->dst[0].shadow, mi->reg1.reg) ||
         opnd_uses_reg(mi->src[0].shadow, mi->reg2.reg)) {
         ASSERT(!opnd_uses_reg(mi->dst[0].shadow, mi->reg2.reg), "scratch reg error");
-        scratch = reg_to_size(mi->reg2.reg, (mi->opsz > 8) ? OPSZ_4 :
+        scratch = reg_to_size(mi->reg2.reg, IF_X64((mi->opsz > 16) ? OPSZ_8 :)
+                              (mi->opsz > 8) ? OPSZ_4 :
                               ((mi->opsz == 8) ? OPSZ_2 : OPSZ_1));
         si = &mi->reg2;
     } else {
         ASSERT(!opnd_uses_reg(mi->dst[0].shadow, mi->reg1.reg), "scratch reg error");
-        scratch = reg_to_size(mi->reg1.reg, (mi->opsz > 8) ? OPSZ_4 :
+        scratch = reg_to_size(mi->reg1.reg, IF_X64((mi->opsz > 16) ? OPSZ_8 :)
+                              (mi->opsz > 8) ? OPSZ_4 :
                               ((mi->opsz == 8) ? OPSZ_2 : OPSZ_1));
         si = &mi->reg1;
     }
     scratch3 = mi->reg3.reg == REG_NULL ? REG_NULL :
-        reg_to_size(mi->reg3.reg, (mi->opsz > 8) ? OPSZ_4 :
+        reg_to_size(mi->reg3.reg, IF_X64((mi->opsz > 16) ? OPSZ_8 :)
+                    (mi->opsz > 8) ? OPSZ_4 :
                     ((mi->opsz == 8) ? OPSZ_2 : OPSZ_1));
     if (mi->src_opsz > 4 && !mi->check_definedness/*eflags*/ &&
         mi->num_to_propagate > 0) {
@@ -4114,6 +4195,11 @@ instrument_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
          * Then we can use reg3, which we went to pains to get.
          */
         ASSERT(!mi->use_shared, "we're clobbering reg1 potentially");
+#ifdef X64
+        if (mi->src_opsz == 32) /* ymm */
+            src_val_reg = reg_to_pointer_sized(scratch);
+        else
+#endif
         if (mi->src_opsz == 16) /* xmm */
             src_val_reg = reg_ptrsz_to_32(reg_to_pointer_sized(scratch));
         else if (mi->src_opsz == 8) /* mmx */
@@ -4254,6 +4340,26 @@ instrument_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
          * insert_shadow_op() handle both mem8 or reg8?
          */
     }
+#ifdef X64
+    /* i#243: a VEX-encoded write to an xmm reg zeroes the top of its ymm */
+    if (options.check_uninitialized && opnd_is_reg(mi->dst[0].app) &&
+        reg_is_xmm(opnd_get_reg(mi->dst[0].app)) &&
+        !reg_is_ymm(opnd_get_reg(mi->dst[0].app)) &&
+        proc_avx_enabled() && instr_zeroes_ymmh(inst)) {
+        reg_id_t dst_reg = opnd_get_reg(mi->dst[0].app);
+        ASSERT(mi->reg3.reg != DR_REG_NULL, "spill error");
+        mark_scratch_reg_used(drcontext, bb, mi->bb, &mi->reg3);
+        PRE(bb, inst,
+            INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(mi->reg3.reg),
+                                opnd_create_shadow_reg_slot(dst_reg)));
+        PRE(bb, inst,
+            INSTR_CREATE_mov_st(drcontext,
+                                OPND_CREATE_MEM32(mi->reg3.reg,
+                                                  get_shadow_xmm_offs(dst_reg) +
+                                                  sizeof(uint)),
+                                OPND_CREATE_INT32(SHADOW_DQWORD_DEFINED)));
+    }
+#endif
 #else /* TOOL_DR_MEMORY */
     add_shadow_table_lookup(drcontext, bb, inst, mi, false/*addr not value*/,
                             false, false/*!need_offs*/, false/*!zero_rest*/,
@@ -4262,8 +4368,9 @@ instrument_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
     ASSERT(mi->reg1_8 != REG_NULL && mi->reg1.used, "reg spill error");
     /* shadow lookup left reg1 holding address */
     if (!options.stale_blind_store) {
-        /* FIXME: measure perf to see which is better */
-        /* cmp and avoid store can be faster than blindly storing */
+        /* Only store if not already marked, so the common already-marked case
+         * leaves the shadow line clean and shared across cores.
+         */
         /* all shadow de-refs need xl8 as Umbra uses page faults */
         PREXL8M(bb, inst, INSTR_XL8
                 (INSTR_CREATE_cmp(drcontext, OPND_CREATE_MEM8(mi->reg1.reg, 0),
@@ -56,6 +56,10 @@ hashtable_t bb_table;
 #define XL8_SHARING_HASH_BITS 10
 hashtable_t xl8_sharing_table;
 
+/* -adaptive_slowpath */
+#define SLOWPATH_HITS_HASH_BITS 10
+hashtable_t slowpath_hits_table;
+
 /* alloca handling in fastpath (i#91) */
 #define IGNORE_UNADDR_HASH_BITS 6
 hashtable_t ignore_unaddr_table;
@@ -163,6 +167,7 @@ instrument_fragment_delete(void *drcontext/*may be NULL*/, void *tag)
         for (i = 0; i < bb_size; i++) {
             hashtable_remove(&xl8_sharing_table, (void *)(start + i));
         }
+        adaptive_remove_range(start, bb_size);
     }
 
 #ifdef X86
@@ -262,6 +267,9 @@ instrument_init(void)
         gencode_init();
         hashtable_init(&xl8_sharing_table, XL8_SHARING_HASH_BITS, HASH_INTPTR,
                        false/*!strdup*/);
+        /* We lock explicitly across lookup-then-update sequences */
+        hashtable_init_ex(&slowpath_hits_table, SLOWPATH_HITS_HASH_BITS, HASH_INTPTR,
+                          false/*!strdup*/, false/*!synch*/, NULL, NULL, NULL);
         hashtable_init(&ignore_unaddr_table, IGNORE_UNADDR_HASH_BITS, HASH_INTPTR,
                        false/*!strdup*/);
     }
@@ -294,6 +302,7 @@ instrument_exit(void)
     }
     if (options.shadowing) {
         hashtable_delete_with_stats(&xl8_sharing_table, "xl8_sharing");
+        hashtable_delete_with_stats(&slowpath_hits_table, "slowpath_hits");
         hashtable_delete_with_stats(&ignore_unaddr_table, "ignore_unaddr");
     }
     hashtable_delete_with_stats(&bb_table, "bb_table");
@@ -853,6 +862,91 @@ check_program_counter(void *drcontext, app_pc pc, instr_t *inst)
 }
 
 #ifdef X86
+# ifdef TOOL_DR_MEMORY
+/* Returns whether every byte a rep string loop of count elements of size sz
+ * starting at addr will access is addressable and defined.
+ */
+static bool
+repstr_range_defined(app_pc addr, reg_t count, uint sz, bool backward)
+{
+    size_t len;
+    app_pc start = addr;
+    if (count > POINTER_MAX / sz)
+        return false;
+    len = count * sz;
+    if (backward) {
+        /* with the direction flag set the elements below addr are accessed */
+        if ((ptr_uint_t)addr < len - sz)
+            return false;
+        start = addr + sz - len;
+    }
+    if (POINTER_OVERFLOW_ON_ADD(start, len))
+        return false;
+    return shadow_check_range(start, len, SHADOW_DEFINED, NULL, NULL, NULL);
+}
+
+/* -repstr_range_check: called with the app's registers before a rep movs or
+ * rep stos loop starts.  Checks the whole range the loop will access up front,
+ * so the per-iteration checks can be skipped when nothing there can be
+ * reported and the loop's shadow writes would not change anything.
+ */
+static void
+repstr_check_range(uint opc, uint sz, uint src_reg)
+{
+    void *drcontext = dr_get_current_drcontext();
+    dr_mcontext_t mc; /* do not init whole thing: memset is expensive */
+    bool ok = false;
+    mc.size = sizeof(mc);
+    mc.flags = DR_MC_CONTROL|DR_MC_INTEGER;
+    dr_get_mcontext(drcontext, &mc);
+    STATS_INC(repstr_ranges_checked);
+    /* For a zero count the loop does not run the string instr at all */
+    if (mc.xcx > 0 &&
+        (!options.check_uninitialized ||
+         (is_shadow_register_defined(get_shadow_register(DR_REG_XDI)) &&
+          (opc != OP_movs ||
+           is_shadow_register_defined(get_shadow_register(DR_REG_XSI))) &&
+          (src_reg == DR_REG_NULL ||
+           is_shadow_register_defined(get_shadow_register((reg_id_t)src_reg))))) &&
+        repstr_range_defined((app_pc)mc.xdi, mc.xcx, sz, TEST(EFLAGS_DF, mc.xflags)) &&
+        (opc != OP_movs ||
+         repstr_range_defined((app_pc)mc.xsi, mc.xcx, sz,
+                              TEST(EFLAGS_DF, mc.xflags)))) {
+        STATS_INC(repstr_ranges_ok);
+        ok = true;
+    }
+    LOG(3, "rep string range check xdi="PFX" xcx="PIFX": %s\n",
+        mc.xdi, mc.xcx, ok ? "ok" : "per-iteration");
+    set_shadow_repstr_range_ok(ok);
+}
+
+/* Whether -repstr_range_check can apply to the string instr of a
+ * repstr_to_loop bb: a rep movs or rep stos whose count and pointers are the
+ * full xcx, xsi, and xdi.  The rep cmps and scas forms can stop early, so the
+ * range their count implies may be far larger than what they access.
+ */
+static bool
+repstr_range_check_applies(instr_t *string)
+{
+    int opc = instr_get_opcode(string);
+    opnd_t dst = instr_get_dst(string, 0);
+    if (!options.repstr_range_check || options.pattern != 0 ||
+        !whole_bb_spills_enabled())
+        return false;
+    if (opc != OP_movs && opc != OP_stos)
+        return false;
+    /* An address-size prefix would make the loop use ecx, esi, and edi */
+    if (!opnd_is_base_disp(dst) || opnd_get_base(dst) != DR_REG_XDI)
+        return false;
+    if (opc == OP_movs) {
+        opnd_t src = instr_get_src(string, 0);
+        if (!opnd_is_base_disp(src) || opnd_get_base(src) != DR_REG_XSI)
+            return false;
+    }
+    return true;
+}
+# endif /* TOOL_DR_MEMORY */
+
 /* PR 580123: add fastpath for rep string instrs by converting to normal loop */
 static void
 convert_repstr_to_loop(void *drcontext, instrlist_t *bb, bb_info_t *bi,
@@ -924,6 +1018,9 @@ convert_repstr_to_loop(void *drcontext, instrlist_t *bb, bb_info_t *bi,
         bi->fake_xl8 = (app_pc) entry;
 
         bi->is_repstr_to_loop = true;
+# ifdef TOOL_DR_MEMORY
+        bi->repstr_range_check = repstr_range_check_applies(string);
+# endif
     }
 }
 #endif
@@ -1051,6 +1148,7 @@ instru_event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb,
             bi->pattern_4byte_check_only = save->pattern_4byte_check_only;
             IF_DEBUG(bi->pattern_4byte_check_field_set = true);
             bi->share_xl8_max_diff = save->share_xl8_max_diff;
+            bi->demotion_epoch = save->demotion_epoch;
             hashtable_unlock(&bb_table);
         } else {
             /* We want to ignore unaddr refs by heap routines (when touching headers,
@@ -1068,6 +1166,11 @@ instru_event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb,
             });
             /* i#826: share_xl8_max_diff changes over time, so save it. */
             bi->share_xl8_max_diff = options.share_xl8_max_diff;
+            /* The bb table entry that lets us recreate this bb's demotions
+             * only exists with whole-bb spills.
+             */
+            if (options.shadowing && whole_bb_spills_enabled())
+                bi->demotion_epoch = adaptive_current_epoch();
 #ifdef TOOL_DR_MEMORY
             if (options.check_memset_unaddr &&
                 in_replace_memset(dr_fragment_app_pc(tag))) {
@@ -1137,6 +1240,25 @@ instru_event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *ins
     }
 
     if (bi->first_instr && bi->is_repstr_to_loop) {
+#if defined(TOOL_DR_MEMORY) && defined(X86)
+        if (bi->repstr_range_check) {
+            instr_t *string = bi->fake_xl8_override_instr;
+            opnd_t src = instr_get_src(string, 0);
+            /* This runs once per rep string execution, ahead of the loop.
+             * We insert it before any whole-bb spill so the callee sees the
+             * app's registers, and have the spills go after it.
+             */
+            dr_insert_clean_call(drcontext, bb, inst, (void *)repstr_check_range,
+                                 false, 3,
+                                 OPND_CREATE_INT32(instr_get_opcode(string)),
+                                 OPND_CREATE_INT32(opnd_size_in_bytes
+                                                   (opnd_get_size
+                                                    (instr_get_dst(string, 0)))),
+                                 OPND_CREATE_INT32(opnd_is_reg(src) ?
+                                                   opnd_get_reg(src) : DR_REG_NULL));
+            bi->spill_after = instr_get_prev(inst);
+        }
+#endif
         /* if xcx is 0 we'll skip ahead and will restore the whole-bb regs
          * at the bottom of the bb so make sure we save first.
          * this is a case of internal control flow messing up code that
@@ -1197,6 +1319,15 @@ instru_event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *ins
         goto instru_event_bb_insert_done;
     if (options.pattern != 0 && instr_is_prefetch(inst))
         goto instru_event_bb_insert_done;
+#if defined(TOOL_DR_MEMORY) && defined(X86_64)
+    /* i#243: vzeroupper and vzeroall have no operands for us to propagate to */
+    if (options.check_uninitialized &&
+        (opc == OP_vzeroupper || opc == OP_vzeroall)) {
+        dr_insert_clean_call(drcontext, bb, inst, (void *)register_shadow_zero_ymm,
+                             false, 1, OPND_CREATE_INT32(opc == OP_vzeroupper));
+        goto instru_event_bb_insert_done;
+    }
+#endif
 
     /* if there are no shadowed reg or mem operands, we can ignore it */
     has_shadowed_reg = false;
@@ -1259,11 +1390,42 @@ instru_event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *ins
         }
     } else if (options.shadowing &&
                (options.check_uninitialized || has_noignorable_mem)) {
-        if (instr_ok_for_instrument_fastpath(inst, &mi, bi)) {
+        instr_t *repstr_skip = NULL;
+#ifdef TOOL_DR_MEMORY
+        if (bi->repstr_range_check && inst == bi->fake_xl8_override_instr) {
+            /* -repstr_range_check: skip this iteration's checks if the whole
+             * range passed up front.  The repstr_to_loop code above saved
+             * the flags at the top of the bb.
+             */
+            repstr_skip = INSTR_CREATE_label(drcontext);
+            mark_eflags_used(drcontext, bb, bi);
+            PRE(bb, inst,
+                INSTR_CREATE_cmp(drcontext, opnd_create_shadow_repstr_slot(),
+                                 OPND_CREATE_INT8(0)));
+            PRE(bb, inst,
+                INSTR_CREATE_jcc(drcontext, OP_jne, opnd_create_instr(repstr_skip)));
+        }
+#endif
+        if (IF_DRMEM_ELSE(elide_overlap_instr_covered(bi, inst), false)) {
+            /* No check needed, but we still need the global spill handling below */
+            STATS_INC(overlap_checks_elided);
+            LOG(3, "overlapping check elided "PFX"\n", pc);
+            bi->shared_memop = opnd_create_null();
+        } else if (instr_ok_for_instrument_fastpath(inst, &mi, bi) &&
+                   /* instr_ok_for_instrument_fastpath() fills in mi even if we
+                    * then demote.  We do not demote the pieces of a rep string
+                    * loop, whose slowpath entries are reported at the rep
+                    * string pc.
+                    */
+                   (bi->is_repstr_to_loop || !instr_demoted_to_slowpath(bi, pc))) {
             instrument_fastpath(drcontext, bb, inst, &mi, bi->check_ignore_unaddr);
             used_fastpath = true;
             bi->added_instru = true;
+            if (bi->is_repstr_to_loop && !translating)
+                adaptive_ignore_instr(pc);
         } else {
+            if (!translating)
+                adaptive_ignore_instr(pc);
             LOG(3, "fastpath unavailable "PFX": ", pc);
             DOLOG(3, { instr_disassemble(drcontext, inst, LOGFILE_GET(drcontext)); });
             LOG(3, "\n");
@@ -1279,6 +1441,14 @@ instru_event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *ins
             /* for whole-bb slowpath does interact w/ global regs */
             bi->added_instru = whole_bb_spills_enabled();
         }
+        if (repstr_skip != NULL) {
+            PRE(bb, inst, repstr_skip);
+            /* the skipped code may have set up a shared translation */
+            bi->shared_memop = opnd_create_null();
+        }
+#ifdef TOOL_DR_MEMORY
+        elide_overlap_note_checks(bi, inst);
+#endif
     }
     /* do esp adjust last, for ret immed; leave wants it the
      * other way but we compensate in adjust_memop() */
@@ -1322,6 +1492,10 @@ instru_event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *ins
  instru_event_bb_insert_done:
     if (bi->first_instr && instr_is_app(inst))
         bi->first_instr = false;
+#ifdef TOOL_DR_MEMORY
+    if (instr_is_app(inst))
+        elide_overlap_update_regs(bi, inst);
+#endif
     if (!used_fastpath && options.shadowing) {
         /* i#1870: sanity check in case we bail out of instrumenting the next instr
          * when we're sharing.
@@ -1377,6 +1377,12 @@ leak_scan_for_leaks(bool at_exit)
      * pointers are aligned.  For now only considering pointers to the start of
      * a heap block: we'll see how many false positives we hit with that.
      */
+#ifdef TOOL_DR_MEMORY
+    /* The scan reads shadow memory, which must not be reclaimed beneath it
+     * should we fail to suspend all threads.
+     */
+    shadow_reclaim_pause();
+#endif
     if (IF_WINDOWS_ELSE(false, true) && at_exit && op_have_defined_info) {
         /* We assume no synch is needed at exit time, and that we
          * can ignore thread registers as roots of the search.
@@ -1418,6 +1424,9 @@ leak_scan_for_leaks(bool at_exit)
      * useful later on.  I have measured the cost of having the malloc
      * hashtable be an rbtree instead, avoiding this creation, but the extra
      * overhead shows up on heap-intensive bmarks (PR 535568).
+     * XXX: the walks here stay serial, though with -chunk_index they read the
+     * index, as every callback updates data or the tree without a lock.
+     * Using malloc_iterate_parallel() would need per-thread queues merged after.
      */
     malloc_iterate(malloc_iterate_build_tree_cb, (void *) data.alloc_tree);
 
@@ -1497,6 +1506,9 @@ leak_scan_for_leaks(bool at_exit)
             dr_resume_all_other_threads(drcontexts, num_threads);
         ASSERT(ok, "failed to resume after leak scan");
     }
+#ifdef TOOL_DR_MEMORY
+    shadow_reclaim_resume();
+#endif
 
     /* We do not maintain the tree throughout execution: we make a new one for
      * each reachability scan.
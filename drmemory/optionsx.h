@@ -482,6 +482,15 @@ OPTION_CLIENT_SCOPE(drmemscope, delay_frees, uint, 2000, 0, UINT_MAX,
 OPTION_CLIENT_SCOPE(drmemscope, delay_frees_maxsz, uint, 20000000, 0, UINT_MAX,
                     "Maximum size of frees to delay before committing",
                     "Maximum size of frees to delay before committing.  The larger this number, the greater the likelihood that "TOOLNAME" will identify use-after-free errors.  However, the larger this number, the more memory will be used.  This value is separate for each set of allocation routines and each Windows Heap.")
+OPTION_CLIENT_BOOL(drmemscope, delay_frees_by_size, false,
+                   "Delay frees separately for small, medium, and large sizes",
+                   "Only applies to -replace_malloc.  Keeps small, medium, and large delayed frees in separate queues.  When -delay_frees or -delay_frees_maxsz is exceeded, the oldest entry of the size class holding the most entries or bytes, respectively, is committed first, so that a few large frees do not push every small free out of the delayed-free queue.")
+OPTION_CLIENT_SCOPE(drmemscope, delay_frees_global_maxsz, uint, 0, 0, INT_MAX,
+                    "Maximum total size of frees to delay across all heaps",
+                    "Only applies to -replace_malloc.  Limits the total size of delayed frees summed across all sets of allocation routines and all Windows Heaps, in addition to the per-heap -delay_frees_maxsz.  0 means no total limit.")
+OPTION_CLIENT(internal, delay_frees_batch, uint, 0, 0, 1024,
+              "Minimum number of delayed frees to commit at once",
+              "Only applies to -replace_malloc.  When a delayed-free limit is reached, commit at least this many delayed frees at once so that subsequent frees do not each need to commit one.  0 commits only as many as needed to get back under the limits.")
 OPTION_CLIENT_BOOL(drmemscope, delay_frees_stack, true,
                    "Record callstacks on free to use when reporting use-after-free",
                    "Record callstacks on free to use when reporting use-after-free or other errors that overlap with freed objects.  There is a slight performance hit incurred by this feature for malloc-intensive applications.  The callstack size is controlled by -free_max_frames.")
@@ -838,6 +847,11 @@ OPTION_CLIENT_BOOL(internal, statistics, false,
 OPTION_CLIENT(internal, stats_dump_interval, uint, 500000, 1, UINT_MAX,
               "How often to dump statistics, in units of slowpath executions",
               "How often to dump statistics, in units of slowpath executions")
+#ifdef TOOL_DR_MEMORY
+OPTION_CLIENT(internal, slowpath_profile, uint, 0, 0, 100000,
+              "Profile the slowpath and log this many of its hottest instructions",
+              "Counts, for each application instruction, how many times it enters the slowpath (including the shared slowpath) and how many cycles are spent checking its memory references there.  At exit and on each nudge, this many of the instructions with the most slowpath entries are listed in the global log file with their opcodes and modules.  Useful for finding which instructions the fastpath does not handle on a given application.  0 disables.")
+#endif
 /* We don't want or need this on Linux (xref i#1295) */
 OPTION_CLIENT_BOOL(internal, define_unknown_regions, IF_WINDOWS_ELSE(true, false),
                    "Mark unknown regions as defined",
@@ -876,6 +890,12 @@ OPTION_CLIENT(internal, share_xl8_max_diff, uint, 2048, 0, SHADOW_REDZONE_SIZE*4
 OPTION_CLIENT(internal, share_xl8_max_flushes, uint, 64, 0, UINT_MAX,
               "How many flushes before abandoning sharing altogether",
               "How many flushes before abandoning sharing altogether")
+OPTION_CLIENT(internal, adaptive_slowpath, uint, 0, 0, UINT_MAX/4,
+              "How many slowpaths before re-instrumenting an instr to skip its fastpath",
+              "When an instruction instrumented with a fastpath enters the slowpath this many times, its block is flushed and the instruction is re-instrumented to call the slowpath directly, saving the cost of attempting the fastpath first.  Every instruction's count is halved after each 64 times this many slowpath entries overall, so that only instructions that keep failing their fastpath are re-instrumented.  At most -adaptive_max_flushes such flushes are done.  0 disables.")
+OPTION_CLIENT(internal, adaptive_max_flushes, uint, 64, 0, 0x10000,
+              "How many -adaptive_slowpath flushes before abandoning it altogether",
+              "How many -adaptive_slowpath flushes before abandoning it altogether")
 OPTION_CLIENT_BOOL(internal, check_memset_unaddr, true,
                    "Check for in-heap unaddr in memset",
                    "Check for in-heap unaddr in memset")
@@ -918,6 +938,36 @@ OPTION_CLIENT_BOOL(internal, pattern_use_malloc_tree, false,
 OPTION_CLIENT_BOOL(internal, replace_malloc, true,
                    "Replace malloc rather than wrapping existing routines",
                    "Replace malloc with custom routines rather than wrapping existing routines.  Replacing is more efficient and avoids several issues with the Windows debug C library where wrapping must disable some of Dr. Memory's checks.")
+OPTION_CLIENT_BOOL(internal, external_headers, false,
+                   "Keep -replace_malloc chunk headers outside of the heap",
+                   "Only applies to -replace_malloc.  Stores each chunk's header in a separate table indexed by address rather than inside the redzone, so that chunks need no space beyond -redzone_size between them and application data does not share cache lines with headers.  This reduces heap overhead for small allocations, particularly with a small -redzone_size.  Disables -magazine_size.")
+OPTION_CLIENT(internal, magazine_size, uint, 0, 0, 64,
+              "Per-thread cache size for small -replace_malloc allocations",
+              "Only applies to -replace_malloc.  When non-zero, each thread caches up to this many free chunks of each small size class, and batches this many frees before appending them to the shared delayed-free queue, avoiding the heap lock for most allocations and frees.  Delayed frees are still released in first-in-first-out order.  0 disables the per-thread caches.")
+OPTION_CLIENT(internal, arena_shards, uint, 1, 1, 64,
+              "Number of independent -replace_malloc heaps on Linux",
+              "Only applies to -replace_malloc on Linux.  Threads are assigned to this many independent heap arenas by thread id, each with its own lock, free lists, and delayed-free queue, reducing lock contention in multi-threaded applications.  Memory freed by a different thread is returned to the arena it came from.  Each arena delays frees independently.")
+OPTION_CLIENT_BOOL(internal, arena_huge_pages, false,
+                   "Back -replace_malloc heaps with transparent huge pages on Linux",
+                   "Only applies to -replace_malloc on Linux.  Aligns each heap arena to 2MB, grows arenas in 2MB units, and asks the kernel to back them with transparent huge pages, reducing TLB misses for large heaps at the cost of higher resident memory.  Has no effect if transparent huge pages are disabled in the kernel.")
+OPTION_CLIENT(internal, heap_release_threshold, uint, 0, 0, UINT_MAX,
+              "Minimum size of a free -replace_malloc chunk whose pages are returned to the OS",
+              "Only applies to -replace_malloc on Linux.  When a free chunk of at least this size forms in the middle of a heap arena, the whole pages inside it are returned to the OS while remaining mapped, and the shadow memory covering them is released where possible.  With -arena_huge_pages only whole 2MB pages are returned.  Ignored with -pattern.  0 disables.")
+OPTION_CLIENT_BOOL(internal, chunk_index, false,
+                   "Index -replace_malloc chunks for faster heap iteration",
+                   "Only applies to -replace_malloc.  Keeps an address-ordered array of the chunks in each heap arena, rebuilt on demand after chunks are split, coalesced, or added, so that leak scans and other walks over the heap read a dense array rather than stepping through every chunk header in memory.")
+OPTION_CLIENT(internal, reclaim_shadow_interval, uint, 0, 0, UINT_MAX,
+              "Period in milliseconds between checks for redundant shadow memory",
+              "Every this many milliseconds, if at least -reclaim_shadow_threshold of application memory has been unmapped or released since the last reclamation, all threads are suspended and shadow blocks that hold nothing but the unaddressable value are freed.  They are re-created on their next touch.  0 disables.")
+OPTION_CLIENT(internal, reclaim_shadow_threshold, uint, 256, 0, UINT_MAX,
+              "Megabytes of application memory to unmap or release before reclaiming shadow memory",
+              "See -reclaim_shadow_interval.  Unmapped memory and -replace_malloc heap pages returned to the OS both count toward this threshold.")
+OPTION_CLIENT_BOOL(internal, share_shadow_blocks, false,
+                   "Share identical shadow blocks during shadow reclamation",
+                   "When -reclaim_shadow_interval is non-zero, each reclamation check also maps shadow blocks that hold a single value throughout onto one shared read-only copy per value, if at least -reclaim_shadow_threshold of shadow memory has been committed since the last such pass.  A write to a shared block gives it back its own copy, a page at a time.  Useful for applications with large heaps, whose shadow is mostly uniform.  64-bit Linux only: on 32-bit such blocks are already shared when created.")
+OPTION_CLIENT_BOOL(internal, fork_share_state, false,
+                   "Leave state inherited across fork shared with the parent",
+                   "Linux-only.  A fork child shares its copy of the parent's state copy-on-write.  Normally the child frees each entry of the inherited error and thread tables, which copies every page they touch.  With this option the child instead sets the inherited tables aside, never freeing them, and starts with empty ones, and only writes out the symbol caches it adds to, leaving the rest to the parent, so a child that does little work copies few of its parent's pages.  Shadow memory and heap metadata are always inherited as they are, and only the per-thread and log file state is created anew.  Useful for applications that fork many worker processes.")
 OPTION_CLIENT_SCOPE(internal, pattern_max_2byte_faults, int, 0x1000, -1, INT_MAX,
                     "The max number of faults caused by 2-byte pattern checks we could tolerate before switching to 4-byte checks only",
                     "The max number of faults caused by 2-byte pattern checks we could tolerate before switching to 4-byte checks only. 0 means do not use 2-byte checks, and negative value means always use 2-byte checks")
@@ -927,6 +977,12 @@ OPTION_CLIENT(internal, callstack_dump_stack, uint, 0, 0, 512*1024,
 OPTION_CLIENT_BOOL(internal, pattern_opt_repstr, true,
                    "For pattern mode, optimize each loop expanded from a rep string instruction",
                    "For pattern mode, optimize each loop expanded from a rep string instruction by using an inner loop to avoid unnecessary aflags save/restore.")
+OPTION_CLIENT_BOOL(internal, elide_overlap, false,
+                   "For -no_check_uninitialized, remove redundant checks",
+                   "Only applies for -no_check_uninitialized.  Within a basic block, skips checking the addressability of a [base+displacement] memory reference when earlier checks through the same unmodified base register cover it, either directly or because both ends of a range no larger than -redzone_size were checked.  As with -pattern_opt_elide_overlap, this can result in not reporting an error in favor of reporting another error whose memory reference is adjacent.")
+OPTION_CLIENT_BOOL(internal, repstr_range_check, false,
+                   "Check each rep string loop's whole memory range up front",
+                   "For -repstr_to_loop, checks the whole range that each rep movs or rep stos will access before its loop starts.  If every byte is addressable and defined, and so are the registers the string instruction reads, the loop's iterations skip their individual checks.  Otherwise each iteration is checked as usual.  The up-front check costs a clean call per rep string execution, so this pays off for long strings.")
 OPTION_CLIENT_BOOL(internal, pattern_opt_elide_overlap, false,
                    "For pattern mode, remove redundant checks",
                    "For pattern mode, remove redundant checks if they overlap with other existing checks. This can result in not reporting an error in favor of reporting another error whose memory reference is adjacent. Thus, this gives up the property of reporting any particular error before it happens: a minor tradeoff in favor of performance.")
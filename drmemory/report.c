@@ -334,6 +334,14 @@ static void *thread_table_lock;
 static thread_id_t main_thread;
 static bool main_thread_printed;
 
+#ifdef UNIX
+/* With -fork_share_state, a fork child sets the tables it inherits aside here
+ * instead of clearing them, and never frees them.
+ */
+static hashtable_t inherited_error_table;
+static hashtable_t inherited_thread_table;
+#endif
+
 static void
 report_delayed_thread(thread_id_t tid);
 
@@ -1477,6 +1485,24 @@ missing_syms_cb(const char *modpath)
 #endif
 }
 
+static void
+error_table_init(hashtable_t *table)
+{
+    hashtable_init_ex(table, ERROR_HASH_BITS, HASH_CUSTOM,
+                      false/*!str_dup*/, false/*using error_lock*/,
+                      (void (*)(void*)) stored_error_free,
+                      (uint (*)(void*)) stored_error_hash,
+                      (bool (*)(void*, void*)) stored_error_cmp);
+}
+
+static void
+thread_table_init(hashtable_t *table)
+{
+    hashtable_init_ex(table, THREAD_HASH_BITS, HASH_INTPTR,
+                      false/*!str_dup*/, false/*!synch*/,
+                      (void (*)(void*)) packed_callstack_free, NULL, NULL);
+}
+
 void
 report_init(void)
 {
@@ -1496,11 +1522,7 @@ report_init(void)
 
     error_lock = dr_mutex_create();
 
-    hashtable_init_ex(&error_table, ERROR_HASH_BITS, HASH_CUSTOM,
-                      false/*!str_dup*/, false/*using error_lock*/,
-                      (void (*)(void*)) stored_error_free,
-                      (uint (*)(void*)) stored_error_hash,
-                      (bool (*)(void*, void*)) stored_error_cmp);
+    error_table_init(&error_table);
 
 #ifdef USE_DRSYMS
     /* callstack.c wants these as null-separated, double-null-terminated */
@@ -1660,9 +1682,7 @@ report_init(void)
     }
     if (options.show_threads && !options.show_all_threads) {
         thread_table_lock = dr_mutex_create();
-        hashtable_init_ex(&thread_table, THREAD_HASH_BITS, HASH_INTPTR,
-                          false/*!str_dup*/, false/*!synch*/,
-                          (void (*)(void*)) packed_callstack_free, NULL, NULL);
+        thread_table_init(&thread_table);
     }
 
     if (options.prefix_style == PREFIX_STYLE_BLANK) {
@@ -1720,7 +1740,15 @@ report_fork_init(void)
     num_suppressed_leaks_default = 0;
     num_throttled_errors = 0;
     num_throttled_leaks = 0;
-    hashtable_clear(&error_table);
+    if (options.fork_share_state) {
+        /* Freeing every inherited entry, even at exit, would copy the pages
+         * holding them.  A grandchild drops what its parent set aside, which
+         * is just as shared.
+         */
+        inherited_error_table = error_table;
+        error_table_init(&error_table);
+    } else
+        hashtable_clear(&error_table);
     /* Be sure to reset the error list (xref PR 519222)
      * The error list points at hashtable payloads so nothing to free
      */
@@ -1730,7 +1758,11 @@ report_fork_init(void)
 
     if (options.show_threads && !options.show_all_threads) {
         dr_mutex_lock(thread_table_lock);
-        hashtable_clear(&thread_table);
+        if (options.fork_share_state) {
+            inherited_thread_table = thread_table;
+            thread_table_init(&thread_table);
+        } else
+            hashtable_clear(&thread_table);
         dr_mutex_unlock(thread_table_lock);
     }
 }
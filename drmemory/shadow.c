@@ -29,6 +29,10 @@
 #include "instru.h"
 #include <limits.h> /* UINT_MAX */
 #include <stddef.h>
+#ifdef X86
+# include <emmintrin.h> /* SSE2 */
+# include <immintrin.h> /* AVX2 */
+#endif
 #ifdef TOOL_DR_HEAPSTAT
 # include "../drheapstat/staleness.h"
 #endif
@@ -608,6 +612,207 @@ shadow_free_buffer(shadow_buffer_t *shadow_buffer)
     global_free(saved, SIZEOF_SAVED_BUFFER(saved->size), HEAPSTAT_SHADOW);
 }
 
+/***************************************************************************
+ * SHADOW RANGE KERNELS
+ *
+ * Within one normal shadow block, a 16-byte-aligned run of app memory is
+ * shadowed by a contiguous run of shadow bytes, each covering 4 app bytes.
+ * These kernels scan or rewrite such runs a vector at a time.  The best
+ * version for the processor is selected in shadow_init().
+ */
+
+#if defined(X86) && defined(UNIX)
+/* gcc and clang need each function enabled for the ISA it uses; cl does not */
+# define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+# define SIMD_TARGET(isa) /* nothing */
+#endif
+
+/* Don't bother with a kernel for runs shorter than this many shadow bytes */
+#define SHADOW_KERNEL_MIN_LEN 16
+
+/* Returns the number of leading bytes in [shadow, shadow+len) equal to pattern */
+typedef size_t (*shadow_match_len_func_t)(byte *shadow, size_t len, byte pattern);
+
+/* Each 2-bit value in [shadow, shadow+len) that differs from the value repeated
+ * in not_pattern is replaced with the value repeated in pattern.
+ */
+typedef void (*shadow_replace_func_t)(byte *shadow, size_t len, byte pattern,
+                                      byte not_pattern);
+
+/* Replicates a byte across a pointer-sized word */
+#define BYTE_TO_PTR_WORD(b) ((ptr_uint_t)(b) * (POINTER_MAX / 0xff))
+
+static size_t
+shadow_match_len_scalar(byte *shadow, size_t len, byte pattern)
+{
+    ptr_uint_t word = BYTE_TO_PTR_WORD(pattern);
+    size_t i = 0;
+    for (; i < len && !ALIGNED(shadow + i, sizeof(ptr_uint_t)); i++) {
+        if (shadow[i] != pattern)
+            return i;
+    }
+    for (; i + sizeof(ptr_uint_t) <= len; i += sizeof(ptr_uint_t)) {
+        if (*(ptr_uint_t *)(shadow + i) != word)
+            break;
+    }
+    for (; i < len; i++) {
+        if (shadow[i] != pattern)
+            break;
+    }
+    return i;
+}
+
+/* Operates on each 2-bit value of a word in parallel: a value's two bits
+ * are both set in the mask iff it differs from not_word's.
+ */
+static inline ptr_uint_t
+shadow_word_replace(ptr_uint_t cur, ptr_uint_t word, ptr_uint_t not_word)
+{
+    ptr_uint_t diff = cur ^ not_word;
+    ptr_uint_t mask = (diff | (diff >> 1)) & BYTE_TO_PTR_WORD(0x55);
+    mask |= mask << 1;
+    return (cur & ~mask) | (word & mask);
+}
+
+static void
+shadow_replace_scalar(byte *shadow, size_t len, byte pattern, byte not_pattern)
+{
+    ptr_uint_t word = BYTE_TO_PTR_WORD(pattern);
+    ptr_uint_t not_word = BYTE_TO_PTR_WORD(not_pattern);
+    size_t i = 0;
+    for (; i < len && !ALIGNED(shadow + i, sizeof(ptr_uint_t)); i++) {
+        shadow[i] = (byte) shadow_word_replace(shadow[i], pattern, not_pattern);
+    }
+    for (; i + sizeof(ptr_uint_t) <= len; i += sizeof(ptr_uint_t)) {
+        ptr_uint_t *ptr = (ptr_uint_t *)(shadow + i);
+        *ptr = shadow_word_replace(*ptr, word, not_word);
+    }
+    for (; i < len; i++)
+        shadow[i] = (byte) shadow_word_replace(shadow[i], pattern, not_pattern);
+}
+
+#ifdef X86
+static size_t SIMD_TARGET("sse2")
+shadow_match_len_sse2(byte *shadow, size_t len, byte pattern)
+{
+    __m128i pat = _mm_set1_epi8((char)pattern);
+    size_t i;
+    for (i = 0; i + sizeof(__m128i) <= len; i += sizeof(__m128i)) {
+        __m128i cur = _mm_loadu_si128((__m128i *)(shadow + i));
+        uint match = (uint) _mm_movemask_epi8(_mm_cmpeq_epi8(cur, pat));
+        if (match != 0xffff)
+            return i + lowest_set_bit(~match);
+    }
+    return i + shadow_match_len_scalar(shadow + i, len - i, pattern);
+}
+
+static void SIMD_TARGET("sse2")
+shadow_replace_sse2(byte *shadow, size_t len, byte pattern, byte not_pattern)
+{
+    __m128i pat = _mm_set1_epi8((char)pattern);
+    __m128i not_pat = _mm_set1_epi8((char)not_pattern);
+    __m128i low_bits = _mm_set1_epi8(0x55);
+    size_t i;
+    for (i = 0; i + sizeof(__m128i) <= len; i += sizeof(__m128i)) {
+        __m128i cur = _mm_loadu_si128((__m128i *)(shadow + i));
+        __m128i diff = _mm_xor_si128(cur, not_pat);
+        /* the 16-bit shift moves one bit across bytes, which the mask drops */
+        __m128i mask = _mm_and_si128(_mm_or_si128(diff, _mm_srli_epi16(diff, 1)),
+                                     low_bits);
+        mask = _mm_or_si128(mask, _mm_add_epi8(mask, mask));
+        cur = _mm_or_si128(_mm_andnot_si128(mask, cur), _mm_and_si128(mask, pat));
+        _mm_storeu_si128((__m128i *)(shadow + i), cur);
+    }
+    shadow_replace_scalar(shadow + i, len - i, pattern, not_pattern);
+}
+
+/* Compares a 64-byte cache line per iteration */
+static size_t SIMD_TARGET("avx2")
+shadow_match_len_avx2(byte *shadow, size_t len, byte pattern)
+{
+    __m256i pat = _mm256_set1_epi8((char)pattern);
+    size_t i;
+    for (i = 0; i + 2*sizeof(__m256i) <= len; i += 2*sizeof(__m256i)) {
+        __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(shadow + i)),
+                                       pat);
+        __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)
+                                                          (shadow + i + sizeof(__m256i))),
+                                       pat);
+        if ((uint)_mm256_movemask_epi8(_mm256_and_si256(lo, hi)) != UINT_MAX) {
+            uint match = (uint) _mm256_movemask_epi8(lo);
+            if (match != UINT_MAX)
+                return i + lowest_set_bit(~match);
+            match = (uint) _mm256_movemask_epi8(hi);
+            return i + sizeof(__m256i) + lowest_set_bit(~match);
+        }
+    }
+    return i + shadow_match_len_sse2(shadow + i, len - i, pattern);
+}
+
+static void SIMD_TARGET("avx2")
+shadow_replace_avx2(byte *shadow, size_t len, byte pattern, byte not_pattern)
+{
+    __m256i pat = _mm256_set1_epi8((char)pattern);
+    __m256i not_pat = _mm256_set1_epi8((char)not_pattern);
+    __m256i low_bits = _mm256_set1_epi8(0x55);
+    size_t i;
+    for (i = 0; i + sizeof(__m256i) <= len; i += sizeof(__m256i)) {
+        __m256i cur = _mm256_loadu_si256((__m256i *)(shadow + i));
+        __m256i diff = _mm256_xor_si256(cur, not_pat);
+        __m256i mask = _mm256_and_si256(_mm256_or_si256(diff,
+                                                        _mm256_srli_epi16(diff, 1)),
+                                        low_bits);
+        mask = _mm256_or_si256(mask, _mm256_add_epi8(mask, mask));
+        cur = _mm256_or_si256(_mm256_andnot_si256(mask, cur),
+                              _mm256_and_si256(mask, pat));
+        _mm256_storeu_si256((__m256i *)(shadow + i), cur);
+    }
+    shadow_replace_sse2(shadow + i, len - i, pattern, not_pattern);
+}
+#endif /* X86 */
+
+static shadow_match_len_func_t shadow_match_len = shadow_match_len_scalar;
+static shadow_replace_func_t shadow_replace = shadow_replace_scalar;
+
+static void
+shadow_kernels_init(void)
+{
+#ifdef X86
+    if (proc_has_feature(FEATURE_AVX2) && proc_avx_enabled()) {
+        shadow_match_len = shadow_match_len_avx2;
+        shadow_replace = shadow_replace_avx2;
+        LOG(1, "using AVX2 shadow range kernels\n");
+    } else if (proc_has_feature(FEATURE_SSE2)) {
+        shadow_match_len = shadow_match_len_sse2;
+        shadow_replace = shadow_replace_sse2;
+        LOG(1, "using SSE2 shadow range kernels\n");
+    }
+#endif
+}
+
+/* Returns the number of bytes of the normal shadow block described by info,
+ * starting at the 16-aligned pc and stopping before end, that can be handed
+ * to a kernel: a multiple of 16, or 0 if the run is too short.  Sets *shadow
+ * to the shadow of pc.
+ */
+static size_t
+shadow_kernel_run(umbra_shadow_memory_info_t *info, app_pc pc, app_pc end,
+                  byte **shadow OUT)
+{
+    size_t offs = pc - info->app_base;
+    size_t run;
+    ASSERT(ALIGNED(pc, 16), "kernel runs must be aligned");
+    if (MAP_4B_TO_1B || !TEST(UMBRA_SHADOW_MEMORY_TYPE_NORMAL, info->shadow_type) ||
+        pc < info->app_base || offs >= info->app_size)
+        return 0;
+    run = ALIGN_BACKWARD(MIN(info->app_size - offs, (size_t)(end - pc)), 16);
+    if (run / SHADOW_GRANULARITY < SHADOW_KERNEL_MIN_LEN)
+        return 0;
+    *shadow = info->shadow_base + BLOCK_AS_BYTE_ARRAY_IDX(offs);
+    return run;
+}
+
 /* Sets the two bits for each byte in the range [start, end) */
 void
 shadow_set_range(app_pc start, app_pc end, uint val)
@@ -662,6 +867,35 @@ shadow_set_range(app_pc start, app_pc end, uint val)
     }
 }
 
+/* Sets the range [start, end) to SHADOW_UNADDRESSABLE and releases any shadow
+ * memory that is then no longer needed.
+ */
+void
+shadow_release_range(app_pc start, app_pc end)
+{
+    app_pc aligned_start = (app_pc)ALIGN_FORWARD(start, SHADOW_GRANULARITY);
+    app_pc aligned_end = (app_pc)ALIGN_BACKWARD(end, SHADOW_GRANULARITY);
+    ASSERT(options.shadowing, "shadowing disabled");
+    ASSERT(SHADOW_DEFAULT_VALUE == SHADOW_DWORD_UNADDRESSABLE,
+           "default shadow value must be unaddressable");
+    LOG(2, "release range "PFX"-"PFX"\n", start, end);
+#ifdef TOOL_DR_MEMORY
+    shadow_reclaim_note_release(end - start);
+#endif
+    if (aligned_end <= aligned_start) {
+        shadow_set_range(start, end, SHADOW_UNADDRESSABLE);
+        return;
+    }
+    shadow_set_range(start, aligned_start, SHADOW_UNADDRESSABLE);
+    /* Umbra frees whole shadow blocks where it can and resets the rest to
+     * the default value.
+     */
+    if (umbra_delete_shadow_memory(umbra_map, aligned_start,
+                                   aligned_end - aligned_start) != DRMF_SUCCESS)
+        ASSERT(false, "fail to release shadow memory");
+    shadow_set_range(aligned_end, end, SHADOW_UNADDRESSABLE);
+}
+
 /* Copies the values for each byte in the range [old_start, old_start+size) to
  * [new_start, new_start+size).  The two ranges can overlap.
  */
@@ -747,15 +981,29 @@ shadow_set_non_matching_range(app_pc start, size_t size, uint val, uint val_not)
     ASSERT(!MAP_4B_TO_1B, "invalid shadow mode");
     LOG(2, "Marking non-%s bytes in range "PFX"-"PFX" as %s\n",
         shadow_name[val_not], start, end, shadow_name[val]);
-    /* XXX: We could try to be clever for perf, but these calls are rare, so we
-     * go byte by byte.
-     */
     umbra_shadow_memory_info_init(&info);
-    for (cur = start; cur != end; cur++) {
+    cur = start;
+    while (cur != end) {
         uint shadow = shadow_get_byte(&info, cur);
-        if (shadow != val_not) {
-            shadow_set_byte(&info, cur, val);
+        if (ALIGNED(cur, 16)) {
+            byte *shadow_start;
+            size_t run = shadow_kernel_run(&info, cur, end, &shadow_start);
+            if (run > 0) {
+                shadow_replace(shadow_start, run / SHADOW_GRANULARITY,
+                               (byte) val_to_dword[val], (byte) val_to_dword[val_not]);
+                cur += run;
+                continue;
+            }
+            /* a shared block holds a single value throughout */
+            if (SHADOW_IS_SHARED_ONLY(info.shadow_type) && shadow == val_not) {
+                app_pc block_end = info.app_base + info.app_size;
+                cur = (block_end > cur && block_end < end) ? block_end : end;
+                continue;
+            }
         }
+        if (shadow != val_not)
+            shadow_set_byte(&info, cur, val);
+        cur++;
     }
 }
 
@@ -811,6 +1059,24 @@ shadow_check_range(app_pc start, size_t size, uint expect,
         } else if (SHADOW_IS_SHARED_ONLY(info.shadow_type)) {
             incr = info.app_base + info.app_size - pc;
         } else {
+            /* Skip the run of whole shadow bytes with the value we are looking
+             * for: expect, or bad_val when measuring the extent of a mismatch.
+             */
+            uint want = res ? expect : bad_val;
+            byte *shadow_start;
+            size_t run;
+            if (want < SHADOW_MIXED && (res || bad_end != NULL) &&
+                (run = shadow_kernel_run(&info, pc, start+size, &shadow_start)) > 0) {
+                size_t match = shadow_match_len(shadow_start, run / SHADOW_GRANULARITY,
+                                                (byte) val_to_dword[want]);
+                /* stay 16-aligned: a partial dword is decoded below */
+                match = ALIGN_BACKWARD(match, sizeof(uint)) * SHADOW_GRANULARITY;
+                if (match > 0) {
+                    val = want;
+                    pc += match;
+                    continue;
+                }
+            }
             val = bitmapx2_dword((bitmap_t)info.shadow_base, pc-info.app_base);
             val = dqword_to_val(val);
             if (val == UINT_MAX) {
@@ -899,6 +1165,29 @@ shadow_next_dword(app_pc start, app_pc end, uint expect)
     return NULL;
 }
 
+/* Finds the next aligned dword, starting at start and stopping at
+ * end, whose shadow does not equal expect expanded to a dword.
+ */
+app_pc
+shadow_next_non_matching_dword(app_pc start, app_pc end, uint expect)
+{
+    bool found;
+    app_pc app_addr = start;
+    ASSERT(expect < SHADOW_MIXED, "invalid shadow value");
+    ASSERT(ALIGNED(start, 4), "invalid start pc");
+    if (end <= start)
+        return NULL;
+    if (umbra_different_value_in_shadow_memory(umbra_map,
+                                               (app_pc *)&app_addr,
+                                               end - app_addr,
+                                               val_to_dword[expect], 1,
+                                               &found) != DRMF_SUCCESS)
+        ASSERT(false, "failed to check value in shadow memory");
+    if (found)
+        return app_addr;
+    return NULL;
+}
+
 /* Finds the previous aligned dword, starting at start and stopping at
  * end (end < start), whose shadow equals expect expanded to a dword.
  */
@@ -1485,6 +1774,162 @@ const byte shadow_word_addr_not_bit[4][256] = {
 },
 };
 
+/***************************************************************************
+ * Unit tests
+ */
+
+#ifdef BUILD_UNIT_TESTS
+typedef struct _shadow_kernels_t {
+    const char *name;
+    shadow_match_len_func_t match_len;
+    shadow_replace_func_t replace;
+} shadow_kernels_t;
+
+/* Room for the longest run at every start offset, with guard bytes after it */
+#define TEST_BUF_SIZE 512
+#define TEST_MAX_OFFS 33
+#define TEST_GUARD 0x1b
+
+static const size_t test_lens[] = {
+    0, 1, 3, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129, 200, 257,
+};
+
+/* One 2-bit value at a time, independent of the kernels' word tricks */
+static byte
+test_replace_byte(byte cur, byte pattern, byte not_pattern)
+{
+    uint shift;
+    for (shift = 0; shift < 8; shift += 2) {
+        if (((cur >> shift) & 3) != ((not_pattern >> shift) & 3)) {
+            cur = (byte) ((cur & ~(3 << shift)) | (pattern & (3 << shift)));
+        }
+    }
+    return cur;
+}
+
+static void
+test_match_len(shadow_kernels_t *k, byte *buf, byte pattern)
+{
+    size_t offs, l, bad;
+    for (offs = 0; offs < TEST_MAX_OFFS; offs++) {
+        for (l = 0; l < BUFFER_SIZE_ELEMENTS(test_lens); l++) {
+            size_t len = test_lens[l];
+            byte *start = buf + offs;
+            memset(buf, TEST_GUARD, TEST_BUF_SIZE);
+            memset(start, pattern, len);
+            /* the guard right past the run must not be counted */
+            EXPECT(k->match_len(start, len, pattern) == len);
+            for (bad = 0; bad < len; bad++) {
+                start[bad] = pattern ^ 0x40;
+                EXPECT(k->match_len(start, len, pattern) == bad);
+                start[bad] = pattern;
+            }
+        }
+    }
+}
+
+static void
+test_replace(shadow_kernels_t *k, byte *buf, byte *expect, byte pattern,
+             byte not_pattern)
+{
+    size_t offs, l, i;
+    uint seed = 1;
+    for (offs = 0; offs < TEST_MAX_OFFS; offs++) {
+        for (l = 0; l < BUFFER_SIZE_ELEMENTS(test_lens); l++) {
+            size_t len = test_lens[l];
+            byte *start = buf + offs;
+            for (i = 0; i < TEST_BUF_SIZE; i++) {
+                seed = seed * 1103515245 + 12345;
+                buf[i] = (byte) (seed >> 16);
+            }
+            memcpy(expect, buf, TEST_BUF_SIZE);
+            for (i = 0; i < len; i++)
+                expect[offs + i] = test_replace_byte(start[i], pattern, not_pattern);
+            k->replace(start, len, pattern, not_pattern);
+            /* bytes before and after the run are untouched */
+            EXPECT(memcmp(buf, expect, TEST_BUF_SIZE) == 0);
+        }
+    }
+}
+
+static void
+test_kernel_run(byte *buf)
+{
+    umbra_shadow_memory_info_t info;
+    bool check_uninitialized = options.check_uninitialized;
+    byte *shadow = NULL;
+    app_pc base = (app_pc) 0x10000;
+    size_t size = 0x1000;
+
+    options.check_uninitialized = true; /* so not MAP_4B_TO_1B */
+    info.app_base = base;
+    info.app_size = size;
+    info.shadow_base = buf;
+    info.shadow_size = size / SHADOW_GRANULARITY;
+    info.shadow_type = UMBRA_SHADOW_MEMORY_TYPE_NORMAL;
+
+    EXPECT(shadow_kernel_run(&info, base, base + 2*size, &shadow) == size);
+    EXPECT(shadow == buf);
+    /* a run stops at the block end */
+    EXPECT(shadow_kernel_run(&info, base + size - 0x100, base + 2*size, &shadow) ==
+           0x100);
+    EXPECT(shadow == buf + (size - 0x100) / SHADOW_GRANULARITY);
+    /* an unaligned end is left for the per-byte tail */
+    EXPECT(shadow_kernel_run(&info, base + 0x20, base + 0x20 + 0x10f, &shadow) ==
+           0x100);
+    EXPECT(shadow == buf + 0x20 / SHADOW_GRANULARITY);
+    /* too short for a kernel */
+    EXPECT(shadow_kernel_run(&info, base, base + 16*SHADOW_GRANULARITY - 1,
+                             &shadow) == 0);
+    EXPECT(shadow_kernel_run(&info, base + size - 0x30, base + 2*size, &shadow) == 0);
+    EXPECT(shadow_kernel_run(&info, base, base + 16*SHADOW_GRANULARITY, &shadow) ==
+           16*SHADOW_GRANULARITY);
+    /* outside the block */
+    EXPECT(shadow_kernel_run(&info, base + size, base + 2*size, &shadow) == 0);
+    EXPECT(shadow_kernel_run(&info, base - 0x100, base + size, &shadow) == 0);
+    info.shadow_type = UMBRA_SHADOW_MEMORY_TYPE_SHARED;
+    EXPECT(shadow_kernel_run(&info, base, base + size, &shadow) == 0);
+    options.check_uninitialized = check_uninitialized;
+}
+
+void
+shadow_unit_tests(void)
+{
+    static byte buf[TEST_BUF_SIZE];
+    static byte expect[TEST_BUF_SIZE];
+    shadow_kernels_t kernels[3];
+    uint num_kernels = 0, i, j, v;
+
+    kernels[num_kernels].name = "scalar";
+    kernels[num_kernels].match_len = shadow_match_len_scalar;
+    kernels[num_kernels++].replace = shadow_replace_scalar;
+#ifdef X86
+    if (proc_has_feature(FEATURE_SSE2)) {
+        kernels[num_kernels].name = "sse2";
+        kernels[num_kernels].match_len = shadow_match_len_sse2;
+        kernels[num_kernels++].replace = shadow_replace_sse2;
+    }
+    if (proc_has_feature(FEATURE_AVX2) && proc_avx_enabled()) {
+        kernels[num_kernels].name = "avx2";
+        kernels[num_kernels].match_len = shadow_match_len_avx2;
+        kernels[num_kernels++].replace = shadow_replace_avx2;
+    }
+#endif
+    for (i = 0; i < num_kernels; i++) {
+        for (v = 0; v < 4; v++) {
+            /* each 2-bit value repeated, as val_to_dword holds them */
+            byte pattern = (byte) (v * 0x55);
+            test_match_len(&kernels[i], buf, pattern);
+            for (j = 0; j < 4; j++) {
+                test_replace(&kernels[i], buf, expect, pattern, (byte) (j * 0x55));
+            }
+        }
+        dr_printf("shadow %s kernels ok\n", kernels[i].name);
+    }
+    test_kernel_run(buf);
+}
+#endif /* BUILD_UNIT_TESTS */
+
 #endif /* TOOL_DR_MEMORY around whole shadow table */
 
 /***************************************************************************
@@ -1499,9 +1944,11 @@ const byte shadow_word_addr_not_bit[4][256] = {
 #define NUM_MMX_REGS 8
 
 typedef struct _shadow_aux_registers_t {
-    /* i#243: shadow xmm registers */
-    int xmm[NUM_XMM_REGS];
-    int ymmh[NUM_XMM_REGS];
+    /* i#243: shadow xmm and ymm registers.  Each ymm's shadow is contiguous,
+     * with its xmm's shadow in the first dword followed by the shadow for the
+     * top 128 bits, so the fastpath can load a whole ymm's shadow at once.
+     */
+    int ymm[NUM_XMM_REGS][2];
     /* i#1473: shadow mmx registers */
     short mm[NUM_MMX_REGS];
     /* XXX i#471: add floating-point registers here as well */
@@ -1545,7 +1992,11 @@ typedef struct _shadow_registers_t {
     shadow_reg_type_t eflags;
     /* Used for PR 578892.  Should remain a very small integer so byte is fine. */
     byte in_heap_routine;
-    byte padding[IF_X64_ELSE(4,2)];
+    /* Result of the -repstr_range_check up-front check: nonzero means the
+     * current rep string loop's iterations need no checks.
+     */
+    byte repstr_range_ok;
+    byte padding[IF_X64_ELSE(3,1)];
     /* Fourth/sixth TLS slot, which provides indirection to additional
      * shadow memory.
      */
@@ -1608,9 +2059,9 @@ get_shadow_xmm_offs(reg_id_t reg)
 {
 #ifdef X86
     if (reg_is_ymm(reg))
-        return offsetof(shadow_aux_registers_t, ymmh) + sizeof(int)*(reg - DR_REG_YMM0);
+        return offsetof(shadow_aux_registers_t, ymm) + sizeof(int)*2*(reg - DR_REG_YMM0);
     if (reg_is_xmm(reg))
-        return offsetof(shadow_aux_registers_t, xmm) + sizeof(int)*(reg - DR_REG_XMM0);
+        return offsetof(shadow_aux_registers_t, ymm) + sizeof(int)*2*(reg - DR_REG_XMM0);
     else {
         ASSERT(reg_is_mmx(reg), "invalid reg");
         return offsetof(shadow_aux_registers_t, mm) + sizeof(short)*(reg - DR_REG_MM0);
@@ -1646,6 +2097,17 @@ opnd_create_shadow_inheap_slot(void)
           * Core or Core2, and P4 doesn't care that much */
          false, true, false);
 }
+
+/* Opnd to acquire the -repstr_range_check result TLS flag */
+opnd_t
+opnd_create_shadow_repstr_slot(void)
+{
+    ASSERT(options.shadowing, "incorrectly called");
+    return opnd_create_far_base_disp_ex
+        (tls_shadow_seg, REG_NULL, REG_NULL, 1, tls_shadow_base +
+         offsetof(shadow_registers_t, repstr_range_ok), OPSZ_1,
+         false, true, false);
+}
 #endif /* TOOL_DR_MEMORY */
 
 #if defined(TOOL_DR_MEMORY) || defined(WINDOWS)
@@ -1710,6 +2172,7 @@ shadow_registers_thread_init(void *drcontext)
 #endif
     }
     sr->in_heap_routine = 0;
+    sr->repstr_range_ok = 0;
 #endif /* TOOL_DR_MEMORY */
 
     /* store in per-thread data struct so we can access from another thread */
@@ -1775,7 +2238,7 @@ print_shadow_registers(void)
     for (i = 0; i < NUM_XMM_REGS; i++) {
         if (i % 4 == 0)
             LOG(0, "    ");
-        LOG(0, "xmm%d=%08x ", i, sr->aux->xmm[i]);
+        LOG(0, "ymm%d=%08x%08x ", i, sr->aux->ymm[i][1], sr->aux->ymm[i][0]);
         if (i % 4 == 3)
             LOG(0, "\n");
     }
@@ -1797,11 +2260,11 @@ reg_shadow_addr(shadow_registers_t *sr, reg_id_t reg)
             (reg_to_pointer_sized(reg) - DR_REG_START_GPR)*sizeof(shadow_reg_type_t);
     } else {
 #ifdef X86
-        /* Caller must ask for xmm to get low bits (won't all fit in uint) */
+        /* Both xmm and ymm point at the start of the register's shadow */
         if (reg_is_ymm(reg))
-            return (byte *) &sr->aux->ymmh[reg - DR_REG_YMM0];
+            return (byte *) &sr->aux->ymm[reg - DR_REG_YMM0][0];
         if (reg_is_xmm(reg))
-            return (byte *) &sr->aux->xmm[reg - DR_REG_XMM0];
+            return (byte *) &sr->aux->ymm[reg - DR_REG_XMM0][0];
         else {
             ASSERT(reg_is_mmx(reg), "invalid reg");
             return (byte *) &sr->aux->mm[reg - DR_REG_MM0];
@@ -1821,6 +2284,8 @@ get_shadow_register_common(shadow_registers_t *sr, reg_id_t reg)
     opnd_size_t sz = reg_get_size(reg);
     byte *addr = reg_shadow_addr(sr, reg);
     ASSERT(options.shadowing, "incorrectly called");
+    if (reg_is_ymm(reg)) /* the top 128 bits: see get_shadow_register() */
+        return *(uint *)(addr + sizeof(uint));
     if (reg_is_xmm(reg) || reg_is_mmx(reg))
         return *(uint *)addr;
     ASSERT(reg_is_gpr(reg), "internal shadow reg error");
@@ -1870,6 +2335,17 @@ get_thread_shadow_register(void *drcontext, reg_id_t reg)
     return get_shadow_register_common(sr, reg);
 }
 
+uint
+get_shadow_register_byte(reg_id_t reg, uint bytenum)
+{
+    shadow_registers_t *sr = get_shadow_registers();
+    uint *addr = (uint *) reg_shadow_addr(sr, reg);
+    ASSERT(options.shadowing, "incorrectly called");
+    ASSERT(reg_is_xmm(reg) && bytenum < opnd_size_in_bytes(reg_get_size(reg)),
+           "only supported for xmm and ymm regs");
+    return SHADOW_DWORD2BYTE(addr[bytenum / 16], bytenum % 16);
+}
+
 void
 register_shadow_set_byte(reg_id_t reg, uint bytenum, uint val)
 {
@@ -1878,7 +2354,7 @@ register_shadow_set_byte(reg_id_t reg, uint bytenum, uint val)
     byte *addr = reg_shadow_addr(sr, reg);
     ASSERT(options.shadowing, "incorrectly called");
     while (shift > 7) {
-        ASSERT(reg_is_xmm(reg) ||
+        ASSERT((reg_is_xmm(reg) && (reg_is_ymm(reg) || shift < 32)) ||
                (shift < 16 IF_NOT_X64(&& reg_is_mmx(reg))), "shift too big for reg");
         addr++;
         shift -= 8;
@@ -1938,6 +2414,22 @@ register_shadow_set_dqword(reg_id_t reg, uint val)
     *(uint *)addr = val;
 }
 
+#ifdef X86_64
+/* Called from a clean call for vzeroupper and vzeroall, which have no operands */
+void
+register_shadow_zero_ymm(bool upper_only)
+{
+    shadow_registers_t *sr = get_shadow_registers();
+    int i;
+    ASSERT(options.shadowing, "incorrectly called");
+    for (i = 0; i < NUM_XMM_REGS; i++) {
+        sr->aux->ymm[i][1] = SHADOW_DQWORD_DEFINED;
+        if (!upper_only)
+            sr->aux->ymm[i][0] = SHADOW_DQWORD_DEFINED;
+    }
+}
+#endif
+
 uint
 get_shadow_eflags(void)
 {
@@ -1972,6 +2464,15 @@ set_shadow_inheap(uint val)
     sr->in_heap_routine = (byte) val;
 }
 
+void
+set_shadow_repstr_range_ok(bool ok)
+{
+    shadow_registers_t *sr;
+    ASSERT(options.shadowing, "incorrectly called");
+    sr = get_shadow_registers();
+    sr->repstr_range_ok = (byte) ok;
+}
+
 /* assumes val was obtained from get_shadow_register(),
  * but should never have unaddressable anyway
  */
@@ -1985,8 +2486,238 @@ is_shadow_register_defined(uint val)
            "if change bit patterns, change here");
     return (val == SHADOW_DEFINED);
 }
+
+/***************************************************************************
+ * SHADOW RECLAMATION
+ *
+ * Freeing heap memory and unmapping leave behind shadow blocks that hold
+ * nothing but SHADOW_UNADDRESSABLE, the default value.  Umbra re-creates such
+ * a block on its next touch, so a client thread periodically frees them once
+ * enough application memory has gone away to make a pass worthwhile.
+ *
+ * With -share_shadow_blocks the same thread also has Umbra share blocks that
+ * hold a single value, once enough new shadow memory has been committed.
+ * Only uniform blocks are shared, as shadow_set_byte() and others assume a
+ * shared block holds one value throughout.
+ *
+ * A pass runs under reclaim_lock, which a leak scan also holds, as a scan
+ * that fails to suspend all threads goes ahead anyway and must not find
+ * shadow blocks freed beneath it.
+ */
+
+uint shadow_reclaim_passes;
+uint shadow_blocks_reclaimed;
+uint shadow_kb_reclaimed;
+uint shadow_blocks_shared;
+
+/* Pages of application memory unmapped or released since the last pass */
+static volatile int reclaim_pages_released;
+static volatile bool reclaim_exiting;
+static void *reclaim_lock;
+/* Unshared shadow memory after the last sharing pass */
+static size_t reclaim_private_at_share;
+
+void
+shadow_reclaim_note_release(size_t size)
+{
+    if (options.reclaim_shadow_interval == 0)
+        return;
+    atomic_add32_return_sum(&reclaim_pages_released, (int)(size / PAGE_SIZE));
+}
+
+/* Returns the committed shadow memory that is not shared */
+static size_t
+shadow_private_committed(void)
+{
+    umbra_shadow_footprint_t footprint = {sizeof(footprint),};
+    if (umbra_get_shadow_footprint(umbra_map, false/*!scan values*/,
+                                   &footprint) != DRMF_SUCCESS)
+        return 0;
+    return footprint.committed_bytes - footprint.shared_bytes;
+}
+
+void
+shadow_reclaim_pause(void)
+{
+    if (reclaim_lock != NULL)
+        dr_mutex_lock(reclaim_lock);
+}
+
+void
+shadow_reclaim_resume(void)
+{
+    if (reclaim_lock != NULL)
+        dr_mutex_unlock(reclaim_lock);
+}
+
+/* Suspends all other threads and frees redundant shadow blocks, if
+ * free_redundant, and shares uniform ones, if share.  Returns whether
+ * the pass ran.
+ */
+static bool
+shadow_reclaim_redundant_blocks(bool free_redundant, bool share)
+{
+    void **drcontexts = NULL;
+    uint num_threads = 0;
+    uint count = 0, shared = 0;
+    size_t block_size;
+    drmf_status_t res = DRMF_SUCCESS, share_res = DRMF_SUCCESS;
+    if (!dr_suspend_all_other_threads(&drcontexts, &num_threads, NULL)) {
+        /* Another thread is likely suspending the world (e.g., for a leak scan):
+         * we'll try again next period.
+         */
+        LOG(1, "shadow reclamation: failed to suspend all threads\n");
+        if (drcontexts != NULL)
+            dr_resume_all_other_threads(drcontexts, num_threads);
+        return false;
+    }
+    /* We only take the lock with the world suspended, so that a thread blocked
+     * on it in a leak scan cannot keep us from suspending it.  It is held
+     * by a scan that runs without all threads suspended.
+     */
+    if (!dr_mutex_trylock(reclaim_lock)) {
+        LOG(1, "shadow reclamation: leak scan in progress\n");
+        dr_resume_all_other_threads(drcontexts, num_threads);
+        return false;
+    }
+    if (reclaim_exiting) {
+        dr_mutex_unlock(reclaim_lock);
+        dr_resume_all_other_threads(drcontexts, num_threads);
+        return false;
+    }
+    /* Umbra fails rather than waits if a suspended thread holds its map lock */
+    if (free_redundant)
+        res = umbra_clear_redundant_blocks(umbra_map, &count);
+    if (share) {
+        share_res = umbra_share_identical_blocks(umbra_map, true/*uniform only*/,
+                                                 &shared);
+    }
+    dr_mutex_unlock(reclaim_lock);
+    dr_resume_all_other_threads(drcontexts, num_threads);
+    if (share) {
+        reclaim_private_at_share = shadow_private_committed();
+        if (share_res == DRMF_SUCCESS) {
+            shadow_blocks_shared += shared;
+            LOG(1, "shadow sharing: shared %d blocks, %d total\n",
+                shared, shadow_blocks_shared);
+        } else
+            LOG(1, "shadow sharing failed: %d\n", share_res);
+    }
+    if (!free_redundant)
+        return true;
+    if (res != DRMF_SUCCESS) {
+        LOG(1, "shadow reclamation failed: %d\n", res);
+        return res != DRMF_ERROR_ACCESS_DENIED;
+    }
+    if (umbra_get_shadow_block_size(umbra_map, &block_size) != DRMF_SUCCESS)
+        ASSERT(false, "fail to get shadow block size");
+    shadow_reclaim_passes++;
+    shadow_blocks_reclaimed += count;
+    shadow_kb_reclaimed += (uint)(count * (block_size / 1024));
+    LOG(1, "shadow reclamation #%d: freed %d blocks, %d blocks (%dKB) total\n",
+        shadow_reclaim_passes, count, shadow_blocks_reclaimed, shadow_kb_reclaimed);
+    return true;
+}
+
+static void
+shadow_reclaim_thread(void *arg)
+{
+    int threshold = (int)(((uint64)options.reclaim_shadow_threshold * 1024 * 1024) /
+                          PAGE_SIZE);
+    while (true) {
+        int released;
+        bool share = false;
+        dr_sleep(options.reclaim_shadow_interval);
+        if (reclaim_exiting)
+            break;
+        released = reclaim_pages_released;
+        if (options.share_shadow_blocks) {
+            share = (shadow_private_committed() >= reclaim_private_at_share +
+                     (size_t)options.reclaim_shadow_threshold * 1024 * 1024);
+        }
+        if (released < threshold && !share)
+            continue;
+        /* A pass that did not run leaves the count for the next period */
+        if (shadow_reclaim_redundant_blocks(released >= threshold, share) &&
+            released >= threshold)
+            atomic_add32_return_sum(&reclaim_pages_released, -released);
+    }
+}
+
+static void
+shadow_reclaim_init(void)
+{
+    if (options.reclaim_shadow_interval == 0)
+        return;
+    reclaim_lock = dr_mutex_create();
+    if (!dr_create_client_thread(shadow_reclaim_thread, NULL))
+        LOG(1, "failed to create shadow reclamation thread\n");
+}
+
+static void
+shadow_reclaim_exit(void)
+{
+    if (reclaim_lock == NULL)
+        return;
+    reclaim_exiting = true;
+    /* The reclamation thread only holds reclaim_lock while every other thread
+     * is suspended, so it cannot be holding it while we run.  DR has also
+     * terminated it by now (i#297): the flag only matters if we are ever
+     * torn down before process exit.
+     */
+    dr_mutex_destroy(reclaim_lock);
+    reclaim_lock = NULL;
+}
 #endif /* TOOL_DR_MEMORY */
 
+/***************************************************************************
+ * SHADOW FOOTPRINT
+ */
+
+void
+shadow_dump_footprint(file_t f)
+{
+    umbra_shadow_footprint_t footprint = {sizeof(footprint),};
+    umbra_fault_stats_t faults = {sizeof(faults),};
+    size_t other_blocks;
+    uint i;
+    if (umbra_get_shadow_footprint(umbra_map, true/*scan values*/,
+                                   &footprint) != DRMF_SUCCESS) {
+        LOG(1, "failed to get the shadow footprint\n");
+        return;
+    }
+    dr_fprintf(f, "shadow committed: %8uKB, peak: %8uKB, shared: %8uKB\n",
+               (uint)(footprint.committed_bytes / 1024),
+               (uint)(footprint.peak_committed_bytes / 1024),
+               (uint)(footprint.shared_bytes / 1024));
+    other_blocks = 0;
+    for (i = 0; i < BUFFER_SIZE_ELEMENTS(footprint.blocks_by_value); i++)
+        other_blocks += footprint.blocks_by_value[i];
+    other_blocks -= footprint.blocks_by_value[SHADOW_DWORD_UNADDRESSABLE] +
+        footprint.blocks_by_value[SHADOW_DWORD_UNDEFINED] +
+        footprint.blocks_by_value[SHADOW_DWORD_DEFINED] +
+        footprint.blocks_by_value[SHADOW_DWORD_BITLEVEL];
+    dr_fprintf(f, "shadow blocks by value: unaddr: %6u, undef: %6u, def: %6u, "
+               "bitlevel: %6u, mixed: %6u; uniform: %6u\n",
+               (uint)footprint.blocks_by_value[SHADOW_DWORD_UNADDRESSABLE],
+               (uint)footprint.blocks_by_value[SHADOW_DWORD_UNDEFINED],
+               (uint)footprint.blocks_by_value[SHADOW_DWORD_DEFINED],
+               (uint)footprint.blocks_by_value[SHADOW_DWORD_BITLEVEL],
+               (uint)other_blocks, (uint)footprint.uniform_blocks);
+    for (i = 0; i < footprint.num_segments; i++) {
+        dr_fprintf(f, "\tsegment "PFX"-"PFX": committed %8uKB, peak %8uKB\n",
+                   footprint.segments[i].app_base, footprint.segments[i].app_end,
+                   (uint)(footprint.segments[i].committed_bytes / 1024),
+                   (uint)(footprint.segments[i].peak_committed_bytes / 1024));
+    }
+    if (umbra_get_fault_stats(umbra_map, &faults) == DRMF_SUCCESS &&
+        faults.num_faults > 0) {
+        dr_fprintf(f, "shadow faults: %8"UINT64_FORMAT_CODE", blocks created: %8"
+                   UINT64_FORMAT_CODE", prefetched: %8"UINT64_FORMAT_CODE"\n",
+                   faults.num_faults, faults.blocks_created, faults.blocks_prefetched);
+    }
+}
+
 /***************************************************************************/
 
 void
@@ -2007,11 +2738,18 @@ shadow_init(void)
     ASSERT(options.shadowing, "shadowing disabled");
     shadow_registers_init();
     shadow_table_init();
+    shadow_kernels_init();
+#ifdef TOOL_DR_MEMORY
+    shadow_reclaim_init();
+#endif
 }
 
 void
 shadow_exit(void)
 {
+#ifdef TOOL_DR_MEMORY
+    shadow_reclaim_exit();
+#endif
     shadow_registers_exit();
     shadow_table_exit();
 }
@@ -126,6 +126,13 @@ const char *shadow_dqword_name(uint dqword);
 # define SHADOW_GPR_OPSZ OPSZ_1
 #endif
 
+#ifdef TOOL_DR_MEMORY
+extern uint shadow_reclaim_passes;
+extern uint shadow_blocks_reclaimed;
+extern uint shadow_kb_reclaimed;
+extern uint shadow_blocks_shared;
+#endif
+
 #ifdef STATISTICS
 extern uint shadow_block_alloc;
 extern uint shadow_block_free;
@@ -227,6 +234,34 @@ shadow_free_buffer(shadow_buffer_t *shadow_buffer);
 void
 shadow_set_range(app_pc start, app_pc end, uint val);
 
+/* Sets the range [start, end) to SHADOW_UNADDRESSABLE and releases any shadow
+ * memory that is then no longer needed.
+ */
+void
+shadow_release_range(app_pc start, app_pc end);
+
+/* Records that size bytes of application memory were unmapped or released,
+ * counting toward the next reclamation of redundant shadow blocks.
+ */
+void
+shadow_reclaim_note_release(size_t size);
+
+/* Keeps the reclamation of shadow blocks from running until
+ * shadow_reclaim_resume(), for a walk of shadow memory that might not have
+ * suspended all threads.
+ */
+void
+shadow_reclaim_pause(void);
+
+void
+shadow_reclaim_resume(void);
+
+/* Prints the committed and shared shadow memory, the committed blocks by
+ * dominant value, and per-segment high-water marks to f.
+ */
+void
+shadow_dump_footprint(file_t f);
+
 /* Copies the values for each byte in the range [old_start, old_start+size) to
  * [new_start, new_start+size).  The two ranges can overlap.
  */
@@ -264,6 +299,12 @@ shadow_check_range_backward(app_pc start, size_t size, uint expect, app_pc *bad_
 app_pc
 shadow_next_dword(app_pc start, app_pc end, uint expect);
 
+/* Finds the next aligned dword, starting at start and stopping at
+ * end, whose shadow does not equal expect expanded to a dword.
+ */
+app_pc
+shadow_next_non_matching_dword(app_pc start, app_pc end, uint expect);
+
 /* Finds the previous aligned dword, starting at start and stopping at
  * end (end < start), whose shadow equals expect expanded to a dword.
  */
@@ -319,6 +360,9 @@ opnd_create_shadow_eflags_slot(void);
 opnd_t
 opnd_create_shadow_inheap_slot(void);
 
+opnd_t
+opnd_create_shadow_repstr_slot(void);
+
 /* Note that any SHADOW_UNADDRESSABLE bit pairs simply mean it's
  * a sub-register.
  * For ymm registers, returns only the shadow for the high 128 bits --
@@ -331,6 +375,12 @@ get_shadow_register(reg_id_t reg);
 uint
 get_thread_shadow_register(void *drcontext, reg_id_t reg);
 
+/* Returns the shadow value of byte bytenum of an xmm or ymm register.
+ * Unlike get_shadow_register(), this covers all 32 bytes of a ymm register.
+ */
+uint
+get_shadow_register_byte(reg_id_t reg, uint bytenum);
+
 void
 register_shadow_set_byte(reg_id_t reg, uint bytenum, uint val);
 
@@ -351,6 +401,14 @@ register_shadow_set_ptrsz(reg_id_t reg, uint val);
 void
 register_shadow_set_dqword(reg_id_t reg, uint val);
 
+#ifdef X86_64
+/* Marks the top half of every ymm register as defined, and if !upper_only
+ * the bottom half as well.
+ */
+void
+register_shadow_zero_ymm(bool upper_only);
+#endif
+
 uint
 get_shadow_eflags(void);
 
@@ -363,7 +421,16 @@ get_shadow_inheap(void);
 void
 set_shadow_inheap(uint val);
 
+/* Sets the flag tested by -repstr_range_check's per-iteration guard */
+void
+set_shadow_repstr_range_ok(bool ok);
+
 bool
 is_shadow_register_defined(uint val);
 
+#if defined(TOOL_DR_MEMORY) && defined(BUILD_UNIT_TESTS)
+void
+shadow_unit_tests(void);
+#endif
+
 #endif /* _SHADOW_H_ */
@@ -47,7 +47,15 @@
 #endif
 #include "pattern.h"
 #include <stddef.h>
+#include <string.h> /* for memset */
 #include "asm_utils.h"
+#ifdef X86
+# ifdef WINDOWS
+#  include <intrin.h> /* for __rdtsc */
+# else
+#  include <x86intrin.h> /* for __rdtsc */
+# endif
+#endif
 
 #ifdef STATISTICS
 /* per-opcode counts */
@@ -119,6 +127,10 @@ uint xl8_not_shared_offs;
 uint xl8_not_shared_slowpaths;
 uint xl8_shared_slowpath_instrs;
 uint xl8_shared_slowpath_count;
+uint slowpath_demotions;
+uint overlap_checks_elided;
+uint repstr_ranges_checked;
+uint repstr_ranges_ok;
 uint slowpath_unaligned;
 uint slowpath_8_at_border;
 uint num_bbs;
@@ -172,6 +184,189 @@ byte *shared_slowpath_entry;
 /* Lock for updating gencode later */
 static void *gencode_lock;
 
+#ifdef TOOL_DR_MEMORY
+/***************************************************************************
+ * SLOWPATH PROFILING
+ */
+
+/* -slowpath_profile: per-app-pc counts of slowpath entries and of the time
+ * spent in handle_mem_ref_internal(), to find which instructions the fastpath
+ * is missing on a given workload.  The tables are only touched from the
+ * slowpath, which already decodes and does a clean call, so one lock per
+ * entry is not a noticeable addition.
+ */
+#define SLOWPATH_PROFILE_HASH_BITS 12
+
+typedef struct _slowpath_site_t {
+    app_pc pc;
+    uint opcode; /* OP_INVALID until the site is entered from the slowpath */
+    uint64 entries;
+    uint64 shared_entries;
+    uint64 memref_calls;
+    uint64 memref_ticks;
+} slowpath_site_t;
+
+static bool slowpath_profile_enabled;
+static hashtable_t slowpath_profile_table;
+
+#ifdef X86
+# define PROFILE_TICK_UNITS "cycles"
+#else
+# define PROFILE_TICK_UNITS "us"
+#endif
+
+static inline uint64
+profile_timestamp(void)
+{
+#ifdef X86
+    return __rdtsc();
+#else
+    return dr_get_microseconds();
+#endif
+}
+
+static void
+slowpath_profile_free_site(void *payload)
+{
+    global_free(payload, sizeof(slowpath_site_t), HEAPSTAT_MISC);
+}
+
+static void
+slowpath_profile_init(void)
+{
+    if (options.slowpath_profile == 0)
+        return;
+    hashtable_init_ex(&slowpath_profile_table, SLOWPATH_PROFILE_HASH_BITS, HASH_INTPTR,
+                      false/*!strdup*/, false/*!synch*/, slowpath_profile_free_site,
+                      NULL, NULL);
+    slowpath_profile_enabled = true;
+}
+
+static void
+slowpath_profile_exit(void)
+{
+    if (!slowpath_profile_enabled)
+        return;
+    slowpath_profile_enabled = false;
+    hashtable_delete_with_stats(&slowpath_profile_table, "slowpath_profile");
+}
+
+/* Returns the site for pc with the table locked: the caller must unlock it.
+ * decode_pc may be NULL if the opcode is not known yet.
+ */
+static slowpath_site_t *
+slowpath_profile_site(void *drcontext, app_pc pc, app_pc decode_pc)
+{
+    slowpath_site_t *site;
+    hashtable_lock(&slowpath_profile_table);
+    site = (slowpath_site_t *) hashtable_lookup(&slowpath_profile_table, pc);
+    if (site == NULL) {
+        site = (slowpath_site_t *) global_alloc(sizeof(*site), HEAPSTAT_MISC);
+        memset(site, 0, sizeof(*site));
+        site->pc = pc;
+        site->opcode = OP_INVALID;
+        hashtable_add(&slowpath_profile_table, pc, site);
+    }
+    /* We only decode once per site */
+    if (site->opcode == OP_INVALID && decode_pc != NULL) {
+        instr_t inst;
+        instr_init(drcontext, &inst);
+        if (decode_opcode(drcontext, decode_pc, &inst) != NULL)
+            site->opcode = instr_get_opcode(&inst);
+        instr_free(drcontext, &inst);
+    }
+    return site;
+}
+
+static void
+slowpath_profile_entry(void *drcontext, app_pc pc, app_pc decode_pc, bool shared)
+{
+    slowpath_site_t *site = slowpath_profile_site(drcontext, pc, decode_pc);
+    site->entries++;
+    if (shared)
+        site->shared_entries++;
+    hashtable_unlock(&slowpath_profile_table);
+}
+
+static void
+slowpath_profile_memref(app_loc_t *loc, uint64 ticks)
+{
+    slowpath_site_t *site;
+    /* System call parameters and the like are not attributed */
+    if (loc->type != APP_LOC_PC || !loc->u.addr.valid)
+        return;
+    site = slowpath_profile_site(dr_get_current_drcontext(), loc->u.addr.pc, NULL);
+    site->memref_calls++;
+    site->memref_ticks += ticks;
+    hashtable_unlock(&slowpath_profile_table);
+}
+
+static inline bool
+slowpath_site_hotter(slowpath_site_t *a, slowpath_site_t *b)
+{
+    return (a->entries > b->entries ||
+            (a->entries == b->entries && a->memref_ticks > b->memref_ticks));
+}
+
+void
+slowpath_profile_report(file_t f)
+{
+    slowpath_site_t **top;
+    uint num_top = 0, num_sites = 0, i, j;
+    uint64 total_entries = 0, total_shared = 0, total_calls = 0, total_ticks = 0;
+    if (!slowpath_profile_enabled)
+        return;
+    top = (slowpath_site_t **)
+        global_alloc(options.slowpath_profile * sizeof(*top), HEAPSTAT_MISC);
+    hashtable_lock(&slowpath_profile_table);
+    for (i = 0; i < HASHTABLE_SIZE(slowpath_profile_table.table_bits); i++) {
+        hash_entry_t *he;
+        for (he = slowpath_profile_table.table[i]; he != NULL; he = he->next) {
+            slowpath_site_t *site = (slowpath_site_t *) he->payload;
+            num_sites++;
+            total_entries += site->entries;
+            total_shared += site->shared_entries;
+            total_calls += site->memref_calls;
+            total_ticks += site->memref_ticks;
+            /* Insertion into the hottest-first top array */
+            if (num_top < options.slowpath_profile)
+                num_top++;
+            else if (!slowpath_site_hotter(site, top[num_top - 1]))
+                continue;
+            for (j = num_top - 1; j > 0 && slowpath_site_hotter(site, top[j - 1]); j--)
+                top[j] = top[j - 1];
+            top[j] = site;
+        }
+    }
+    dr_fprintf(f, "\nSlowpath profile: %u sites, %"UINT64_FORMAT_CODE" entries "
+               "(%"UINT64_FORMAT_CODE" shared), %"UINT64_FORMAT_CODE" memrefs "
+               "taking %"UINT64_FORMAT_CODE" "PROFILE_TICK_UNITS"\n",
+               num_sites, total_entries, total_shared, total_calls, total_ticks);
+    dr_fprintf(f, "%12s %12s %12s %14s %-12s %-18s %s\n", "entries", "shared",
+               "memrefs", PROFILE_TICK_UNITS, "opcode", "pc", "module");
+    for (i = 0; i < num_top; i++) {
+        slowpath_site_t *site = top[i];
+        module_data_t *data = dr_lookup_module(site->pc);
+        const char *modname = NULL;
+        if (data != NULL)
+            modname = dr_module_preferred_name(data);
+        dr_fprintf(f, "%12"UINT64_FORMAT_CODE" %12"UINT64_FORMAT_CODE
+                   " %12"UINT64_FORMAT_CODE" %14"UINT64_FORMAT_CODE" %-12s "PFX,
+                   site->entries, site->shared_entries, site->memref_calls,
+                   site->memref_ticks, site->opcode == OP_INVALID ? "<unknown>" :
+                   decode_opcode_name(site->opcode), site->pc);
+        if (data != NULL) {
+            dr_fprintf(f, " %s+"PIFX"\n", modname == NULL ? "<noname>" : modname,
+                       site->pc - data->start);
+            dr_free_module_data(data);
+        } else
+            dr_fprintf(f, " <not in a module>\n");
+    }
+    hashtable_unlock(&slowpath_profile_table);
+    global_free(top, options.slowpath_profile * sizeof(*top), HEAPSTAT_MISC);
+}
+#endif /* TOOL_DR_MEMORY */
+
 /***************************************************************************
  * ISA
  */
@@ -368,8 +563,12 @@ integrate_register_shadow(shadow_combine_t *comb INOUT, int opnum,
         sz = opnd_size_in_bytes(reg_get_size(reg));
     } else
         sz = opnd_size_in_bytes(opnd_get_size(comb->opnd));
-    for (i = 0; i < sz; i++)
-        map_src_to_dst(comb, opnum, i, SHADOW_DWORD2BYTE(shadow, i));
+    for (i = 0; i < sz; i++) {
+        /* i#243: shadow holds only the top half of a ymm */
+        map_src_to_dst(comb, opnum, i, IF_X86(reg_is_ymm(reg) ?
+                                              get_shadow_register_byte(reg, i) :)
+                       SHADOW_DWORD2BYTE(shadow, i));
+    }
 }
 
 /* Assigns the array of source shadow_vals to the destination register shadow */
@@ -495,6 +694,7 @@ slow_path_without_uninitialized(void *drcontext, dr_mcontext_t *mc, instr_t *ins
 
     /* call this last after freeing inst in case it does a synchronous flush */
     slow_path_xl8_sharing(loc, instr_sz, memop, mc);
+    slow_path_adaptive(loc);
 
     return true;
 }
@@ -521,8 +721,9 @@ slow_path_without_uninitialized(void *drcontext, dr_mcontext_t *mc, instr_t *ins
  * one byte at a time, so we can make the slowpath more closely match the
  * fastpath code, and thus make it easier to transition opcodes to the fastpath?
  */
-bool
-slow_path_with_mc(void *drcontext, app_pc pc, app_pc decode_pc, dr_mcontext_t *mc)
+static bool
+slow_path_internal(void *drcontext, app_pc pc, app_pc decode_pc, dr_mcontext_t *mc,
+                   bool shared)
 {
     instr_t inst;
     int opc;
@@ -554,6 +755,11 @@ slow_path_with_mc(void *drcontext, app_pc pc, app_pc decode_pc, dr_mcontext_t *m
     }
 #endif
 
+#ifdef TOOL_DR_MEMORY
+    if (slowpath_profile_enabled)
+        slowpath_profile_entry(drcontext, pc, decode_pc, shared);
+#endif
+
     pc_to_loc(&loc, pc);
 
     /* Locally-spilled and whole-bb-spilled (PR 489221) registers have
@@ -895,6 +1101,7 @@ slow_path_with_mc(void *drcontext, app_pc pc, app_pc decode_pc, dr_mcontext_t *m
 
     /* call this last after freeing inst in case it does a synchronous flush */
     slow_path_xl8_sharing(&loc, instr_sz, memop, mc);
+    slow_path_adaptive(&loc);
 
     DOLOG(5, { /* this pollutes the logfile, so it's a pain to have at 4 or lower */
         if (pc == decode_pc/*else retpc not in tls3*/) {
@@ -939,9 +1146,14 @@ slow_path_with_mc(void *drcontext, app_pc pc, app_pc decode_pc, dr_mcontext_t *m
 #endif /* !TOOL_DR_HEAPSTAT */
 }
 
-/* called from code cache */
-static bool
-slow_path(app_pc pc, app_pc decode_pc)
+bool
+slow_path_with_mc(void *drcontext, app_pc pc, app_pc decode_pc, dr_mcontext_t *mc)
+{
+    return slow_path_internal(drcontext, pc, decode_pc, mc, false/*!shared*/);
+}
+
+static inline bool
+slow_path_from_cache(app_pc pc, app_pc decode_pc, bool shared)
 {
     void *drcontext = dr_get_current_drcontext();
     dr_mcontext_t mc; /* do not init whole thing: memset is expensive */
@@ -949,7 +1161,7 @@ slow_path(app_pc pc, app_pc decode_pc)
     mc.size = sizeof(mc);
     mc.flags = DR_MC_CONTROL|DR_MC_INTEGER; /* don't need xmm */
     dr_get_mcontext(drcontext, &mc);
-    res = slow_path_with_mc(drcontext, pc, decode_pc, &mc);
+    res = slow_path_internal(drcontext, pc, decode_pc, &mc, shared);
 #ifdef TOOL_DR_MEMORY
     DODEBUG({
         cls_drmem_t *cpt = (cls_drmem_t *) drmgr_get_cls_field(drcontext, cls_idx_drmem);
@@ -962,6 +1174,20 @@ slow_path(app_pc pc, app_pc decode_pc)
     return res;
 }
 
+/* called from code cache */
+static bool
+slow_path(app_pc pc, app_pc decode_pc)
+{
+    return slow_path_from_cache(pc, decode_pc, false/*!shared*/);
+}
+
+/* called from the shared slowpath in gencode, for -slowpath_profile */
+static bool
+shared_slow_path(app_pc pc, app_pc decode_pc)
+{
+    return slow_path_from_cache(pc, decode_pc, true/*shared*/);
+}
+
 /* Returns whether a single pc can be used for app reporting and
  * decoding of the app instr (or, whether a separate decode pc can be
  * used b/c there's fixup code for the pc to report in the slowpath).
@@ -1246,7 +1472,7 @@ generate_shared_slowpath(void *drcontext, instrlist_t *ilist, byte *pc)
      */
     shared_slowpath_entry = pc;
     dr_insert_clean_call(drcontext, ilist, NULL,
-                         (void *) slow_path, false, 2,
+                         (void *) shared_slow_path, false, 2,
                          spill_slot_opnd(drcontext, SPILL_SLOT_SLOW_PARAM),
                          spill_slot_opnd(drcontext, SPILL_SLOT_SLOW_PARAM));
     PRE(ilist, NULL,
@@ -1328,6 +1554,9 @@ gencode_init(void)
 #endif
 
     gencode_lock = dr_mutex_create();
+#ifdef TOOL_DR_MEMORY
+    slowpath_profile_init();
+#endif
 
 #ifdef STATISTICS
     next_stats_dump = options.stats_dump_interval;
@@ -1378,6 +1607,7 @@ gencode_exit(void)
 {
     dr_mutex_destroy(gencode_lock);
 #ifdef TOOL_DR_MEMORY
+    slowpath_profile_exit();
     nonheap_free(shared_slowpath_region, SHARED_SLOWPATH_SIZE,
                  HEAPSTAT_GENCODE);
 #endif
@@ -1443,6 +1673,7 @@ handle_mem_ref_internal(uint flags, app_loc_t *loc, app_pc addr, size_t sz,
     app_pc stack_base = NULL;
     size_t stack_size = 0;
     bool handled_push_addr = false;
+    uint64 profile_start = slowpath_profile_enabled ? profile_timestamp() : 0;
     bool is_write =
         /* ADDR is assumed to be for writes only (i#517) */
         TESTANY(MEMREF_WRITE | MEMREF_CHECK_ADDRESSABLE, flags) &&
@@ -1743,6 +1974,8 @@ handle_mem_ref_internal(uint flags, app_loc_t *loc, app_pc addr, size_t sz,
                  is_write ? DR_MEMPROT_WRITE : DR_MEMPROT_READ, addr, addr + sz, mc);
         }
     }
+    if (slowpath_profile_enabled)
+        slowpath_profile_memref(loc, profile_timestamp() - profile_start);
     return allgood;
 }
 
@@ -1826,17 +2059,46 @@ check_mem_opnd_nouninit(uint opc, uint flags, app_loc_t *loc, opnd_t opnd, uint
     return check_mem_opnd(opc, flags, loc, opnd, sz, mc, 0, NULL);
 }
 
+#ifdef TOOL_DR_MEMORY
+/* Returns the shadow of the bottom sz bytes of reg, suitable only for
+ * checking definedness.
+ */
+static uint
+get_shadow_register_for_check(reg_id_t reg, size_t sz)
+{
+    uint shadow;
+    if (reg == REG_EFLAGS)
+        return get_shadow_eflags();
+# ifdef X86
+    if (reg_is_ymm(reg)) {
+        /* i#243: get_shadow_register() returns just the top half of a ymm */
+        reg_id_t xmm = reg - DR_REG_YMM0 + DR_REG_XMM0;
+        if (sz > 16) {
+            uint high = get_shadow_register(reg);
+            if (sz < 32)
+                high &= (1 << ((sz - 16)*2)) - 1;
+            /* or-ing the halves is enough to tell whether all are defined */
+            return high | get_shadow_register(xmm);
+        }
+        reg = xmm;
+    }
+# endif
+    shadow = get_shadow_register(reg);
+    if (sz < opnd_size_in_bytes(reg_get_size(reg))) {
+        /* only check sub-reg piece */
+        shadow &= (1 << (sz*2)) - 1;
+    }
+    return shadow;
+}
+#endif
+
 bool
 check_register_defined(void *drcontext, reg_id_t reg, app_loc_t *loc, size_t sz,
                        dr_mcontext_t *mc, instr_t *inst)
 {
 #ifdef TOOL_DR_MEMORY
-    uint shadow = (reg == REG_EFLAGS) ? get_shadow_eflags() : get_shadow_register(reg);
+    uint shadow = get_shadow_register_for_check(reg, sz);
     ASSERT(CHECK_UNINITS(), "shouldn't be called");
-    if (reg != REG_EFLAGS && sz < opnd_size_in_bytes(reg_get_size(reg))) {
-        /* only check sub-reg piece */
-        shadow &= (1 << (sz*2)) - 1;
-    }
     if (!is_shadow_register_defined(shadow)) {
         if (!check_undefined_reg_exceptions(drcontext, loc, reg, mc, inst)) {
             /* FIXME: report which bytes within reg via container params? */
@@ -1851,7 +2113,7 @@ check_register_defined(void *drcontext, reg_id_t reg, app_loc_t *loc, size_t sz,
         }
     }
     /* check again, since exception may have marked as defined */
-    shadow = (reg == REG_EFLAGS) ? get_shadow_eflags() : get_shadow_register(reg);
+    shadow = get_shadow_register_for_check(reg, sz);
     return is_shadow_register_defined(shadow);
 #else
     return true;
@@ -1924,6 +2186,8 @@ main(int argc, char *argv[])
 
     slowpath_unit_tests_arch(drcontext);
 
+    shadow_unit_tests();
+
     /* add more tests here */
 
     dr_printf("success\n");
@@ -61,6 +61,12 @@ generate_shared_slowpath(void *drcontext, instrlist_t *ilist, byte *pc);
 void
 update_stack_swap_threshold(void *drcontext, int new_threshold);
 
+#ifdef TOOL_DR_MEMORY
+/* Prints the -slowpath_profile hottest sites to f */
+void
+slowpath_profile_report(file_t f);
+#endif
+
 /* flags passed in to check_mem_opnd() and handle_mem_ref() */
 enum {
     MEMREF_WRITE              = 0x001,
@@ -148,6 +154,10 @@ extern uint xl8_not_shared_offs;
 extern uint xl8_not_shared_slowpaths;
 extern uint xl8_shared_slowpath_instrs;
 extern uint xl8_shared_slowpath_count;
+extern uint slowpath_demotions;
+extern uint overlap_checks_elided;
+extern uint repstr_ranges_checked;
+extern uint repstr_ranges_ok;
 extern uint slowpath_unaligned;
 extern uint slowpath_8_at_border;
 extern uint alloc_stack_count;
@@ -170,6 +180,9 @@ extern hashtable_t bb_table;
 /* PR 493257: share shadow translation across multiple instrs */
 extern hashtable_t xl8_sharing_table;
 
+/* -adaptive_slowpath: per-instr slowpath counts and demotions */
+extern hashtable_t slowpath_hits_table;
+
 /* alloca handling in fastpath (i#91) */
 extern hashtable_t ignore_unaddr_table;
 
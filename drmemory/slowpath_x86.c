@@ -277,8 +277,11 @@ reg_is_shadowed(int opc, reg_id_t reg)
 {
     /* i#471: we don't yet shadow floating-point regs */
     return (reg_is_gpr(reg) ||
-            /* i#243: we don't yet shadow ymm regs */
-            (reg_is_xmm(reg) && !reg_is_ymm(reg)) ||
+            /* i#243: we shadow ymm regs only on x64, where the fastpath can
+             * hold a whole ymm's shadow in one GPR.
+             * XXX: AVX-512 zmm and opmask regs are not shadowed.
+             */
+            (reg_is_xmm(reg) && IF_X64_ELSE(true, !reg_is_ymm(reg))) ||
             /* i#1473: propagate mmx */
             reg_is_mmx(reg));
 }
@@ -1049,6 +1052,12 @@ map_src_to_dst(shadow_combine_t *comb INOUT, int opnum, int src_bytenum, uint sh
     int opc = comb->opcode;
     uint opsz = comb->opsz;
     uint shift = 0;
+    /* i#243: 256-bit unpck* and most other shuffles operate on each 128-bit
+     * lane separately.
+     */
+    uint lanesz = (opsz > 16) ? 16 : opsz;
+    uint lane = (lanesz == 0) ? 0 : src_bytenum - src_bytenum % lanesz;
+    uint inlane = src_bytenum - lane;
     if (opc_is_gpr_shift(opc)) {
         if (map_src_to_dst_shift(comb, comb->opcode, opnum, src_bytenum, 0,
                                  comb->opsz, shadow)) {
@@ -1104,13 +1113,13 @@ map_src_to_dst(shadow_combine_t *comb INOUT, int opnum, int src_bytenum, uint sh
         /* Dst is opnum==1 and its 0-n/2 => 0, 2, 4, 6, ....
          * Src is opnum==0 and its 0-n/2 => 1, 3, 5, 7, ...
          */
-        if (src_bytenum < opsz/2)
-            accum_shadow(&comb->dst[src_bytenum*2 + (1 - opnum)], shadow);
+        if (inlane < lanesz/2)
+            accum_shadow(&comb->dst[lane + inlane*2 + (1 - opnum)], shadow);
         break;
     case OP_punpcklwd:
     case OP_vpunpcklwd:
-        if (src_bytenum < opsz/2) {
-            accum_shadow(&comb->dst[(src_bytenum/2) *4 + (src_bytenum % 2) +
+        if (inlane < lanesz/2) {
+            accum_shadow(&comb->dst[lane + (inlane/2) *4 + (inlane % 2) +
                                     2*(1 - opnum)], shadow);
         }
         break;
@@ -1118,8 +1127,8 @@ map_src_to_dst(shadow_combine_t *comb INOUT, int opnum, int src_bytenum, uint sh
     case OP_vpunpckldq:
     case OP_unpcklps:
     case OP_vunpcklps:
-        if (src_bytenum < opsz/2) {
-            accum_shadow(&comb->dst[(src_bytenum/4) *8 + (src_bytenum % 4) +
+        if (inlane < lanesz/2) {
+            accum_shadow(&comb->dst[lane + (inlane/4) *8 + (inlane % 4) +
                                     4*(1 - opnum)], shadow);
         }
         break;
@@ -1127,21 +1136,21 @@ map_src_to_dst(shadow_combine_t *comb INOUT, int opnum, int src_bytenum, uint sh
     case OP_vpunpcklqdq:
     case OP_unpcklpd:
     case OP_vunpcklpd:
-        if (src_bytenum < opsz/2) {
-            accum_shadow(&comb->dst[(src_bytenum/8) *16 + (src_bytenum % 8) +
+        if (inlane < lanesz/2) {
+            accum_shadow(&comb->dst[lane + (inlane/8) *16 + (inlane % 8) +
                                     8*(1 - opnum)], shadow);
         }
         break;
     case OP_punpckhbw:
     case OP_vpunpckhbw:
-        if (src_bytenum >= opsz/2) {
-            accum_shadow(&comb->dst[(src_bytenum-opsz/2)*2 + (1 - opnum)], shadow);
+        if (inlane >= lanesz/2) {
+            accum_shadow(&comb->dst[lane + (inlane-lanesz/2)*2 + (1 - opnum)], shadow);
         }
         break;
     case OP_punpckhwd:
     case OP_vpunpckhwd:
-        if (src_bytenum >= opsz/2) {
-            accum_shadow(&comb->dst[((src_bytenum-opsz/2)/2) *4 + (src_bytenum % 2) +
+        if (inlane >= lanesz/2) {
+            accum_shadow(&comb->dst[lane + ((inlane-lanesz/2)/2) *4 + (inlane % 2) +
                                     2*(1 - opnum)], shadow);
         }
         break;
@@ -1149,8 +1158,8 @@ map_src_to_dst(shadow_combine_t *comb INOUT, int opnum, int src_bytenum, uint sh
     case OP_vpunpckhdq:
     case OP_unpckhps:
     case OP_vunpckhps:
-        if (src_bytenum >= opsz/2) {
-            accum_shadow(&comb->dst[((src_bytenum-opsz/2)/4) *8 + (src_bytenum % 4) +
+        if (inlane >= lanesz/2) {
+            accum_shadow(&comb->dst[lane + ((inlane-lanesz/2)/4) *8 + (inlane % 4) +
                                     4*(1 - opnum)], shadow);
         }
         break;
@@ -1158,8 +1167,8 @@ map_src_to_dst(shadow_combine_t *comb INOUT, int opnum, int src_bytenum, uint sh
     case OP_vpunpckhqdq:
     case OP_unpckhpd:
     case OP_vunpckhpd:
-        if (src_bytenum >= opsz/2) {
-            accum_shadow(&comb->dst[((src_bytenum-opsz/2)/8) *16 + (src_bytenum % 8) +
+        if (inlane >= lanesz/2) {
+            accum_shadow(&comb->dst[lane + ((inlane-lanesz/2)/8) *16 + (inlane % 8) +
                                     8*(1 - opnum)], shadow);
         }
         break;
@@ -1211,12 +1220,116 @@ map_src_to_dst(shadow_combine_t *comb INOUT, int opnum, int src_bytenum, uint sh
         }
         break;
     }
-    case OP_pshufw:
     case OP_pshufd:
+    case OP_vpshufd:
+    case OP_vpermilps:
+    case OP_vpermilpd:
+    case OP_vpermq:
+    case OP_vpermpd:
+    case OP_vperm2f128:
+    case OP_vperm2i128:
+    case OP_vextractf128:
+    case OP_vextracti128:
+    case OP_vinsertf128:
+    case OP_vinserti128: {
+        /* i#243: shuffles controlled by an immed */
+        ptr_uint_t immed = 0;
+        uint immed_idx = (opc == OP_vperm2f128 || opc == OP_vperm2i128 ||
+                          opc == OP_vinsertf128 || opc == OP_vinserti128) ? 2 : 1;
+        uint i;
+        ASSERT(comb->inst != NULL, "need inst for immed shuffle");
+        if (immed_idx >= (uint) instr_num_srcs(comb->inst) ||
+            !opnd_is_immed_int(instr_get_src(comb->inst, immed_idx))) {
+            /* FIXME i#1484: vpermil* with the selectors in a register: bailing */
+            accum_shadow(&comb->dst[src_bytenum], SHADOW_DEFINED);
+            break;
+        }
+        immed = (ptr_uint_t) opnd_get_immed_int(instr_get_src(comb->inst, immed_idx));
+        switch (opc) {
+        case OP_pshufd:
+        case OP_vpshufd:
+        case OP_vpermilps:
+            /* each dword of a lane selects a dword from the same lane */
+            for (i = 0; i < 4; i++) {
+                if (((immed >> (2*i)) & 0x3) == inlane/4)
+                    accum_shadow(&comb->dst[lane + i*4 + inlane % 4], shadow);
+            }
+            break;
+        case OP_vpermilpd:
+            /* each qword selects a qword from the same lane, 1 bit per qword */
+            for (i = 0; i < 2; i++) {
+                if (((immed >> (lane/8 + i)) & 0x1) == inlane/8)
+                    accum_shadow(&comb->dst[lane + i*8 + inlane % 8], shadow);
+            }
+            break;
+        case OP_vpermq:
+        case OP_vpermpd:
+            /* these cross lanes */
+            for (i = 0; i < 4; i++) {
+                if (((immed >> (2*i)) & 0x3) == (uint)src_bytenum/8)
+                    accum_shadow(&comb->dst[i*8 + src_bytenum % 8], shadow);
+            }
+            break;
+        case OP_vperm2f128:
+        case OP_vperm2i128: {
+            /* 1st src's lanes are 0 and 1, 2nd src's are 2 and 3.  A dst
+             * lane with bit 3 set is zeroed, which leaves it defined.
+             */
+            uint src_lane = opnum*2 + src_bytenum/16;
+            for (i = 0; i < 2; i++) {
+                uint control = (immed >> (4*i)) & 0xf;
+                if (!TEST(0x8, control) && (control & 0x3) == src_lane)
+                    accum_shadow(&comb->dst[i*16 + src_bytenum % 16], shadow);
+            }
+            break;
+        }
+        case OP_vextractf128:
+        case OP_vextracti128:
+            if ((uint)src_bytenum/16 == (immed & 0x1))
+                accum_shadow(&comb->dst[src_bytenum % 16], shadow);
+            break;
+        case OP_vinsertf128:
+        case OP_vinserti128:
+            if (opnum == 0) {
+                if ((uint)src_bytenum/16 != (immed & 0x1))
+                    accum_shadow(&comb->dst[src_bytenum], shadow);
+            } else
+                accum_shadow(&comb->dst[(immed & 0x1)*16 + src_bytenum], shadow);
+            break;
+        }
+        break;
+    }
+    case OP_vbroadcastss:
+    case OP_vbroadcastsd:
+    case OP_vbroadcastf128:
+    case OP_vbroadcasti128:
+    case OP_vpbroadcastb:
+    case OP_vpbroadcastw:
+    case OP_vpbroadcastd:
+    case OP_vpbroadcastq: {
+        /* i#243: replicate the element's shadow across the dst */
+        uint elemsz, dstsz, i;
+        ASSERT(comb->inst != NULL, "need inst for broadcast");
+        switch (opc) {
+        case OP_vpbroadcastb: elemsz = 1; break;
+        case OP_vpbroadcastw: elemsz = 2; break;
+        case OP_vbroadcastss:
+        case OP_vpbroadcastd: elemsz = 4; break;
+        case OP_vbroadcastsd:
+        case OP_vpbroadcastq: elemsz = 8; break;
+        default: elemsz = 16; break;
+        }
+        dstsz = opnd_size_in_bytes(opnd_get_size(instr_get_dst(comb->inst, 0)));
+        if ((uint)src_bytenum < elemsz) {
+            for (i = src_bytenum; i < dstsz; i += elemsz)
+                accum_shadow(&comb->dst[i], shadow);
+        }
+        break;
+    }
+    case OP_pshufw:
     case OP_pshufhw:
     case OP_pshuflw:
     case OP_vpshufhw:
-    case OP_vpshufd:
     case OP_vpshuflw:
         /* FIXME i#1484: fill in proper shuffling */
         accum_shadow(&comb->dst[src_bytenum], SHADOW_DEFINED);
@@ -1331,6 +1444,8 @@ map_src_to_dst(shadow_combine_t *comb INOUT, int opnum, int src_bytenum, uint sh
     case OP_vpsrlvq:
     case OP_vpsllvd:
     case OP_vpsllvq:
+    case OP_vpermd:
+    case OP_vpermps:
         /* FIXME i#1484: these are complex, bailing for now */
         accum_shadow(&comb->dst[src_bytenum], SHADOW_DEFINED);
         break;
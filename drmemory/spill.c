@@ -1726,6 +1726,7 @@ fastpath_bottom_of_bb(void *drcontext, void *tag, instrlist_t *bb,
         save->check_ignore_unaddr = check_ignore_unaddr;
         /* i#826: share_xl8_max_diff can change, save it. */
         save->share_xl8_max_diff = bi->share_xl8_max_diff;
+        save->demotion_epoch = bi->demotion_epoch;
         /* store style of instru rather than ask DR to store xl8.
          * XXX DRi#772: could add flush callback and avoid this save
          */
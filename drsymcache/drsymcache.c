@@ -144,6 +144,7 @@ typedef struct _offset_list_t {
 
 static char symcache_dir[MAXIMUM_PATH];
 static size_t op_modsize_cache_threshold;
+static bool op_share_across_fork;
 
 static void
 symcache_module_load(void *drcontext, const module_data_t *mod, bool loaded);
@@ -154,6 +155,11 @@ symcache_module_load_save(void *drcontext, const module_data_t *mod, bool loaded
 static void
 symcache_module_unload(void *drcontext, const module_data_t *mod);
 
+#ifdef UNIX
+static void
+symcache_fork_init(void *drcontext);
+#endif
+
 static bool
 module_has_symbols(const module_data_t *mod)
 {
@@ -624,6 +630,9 @@ drsymcache_init(client_id_t client_id,
     drmgr_register_module_load_event_ex(symcache_module_load, &pri_mod_load_cache);
     drmgr_register_module_unload_event_ex(symcache_module_unload, &pri_mod_unload_cache);
     drmgr_register_module_load_event_ex(symcache_module_load_save, &pri_mod_save_cache);
+#ifdef UNIX
+    dr_register_fork_init_event(symcache_fork_init);
+#endif
 
     initialized = true;
 
@@ -702,6 +711,9 @@ drsymcache_exit(void)
     drmgr_unregister_module_load_event(symcache_module_load);
     drmgr_unregister_module_unload_event(symcache_module_unload);
     drmgr_unregister_module_load_event(symcache_module_load_save);
+#ifdef UNIX
+    dr_unregister_fork_init_event(symcache_fork_init);
+#endif
     drmgr_exit();
 
     return DRMF_SUCCESS;
@@ -835,6 +847,32 @@ symcache_module_load_save(void *drcontext, const module_data_t *mod, bool loaded
     symcache_module_save_common(mod, false/*keep*/);
 }
 
+#ifdef UNIX
+/* A fork child inherits the parent's caches, which the parent writes out.
+ * With drsymcache_share_across_fork() we mark them as though read from their
+ * files so the child only writes those it adds to, rather than every child
+ * rewriting them all.  This only touches the outer entries: the symbol tables
+ * stay shared with the parent.
+ */
+static void
+symcache_fork_init(void *drcontext)
+{
+    uint i;
+    if (!op_share_across_fork)
+        return;
+    dr_mutex_lock(symcache_lock);
+    for (i = 0; i < HASHTABLE_SIZE(symcache_table.table_bits); i++) {
+        hash_entry_t *he;
+        for (he = symcache_table.table[i]; he != NULL; he = he->next) {
+            mod_cache_t *modcache = (mod_cache_t *) he->payload;
+            modcache->from_file = true;
+            modcache->appended = false;
+        }
+    }
+    dr_mutex_unlock(symcache_lock);
+}
+#endif
+
 static void
 symcache_module_unload(void *drcontext, const module_data_t *mod)
 {
@@ -963,3 +1001,13 @@ drsymcache_free_lookup(size_t *offs, uint num)
         global_free(offs, num * sizeof(size_t), HEAPSTAT_HASHTABLE);
     return DRMF_SUCCESS;
 }
+
+DR_EXPORT
+drmf_status_t
+drsymcache_share_across_fork(bool share)
+{
+    if (!initialized)
+        return DRMF_ERROR_NOT_INITIALIZED;
+    op_share_across_fork = share;
+    return DRMF_SUCCESS;
+}
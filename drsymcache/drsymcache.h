@@ -215,6 +215,21 @@ DR_EXPORT
 drmf_status_t
 drsymcache_free_lookup(size_t *offs, uint num);
 
+DR_EXPORT
+/**
+ * Controls what a fork child does with the symbol caches it inherits.  By
+ * default a child treats them as its own and writes each of them out at exit.
+ * When \p share is true, the child instead treats them as already written by
+ * the parent, and only writes out those it adds symbols to.  Only applies on
+ * UNIX.
+ *
+ * @param[in]  share  Whether to leave inherited caches to the parent.
+ *
+ * \return success code.
+ */
+drmf_status_t
+drsymcache_share_across_fork(bool share);
+
 /*@}*/ /* end doxygen group */
 
 #ifdef __cplusplus
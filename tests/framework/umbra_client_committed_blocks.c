@@ -0,0 +1,182 @@
+/* **************************************************************
+ * Copyright (c) 2026 Google, Inc.  All rights reserved.
+ * **************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Google, Inc. nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL GOOGLE, INC. OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* Tests walks of the index of committed 64-bit shadow blocks: iterating,
+ * stopping an iteration, searching across uncommitted gaps and clearing
+ * redundant blocks.  The blocks are spread across bitmap words and summary
+ * words.
+ */
+
+#include <string.h>
+
+#include "dr_api.h"
+#include "umbra.h"
+
+/* We don't want a popup so we don't use DR_ASSERT_MSG. */
+#define CHECK(cond, msg) ((void)((cond) ? 0 :                   \
+    (dr_fprintf(STDERR,  "ASSERT FAILURE: %s:%d: %s (%s)\n",    \
+                __FILE__, __LINE__, #cond, msg), dr_abort(), 0)))
+
+/* Block indices from the base: a 32-block bitmap word and a 1024-block summary
+ * word apart.
+ */
+#define NUM_BLOCKS 4
+static const uint block_index[NUM_BLOCKS] = {0, 1, 33, 1100};
+/* Only the last block holds the searched-for value */
+#define SEARCH_VALUE 0x33
+/* The redundant block holds the default value */
+#define REDUNDANT_BLOCK 1
+
+typedef struct _iter_data_t {
+    app_pc start, end;
+    app_pc last;
+    uint count;
+    uint stop_after;
+} iter_data_t;
+
+static umbra_map_t *umbra_map;
+static size_t blk_size;
+
+static bool
+count_blocks(umbra_map_t *map, umbra_shadow_memory_info_t *info, void *user_data)
+{
+    iter_data_t *data = (iter_data_t *) user_data;
+    if (info->app_base < data->start || info->app_base >= data->end)
+        return true;
+    CHECK(data->last == NULL || info->app_base > data->last, "blocks out of order");
+    CHECK(info->app_size == blk_size, "wrong block size");
+    CHECK(info->shadow_type == UMBRA_SHADOW_MEMORY_TYPE_NORMAL, "wrong block type");
+    data->last = info->app_base;
+    data->count++;
+    return data->stop_after == 0 || data->count < data->stop_after;
+}
+
+static uint
+num_blocks(app_pc base, uint stop_after)
+{
+    iter_data_t data;
+    memset(&data, 0, sizeof(data));
+    data.start = base;
+    data.end = base + (block_index[NUM_BLOCKS - 1] + 1) * blk_size;
+    data.stop_after = stop_after;
+    CHECK(umbra_iterate_shadow_memory(umbra_map, &data, count_blocks) ==
+          DRMF_SUCCESS, "failed to iterate shadow memory");
+    return data.count;
+}
+
+static void
+test_committed_blocks(void)
+{
+    module_data_t *exe = dr_get_main_module();
+    size_t span;
+    app_pc base, addr;
+    uint i, count;
+    bool found;
+
+    CHECK(umbra_get_shadow_block_size(umbra_map, &blk_size) == DRMF_SUCCESS,
+          "failed to get block size");
+    /* With UMBRA_MAP_SCALE_SAME_1X an app block is a shadow block long.
+     * Only the shadow of the executable's segment is touched.
+     */
+    base = (app_pc) ALIGN_FORWARD(exe->start, blk_size);
+    dr_free_module_data(exe);
+    span = (block_index[NUM_BLOCKS - 1] + 1) * blk_size;
+
+    for (i = 0; i < NUM_BLOCKS; i++) {
+        ptr_uint_t value = (i == NUM_BLOCKS - 1) ? SEARCH_VALUE :
+            ((i == REDUNDANT_BLOCK) ? 0 : 0x11);
+        CHECK(umbra_create_shadow_memory(umbra_map, 0,
+                                         base + block_index[i] * blk_size,
+                                         blk_size, value, 1) == DRMF_SUCCESS,
+              "failed to create shadow memory");
+    }
+    CHECK(num_blocks(base, 0) == NUM_BLOCKS, "wrong number of blocks iterated");
+    CHECK(num_blocks(base, 1) == 1, "iteration did not stop");
+
+    /* The search skips the uncommitted gaps, without creating blocks there */
+    addr = base;
+    CHECK(umbra_value_in_shadow_memory(umbra_map, &addr, span, SEARCH_VALUE, 1,
+                                       &found) == DRMF_SUCCESS && found &&
+          addr == base + block_index[NUM_BLOCKS - 1] * blk_size,
+          "value past the gaps not found");
+    /* An uncommitted block holds the default value */
+    addr = base;
+    CHECK(umbra_value_in_shadow_memory(umbra_map, &addr, span, 0, 1, &found) ==
+          DRMF_SUCCESS && found &&
+          addr == base + block_index[REDUNDANT_BLOCK] * blk_size,
+          "default value not found");
+    addr = base + 2 * blk_size;
+    CHECK(umbra_value_in_shadow_memory(umbra_map, &addr, span - 2 * blk_size, 0, 1,
+                                       &found) == DRMF_SUCCESS && found &&
+          addr == base + 2 * blk_size, "default value in a gap not found");
+    CHECK(num_blocks(base, 0) == NUM_BLOCKS, "search created blocks");
+
+    CHECK(umbra_clear_redundant_blocks(umbra_map, &count) == DRMF_SUCCESS &&
+          count >= 1, "failed to clear redundant blocks");
+    CHECK(num_blocks(base, 0) == NUM_BLOCKS - 1, "redundant block not cleared");
+
+    for (i = 0; i < NUM_BLOCKS; i++) {
+        CHECK(umbra_delete_shadow_memory(umbra_map, base + block_index[i] * blk_size,
+                                         blk_size) == DRMF_SUCCESS,
+              "failed to delete shadow memory");
+    }
+    CHECK(num_blocks(base, 0) == 0, "deleted blocks iterated");
+    dr_fprintf(STDERR, "committed blocks test passed\n");
+}
+
+static void
+exit_event(void)
+{
+    /* All app threads are gone, as clearing blocks requires */
+    test_committed_blocks();
+    if (umbra_destroy_mapping(umbra_map) != DRMF_SUCCESS)
+        DR_ASSERT(false);
+    umbra_exit();
+}
+
+DR_EXPORT void
+dr_client_main(client_id_t id, int argc, const char *argv[])
+{
+    umbra_map_options_t umbra_map_ops;
+
+    memset(&umbra_map_ops, 0, sizeof(umbra_map_ops));
+    umbra_map_ops.scale              = UMBRA_MAP_SCALE_SAME_1X;
+    umbra_map_ops.flags              = UMBRA_MAP_CREATE_SHADOW_ON_TOUCH;
+    umbra_map_ops.default_value      = 0;
+    umbra_map_ops.default_value_size = 1;
+
+    if (umbra_init(id) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to init umbra");
+    if (umbra_create_mapping(&umbra_map_ops, &umbra_map) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to create shadow memory mapping");
+    dr_register_exit_event(exit_event);
+}
@@ -0,0 +1,208 @@
+/* **************************************************************
+ * Copyright (c) 2026 Google, Inc.  All rights reserved.
+ * **************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Google, Inc. nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL GOOGLE, INC. OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* Tests that sequential faults on missing 64-bit shadow memory make umbra
+ * create blocks ahead of the faulting one.  Meta stores walk the shadow of
+ * NUM_STORES consecutive app blocks, one byte per block, and umbra's own fault
+ * handler creates the shadow.
+ */
+
+#include <string.h>
+
+#include "dr_api.h"
+#include "drmgr.h"
+#include "umbra.h"
+#include "drreg.h"
+
+#include "umbra_test_shared.h"
+
+/* We don't want a popup so we don't use DR_ASSERT_MSG. */
+#define CHECK(cond, msg) ((void)((cond) ? 0 :                   \
+    (dr_fprintf(STDERR,  "ASSERT FAILURE: %s:%d: %s (%s)\n",    \
+                __FILE__, __LINE__, #cond, msg), dr_abort(), 0)))
+
+#define NUM_STORES 32
+#define STORE_VALUE 0x5a
+
+static umbra_map_t *umbra_map;
+static size_t blk_size;
+/* With UMBRA_MAP_SCALE_SAME_1X an app block is a shadow block long */
+static app_pc base;
+static bool stores_inserted;
+
+static void
+instrument_stores(void *drcontext, instrlist_t *ilist, instr_t *where)
+{
+    reg_id_t regaddr;
+    reg_id_t scratch;
+    int i;
+
+    if (drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, NULL, &regaddr) !=
+            DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, NULL, &scratch) !=
+            DRREG_SUCCESS) {
+        DR_ASSERT(false); /* can't recover */
+        return;
+    }
+
+    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)base,
+                                     opnd_create_reg(regaddr), ilist, where, NULL, NULL);
+    if (umbra_insert_app_to_shadow(drcontext, umbra_map, ilist, where, regaddr, &scratch,
+                                   1) != DRMF_SUCCESS)
+        DR_ASSERT(false);
+    /* Each store faults on a missing block unless an earlier fault created it */
+    for (i = 0; i < NUM_STORES; i++) {
+        instrlist_meta_preinsert(
+            ilist, where,
+            INSTR_XL8(XINST_CREATE_store_1byte(
+                          drcontext, OPND_CREATE_MEM8(regaddr, (int)(i * blk_size)),
+                          opnd_create_immed_int(STORE_VALUE, OPSZ_1)),
+                      instr_get_app_pc(where)));
+    }
+
+    if (drreg_unreserve_register(drcontext, ilist, where, regaddr) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, ilist, where, scratch) != DRREG_SUCCESS ||
+        drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+    stores_inserted = true;
+}
+
+static dr_emit_flags_t
+event_app_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace,
+                   bool translating, OUT void **user_data)
+{
+    instr_t *inst;
+    bool prev_was_mov_const = false;
+    ptr_int_t val1, val2;
+    *user_data = NULL;
+    /* Look for duplicate mov immediates telling us which subtest we're in */
+    for (inst = instrlist_first_app(bb); inst != NULL; inst = instr_get_next_app(inst)) {
+        if (instr_is_mov_constant(inst, prev_was_mov_const ? &val2 : &val1)) {
+            if (prev_was_mov_const && val1 == val2 &&
+                val1 != 0 && /* rule out xor w/ self */
+                opnd_is_reg(instr_get_dst(inst, 0))) {
+                *user_data = (void *)val1;
+                instrlist_meta_postinsert(bb, inst, INSTR_CREATE_label(drcontext));
+            } else
+                prev_was_mov_const = true;
+        } else
+            prev_was_mov_const = false;
+    }
+    return DR_EMIT_DEFAULT;
+}
+
+static dr_emit_flags_t
+event_app_instruction(void *drcontext, void *tag, instrlist_t *ilist, instr_t *where,
+                      bool for_trace, bool translating, void *user_data)
+{
+    /* Only the test 1 store, so the walk runs once */
+    if ((ptr_int_t)user_data != UMBRA_TEST_1_C || !instr_writes_memory(where))
+        return DR_EMIT_DEFAULT;
+    instrument_stores(drcontext, ilist, where);
+    return DR_EMIT_DEFAULT;
+}
+
+static void
+test_fault_prefetch(void)
+{
+    umbra_fault_stats_t stats;
+    byte value;
+    size_t size;
+    int i;
+
+    CHECK(stores_inserted, "test store not found");
+    stats.struct_size = sizeof(stats);
+    CHECK(umbra_get_fault_stats(umbra_map, &stats) == DRMF_SUCCESS,
+          "failed to get fault stats");
+    /* The faults at blocks 0, 1, 3, 7, 15 and 31 each create twice as many
+     * blocks as the one before.
+     */
+    CHECK(stats.num_faults > 0 && stats.num_faults < NUM_STORES,
+          "sequential faults were not batched");
+    CHECK(stats.blocks_created >= NUM_STORES, "too few blocks created");
+    CHECK(stats.blocks_prefetched > 0 &&
+          stats.blocks_prefetched < stats.blocks_created, "no blocks prefetched");
+
+    for (i = 0; i < NUM_STORES; i++) {
+        size = 1;
+        CHECK(umbra_read_shadow_memory(umbra_map, base + i * blk_size, 1, &size,
+                                       &value) == DRMF_SUCCESS && size == 1,
+              "failed to read shadow memory");
+        CHECK(value == STORE_VALUE, "store to a prefetched block lost");
+    }
+    dr_fprintf(STDERR, "fault prefetch test passed\n");
+}
+
+static void
+exit_event(void)
+{
+    test_fault_prefetch();
+    if (umbra_destroy_mapping(umbra_map) != DRMF_SUCCESS)
+        DR_ASSERT(false);
+
+    umbra_exit();
+    drmgr_exit();
+    drreg_exit();
+}
+
+DR_EXPORT void
+dr_client_main(client_id_t id, int argc, const char *argv[])
+{
+    drreg_options_t ops = { sizeof(ops), 4, true };
+    umbra_map_options_t umbra_map_ops;
+    module_data_t *exe;
+
+    drmgr_init();
+    drreg_init(&ops);
+
+    memset(&umbra_map_ops, 0, sizeof(umbra_map_ops));
+    umbra_map_ops.scale              = UMBRA_MAP_SCALE_SAME_1X;
+    umbra_map_ops.flags              = UMBRA_MAP_CREATE_SHADOW_ON_TOUCH;
+    umbra_map_ops.default_value      = 0;
+    umbra_map_ops.default_value_size = 1;
+
+    if (umbra_init(id) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to init umbra");
+    if (umbra_create_mapping(&umbra_map_ops, &umbra_map) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to create shadow memory mapping");
+    if (umbra_get_shadow_block_size(umbra_map, &blk_size) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to get shadow block size");
+    /* Only the shadow of the executable's segment is touched */
+    exe = dr_get_main_module();
+    base = (app_pc)ALIGN_FORWARD(exe->start, blk_size);
+    dr_free_module_data(exe);
+
+    drmgr_register_bb_instrumentation_event(event_app_analysis, event_app_instruction,
+                                            NULL);
+    dr_register_exit_event(exit_event);
+}
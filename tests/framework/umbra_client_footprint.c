@@ -0,0 +1,184 @@
+/* **************************************************************
+ * Copyright (c) 2026 Google, Inc.  All rights reserved.
+ * **************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Google, Inc. nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL GOOGLE, INC. OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* Tests umbra_get_shadow_footprint(), with and without scanning values, as
+ * shadow blocks are created and deleted.
+ */
+
+#include <string.h>
+
+#include "dr_api.h"
+#include "umbra.h"
+
+/* We don't want a popup so we don't use DR_ASSERT_MSG. */
+#define CHECK(cond, msg) ((void)((cond) ? 0 :                   \
+    (dr_fprintf(STDERR,  "ASSERT FAILURE: %s:%d: %s (%s)\n",    \
+                __FILE__, __LINE__, #cond, msg), dr_abort(), 0)))
+
+#define UNIFORM_VALUE 0x11
+#define MIXED_VALUE   0x22
+#define MIXED_BYTES   16
+
+static umbra_map_t *umbra_map;
+static size_t blk_size;
+
+/* Too large for the stack */
+static umbra_shadow_footprint_t before, after;
+
+static void
+get_footprint(bool scan_values, umbra_shadow_footprint_t *footprint)
+{
+    footprint->struct_size = sizeof(*footprint);
+    CHECK(umbra_get_shadow_footprint(umbra_map, scan_values, footprint) ==
+          DRMF_SUCCESS, "failed to get footprint");
+    CHECK(footprint->peak_committed_bytes >= footprint->committed_bytes,
+          "peak below committed");
+}
+
+#ifdef X64
+static umbra_segment_footprint_t *
+find_segment(umbra_shadow_footprint_t *footprint, app_pc addr)
+{
+    uint i;
+    for (i = 0; i < footprint->num_segments; i++) {
+        if (addr >= footprint->segments[i].app_base &&
+            addr < footprint->segments[i].app_end)
+            return &footprint->segments[i];
+    }
+    return NULL;
+}
+#endif
+
+static void
+test_footprint(void)
+{
+    module_data_t *exe = dr_get_main_module();
+    byte mixed[MIXED_BYTES];
+    size_t shadow_size;
+    app_pc base;
+    uint i;
+
+    CHECK(umbra_get_shadow_block_size(umbra_map, &blk_size) == DRMF_SUCCESS,
+          "failed to get block size");
+    /* With UMBRA_MAP_SCALE_SAME_1X an app block is a shadow block long.
+     * Only the shadow of the executable's segment is touched.
+     */
+    base = (app_pc) ALIGN_FORWARD(exe->start, blk_size);
+    dr_free_module_data(exe);
+
+    before.struct_size = sizeof(before) - 1;
+    CHECK(umbra_get_shadow_footprint(umbra_map, false, &before) ==
+          DRMF_ERROR_INVALID_PARAMETER, "bad struct_size accepted");
+    get_footprint(true, &before);
+
+    /* One block holding one value, one mostly holding another */
+    CHECK(umbra_create_shadow_memory(umbra_map, 0, base, blk_size, UNIFORM_VALUE,
+                                     1) == DRMF_SUCCESS &&
+          umbra_create_shadow_memory(umbra_map, 0, base + blk_size, blk_size,
+                                     MIXED_VALUE, 1) == DRMF_SUCCESS,
+          "failed to create shadow memory");
+    memset(mixed, UNIFORM_VALUE, sizeof(mixed));
+    shadow_size = sizeof(mixed);
+    CHECK(umbra_write_shadow_memory(umbra_map, base + blk_size, sizeof(mixed),
+                                    &shadow_size, mixed) == DRMF_SUCCESS,
+          "failed to write shadow memory");
+
+    /* The committed and shared amounts come without a scan */
+    get_footprint(false, &after);
+    CHECK(after.committed_bytes == before.committed_bytes + 2 * blk_size,
+          "created blocks not counted");
+    CHECK(after.peak_committed_bytes >= after.committed_bytes, "peak not raised");
+    CHECK(after.uniform_blocks == 0, "values counted without a scan");
+    for (i = 0; i < BUFFER_SIZE_ELEMENTS(after.blocks_by_value); i++)
+        CHECK(after.blocks_by_value[i] == 0, "values counted without a scan");
+#ifdef X64
+    {
+        umbra_segment_footprint_t *seg_before = find_segment(&before, base);
+        umbra_segment_footprint_t *seg_after = find_segment(&after, base);
+        CHECK(seg_before != NULL && seg_after != NULL, "segment not reported");
+        CHECK(seg_after->committed_bytes == seg_before->committed_bytes + 2 * blk_size,
+              "created blocks not counted in the segment");
+        CHECK(seg_after->peak_committed_bytes >= seg_after->committed_bytes,
+              "segment peak below committed");
+    }
+#else
+    CHECK(after.num_segments == 0, "segments reported on 32-bit");
+#endif
+
+    get_footprint(true, &after);
+    CHECK(after.uniform_blocks == before.uniform_blocks + 1,
+          "uniform block not counted");
+    CHECK(after.blocks_by_value[UNIFORM_VALUE] ==
+          before.blocks_by_value[UNIFORM_VALUE] + 1, "uniform value not counted");
+    CHECK(after.blocks_by_value[MIXED_VALUE] ==
+          before.blocks_by_value[MIXED_VALUE] + 1, "dominant value not counted");
+
+    CHECK(umbra_delete_shadow_memory(umbra_map, base, 2 * blk_size) == DRMF_SUCCESS,
+          "failed to delete shadow memory");
+    get_footprint(true, &after);
+    CHECK(after.committed_bytes == before.committed_bytes,
+          "deleted blocks still counted");
+    CHECK(after.peak_committed_bytes >= before.committed_bytes + 2 * blk_size,
+          "peak dropped with deleted blocks");
+    CHECK(after.uniform_blocks == before.uniform_blocks &&
+          after.blocks_by_value[UNIFORM_VALUE] == before.blocks_by_value[UNIFORM_VALUE]
+          && after.blocks_by_value[MIXED_VALUE] == before.blocks_by_value[MIXED_VALUE],
+          "deleted blocks still scanned");
+    dr_fprintf(STDERR, "footprint test passed\n");
+}
+
+static void
+exit_event(void)
+{
+    test_footprint();
+    if (umbra_destroy_mapping(umbra_map) != DRMF_SUCCESS)
+        DR_ASSERT(false);
+    umbra_exit();
+}
+
+DR_EXPORT void
+dr_client_main(client_id_t id, int argc, const char *argv[])
+{
+    umbra_map_options_t umbra_map_ops;
+
+    memset(&umbra_map_ops, 0, sizeof(umbra_map_ops));
+    umbra_map_ops.scale              = UMBRA_MAP_SCALE_SAME_1X;
+    umbra_map_ops.flags              = UMBRA_MAP_CREATE_SHADOW_ON_TOUCH;
+    umbra_map_ops.default_value      = 0;
+    umbra_map_ops.default_value_size = 1;
+
+    if (umbra_init(id) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to init umbra");
+    if (umbra_create_mapping(&umbra_map_ops, &umbra_map) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to create shadow memory mapping");
+    dr_register_exit_event(exit_event);
+}
@@ -0,0 +1,170 @@
+/* **************************************************************
+ * Copyright (c) 2026 Google, Inc.  All rights reserved.
+ * **************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Google, Inc. nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL GOOGLE, INC. OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* Tests that umbra_shadow_set_range() maps a whole block onto the shared block
+ * for its value, which umbra_create_shared_shadow_block() and
+ * umbra_get_shared_shadow_block() return, and that a partial write unshares it.
+ */
+
+#include <string.h>
+
+#include "dr_api.h"
+#include "umbra.h"
+
+/* We don't want a popup so we don't use DR_ASSERT_MSG. */
+#define CHECK(cond, msg) ((void)((cond) ? 0 :                   \
+    (dr_fprintf(STDERR,  "ASSERT FAILURE: %s:%d: %s (%s)\n",    \
+                __FILE__, __LINE__, #cond, msg), dr_abort(), 0)))
+
+/* Neither is the default value */
+#define SET_VALUE 0x55
+#define CREATED_VALUE 0xff
+#define WRITTEN_VALUE 0x22
+
+static umbra_map_t *umbra_map;
+
+static void
+check_shadow_value(app_pc app_addr, byte expect)
+{
+    byte value;
+    size_t shadow_size = sizeof(value);
+    CHECK(umbra_read_shadow_memory(umbra_map, app_addr, 4, &shadow_size,
+                                   &value) == DRMF_SUCCESS,
+          "failed to read shadow memory");
+    CHECK(value == expect, "unexpected shadow value");
+}
+
+static bool
+block_is_shared(app_pc app_addr)
+{
+    byte *shadow_addr;
+    umbra_shadow_memory_info_t info;
+    umbra_shadow_memory_type_t type;
+    umbra_shadow_memory_info_init(&info);
+    CHECK(umbra_get_shadow_memory(umbra_map, app_addr, &shadow_addr,
+                                  &info) == DRMF_SUCCESS,
+          "failed to get shadow memory");
+    CHECK(umbra_shadow_memory_is_shared(umbra_map, shadow_addr, &type) ==
+          DRMF_SUCCESS, "failed to query shadow type");
+    return type == UMBRA_SHADOW_MEMORY_TYPE_SHARED;
+}
+
+static void
+test_shared_value_blocks(void)
+{
+    module_data_t *exe = dr_get_main_module();
+    size_t shadow_blk_size, app_blk_size, size;
+    byte *block, *found;
+    app_pc base;
+
+    CHECK(umbra_get_shadow_block_size(umbra_map, &shadow_blk_size) == DRMF_SUCCESS,
+          "failed to get block size");
+    app_blk_size = shadow_blk_size * 4; /* UMBRA_MAP_SCALE_DOWN_4X */
+    /* Only the shadow of the executable's segment is touched */
+    base = (app_pc) ALIGN_FORWARD(exe->start, app_blk_size);
+    dr_free_module_data(exe);
+
+    CHECK(umbra_get_shared_shadow_block(umbra_map, SET_VALUE, 1, &found) ==
+          DRMF_SUCCESS && found == NULL, "shared block exists too early");
+
+    /* The first block exists already, while the second does not */
+    CHECK(umbra_create_shadow_memory(umbra_map, 0, base, app_blk_size, 0, 1) ==
+          DRMF_SUCCESS, "failed to create shadow memory");
+    CHECK(!block_is_shared(base), "created block is shared");
+    CHECK(umbra_shadow_set_range(umbra_map, base, 2 * app_blk_size, &size,
+                                 SET_VALUE, 1) == DRMF_SUCCESS,
+          "failed to set shadow memory");
+    CHECK(size == 2 * shadow_blk_size, "wrong shadow size set");
+    CHECK(block_is_shared(base) && block_is_shared(base + app_blk_size),
+          "whole blocks not shared");
+    check_shadow_value(base, SET_VALUE);
+    check_shadow_value(base + 2 * app_blk_size - 4, SET_VALUE);
+    CHECK(umbra_get_shared_shadow_block(umbra_map, SET_VALUE, 1, &found) ==
+          DRMF_SUCCESS && found != NULL && found[shadow_blk_size - 1] == SET_VALUE,
+          "shared block not found");
+
+    /* A partial write gives the block its own copy */
+    CHECK(umbra_shadow_set_range(umbra_map, base, 4, &size, WRITTEN_VALUE, 1) ==
+          DRMF_SUCCESS, "failed to write shared block");
+    CHECK(!block_is_shared(base), "written block still shared");
+    check_shadow_value(base, WRITTEN_VALUE);
+    check_shadow_value(base + 4, SET_VALUE);
+    check_shadow_value(base + app_blk_size, SET_VALUE);
+
+    /* A block created ahead of use is the one whole blocks are then mapped onto */
+    CHECK(umbra_create_shared_shadow_block(umbra_map, CREATED_VALUE, 1, &block) ==
+          DRMF_SUCCESS && block != NULL, "failed to create shared block");
+    CHECK(block[0] == CREATED_VALUE && block[shadow_blk_size - 1] == CREATED_VALUE,
+          "wrong shared block contents");
+    CHECK(umbra_get_shared_shadow_block(umbra_map, CREATED_VALUE, 1, &found) ==
+          DRMF_SUCCESS && found == block, "created block not found");
+    CHECK(umbra_shadow_set_range(umbra_map, base, app_blk_size, &size,
+                                 CREATED_VALUE, 1) == DRMF_SUCCESS,
+          "failed to set shadow memory");
+    CHECK(block_is_shared(base), "written block not shared again");
+    check_shadow_value(base, CREATED_VALUE);
+
+    CHECK(umbra_delete_shadow_memory(umbra_map, base, 2 * app_blk_size) ==
+          DRMF_SUCCESS, "failed to delete shadow memory");
+    /* A freed block is re-created with the default value */
+    check_shadow_value(base, 0);
+    CHECK(!block_is_shared(base), "re-created block is shared");
+    dr_fprintf(STDERR, "shared value blocks test passed\n");
+}
+
+static void
+exit_event(void)
+{
+    test_shared_value_blocks();
+    if (umbra_destroy_mapping(umbra_map) != DRMF_SUCCESS)
+        DR_ASSERT(false);
+    umbra_exit();
+}
+
+DR_EXPORT void
+dr_client_main(client_id_t id, int argc, const char *argv[])
+{
+    umbra_map_options_t umbra_map_ops;
+
+    memset(&umbra_map_ops, 0, sizeof(umbra_map_ops));
+    umbra_map_ops.scale              = UMBRA_MAP_SCALE_DOWN_4X;
+    umbra_map_ops.flags              = UMBRA_MAP_CREATE_SHADOW_ON_TOUCH |
+                                       UMBRA_MAP_SHADOW_SHARED_READONLY;
+    umbra_map_ops.default_value      = 0;
+    umbra_map_ops.default_value_size = 1;
+
+    if (umbra_init(id) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to init umbra");
+    if (umbra_create_mapping(&umbra_map_ops, &umbra_map) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to create shadow memory mapping");
+    dr_register_exit_event(exit_event);
+}
@@ -0,0 +1,173 @@
+/* **************************************************************
+ * Copyright (c) 2026 Google, Inc.  All rights reserved.
+ * **************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Google, Inc. nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL GOOGLE, INC. OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* Tests umbra_value_in_shadow_memory() and
+ * umbra_different_value_in_shadow_memory() with each value size, over a range
+ * that crosses a shadow block boundary.
+ */
+
+#include <string.h>
+
+#include "dr_api.h"
+#include "umbra.h"
+
+/* We don't want a popup so we don't use DR_ASSERT_MSG. */
+#define CHECK(cond, msg) ((void)((cond) ? 0 :                   \
+    (dr_fprintf(STDERR,  "ASSERT FAILURE: %s:%d: %s (%s)\n",    \
+                __FILE__, __LINE__, #cond, msg), dr_abort(), 0)))
+
+/* Longer than one pass of the vector kernels */
+#define RANGE 4096
+
+static umbra_map_t *umbra_map;
+
+static void
+write_shadow(app_pc app_addr, const byte *bytes, size_t num)
+{
+    size_t shadow_size = num;
+    CHECK(umbra_write_shadow_memory(umbra_map, app_addr, num, &shadow_size,
+                                    (byte *)bytes) == DRMF_SUCCESS &&
+          shadow_size == num, "failed to write shadow memory");
+}
+
+static app_pc
+find_value(app_pc start, size_t size, ptr_uint_t value, size_t value_size)
+{
+    app_pc addr = start;
+    bool found;
+    CHECK(umbra_value_in_shadow_memory(umbra_map, &addr, size, value, value_size,
+                                       &found) == DRMF_SUCCESS,
+          "failed to search shadow memory");
+    return found ? addr : NULL;
+}
+
+static app_pc
+find_different(app_pc start, size_t size, ptr_uint_t value, size_t value_size)
+{
+    app_pc addr = start;
+    bool found;
+    CHECK(umbra_different_value_in_shadow_memory(umbra_map, &addr, size, value,
+                                                 value_size, &found) == DRMF_SUCCESS,
+          "failed to search shadow memory");
+    return found ? addr : NULL;
+}
+
+static void
+test_value_search(void)
+{
+    static const byte one[] = {0x5a};
+    static const byte two[] = {0x34, 0x12};
+    static const byte three[] = {0x44, 0x33, 0x22};
+    static const byte four[] = {0x44, 0x33, 0x22, 0x11};
+#ifdef X64
+    static const byte eight[] = {0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11};
+#endif
+    module_data_t *exe = dr_get_main_module();
+    size_t shadow_blk_size, size;
+    app_pc base, addr;
+    bool found;
+
+    CHECK(umbra_get_shadow_block_size(umbra_map, &shadow_blk_size) == DRMF_SUCCESS,
+          "failed to get block size");
+    /* With UMBRA_MAP_SCALE_SAME_1X an app block is a shadow block long.
+     * Only the shadow of the executable's segment is touched.
+     */
+    base = (app_pc) ALIGN_FORWARD(exe->start, shadow_blk_size) - RANGE/2;
+    dr_free_module_data(exe);
+
+    CHECK(umbra_shadow_set_range(umbra_map, base, RANGE, &size, 0, 1) ==
+          DRMF_SUCCESS && size == RANGE, "failed to set shadow memory");
+    write_shadow(base + 1000, one, sizeof(one));
+    /* Just past the block boundary, at an odd offset */
+    write_shadow(base + RANGE/2 + 1, two, sizeof(two));
+    write_shadow(base + 2500, three, sizeof(three));
+    write_shadow(base + 3000, four, sizeof(four));
+#ifdef X64
+    write_shadow(base + RANGE - sizeof(eight), eight, sizeof(eight));
+#endif
+
+    CHECK(find_value(base, RANGE, 0x5a, 1) == base + 1000, "byte not found");
+    /* The elements start at base, so the odd 2-byte value is not one of them */
+    CHECK(find_value(base, RANGE, 0x1234, 2) == NULL, "unaligned value found");
+    CHECK(find_value(base + 1, RANGE - 2, 0x1234, 2) == base + RANGE/2 + 1,
+          "2-byte value not found");
+    /* The 3 bytes at 2500 are followed by a zero, which makes up a 4-byte value */
+    CHECK(find_value(base, RANGE, 0x11223344, 4) == base + 3000,
+          "4-byte value not found");
+    CHECK(find_value(base, RANGE, 0x00223344, 4) == base + 2500,
+          "4-byte value with a zero byte not found");
+#ifdef X64
+    CHECK(find_value(base, RANGE, 0x1122334455667788, 8) ==
+          base + RANGE - sizeof(eight), "8-byte value at the end not found");
+#endif
+    CHECK(find_value(base, RANGE, 0x99, 1) == NULL, "absent value found");
+    addr = base;
+    CHECK(umbra_value_in_shadow_memory(umbra_map, &addr, RANGE, 0x100, 1, &found) ==
+          DRMF_ERROR_INVALID_PARAMETER, "value too large for its size accepted");
+
+    CHECK(find_different(base, RANGE, 0, 4) == base + 1000,
+          "first non-zero dword not found");
+    CHECK(find_different(base + 1004, RANGE - 1004, 0, 4) == base + RANGE/2,
+          "non-zero dword past the block boundary not found");
+    CHECK(find_different(base + 1001, 1000, 0, 1) == NULL, "zero run not skipped");
+    CHECK(find_different(base + 1000, RANGE - 1000, 0x5a, 1) == base + 1001,
+          "end of a 1-byte run not found");
+
+    dr_fprintf(STDERR, "value search test passed\n");
+}
+
+static void
+exit_event(void)
+{
+    test_value_search();
+    if (umbra_destroy_mapping(umbra_map) != DRMF_SUCCESS)
+        DR_ASSERT(false);
+    umbra_exit();
+}
+
+DR_EXPORT void
+dr_client_main(client_id_t id, int argc, const char *argv[])
+{
+    umbra_map_options_t umbra_map_ops;
+
+    memset(&umbra_map_ops, 0, sizeof(umbra_map_ops));
+    umbra_map_ops.scale              = UMBRA_MAP_SCALE_SAME_1X;
+    umbra_map_ops.flags              = UMBRA_MAP_CREATE_SHADOW_ON_TOUCH;
+    umbra_map_ops.default_value      = 0;
+    umbra_map_ops.default_value_size = 1;
+
+    if (umbra_init(id) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to init umbra");
+    if (umbra_create_mapping(&umbra_map_ops, &umbra_map) != DRMF_SUCCESS)
+        DR_ASSERT_MSG(false, "fail to create shadow memory mapping");
+    dr_register_exit_event(exit_event);
+}
@@ -0,0 +1,88 @@
+/* **********************************************************
+ * Copyright (c) 2026 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Tests that the replacement allocator's free lists pick the best fit from a
+ * fragmented heap.  We run with -delay_frees 0 so each free goes straight to
+ * the free lists.  Each free chunk is fenced in by a live chunk so nothing
+ * coalesces.  We only print once all the allocations are done so that stdio
+ * does not disturb the free lists.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Sizes for the var-size bucket, which is ordered by size */
+#define LARGE_BIG    100000
+#define LARGE_SMALL   40000
+#define LARGE_MID     70000
+/* Sizes for two different fixed-size buckets, found through the bitmap */
+#define FIXED_BIG      6000
+#define FIXED_SMALL    3000
+
+#define NUM_FREES 5
+
+static const size_t sizes[NUM_FREES] = {
+    LARGE_BIG, LARGE_SMALL, LARGE_MID, FIXED_BIG, FIXED_SMALL
+};
+
+static void
+check(const char *what, void *got, void *expect)
+{
+    printf("%s: %s\n", what, got == expect ? "reused best fit" : "wrong chunk");
+}
+
+int
+main()
+{
+    char *chunk[NUM_FREES], *fence[NUM_FREES];
+    char *fixed, *large_mid, *large_small, *large_big;
+    int i;
+
+    for (i = 0; i < NUM_FREES; i++) {
+        chunk[i] = malloc(sizes[i]);
+        fence[i] = malloc(8);
+        memset(chunk[i], i, sizes[i]);
+    }
+    for (i = 0; i < NUM_FREES; i++)
+        free(chunk[i]);
+
+    /* Lowest non-empty bucket that is large enough: not the 6000 chunk */
+    fixed = malloc(FIXED_SMALL / 2);
+    /* Smallest chunk that is large enough, not the first one we freed */
+    large_mid = malloc(LARGE_MID - 10000);
+    large_small = malloc(LARGE_SMALL - 10000);
+    large_big = malloc(LARGE_BIG - 10000);
+
+    check("fixed-size bucket", fixed, chunk[4]);
+    check("size tree, middle size", large_mid, chunk[2]);
+    check("size tree, smallest size", large_small, chunk[1]);
+    check("size tree, largest size", large_big, chunk[0]);
+
+    free(fixed);
+    free(large_mid);
+    free(large_small);
+    free(large_big);
+    for (i = 0; i < NUM_FREES; i++)
+        free(fence[i]);
+    printf("all done\n");
+    return 0;
+}
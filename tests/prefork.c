@@ -0,0 +1,134 @@
+/* **********************************************************
+ * Copyright (c) 2026 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Fork child start-up benchmark, modeled on a preforking server: the parent
+ * builds up some heap, then forks workers one at a time.  Each worker tells
+ * the parent it is running and exits.  The time from fork() until the
+ * worker's message arrives is its start-up latency.
+ *
+ * As a test it forks a few workers.  As a benchmark, pass the number of
+ * workers and the megabytes of heap to allocate first, and compare the
+ * average reported with and without -fork_share_state:
+ *   drmemory [-fork_share_state] -- prefork 50 256
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_WORKERS 3
+#define DEFAULT_HEAP_MB 4
+#define ALLOC_SIZE 256
+
+static unsigned long long
+time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int
+main(int argc, char **argv)
+{
+    int num_workers = DEFAULT_WORKERS;
+    int heap_mb = DEFAULT_HEAP_MB;
+    int benchmark = (argc > 1);
+    unsigned long long total_us = 0;
+    size_t num_allocs, i;
+    char **allocs;
+    int w;
+
+    if (argc > 1)
+        num_workers = atoi(argv[1]);
+    if (argc > 2)
+        heap_mb = atoi(argv[2]);
+    if (num_workers < 1 || heap_mb < 0) {
+        fprintf(stderr, "usage: %s [workers] [heap MB]\n", argv[0]);
+        return 1;
+    }
+
+    /* Lots of small allocations, as a server's caches would be */
+    num_allocs = (size_t)heap_mb * 1024 * 1024 / ALLOC_SIZE;
+    allocs = (char **) malloc((num_allocs + 1) * sizeof(*allocs));
+    for (i = 0; i < num_allocs; i++) {
+        allocs[i] = (char *) malloc(ALLOC_SIZE);
+        memset(allocs[i], (int)i, ALLOC_SIZE);
+    }
+
+    for (w = 0; w < num_workers; w++) {
+        int fds[2];
+        pid_t child;
+        unsigned long long start;
+        char c;
+        if (pipe(fds) != 0) {
+            perror("ERROR on pipe");
+            return 1;
+        }
+        start = time_us();
+        child = fork();
+        if (child < 0) {
+            perror("ERROR on fork");
+            return 1;
+        } else if (child == 0) {
+            close(fds[0]);
+            c = 'r';
+            if (write(fds[1], &c, 1) != 1)
+                perror("ERROR on write");
+            close(fds[1]);
+            _exit(0);
+        } else {
+            pid_t result;
+            ssize_t res;
+            int iters = 0;
+            close(fds[1]);
+            do {
+                res = read(fds[0], &c, 1);
+            } while (res == -1 && errno == EINTR);
+            total_us += time_us() - start;
+            assert(res == 1 && c == 'r');
+            close(fds[0]);
+            /* PR 479089: we can get interrupted, so loop */
+            do {
+                result = waitpid(child, NULL, 0);
+                assert(++iters < 100);
+            } while (result == -1 && errno == EINTR);
+            assert(result == child);
+        }
+    }
+    if (benchmark) {
+        /* The timing varies, so it is only printed when benchmarking */
+        fprintf(stderr, "%d workers with %d MB of heap: %llu us average start-up\n",
+                num_workers, heap_mb, total_us / num_workers);
+    }
+
+    for (i = 0; i < num_allocs; i++)
+        free(allocs[i]);
+    free(allocs);
+    printf("all done\n");
+    return 0;
+}
@@ -0,0 +1,87 @@
+/* **********************************************************
+ * Copyright (c) 2026 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Tests that realloc grows a chunk in place when it can, either into the free
+ * chunk after it or at the end of its arena.  We run with -delay_frees 0 so
+ * the free below goes straight to the free lists.  We only print once all the
+ * reallocs are done so that stdio does not disturb the heap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SMALL         64
+#define SMALL_GROWN  200
+/* Below the size the allocator mmaps on its own */
+#define TAIL        30000
+#define TAIL_GROWN  60000
+
+static int
+all_set(const char *p, char val, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        if (p[i] != val)
+            return 0;
+    }
+    return 1;
+}
+
+static void
+check(const char *what, void *got, void *expect, int kept)
+{
+    printf("%s: %s, %s\n", what, got == expect ? "grew in place" : "moved",
+           kept ? "data kept" : "data lost");
+}
+
+int
+main()
+{
+    char *small, *next, *fence, *small_grown, *tail, *tail_grown;
+    char c;
+
+    small = malloc(SMALL);
+    next = malloc(SMALL_GROWN);
+    fence = malloc(8);
+    memset(small, 's', SMALL);
+    free(next);
+    small_grown = realloc(small, SMALL_GROWN);
+
+    /* Nothing free is this large, so it comes from the end of the arena */
+    tail = malloc(TAIL);
+    memset(tail, 't', TAIL);
+    tail_grown = realloc(tail, TAIL_GROWN);
+
+    c = small_grown[SMALL_GROWN]; /* error: unaddressable */
+    c = tail_grown[TAIL_GROWN]; /* error: unaddressable */
+
+    check("into the next free chunk", small_grown, small,
+          all_set(small_grown, 's', SMALL));
+    check("at the end of the arena", tail_grown, tail,
+          all_set(tail_grown, 't', TAIL));
+
+    free(small_grown);
+    free(tail_grown);
+    free(fence);
+    printf("all done\n");
+    return 0;
+}
@@ -303,6 +303,28 @@ sharing_test(void)
     xl8_share_slowpath(undef, def);
 }
 
+#ifdef X64
+/* i#243: ymm shadowing, with lanes of differing definedness */
+void ymm_operations(char *dst, char *src);
+
+static void
+ymm_test(void)
+{
+    char dst[64];
+    char uninit[32];
+    uninit[16] = 'x';
+    ymm_operations(dst, uninit);
+    if (dst[0] != 'x') /* the defined byte of the src's top lane */
+        printf("lane swap failed\n");
+    if (dst[20] != 0) /* the zeroed bottom lane, swapped to the top */
+        printf("lane insert failed\n");
+    if (dst[60] != 0) /* the top of a ymm zeroed by a VEX.128 write */
+        printf("VEX.128 write failed\n");
+    if (dst[4] == 'x') /* uninit, from the src's top lane */
+        printf("got x\n");
+}
+#endif
+
 int
 main(int argc, char *argv[])
 {
@@ -341,6 +363,10 @@ main(int argc, char *argv[])
 
     sharing_test();
 
+#ifdef X64
+    ymm_test();
+#endif
+
     return 0;
 }
 
@@ -1085,6 +1111,32 @@ GLOBAL_LABEL(FUNCNAME:)
         END_FUNC(FUNCNAME)
 #undef FUNCNAME
 
+#ifdef X64
+#define FUNCNAME ymm_operations
+/* void ymm_operations(char *dst, char *src); */
+        DECLARE_FUNC_SEH(FUNCNAME)
+GLOBAL_LABEL(FUNCNAME:)
+        mov      REG_XCX, ARG1
+        mov      REG_XAX, ARG2
+        END_PROLOG
+
+        vmovdqu  ymm0, [REG_XAX] /* src: only byte 16 is defined */
+        vxorps   xmm1, xmm1, xmm1 /* VEX.128 write: zeroes the top of ymm1 too */
+        vinsertf128 ymm0, ymm0, xmm1, 0 /* bottom lane defined, top lane undef */
+        vperm2f128 ymm2, ymm0, ymm0, HEX(01) /* swap the lanes */
+        vmovdqu  [REG_XCX], ymm2 /* dst: bottom lane undef but for byte 0 */
+
+        vmovdqu  ymm3, [REG_XAX] /* undef */
+        vmovdqu  xmm3, [REG_XCX + 16] /* defined, and zeroes the top of ymm3 */
+        vmovdqu  [REG_XCX + 32], ymm3 /* dst: all defined */
+        vzeroupper
+
+        add      REG_XSP, 0 /* make a legal SEH64 epilog */
+        ret
+        END_FUNC(FUNCNAME)
+#undef FUNCNAME
+#endif
+
 
 END_FILE
 #endif
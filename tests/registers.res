@@ -129,6 +129,10 @@ registers.c_asm.asm:1106
 Error #26: UNINITIALIZED READ: reading register eax
 registers.c_asm.asm:1076
 %endif
+%if X64
+Error #27: UNINITIALIZED READ: reading register
+registers.c:323
+%endif
 %OUT_OF_ORDER
 : LEAK 15 direct bytes + 0 indirect bytes
 : LEAK 15 direct bytes + 0 indirect bytes
@@ -28,6 +28,11 @@
 #include "drmemory_framework.h"
 #include "../framework/drmf.h"
 #include "utils.h"
+#include <string.h> /* for memcpy */
+#ifdef X86
+# include <emmintrin.h> /* SSE2 */
+# include <immintrin.h> /* AVX2 */
+#endif
 #ifdef UNIX
 # include "sysnum_linux.h"
 # include <sys/mman.h>
@@ -80,6 +85,189 @@ umbra_unlock()
     dr_mutex_unlock(umbra_global_lock);
 }
 
+/***************************************************************************
+ * SHADOW VALUE SEARCH
+ *
+ * Finds the first value_size-byte element of a shadow range that equals (or
+ * differs from) a value.  Elements are laid out from the start of the range.
+ * The vector kernels compare whole bytes and then fold the per-byte results
+ * into per-element results, so one kernel serves every element size.
+ */
+
+#if defined(X86) && defined(UNIX)
+/* gcc and clang need each function enabled for the ISA it uses; cl does not */
+# define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+# define SIMD_TARGET(isa) /* nothing */
+#endif
+
+typedef byte *(*value_search_func_t)(byte *start, size_t size, ptr_uint_t value,
+                                     size_t value_size, bool equal);
+
+static ptr_uint_t
+value_element_mask(size_t value_size)
+{
+    if (value_size >= sizeof(ptr_uint_t))
+        return POINTER_MAX;
+    return ((ptr_uint_t)1 << (value_size * 8)) - 1;
+}
+
+static bool
+umbra_value_size_valid(ptr_uint_t value, size_t value_size)
+{
+    if (value_size != 1 && value_size != 2 && value_size != 4
+        IF_X64(&& value_size != 8))
+        return false;
+    return (value & ~value_element_mask(value_size)) == 0;
+}
+
+bool
+umbra_value_matches_fill(ptr_uint_t value, size_t value_size,
+                         ptr_uint_t fill, size_t fill_size)
+{
+    if (fill_size == value_size)
+        return fill == value;
+    /* a byte-sized fill reads back as the byte repeated */
+    if (fill_size != 1)
+        return false;
+    return value == (value_element_mask(value_size) / 0xff) * fill;
+}
+
+static byte *
+value_search_scalar(byte *start, size_t size, ptr_uint_t value,
+                    size_t value_size, bool equal)
+{
+    byte *cur, *end = start + size - size % value_size;
+    for (cur = start; cur < end; cur += value_size) {
+        ptr_uint_t elem;
+        switch (value_size) {
+        case 1: elem = *cur; break;
+        case 2: elem = *(ushort *)cur; break;
+        case 4: elem = *(uint *)cur; break;
+#ifdef X64
+        case 8: elem = *(ptr_uint_t *)cur; break;
+#endif
+        default: ASSERT(false, "invalid value size"); return NULL;
+        }
+        if ((elem == value) == equal)
+            return cur;
+    }
+    return NULL;
+}
+
+#ifdef X86
+/* Returns the byte offset of the first element whose bytes all compare
+ * equal (if equal) or not all equal (if !equal), given one bit per byte
+ * in byte_mask; or -1 if there is none among the num_bytes covered.
+ */
+static inline int
+value_search_fold(uint byte_mask, size_t num_bytes, size_t value_size, bool equal)
+{
+    /* one bit per element, at the element's first byte */
+    static const uint lanes[] = { 0, 0xffffffff, 0x55555555, 0, 0x11111111,
+                                  0, 0, 0, 0x01010101 };
+    uint elem_mask = byte_mask;
+    size_t shift;
+    for (shift = 1; shift < value_size; shift <<= 1)
+        elem_mask &= elem_mask >> shift;
+    if (!equal)
+        elem_mask = ~elem_mask;
+    elem_mask &= lanes[value_size];
+    if (num_bytes < 32)
+        elem_mask &= (1U << num_bytes) - 1;
+    if (elem_mask == 0)
+        return -1;
+    return (int) lowest_set_bit(elem_mask);
+}
+
+static void
+value_search_pattern(byte *pattern, size_t pattern_size, ptr_uint_t value,
+                     size_t value_size)
+{
+    size_t i;
+    for (i = 0; i < pattern_size; i += value_size)
+        memcpy(pattern + i, &value, value_size);
+}
+
+static byte * SIMD_TARGET("sse2")
+value_search_sse2(byte *start, size_t size, ptr_uint_t value,
+                  size_t value_size, bool equal)
+{
+    byte pattern[sizeof(__m128i)];
+    __m128i pat;
+    size_t i;
+    value_search_pattern(pattern, sizeof(pattern), value, value_size);
+    pat = _mm_loadu_si128((__m128i *)pattern);
+    for (i = 0; i + sizeof(__m128i) <= size; i += sizeof(__m128i)) {
+        __m128i cur = _mm_loadu_si128((__m128i *)(start + i));
+        uint mask = (uint) _mm_movemask_epi8(_mm_cmpeq_epi8(cur, pat));
+        int offs = value_search_fold(mask, sizeof(__m128i), value_size, equal);
+        if (offs >= 0)
+            return start + i + offs;
+    }
+    return value_search_scalar(start + i, size - i, value, value_size, equal);
+}
+
+/* Checks a 64-byte cache line per iteration */
+static byte * SIMD_TARGET("avx2")
+value_search_avx2(byte *start, size_t size, ptr_uint_t value,
+                  size_t value_size, bool equal)
+{
+    byte pattern[sizeof(__m256i)];
+    __m256i pat;
+    size_t i;
+    value_search_pattern(pattern, sizeof(pattern), value, value_size);
+    pat = _mm256_loadu_si256((__m256i *)pattern);
+    for (i = 0; i + 2*sizeof(__m256i) <= size; i += 2*sizeof(__m256i)) {
+        __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(start + i)),
+                                       pat);
+        __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)
+                                                          (start + i +
+                                                           sizeof(__m256i))),
+                                       pat);
+        uint lo_mask, hi_mask;
+        int offs;
+        /* the common case of a long run of the value we are skipping */
+        if (equal) {
+            if (_mm256_testz_si256(_mm256_or_si256(lo, hi),
+                                   _mm256_or_si256(lo, hi)))
+                continue;
+        } else if ((uint)_mm256_movemask_epi8(_mm256_and_si256(lo, hi)) == UINT_MAX)
+            continue;
+        lo_mask = (uint) _mm256_movemask_epi8(lo);
+        offs = value_search_fold(lo_mask, sizeof(__m256i), value_size, equal);
+        if (offs >= 0)
+            return start + i + offs;
+        hi_mask = (uint) _mm256_movemask_epi8(hi);
+        offs = value_search_fold(hi_mask, sizeof(__m256i), value_size, equal);
+        if (offs >= 0)
+            return start + i + sizeof(__m256i) + offs;
+    }
+    return value_search_sse2(start + i, size - i, value, value_size, equal);
+}
+#endif /* X86 */
+
+static value_search_func_t value_search_func = value_search_scalar;
+
+static void
+umbra_value_search_init(void)
+{
+#ifdef X86
+    if (proc_has_feature(FEATURE_AVX2) && proc_avx_enabled())
+        value_search_func = value_search_avx2;
+    else if (proc_has_feature(FEATURE_SSE2))
+        value_search_func = value_search_sse2;
+#endif
+}
+
+byte *
+umbra_shadow_value_search(byte *start, size_t size, ptr_uint_t value,
+                          size_t value_size, bool equal)
+{
+    ASSERT(umbra_value_size_valid(value, value_size), "invalid value");
+    return value_search_func(start, size, value, value_size, equal);
+}
+
 /***************************************************************************
  * UMBRA MAP ROUTINES
  */
@@ -96,6 +284,15 @@ umbra_map_unlock(umbra_map_t *map)
     dr_recurlock_unlock(map->lock);
 }
 
+/* For routines that run with all other threads suspended, where waiting for
+ * a suspended lock owner would never end.
+ */
+bool
+umbra_map_trylock(umbra_map_t *map)
+{
+    return dr_recurlock_trylock(map->lock);
+}
+
 static void
 umbra_map_destroy(umbra_map_t *map)
 {
@@ -308,6 +505,7 @@ umbra_init(client_id_t client_id)
         return res;
 
     umbra_global_lock = dr_mutex_create();
+    umbra_value_search_init();
     res = umbra_arch_init();
     if (res != DRMF_SUCCESS)
         return res;
@@ -483,6 +681,57 @@ umbra_insert_app_to_shadow(IN  void        *drcontext,
                                            num_scratch_regs);
 }
 
+DR_EXPORT
+drmf_status_t
+umbra_insert_app_to_shadow_multi(IN  void        *drcontext,
+                                 IN  umbra_map_t **maps,
+                                 IN  uint         num_maps,
+                                 IN  instrlist_t *ilist,
+                                 IN  instr_t     *where,
+                                 IN  reg_id_t     addr_reg,
+                                 IN  reg_id_t    *shadow_regs,
+                                 IN  reg_id_t    *scratch_regs,
+                                 IN  int          num_scratch_regs)
+{
+    uint i, j;
+    if (maps == NULL || num_maps == 0 || num_maps > MAX_NUM_MAPS)
+        return DRMF_ERROR_INVALID_PARAMETER;
+    for (i = 0; i < num_maps; i++) {
+        if (maps[i] == NULL || maps[i]->magic != UMBRA_MAP_MAGIC) {
+            ASSERT(false, "invalid umbra_map");
+            return DRMF_ERROR_INVALID_PARAMETER;
+        }
+    }
+    if (ilist == NULL || addr_reg == DR_REG_NULL || num_scratch_regs < 0 ||
+        (num_scratch_regs > 0 && scratch_regs == NULL) ||
+        (num_maps > 1 && shadow_regs == NULL))
+        return DRMF_ERROR_INVALID_PARAMETER;
+    /* The shadow registers are written while addr_reg and the scratch
+     * registers are still live, so none may alias.
+     */
+    for (i = 0; i + 1 < num_maps; i++) {
+        if (shadow_regs[i] == DR_REG_NULL || shadow_regs[i] == addr_reg)
+            return DRMF_ERROR_INVALID_PARAMETER;
+        for (j = 0; j < i; j++) {
+            if (shadow_regs[j] == shadow_regs[i])
+                return DRMF_ERROR_INVALID_PARAMETER;
+        }
+        for (j = 0; j < (uint)num_scratch_regs; j++) {
+            if (scratch_regs[j] == shadow_regs[i])
+                return DRMF_ERROR_INVALID_PARAMETER;
+        }
+    }
+    if (num_maps == 1) {
+        return umbra_insert_app_to_shadow_arch(drcontext, maps[0], ilist, where,
+                                               addr_reg, scratch_regs,
+                                               num_scratch_regs);
+    }
+    return umbra_insert_app_to_shadow_multi_arch(drcontext, maps, num_maps,
+                                                 ilist, where, addr_reg,
+                                                 shadow_regs, scratch_regs,
+                                                 num_scratch_regs);
+}
+
 DR_EXPORT
 drmf_status_t
 umbra_read_shadow_memory(IN  umbra_map_t *map,
@@ -595,12 +844,39 @@ umbra_value_in_shadow_memory(IN    umbra_map_t *map,
     }
     if (app_addr == NULL || found == false)
         return DRMF_ERROR_INVALID_PARAMETER;
+    if (!umbra_value_size_valid(value, value_size))
+        return DRMF_ERROR_INVALID_PARAMETER;
     if (app_size == 0) {
         *found = false;
         return DRMF_SUCCESS;
     }
     return umbra_value_in_shadow_memory_arch(map, app_addr, app_size,
-                                             value, value_size, found);
+                                             value, value_size, true, found);
+}
+
+DR_EXPORT
+drmf_status_t
+umbra_different_value_in_shadow_memory(IN    umbra_map_t *map,
+                                       INOUT app_pc *app_addr,
+                                       IN    size_t  app_size,
+                                       IN    ptr_uint_t value,
+                                       IN    size_t value_size,
+                                       OUT   bool   *found)
+{
+    if (map == NULL || map->magic != UMBRA_MAP_MAGIC) {
+        ASSERT(false, "invalid umbra_map");
+        return DRMF_ERROR_INVALID_PARAMETER;
+    }
+    if (app_addr == NULL || found == NULL)
+        return DRMF_ERROR_INVALID_PARAMETER;
+    if (!umbra_value_size_valid(value, value_size))
+        return DRMF_ERROR_INVALID_PARAMETER;
+    if (app_size == 0) {
+        *found = false;
+        return DRMF_SUCCESS;
+    }
+    return umbra_value_in_shadow_memory_arch(map, app_addr, app_size,
+                                             value, value_size, false, found);
 }
 
 DR_EXPORT
@@ -618,6 +894,94 @@ umbra_get_shadow_block_size(IN  umbra_map_t *map,
     return DRMF_SUCCESS;
 }
 
+DR_EXPORT
+drmf_status_t
+umbra_get_fault_stats(IN  umbra_map_t *map,
+                      OUT umbra_fault_stats_t *stats)
+{
+    if (map == NULL || map->magic != UMBRA_MAP_MAGIC) {
+        ASSERT(false, "invalid umbra_map");
+        return DRMF_ERROR_INVALID_PARAMETER;
+    }
+    if (stats == NULL || stats->struct_size != sizeof(*stats))
+        return DRMF_ERROR_INVALID_PARAMETER;
+    umbra_map_lock(map);
+    stats->num_faults = map->num_faults;
+    stats->blocks_created = map->fault_blocks_created;
+    stats->blocks_prefetched = map->fault_blocks_prefetched;
+    umbra_map_unlock(map);
+    return DRMF_SUCCESS;
+}
+
+/* Non-uniform blocks are classified by a sample of every Nth shadow byte */
+#define FOOTPRINT_SAMPLE_STRIDE 64
+
+typedef struct _footprint_data_t {
+    umbra_shadow_footprint_t *footprint;
+    bool scan_values;
+} footprint_data_t;
+
+static bool
+umbra_footprint_block(umbra_map_t *map, umbra_shadow_memory_info_t *info,
+                      void *user_data)
+{
+    footprint_data_t *data = (footprint_data_t *) user_data;
+    umbra_shadow_footprint_t *footprint = data->footprint;
+    uint counts[256];
+    size_t i;
+    uint dominant;
+    if (info->shadow_type == UMBRA_SHADOW_MEMORY_TYPE_SHARED) {
+        footprint->shared_bytes += info->shadow_size;
+        return true;
+    }
+    if (!data->scan_values)
+        return true;
+    if (umbra_shadow_value_search(info->shadow_base, info->shadow_size,
+                                  info->shadow_base[0], 1, false/*!equal*/) == NULL) {
+        footprint->uniform_blocks++;
+        footprint->blocks_by_value[info->shadow_base[0]]++;
+        return true;
+    }
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < info->shadow_size; i += FOOTPRINT_SAMPLE_STRIDE)
+        counts[info->shadow_base[i]]++;
+    dominant = 0;
+    for (i = 1; i < BUFFER_SIZE_ELEMENTS(counts); i++) {
+        if (counts[i] > counts[dominant])
+            dominant = (uint) i;
+    }
+    footprint->blocks_by_value[dominant]++;
+    return true;
+}
+
+DR_EXPORT
+drmf_status_t
+umbra_get_shadow_footprint(IN  umbra_map_t *map,
+                           IN  bool scan_values,
+                           OUT umbra_shadow_footprint_t *footprint)
+{
+    footprint_data_t data;
+    if (map == NULL || map->magic != UMBRA_MAP_MAGIC) {
+        ASSERT(false, "invalid umbra_map");
+        return DRMF_ERROR_INVALID_PARAMETER;
+    }
+    if (footprint == NULL || footprint->struct_size != sizeof(*footprint))
+        return DRMF_ERROR_INVALID_PARAMETER;
+    memset(footprint, 0, sizeof(*footprint));
+    footprint->struct_size = sizeof(*footprint);
+    data.footprint = footprint;
+    data.scan_values = scan_values;
+    umbra_map_lock(map);
+    footprint->committed_bytes = map->committed_blocks * map->shadow_block_size;
+    footprint->peak_committed_bytes =
+        map->peak_committed_blocks * map->shadow_block_size;
+    umbra_get_segment_footprint_arch(map, footprint);
+    /* Without scanning values, the walk only visits the shadow table or bitmaps */
+    umbra_iterate_shadow_memory_arch(map, &data, umbra_footprint_block);
+    umbra_map_unlock(map);
+    return DRMF_SUCCESS;
+}
+
 drmf_status_t
 umbra_iterate_app_memory(IN  umbra_map_t *map,
                          IN  void *user_data,
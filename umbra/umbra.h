@@ -182,6 +182,77 @@ typedef struct _umbra_shadow_memory_info_t {
     umbra_shadow_memory_type_t shadow_type;
 } umbra_shadow_memory_info_t;
 
+/**
+ * Statistics on shadow memory created on touch
+ * (#UMBRA_MAP_CREATE_SHADOW_ON_TOUCH), returned by umbra_get_fault_stats().
+ */
+typedef struct _umbra_fault_stats_t {
+    /** For compatibility.  Set to sizeof(umbra_fault_stats_t). */
+    size_t struct_size;
+    /** Faults on missing shadow memory handled by creating it */
+    uint64 num_faults;
+    /** Shadow blocks created to handle those faults, including prefetched ones */
+    uint64 blocks_created;
+    /**
+     * Shadow blocks created ahead of the faulting block because the faults
+     * were sequential
+     */
+    uint64 blocks_prefetched;
+} umbra_fault_stats_t;
+
+/** The most segments reported by umbra_get_shadow_footprint(). */
+#define UMBRA_MAX_FOOTPRINT_SEGMENTS 8
+
+/** Shadow memory footprint of one application memory segment. */
+typedef struct _umbra_segment_footprint_t {
+    /** Start of the application segment */
+    app_pc app_base;
+    /** End of the application segment */
+    app_pc app_end;
+    /** Shadow memory currently committed for the segment */
+    size_t committed_bytes;
+    /** The high-water mark of \p committed_bytes */
+    size_t peak_committed_bytes;
+} umbra_segment_footprint_t;
+
+/**
+ * Shadow memory footprint of a mapping, returned by umbra_get_shadow_footprint().
+ */
+typedef struct _umbra_shadow_footprint_t {
+    /** For compatibility.  Set to sizeof(umbra_shadow_footprint_t). */
+    size_t struct_size;
+    /**
+     * Shadow memory currently committed in blocks.  On 64-bit this includes
+     * the blocks shared by umbra_share_identical_blocks().
+     */
+    size_t committed_bytes;
+    /** The high-water mark of \p committed_bytes */
+    size_t peak_committed_bytes;
+    /**
+     * Shadow memory in shared blocks.  On 32-bit these are the special shared
+     * blocks (see umbra_create_shared_shadow_block()), which are not committed.
+     * On 64-bit these are the blocks mapped read-only by
+     * umbra_share_identical_blocks(), which are also counted in
+     * \p committed_bytes.
+     */
+    size_t shared_bytes;
+    /**
+     * The number of committed blocks holding one value throughout.
+     * Only computed when values are scanned.
+     */
+    size_t uniform_blocks;
+    /**
+     * The number of committed blocks whose most frequent shadow byte is each
+     * value, estimated from a sample of each non-uniform block.
+     * Only computed when values are scanned.
+     */
+    size_t blocks_by_value[256];
+    /** The number of valid entries in \p segments.  Always zero on 32-bit. */
+    uint num_segments;
+    /** Per-segment footprint */
+    umbra_segment_footprint_t segments[UMBRA_MAX_FOOTPRINT_SEGMENTS];
+} umbra_shadow_footprint_t;
+
 /** Opaque "Umbra map handle" type.  See #umbra_map_t. */
 struct _umbra_map_t;
 /**
@@ -365,6 +436,9 @@ DR_EXPORT
  *
  * \note: part of the shadow memory might not be actually deleted,
  * which will be set to the value specified on \p map creation instead.
+ * On 64-bit, shadow blocks fully covered by the range are only freed if
+ * \p map was created with #UMBRA_MAP_CREATE_SHADOW_ON_TOUCH; otherwise
+ * they are kept and set to that value.
  */
 drmf_status_t
 umbra_delete_shadow_memory(IN  umbra_map_t *map,
@@ -418,6 +492,54 @@ umbra_insert_app_to_shadow(IN  void        *drcontext,
                            IN  reg_id_t    *scratch_regs,
                            IN  int          num_scratch_regs);
 
+DR_EXPORT
+/**
+ * Insert instructions into \p ilist before \p where to translate the
+ * application address stored in \p addr_reg to its shadow address in each of
+ * the \p num_maps mappings in \p maps, sharing the work common to the maps
+ * rather than repeating a full umbra_insert_app_to_shadow() sequence per map.
+ * On return \p addr_reg holds the shadow address for \p maps[0] and
+ * \p shadow_regs[i-1] holds the shadow address for \p maps[i].
+ *
+ * Mappings created by umbra_create_mapping() share a layout, so any set of
+ * them can be combined.  The sequence is cheapest when all the mappings have
+ * the same scale: on 64-bit, each shadow address after the first then takes
+ * two instructions.  On 32-bit x86, the shadow table index is computed once.
+ *
+ * @param[in]  drcontext         The DynamoRIO context for current thread.
+ * @param[in]  maps              The array of mapping objects to use.
+ * @param[in]  num_maps          Number of entries in \p maps.
+ * @param[in]  ilist             The instruction list to be inserted into.
+ * @param[in]  where             The instruction to be inserted before
+ * @param[in]  addr_reg          The Register holding the application address
+ *                               for translation, and holding the shadow memory
+ *                               address for \p maps[0] after translation.
+ * @param[in]  shadow_regs       The array of \p num_maps - 1 registers to hold
+ *                               the shadow memory addresses for the remaining
+ *                               mappings.  They must be distinct from
+ *                               \p addr_reg, from each other, and from the
+ *                               scratch registers.
+ * @param[in]  scratch_regs      The array of scratch registers for use.
+ * @param[in]  num_scratch_regs  Number of scratch register
+ *
+ * \note: \p num_scratch_regs must not be smaller than the value returned from
+ * umbra_num_scratch_regs_for_translation, which does not depend on the
+ * number of mappings.
+ *
+ * \note: This method destroys aflags. Be sure to save and restore aflags before
+ * and after this method is called, e.g. with \p drreg_reserve_aflags().
+ */
+drmf_status_t
+umbra_insert_app_to_shadow_multi(IN  void        *drcontext,
+                                 IN  umbra_map_t **maps,
+                                 IN  uint         num_maps,
+                                 IN  instrlist_t *ilist,
+                                 IN  instr_t     *where,
+                                 IN  reg_id_t     addr_reg,
+                                 IN  reg_id_t    *shadow_regs,
+                                 IN  reg_id_t    *scratch_regs,
+                                 IN  int          num_scratch_regs);
+
 DR_EXPORT
 /**
  * Read shadow memory for application memory at \p app_addr to \p buffer.
@@ -477,6 +599,10 @@ DR_EXPORT
  * \return success code.  If \p app_addr is not a valid application address
  * and the shadow mapping implementation does not support shadow memory
  * for invalid addresses, returns DRMF_ERROR_INVALID_ADDRESS.
+ *
+ * \note: On 64-bit Linux, a whole shadow block of a map created with
+ * #UMBRA_MAP_SHADOW_SHARED_READONLY is shared rather than written (see
+ * umbra_create_shared_shadow_block()).
  */
 drmf_status_t
 umbra_shadow_set_range(IN   umbra_map_t *map,
@@ -514,19 +640,23 @@ DR_EXPORT
 /**
  * Check whether \p value is in the shadow memory for application memory at
  * \p app_addr.
+ * The shadow memory is treated as an array of \p value_size elements
+ * starting at the shadow of \p app_addr.
  *
  * @param[in]     map         The mapping object to use.
  * @param[in,out] app_addr    Starting application memory address.
  *                            Return the application address at which if found.
  * @param[in]     app_size    Application memory size.
- * @param[in]     value       The value to be set in shadow memory.
+ * @param[in]     value       The value to look for in shadow memory.
  * @param[in]     value_size  The value size for \p value, could be 1, 2, 4,
- *                            or 8 (x64). Only 1 is supported now.
+ *                            or 8 (x64).
  * @param[out]    found       Return true if \p value found in the range.
  *
  * \return success code.  If \p app_addr is not a valid application address
  * and the shadow mapping implementation does not support shadow memory
  * for invalid addresses, returns DRMF_ERROR_INVALID_ADDRESS.
+ * If \p value does not fit in \p value_size bytes, returns
+ * DRMF_ERROR_INVALID_PARAMETER.
  */
 drmf_status_t
 umbra_value_in_shadow_memory(IN    umbra_map_t *map,
@@ -536,6 +666,36 @@ umbra_value_in_shadow_memory(IN    umbra_map_t *map,
                              IN    size_t       value_size,
                              OUT   bool        *found);
 
+DR_EXPORT
+/**
+ * Check whether the shadow memory for application memory at \p app_addr
+ * holds any value other than \p value: the counterpart of
+ * umbra_value_in_shadow_memory() for skipping over a run of identical values.
+ * The shadow memory is treated as an array of \p value_size elements
+ * starting at the shadow of \p app_addr.
+ *
+ * @param[in]     map         The mapping object to use.
+ * @param[in,out] app_addr    Starting application memory address.
+ *                            Return the application address of the first
+ *                            element that differs, if found.
+ * @param[in]     app_size    Application memory size.
+ * @param[in]     value       The value to skip over in shadow memory.
+ * @param[in]     value_size  The value size for \p value, could be 1, 2, 4,
+ *                            or 8 (x64).
+ * @param[out]    found       Return true if a different value was found in
+ *                            the range.
+ *
+ * \return success code, with the same failure codes as
+ * umbra_value_in_shadow_memory().
+ */
+drmf_status_t
+umbra_different_value_in_shadow_memory(IN    umbra_map_t *map,
+                                       INOUT app_pc      *app_addr,
+                                       IN    size_t       app_size,
+                                       IN    ptr_uint_t   value,
+                                       IN    size_t       value_size,
+                                       OUT   bool        *found);
+
 DR_EXPORT
 /**
  * Get the shadow block size, which is the unit size Umbra allocates/frees
@@ -548,6 +708,42 @@ drmf_status_t
 umbra_get_shadow_block_size(IN  umbra_map_t *map,
                             OUT size_t *size);
 
+DR_EXPORT
+/**
+ * Get statistics on the shadow memory created on touch
+ * (#UMBRA_MAP_CREATE_SHADOW_ON_TOUCH) for \p map.  When faults on missing
+ * shadow memory come in sequence, Umbra creates a growing number of blocks
+ * ahead of the faulting one in a single allocation.
+ * Shadow memory is only created on a fault on 64-bit, so on 32-bit
+ * all the counts are zero.
+ *
+ * @param[in]  map    The mapping object to use.
+ * @param[out] stats  The statistics.  \p stats->struct_size must be set to
+ *                    sizeof(umbra_fault_stats_t).
+ */
+drmf_status_t
+umbra_get_fault_stats(IN  umbra_map_t *map,
+                      OUT umbra_fault_stats_t *stats);
+
+DR_EXPORT
+/**
+ * Get the shadow memory footprint of \p map: how much shadow memory is
+ * committed and shared, with high-water marks, both overall and per application
+ * segment.  The committed and shared amounts are cheap to query; scanning the
+ * values costs a pass over all committed shadow memory.
+ *
+ * @param[in]  map          The mapping object to use.
+ * @param[in]  scan_values  Whether to classify the committed blocks by value,
+ *                          filling in \p footprint->uniform_blocks and
+ *                          \p footprint->blocks_by_value.
+ * @param[out] footprint    The footprint.  \p footprint->struct_size must be
+ *                          set to sizeof(umbra_shadow_footprint_t).
+ */
+drmf_status_t
+umbra_get_shadow_footprint(IN  umbra_map_t *map,
+                           IN  bool scan_values,
+                           OUT umbra_shadow_footprint_t *footprint);
+
 DR_EXPORT
 /**
  * Iterate the application memory (i.e., any memory that are not part of
@@ -703,8 +899,12 @@ DR_EXPORT
  * \note: Umbra only creates special shared shadow memory if necessary.
  * This routine forces Umbra create one even Umbra may not use it.
  *
- * \note: Umbra does not use special shared shadow block in current x64
- * implementation and always returns DRMF_ERROR_FEATURE_NOT_AVAILABLE.
+ * \note: On 64-bit, the shared block is only available on Linux for
+ * a map created with #UMBRA_MAP_SHADOW_SHARED_READONLY and a 1-byte \p value.
+ * There, umbra_shadow_set_range() maps every whole shadow block it sets
+ * onto the shared block for its value, and \p block is a read-only view of
+ * it, which is unmapped in the child on a fork.  Otherwise this routine
+ * returns DRMF_ERROR_FEATURE_NOT_AVAILABLE.
  */
 drmf_status_t
 umbra_create_shared_shadow_block(IN  umbra_map_t *map,
@@ -723,8 +923,9 @@ DR_EXPORT
  * @param[out] block       The pointer pointing to the base of the shadow block.
  *                         Returns NULL if Umbra fails to find one.
  *
- * \note: Umbra does not use special shared shadow block in current x64
- * implementation and always returns DRMF_ERROR_FEATURE_NOT_AVAILABLE.
+ * \note: On 64-bit, this only finds the shared blocks described in
+ * umbra_create_shared_shadow_block(), and returns
+ * DRMF_ERROR_FEATURE_NOT_AVAILABLE on Windows.
  */
 drmf_status_t
 umbra_get_shared_shadow_block(IN  umbra_map_t *map,
@@ -744,21 +945,62 @@ umbra_shadow_memory_info_init(umbra_shadow_memory_info_t *info)
 DR_EXPORT
 /**
  * Clears and deletes redundant blocks consisting of only default values for \p map.
- * This function is typically invoked when low on memory. It deletes normal blocks
- * and sets mapping entries to the special basic block.
+ * This function is typically invoked when low on memory. On 32-bit it deletes
+ * normal blocks and sets mapping entries to the special basic block.  On 64-bit
+ * it returns the blocks to the system; each is re-created holding the default
+ * value on its next touch.
  *
  * The number of redundant blocks destroyed is returned via \p count. This is an
  * optional parameter and can be set to NULL if the count is not wanted.
  *
  * Assumes that threads are suspended so that Umbra may safely modify shadow memory.
- * It is up to the caller to suspend and resume threads.
+ * It is up to the caller to suspend and resume threads.  If a suspended thread
+ * holds the lock of \p map, returns DRMF_ERROR_ACCESS_DENIED rather than
+ * waiting for it.
  *
- * This feature is only available on 32-bit and requires that the
- * create-on-touch optimization (#UMBRA_MAP_CREATE_SHADOW_ON_TOUCH) is enabled.
+ * This feature requires that the create-on-touch optimization
+ * (#UMBRA_MAP_CREATE_SHADOW_ON_TOUCH) is enabled.
  */
 drmf_status_t
 umbra_clear_redundant_blocks(umbra_map_t *map, uint *count);
 
+DR_EXPORT
+/**
+ * Reduces the shadow memory committed for \p map by sharing blocks with
+ * identical contents.  On 64-bit Linux, each set of identical blocks is
+ * mapped read-only onto a single copy.  A write from inserted
+ * instrumentation to a shared block faults, and Umbra's fault handling
+ * gives the block a private copy-on-write mapping, so only the pages
+ * written are copied.  On 32-bit, a block holding a single value is pointed
+ * at the special shared block for that value, if one has been created by
+ * umbra_create_shared_shadow_block().
+ *
+ * A shared block has the type #UMBRA_SHADOW_MEMORY_TYPE_SHARED.  As for any
+ * shared block, the client must call umbra_replace_shared_shadow_memory()
+ * before writing to one directly, which on 64-bit makes the block writable
+ * in place.  Writes through Umbra routines need no such call.  The block
+ * may be shared again by a later call to this routine, so the client must
+ * not write to it directly while one is running.
+ *
+ * If \p uniform_only is true, only blocks holding a single value throughout
+ * are shared, so a client may assume as on 32-bit that every shared block
+ * is uniform.  On 32-bit only such blocks are ever shared.
+ *
+ * The number of blocks newly shared is returned via \p count. This is an
+ * optional parameter and can be set to NULL if the count is not wanted.
+ *
+ * Assumes that threads are suspended so that Umbra may safely modify shadow memory.
+ * It is up to the caller to suspend and resume threads.  If a suspended thread
+ * holds the lock of \p map, returns DRMF_ERROR_ACCESS_DENIED rather than
+ * waiting for it.
+ *
+ * This feature requires #UMBRA_MAP_SHADOW_SHARED_READONLY.  On 64-bit
+ * Windows it returns DRMF_ERROR_FEATURE_NOT_AVAILABLE, as it does if the
+ * tmpfs file holding the shared copies cannot be created.
+ */
+drmf_status_t
+umbra_share_identical_blocks(umbra_map_t *map, bool uniform_only, uint *count);
+
 DR_EXPORT
 /*
  * A convenience routine that returns granularity information of the passed Umbra map.
@@ -32,7 +32,7 @@
 #include "drmemory_framework.h"
 #include "../framework/drmf.h"
 #include "utils.h"
-#include <string.h> /* for memchr */
+#include <string.h> /* for memset */
 
 #ifdef X64
 # error x86 only
@@ -82,6 +82,7 @@ shadow_table_get_block_offset(umbra_map_t *map, app_pc app_addr)
 static void
 shadow_table_delete_block(umbra_map_t *map, byte *shadow_start)
 {
+    map->committed_blocks--;
     /* Different allocator usage depending on whether redzones are faulty. */
     if (map->options.make_redzone_faulty) {
         nonheap_free(shadow_start - map->options.redzone_size,
@@ -147,6 +148,9 @@ shadow_table_create_block(umbra_map_t *map)
     }
 
     block = shadow_table_init_redzone(map, block);
+    map->committed_blocks++;
+    if (map->committed_blocks > map->peak_committed_blocks)
+        map->peak_committed_blocks = map->committed_blocks;
     LOG(UMBRA_VERBOSE, "created new shadow block "PFX"\n", block);
     return block;
 }
@@ -302,12 +306,9 @@ umbra_num_scratch_regs_for_translation_arch(void)
  * %reg_addr   += table[%reg_index];
  */
 static void
-shadow_table_insert_app_to_shadow_arch(void *drcontext, umbra_map_t *map,
-                                       instrlist_t *ilist, instr_t *where,
-                                       reg_id_t reg_addr, reg_id_t reg_idx)
+shadow_table_insert_index(void *drcontext, instrlist_t *ilist, instr_t *where,
+                          reg_id_t reg_addr, reg_id_t reg_idx)
 {
-    uint disp;
-
     /* %reg_index = %reg_addr */
     PRE(ilist, where, XINST_CREATE_move(drcontext,
                                         opnd_create_reg(reg_idx),
@@ -316,6 +317,16 @@ shadow_table_insert_app_to_shadow_arch(void *drcontext, umbra_map_t *map,
     PRE(ilist, where, INSTR_CREATE_shr(drcontext,
                                        opnd_create_reg(reg_idx),
                                        OPND_CREATE_INT8(APP_BLOCK_BITS)));
+}
+
+/* The index in reg_idx does not depend on the map, so it can be shared */
+static void
+shadow_table_insert_scale_and_add(void *drcontext, umbra_map_t *map,
+                                  instrlist_t *ilist, instr_t *where,
+                                  reg_id_t reg_addr, reg_id_t reg_idx)
+{
+    uint disp;
+
     /* We assume that the addr is aligned and won't keep the offset in byte. */
     if (UMBRA_MAP_SCALE_IS_DOWN(map->options.scale)) {
         /* %reg_addr >>= map->scale*/
@@ -339,6 +350,16 @@ shadow_table_insert_app_to_shadow_arch(void *drcontext, umbra_map_t *map,
                                                              disp,
                                                              OPSZ_PTR)));
 }
+
+static void
+shadow_table_insert_app_to_shadow_arch(void *drcontext, umbra_map_t *map,
+                                       instrlist_t *ilist, instr_t *where,
+                                       reg_id_t reg_addr, reg_id_t reg_idx)
+{
+    shadow_table_insert_index(drcontext, ilist, where, reg_addr, reg_idx);
+    shadow_table_insert_scale_and_add(drcontext, map, ilist, where,
+                                      reg_addr, reg_idx);
+}
 #elif defined(ARM)
 /* code sequence:
  * %reg_idx   = table
@@ -503,6 +524,27 @@ shadow_table_replace_block(umbra_map_t *map, app_pc app_base)
     umbra_map_unlock(map);
 }
 
+/* Points the shadow for the block at app_base at the existing special block
+ * holding value, if there is one and the block is still special.  We never do
+ * this for a normal block as we can't free it (PR 580017).
+ */
+static bool
+shadow_table_swap_special_block(umbra_map_t *map, app_pc app_base,
+                                ptr_uint_t value, size_t value_size)
+{
+    bool swapped = false;
+    byte *block = shadow_table_lookup_special_block(map, value, value_size);
+    if (block == NULL)
+        return false;
+    umbra_map_lock(map);
+    if (shadow_table_use_special_block(map, app_base, NULL, NULL)) {
+        shadow_table_set_block(map, SHADOW_TABLE_INDEX(app_base), block);
+        swapped = true;
+    }
+    umbra_map_unlock(map);
+    return swapped;
+}
+
 static void
 shadow_table_init(umbra_map_t *map)
 {
@@ -800,6 +842,14 @@ umbra_shadow_set_range_arch(IN   umbra_map_t *map,
         size = umbra_map_scale_app_to_shadow(map, iter_size);
         if (shadow_table_is_in_special_block(map, shadow_start,
                                              &blk_val, &blk_val_sz, NULL)) {
+            /* A whole special block can point at the special block for the new
+             * value instead of becoming a normal block.
+             */
+            if (iter_size == map->app_block_size &&
+                shadow_table_swap_special_block(map, app_blk_base, value, value_size)) {
+                shdw_size += size;
+                continue;
+            }
             shadow_table_replace_block(map, app_blk_base);
             shadow_start = shadow_table_app_to_shadow(map, start);
         }
@@ -886,6 +936,7 @@ umbra_value_in_shadow_memory_arch(IN    umbra_map_t *map,
                                   IN    size_t  app_size,
                                   IN    ptr_uint_t value,
                                   IN    size_t value_size,
+                                  IN    bool equal,
                                   OUT   bool  *found)
 {
     /* i#1260: end pointers are all closed (i.e., inclusive) to handle overflow */
@@ -896,8 +947,6 @@ umbra_value_in_shadow_memory_arch(IN    umbra_map_t *map,
     ptr_uint_t val;
     size_t valsz, shadow_size;
 
-    if (value > USHRT_MAX || value_size != 1)
-        return DRMF_ERROR_NOT_IMPLEMENTED;
     if (POINTER_OVERFLOW_ON_ADD(*app_addr, app_size-1)) /* just hitting top is ok */
         return DRMF_ERROR_INVALID_SIZE;
 
@@ -907,7 +956,7 @@ umbra_value_in_shadow_memory_arch(IN    umbra_map_t *map,
         if (shadow_table_use_default_block(map, app_blk_base))
             return DRMF_ERROR_INVALID_PARAMETER;
         if (shadow_table_use_special_block(map, app_blk_base, &val, &valsz)) {
-            if (val == value && valsz == value_size) {
+            if (umbra_value_matches_fill(value, value_size, val, valsz) == equal) {
                 *app_addr = start;
                 *found = true;
                 return DRMF_SUCCESS;
@@ -916,7 +965,8 @@ umbra_value_in_shadow_memory_arch(IN    umbra_map_t *map,
         }
         shadow_start = shadow_table_app_to_shadow(map, start);
         shadow_size  = umbra_map_scale_app_to_shadow(map, iter_size);
-        shadow_addr  = memchr(shadow_start, (int)value, shadow_size);
+        shadow_addr  = umbra_shadow_value_search(shadow_start, shadow_size,
+                                                 value, value_size, equal);
         if (shadow_addr != NULL) {
             *app_addr = start +
                 umbra_map_scale_shadow_to_app(map, shadow_addr - shadow_start);
@@ -944,6 +994,54 @@ umbra_insert_app_to_shadow_arch(void *drcontext,
     return DRMF_SUCCESS;
 }
 
+/* code sequence on x86:
+ * %reg_index   = %reg_addr;
+ * %reg_index >>= 16;
+ * for each map i after the first:
+ *   %shadow_reg_i   = %reg_addr;
+ *   %shadow_reg_i >>= map_i->scale;
+ *   %shadow_reg_i  += table_i[%reg_index];
+ * %reg_addr  >>= map_0->scale;
+ * %reg_addr   += table_0[%reg_index];
+ * On ARM the table address is folded into the index, so only the copies of
+ * the app address are shared.
+ */
+drmf_status_t
+umbra_insert_app_to_shadow_multi_arch(void *drcontext,
+                                      umbra_map_t **maps,
+                                      uint num_maps,
+                                      instrlist_t *ilist,
+                                      instr_t *where,
+                                      reg_id_t reg_addr,
+                                      reg_id_t *shadow_regs,
+                                      reg_id_t *scratch_regs,
+                                      int num_scratch_regs)
+{
+    uint i;
+    if (num_scratch_regs < umbra_num_scratch_regs_for_translation_arch() ||
+        scratch_regs == NULL)
+        return DRMF_ERROR_INVALID_PARAMETER;
+#ifdef X86
+    shadow_table_insert_index(drcontext, ilist, where, reg_addr, scratch_regs[0]);
+#endif
+    for (i = 1; i < num_maps; i++) {
+        PRE(ilist, where, XINST_CREATE_move(drcontext,
+                                            opnd_create_reg(shadow_regs[i-1]),
+                                            opnd_create_reg(reg_addr)));
+    }
+    for (i = 0; i < num_maps; i++) {
+        reg_id_t reg = (i == 0) ? reg_addr : shadow_regs[i-1];
+#ifdef X86
+        shadow_table_insert_scale_and_add(drcontext, maps[i], ilist, where,
+                                          reg, scratch_regs[0]);
+#else
+        shadow_table_insert_app_to_shadow_arch(drcontext, maps[i], ilist, where,
+                                               reg, scratch_regs[0]);
+#endif
+    }
+    return DRMF_SUCCESS;
+}
+
 drmf_status_t
 umbra_iterate_shadow_memory_arch(umbra_map_t *map,
                                  void *user_data,
@@ -1103,6 +1201,14 @@ umbra_get_shared_shadow_block_arch(IN  umbra_map_t *map,
     return DRMF_SUCCESS;
 }
 
+void
+umbra_get_segment_footprint_arch(umbra_map_t *map,
+                                 umbra_shadow_footprint_t *footprint)
+{
+    /* The shadow table covers the whole address space with no segments */
+    footprint->num_segments = 0;
+}
+
 bool
 umbra_handle_fault(void *drcontext, byte *target, dr_mcontext_t *raw_mc,
                    dr_mcontext_t *mc)
@@ -1127,7 +1233,8 @@ umbra_clear_redundant_blocks(umbra_map_t *map, uint *count)
         return DRMF_ERROR_INVALID_PARAMETER;
     }
 
-    umbra_map_lock(map);
+    if (!umbra_map_trylock(map))
+        return DRMF_ERROR_ACCESS_DENIED;
     for (i = 0; i < SHADOW_TABLE_ENTRIES; i++) {
         shadow_data = shadow_table_get_block(map, i);
         /* Redundant blocks must be "normal". */
@@ -1160,3 +1267,45 @@ umbra_clear_redundant_blocks(umbra_map_t *map, uint *count)
 
     return DRMF_SUCCESS;
 }
+
+drmf_status_t
+umbra_share_identical_blocks(umbra_map_t *map, bool uniform_only, uint *count)
+{
+    byte *shadow_data, *special_block;
+    uint i;
+
+    if (map == NULL)
+        return DRMF_ERROR_INVALID_PARAMETER;
+
+    if (count != NULL)
+        *count = 0;
+
+    if (!TEST(UMBRA_MAP_SHADOW_SHARED_READONLY, map->options.flags))
+        return DRMF_ERROR_INVALID_PARAMETER;
+
+    /* A normal block is writable, so only blocks that hold a single value
+     * throughout can be shared here, by pointing their entries at the special
+     * block for that value.  Blocks with other contents are left alone even
+     * if !uniform_only.
+     */
+    if (!umbra_map_trylock(map))
+        return DRMF_ERROR_ACCESS_DENIED;
+    for (i = 0; i < SHADOW_TABLE_ENTRIES; i++) {
+        shadow_data = shadow_table_get_block(map, i);
+        if (!shadow_table_is_in_normal_block(map, shadow_data))
+            continue;
+        if (umbra_shadow_value_search(shadow_data, map->shadow_block_size,
+                                      shadow_data[0], 1, false/*!equal*/) != NULL)
+            continue;
+        special_block = shadow_table_lookup_special_block(map, shadow_data[0], 1);
+        if (special_block == NULL)
+            continue;
+        shadow_table_delete_block(map, shadow_data);
+        shadow_table_set_block(map, i, special_block);
+        if (count != NULL)
+            (*count)++;
+    }
+    umbra_map_unlock(map);
+
+    return DRMF_SUCCESS;
+}
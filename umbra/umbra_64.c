@@ -31,7 +31,10 @@
 #include "drmemory_framework.h"
 #include "../framework/drmf.h"
 #include "utils.h"
-#include <string.h> /* for memchr */
+#ifdef UNIX
+# include "hashtable.h"
+#endif
+#include <string.h> /* for memset */
 
 #ifndef X64
 # error x64 only
@@ -283,12 +286,19 @@ static ptr_uint_t segment_base(uint num_seg_bits, app_pc pc)
 /* we pick 64KB because it is the minmal Windows kernel alloc size */
 #define ALLOC_UNIT_SIZE   (1 << 16) /* 64KB */
 
-#define BIT_PER_BYTE 8
-#define BITMAP_BYTE_INDEX(map, addr, base) \
-    (((addr) - (base)) / ((map)->shadow_block_size * BIT_PER_BYTE))
-#define BITMAP_BIT_INDEX(map, addr, base)  \
-    ((ptr_uint_t)(((addr) - (base)) / (ptr_uint_t)(map)->shadow_block_size) & \
-     (ptr_uint_t)(BIT_PER_BYTE - 1))
+/* The committed shadow blocks of a segment are tracked in a two-level bitmap:
+ * one bit per block, plus a summary with one bit per bitmap word that is set
+ * when any block in that word is committed.  Walks over the committed blocks
+ * then scan 1/1024 of the bitmap rather than all of it.
+ */
+#define BIT_PER_WORD 32
+#define BLOCK_INDEX(map, addr, base) \
+    ((size_t)((addr) - (base)) / (map)->shadow_block_size)
+#define WORD_INDEX(idx) ((idx) / BIT_PER_WORD)
+#define WORD_BIT(idx)   (1U << ((idx) % BIT_PER_WORD))
+
+/* The most blocks created for one fault: 4MB of shadow with 64KB blocks */
+#define MAX_FAULT_PREFETCH_BLOCKS 64
 
 typedef struct _app_segment_t {
     /* app segment range */
@@ -302,11 +312,20 @@ typedef struct _app_segment_t {
      * instead, we allocate a chunk (64KB or lager) at a time and use
      * bitmap to track if shadow memory is allocated.
      */
-    byte  *shadow_bitmap[MAX_NUM_MAPS];
+    uint  *shadow_bitmap[MAX_NUM_MAPS];
+    uint  *shadow_summary[MAX_NUM_MAPS];
+    /* committed shadow blocks, and the most ever committed */
+    size_t committed_blocks[MAX_NUM_MAPS];
+    size_t peak_committed_blocks[MAX_NUM_MAPS];
     /* for shadow's shadow */
     byte  *reserve_base[MAX_NUM_MAPS];
     byte  *reserve_end[MAX_NUM_MAPS];
     umbra_map_t *map[MAX_NUM_MAPS];
+    /* Shadow creation on fault: the block index just past the blocks created
+     * for the last fault, and how many blocks that fault created.
+     */
+    size_t fault_next_block[MAX_NUM_MAPS];
+    uint   fault_prefetch[MAX_NUM_MAPS];
 } app_segment_t;
 
 #ifdef UNIX /* TODO i#1438: Update for Mac64. */
@@ -448,6 +467,26 @@ umbra_xl8_app_to_shadow(const umbra_map_t *map, app_pc pc)
 /***************************************************************************
  * SEGMENT ROUTINES
  */
+
+static size_t
+segment_num_blocks(umbra_map_t *map, app_segment_t *seg)
+{
+    return (seg->shadow_end[map->index] - seg->shadow_base[map->index]) /
+        map->shadow_block_size;
+}
+
+static size_t
+segment_bitmap_words(umbra_map_t *map, app_segment_t *seg)
+{
+    return ALIGN_FORWARD(segment_num_blocks(map, seg), BIT_PER_WORD) / BIT_PER_WORD;
+}
+
+static size_t
+segment_summary_words(umbra_map_t *map, app_segment_t *seg)
+{
+    return ALIGN_FORWARD(segment_bitmap_words(map, seg), BIT_PER_WORD) / BIT_PER_WORD;
+}
+
 static bool
 segment_overlap(app_pc base1, app_pc end1, app_pc base2, app_pc end2)
 {
@@ -469,10 +508,12 @@ umbra_add_shadow_segment(umbra_map_t *map, app_segment_t *seg)
         umbra_xl8_app_to_shadow(map, seg->app_end);
     ASSERT(seg->shadow_end[seg_map_idx] > seg->shadow_base[seg_map_idx],
            "wrong shadow segment range");
-    size = seg->shadow_end[seg_map_idx] - seg->shadow_base[seg_map_idx];
-    size = size / map->shadow_block_size / BIT_PER_BYTE;
+    size = segment_bitmap_words(map, seg) * sizeof(uint);
     seg->shadow_bitmap[seg_map_idx] = global_alloc(size, HEAPSTAT_SHADOW);
     memset(seg->shadow_bitmap[seg_map_idx], 0, size);
+    size = segment_summary_words(map, seg) * sizeof(uint);
+    seg->shadow_summary[seg_map_idx] = global_alloc(size, HEAPSTAT_SHADOW);
+    memset(seg->shadow_summary[seg_map_idx], 0, size);
     seg->reserve_base[seg_map_idx] =
         umbra_xl8_app_to_shadow(map, seg->shadow_base[seg_map_idx]);
     seg->reserve_end[seg_map_idx] =
@@ -659,50 +700,660 @@ umbra_address_space_init()
     return true;
 }
 
-static void
-umbra_set_shadow_bitmap(umbra_map_t *map, app_pc shdw_addr)
+/* Returns the segment whose shadow for map contains shdw_addr, or NULL */
+static app_segment_t *
+umbra_shadow_segment(umbra_map_t *map, app_pc shdw_addr)
 {
     uint i, map_idx = map->index;
     for (i = 0; i < MAX_NUM_APP_SEGMENTS; i++) {
         if (app_segments[i].app_used &&
             app_segments[i].map[map_idx] == map &&
             app_segments[i].shadow_base[map_idx] <= shdw_addr &&
-            app_segments[i].shadow_end[map_idx]  >  shdw_addr) {
-            uint byte_idx =
-                BITMAP_BYTE_INDEX(map, shdw_addr,
-                                  app_segments[i].shadow_base[map_idx]);
-            uint bit_idx =
-                BITMAP_BIT_INDEX(map, shdw_addr,
-                                 app_segments[i].shadow_base[map_idx]);
-            app_segments[i].shadow_bitmap[map_idx][byte_idx] |= (1<<bit_idx);
-            return;
-        }
+            app_segments[i].shadow_end[map_idx]  >  shdw_addr)
+            return &app_segments[i];
+    }
+    return NULL;
+}
+
+static void
+umbra_set_shadow_bitmap(umbra_map_t *map, app_pc shdw_addr)
+{
+    uint map_idx = map->index;
+    app_segment_t *seg = umbra_shadow_segment(map, shdw_addr);
+    size_t idx;
+    if (seg == NULL)
+        return;
+    idx = BLOCK_INDEX(map, shdw_addr, seg->shadow_base[map_idx]);
+    if (TEST(WORD_BIT(idx), seg->shadow_bitmap[map_idx][WORD_INDEX(idx)]))
+        return;
+    seg->shadow_bitmap[map_idx][WORD_INDEX(idx)] |= WORD_BIT(idx);
+    seg->shadow_summary[map_idx][WORD_INDEX(WORD_INDEX(idx))] |=
+        WORD_BIT(WORD_INDEX(idx));
+    seg->committed_blocks[map_idx]++;
+    if (seg->committed_blocks[map_idx] > seg->peak_committed_blocks[map_idx])
+        seg->peak_committed_blocks[map_idx] = seg->committed_blocks[map_idx];
+    map->committed_blocks++;
+    if (map->committed_blocks > map->peak_committed_blocks)
+        map->peak_committed_blocks = map->committed_blocks;
+}
+
+static void
+umbra_clear_shadow_bitmap(umbra_map_t *map, app_pc shdw_addr)
+{
+    uint map_idx = map->index;
+    app_segment_t *seg = umbra_shadow_segment(map, shdw_addr);
+    size_t idx;
+    if (seg == NULL)
+        return;
+    idx = BLOCK_INDEX(map, shdw_addr, seg->shadow_base[map_idx]);
+    if (!TEST(WORD_BIT(idx), seg->shadow_bitmap[map_idx][WORD_INDEX(idx)]))
+        return;
+    seg->shadow_bitmap[map_idx][WORD_INDEX(idx)] &= ~WORD_BIT(idx);
+    seg->committed_blocks[map_idx]--;
+    map->committed_blocks--;
+    if (seg->shadow_bitmap[map_idx][WORD_INDEX(idx)] == 0) {
+        seg->shadow_summary[map_idx][WORD_INDEX(WORD_INDEX(idx))] &=
+            ~WORD_BIT(WORD_INDEX(idx));
     }
 }
 
 static bool
 umbra_shadow_block_exist(umbra_map_t *map, app_pc shdw_addr)
+{
+    uint map_idx = map->index;
+    app_segment_t *seg = umbra_shadow_segment(map, shdw_addr);
+    size_t idx;
+    if (seg == NULL)
+        return false;
+    idx = BLOCK_INDEX(map, shdw_addr, seg->shadow_base[map_idx]);
+    return TEST(WORD_BIT(idx), seg->shadow_bitmap[map_idx][WORD_INDEX(idx)]);
+}
+
+/* Finds the first committed block of seg whose index is at least from.
+ * Returns false if there is none.
+ */
+static bool
+umbra_find_committed_block(umbra_map_t *map, app_segment_t *seg, size_t from,
+                           size_t *found OUT)
+{
+    uint *bitmap = seg->shadow_bitmap[map->index];
+    uint *summary = seg->shadow_summary[map->index];
+    size_t num_words = segment_bitmap_words(map, seg);
+    size_t num_summary_words = segment_summary_words(map, seg);
+    size_t word = WORD_INDEX(from), sword;
+    uint bits;
+    if (word >= num_words)
+        return false;
+    bits = bitmap[word] & ~(WORD_BIT(from) - 1);
+    if (bits != 0) {
+        *found = word * BIT_PER_WORD + lowest_set_bit(bits);
+        return true;
+    }
+    /* Use the summary to find the next non-empty bitmap word */
+    for (word++, sword = WORD_INDEX(word); sword < num_summary_words; sword++) {
+        bits = summary[sword];
+        if (sword == WORD_INDEX(word))
+            bits &= ~(WORD_BIT(word) - 1);
+        if (bits != 0) {
+            word = sword * BIT_PER_WORD + lowest_set_bit(bits);
+            ASSERT(word < num_words && bitmap[word] != 0, "summary out of synch");
+            *found = word * BIT_PER_WORD + lowest_set_bit(bitmap[word]);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Returns the application address of the first committed shadow block of map
+ * that covers any of [app_addr, app_last], or NULL if there is none.
+ */
+static app_pc
+umbra_next_committed_app_block(umbra_map_t *map, app_pc app_addr, app_pc app_last)
 {
     uint i, map_idx = map->index;
+    app_pc next = NULL;
     for (i = 0; i < MAX_NUM_APP_SEGMENTS; i++) {
-        if (app_segments[i].app_used &&
-            app_segments[i].map[map_idx] == map &&
-            app_segments[i].shadow_base[map_idx] <= shdw_addr &&
-            app_segments[i].shadow_end[map_idx]  >  shdw_addr) {
-            uint byte_idx =
-                BITMAP_BYTE_INDEX(map, shdw_addr,
-                                  app_segments[i].shadow_base[map_idx]);
-            uint bit_idx =
-                BITMAP_BIT_INDEX(map, shdw_addr,
-                                 app_segments[i].shadow_base[map_idx]);
-            if (TEST(1 << bit_idx,
-                     app_segments[i].shadow_bitmap[map_idx][byte_idx]))
-                return true;
-            else
+        app_segment_t *seg = &app_segments[i];
+        size_t from = 0, idx;
+        app_pc app_blk;
+        if (!seg->app_used || seg->map[map_idx] != map ||
+            seg->app_end <= app_addr || seg->app_base > app_last)
+            continue;
+        if (app_addr > seg->app_base) {
+            from = BLOCK_INDEX(map, umbra_xl8_app_to_shadow(map, app_addr),
+                               seg->shadow_base[map_idx]);
+        }
+        if (!umbra_find_committed_block(map, seg, from, &idx))
+            continue;
+        app_blk = seg->app_base +
+            umbra_map_scale_shadow_to_app(map, idx * map->shadow_block_size);
+        if (app_blk <= app_last && (next == NULL || app_blk < next))
+            next = app_blk;
+    }
+    return next;
+}
+
+/* Calls block_func on each committed shadow block of map, in address order
+ * within each segment, until it returns false.  block_func may free the
+ * block it is passed.  Returns false if stopped early.
+ */
+static bool
+umbra_iterate_committed_blocks(umbra_map_t *map,
+                               bool (*block_func)(umbra_map_t *map,
+                                                  app_segment_t *seg,
+                                                  byte *blk, void *data),
+                               void *data)
+{
+    uint i, map_idx = map->index;
+    for (i = 0; i < MAX_NUM_APP_SEGMENTS; i++) {
+        app_segment_t *seg = &app_segments[i];
+        size_t idx = 0;
+        if (!seg->app_used || seg->map[map_idx] != map)
+            continue;
+        while (umbra_find_committed_block(map, seg, idx, &idx)) {
+            if (!block_func(map, seg, seg->shadow_base[map_idx] +
+                            idx * map->shadow_block_size, data))
                 return false;
+            idx++;
         }
     }
+    return true;
+}
+
+/***************************************************************************
+ * SHADOW BLOCK SHARING
+ *
+ * umbra_share_identical_blocks() maps committed blocks with identical
+ * contents onto a single copy kept in an unlinked tmpfs file, where each
+ * distinct content occupies one block-sized "slot".  A shared block is a
+ * read-only shared mapping of its slot.  A write to it from instrumentation
+ * faults, and umbra_handle_fault() replaces it in place with a private
+ * mapping of the same slot, so the kernel copies only the pages written.
+ * Umbra's own writers do the same before writing.  A slot holds a reference
+ * from every block mapping it either way, and is only rewritten for new
+ * contents once none is left.
+ */
+
+#ifdef UNIX
+# define DEDUP_FILE_DIR "/dev/shm"
+# define DEDUP_SLOT_TABLE_BITS 10
+# define DEDUP_BLOCK_TABLE_BITS 12
+
+typedef struct _dedup_slot_t {
+    uint64 offs;                /* offset of the contents in the file */
+    byte *view;                 /* read-only mapping for comparing contents */
+    uint hash;
+    uint refcount;              /* blocks mapping this slot */
+    struct _dedup_slot_t *next; /* same hash, or next free slot */
+} dedup_slot_t;
+
+typedef struct _dedup_block_t {
+    dedup_slot_t *slot;
+    bool writable;              /* a private copy-on-write mapping */
+} dedup_block_t;
+
+/* All fields are protected by the map lock */
+typedef struct _dedup_state_t {
+    bool initialized;
+    umbra_map_t *map;
+    file_t file;
+    uint64 file_size;
+    hashtable_t slots;          /* hash => chain of dedup_slot_t */
+    hashtable_t blocks;         /* block base => dedup_block_t */
+    dedup_slot_t *free_slots;
+    uint num_readonly;          /* blocks currently mapped read-only */
+    /* The slot holding nothing but each value, once needed.  Each holds a
+     * reference so it is never rewritten.
+     */
+    dedup_slot_t *uniform[UCHAR_MAX + 1];
+} dedup_state_t;
+
+static dedup_state_t dedup_state[MAX_NUM_MAPS];
+
+static void
+dedup_block_free(void *entry)
+{
+    global_free(entry, sizeof(dedup_block_t), HEAPSTAT_SHADOW);
+}
+
+static bool
+dedup_init(umbra_map_t *map, dedup_state_t *dd)
+{
+    char path[MAXIMUM_PATH];
+    if (dd->initialized)
+        return true;
+    /* The file is only needed while something maps it */
+    dr_snprintf(path, BUFFER_SIZE_ELEMENTS(path), "%s/umbra.%d.%d",
+                DEDUP_FILE_DIR, dr_get_process_id(), map->index);
+    NULL_TERMINATE_BUFFER(path);
+    dd->file = dr_open_file(path, DR_FILE_READ | DR_FILE_WRITE_REQUIRE_NEW |
+                            DR_FILE_ALLOW_LARGE);
+    if (dd->file == INVALID_FILE) {
+        LOG(1, "failed to create shadow sharing file %s\n", path);
+        return false;
+    }
+    dr_delete_file(path);
+    dd->file_size = 0;
+    dd->free_slots = NULL;
+    dd->num_readonly = 0;
+    memset(dd->uniform, 0, sizeof(dd->uniform));
+    dd->map = map;
+    hashtable_init(&dd->slots, DEDUP_SLOT_TABLE_BITS, HASH_INTPTR, false/*!strdup*/);
+    hashtable_init_ex(&dd->blocks, DEDUP_BLOCK_TABLE_BITS, HASH_INTPTR,
+                      false/*!strdup*/, false/*map lock*/, dedup_block_free,
+                      NULL, NULL);
+    dd->initialized = true;
+    return true;
+}
+
+/* Tears down the sharing state of map.  Every block that maps a slot has
+ * been freed or privatized by the caller.
+ */
+static void
+dedup_exit(umbra_map_t *map, dedup_state_t *dd)
+{
+    uint i;
+    dedup_slot_t *slot, *next;
+    if (!dd->initialized)
+        return;
+    ASSERT(dd->blocks.entries == 0, "blocks still map slots");
+    for (i = 0; i < HASHTABLE_SIZE(dd->slots.table_bits); i++) {
+        hash_entry_t *he;
+        for (he = dd->slots.table[i]; he != NULL; he = he->next) {
+            for (slot = (dedup_slot_t *) he->payload; slot != NULL; slot = next) {
+                next = slot->next;
+                dr_unmap_file(slot->view, map->shadow_block_size);
+                global_free(slot, sizeof(*slot), HEAPSTAT_SHADOW);
+            }
+        }
+    }
+    for (slot = dd->free_slots; slot != NULL; slot = next) {
+        next = slot->next;
+        dr_unmap_file(slot->view, map->shadow_block_size);
+        global_free(slot, sizeof(*slot), HEAPSTAT_SHADOW);
+    }
+    hashtable_delete(&dd->slots);
+    hashtable_delete(&dd->blocks);
+    dr_close_file(dd->file);
+    memset(dd->uniform, 0, sizeof(dd->uniform));
+    dd->initialized = false;
+}
+
+static uint
+dedup_hash(byte *blk, size_t size)
+{
+    ptr_uint_t *word = (ptr_uint_t *) blk, *end = (ptr_uint_t *)(blk + size);
+    ptr_uint_t hash = 0;
+    for (; word < end; word++)
+        hash = (hash ^ *word) * 0x100000001b3ULL; /* FNV-1a prime */
+    return (uint)(hash ^ (hash >> 32));
+}
+
+static dedup_slot_t *
+dedup_lookup_slot(umbra_map_t *map, dedup_state_t *dd, byte *blk, uint hash)
+{
+    dedup_slot_t *slot;
+    for (slot = (dedup_slot_t *) hashtable_lookup(&dd->slots, (void *)(ptr_uint_t)hash);
+         slot != NULL; slot = slot->next) {
+        if (memcmp(slot->view, blk, map->shadow_block_size) == 0)
+            return slot;
+    }
+    return NULL;
+}
+
+/* Stores the contents of blk in a slot, reusing a free one if possible */
+static dedup_slot_t *
+dedup_new_slot(umbra_map_t *map, dedup_state_t *dd, byte *blk, uint hash)
+{
+    dedup_slot_t *slot = dd->free_slots;
+    if (slot != NULL)
+        dd->free_slots = slot->next;
+    else {
+        slot = global_alloc(sizeof(*slot), HEAPSTAT_SHADOW);
+        slot->offs = dd->file_size;
+        slot->view = NULL;
+    }
+    if (!dr_file_seek(dd->file, slot->offs, DR_SEEK_SET) ||
+        dr_write_file(dd->file, blk, map->shadow_block_size) !=
+        (ssize_t)map->shadow_block_size) {
+        LOG(1, "failed to write shadow sharing file\n");
+        slot->next = dd->free_slots;
+        dd->free_slots = slot;
+        return NULL;
+    }
+    if (slot->offs == dd->file_size)
+        dd->file_size += map->shadow_block_size;
+    if (slot->view == NULL) {
+        size_t size = map->shadow_block_size;
+        slot->view = dr_map_file(dd->file, &size, slot->offs, NULL,
+                                 DR_MEMPROT_READ, 0);
+        if (slot->view == NULL) {
+            slot->next = dd->free_slots;
+            dd->free_slots = slot;
+            return NULL;
+        }
+    }
+    slot->hash = hash;
+    slot->refcount = 0;
+    slot->next = (dedup_slot_t *) hashtable_lookup(&dd->slots, (void *)(ptr_uint_t)hash);
+    hashtable_add_replace(&dd->slots, (void *)(ptr_uint_t)hash, slot);
+    return slot;
+}
+
+static void
+dedup_release_slot(dedup_state_t *dd, dedup_slot_t *slot)
+{
+    dedup_slot_t *head, *prev;
+    ASSERT(slot->refcount > 0, "slot refcount underflow");
+    if (--slot->refcount > 0)
+        return;
+    head = (dedup_slot_t *) hashtable_lookup(&dd->slots, (void *)(ptr_uint_t)slot->hash);
+    if (head == slot) {
+        if (slot->next != NULL)
+            hashtable_add_replace(&dd->slots, (void *)(ptr_uint_t)slot->hash, slot->next);
+        else
+            hashtable_remove(&dd->slots, (void *)(ptr_uint_t)slot->hash);
+    } else {
+        for (prev = head; prev != NULL && prev->next != slot; prev = prev->next)
+            ; /* nothing */
+        ASSERT(prev != NULL, "slot missing from its chain");
+        if (prev != NULL)
+            prev->next = slot->next;
+    }
+    slot->next = dd->free_slots;
+    dd->free_slots = slot;
+}
+
+/* Replaces the committed block at blk with a read-only mapping of slot */
+static bool
+dedup_map_block(umbra_map_t *map, dedup_state_t *dd, byte *blk, dedup_slot_t *slot)
+{
+    dedup_block_t *entry = (dedup_block_t *) hashtable_lookup(&dd->blocks, blk);
+    size_t size = map->shadow_block_size;
+    if (dr_map_file(dd->file, &size, slot->offs, blk, DR_MEMPROT_READ,
+                    DR_MAP_FIXED) != blk) {
+        LOG(1, "failed to share shadow block "PFX"\n", blk);
+        return false;
+    }
+    slot->refcount++;
+    if (entry == NULL) {
+        entry = global_alloc(sizeof(*entry), HEAPSTAT_SHADOW);
+        hashtable_add(&dd->blocks, blk, entry);
+        dd->num_readonly++;
+    } else {
+        dedup_release_slot(dd, entry->slot);
+        if (entry->writable)
+            dd->num_readonly++;
+    }
+    entry->slot = slot;
+    entry->writable = false;
+    return true;
+}
+
+/* Returns the slot holding nothing but value, or NULL on failure */
+static dedup_slot_t *
+dedup_uniform_slot(umbra_map_t *map, dedup_state_t *dd, byte value)
+{
+    dedup_slot_t *slot = dd->uniform[value];
+    byte *buf;
+    uint hash;
+    if (slot != NULL)
+        return slot;
+    buf = global_alloc(map->shadow_block_size, HEAPSTAT_SHADOW);
+    memset(buf, value, map->shadow_block_size);
+    hash = dedup_hash(buf, map->shadow_block_size);
+    slot = dedup_lookup_slot(map, dd, buf, hash);
+    if (slot == NULL)
+        slot = dedup_new_slot(map, dd, buf, hash);
+    global_free(buf, map->shadow_block_size, HEAPSTAT_SHADOW);
+    if (slot != NULL) {
+        slot->refcount++;
+        dd->uniform[value] = slot;
+    }
+    return slot;
+}
+
+/* Fills the whole block at blk, which need not exist yet, with value by
+ * mapping the slot holding nothing but value, in place of writing it.
+ * Returns false if the caller must write the block instead.
+ */
+static bool
+dedup_map_uniform_block(umbra_map_t *map, byte *blk, byte value)
+{
+    dedup_state_t *dd = &dedup_state[map->index];
+    dedup_block_t *entry;
+    dedup_slot_t *slot;
+    bool res = false;
+    umbra_map_lock(map);
+    if (dedup_init(map, dd)) {
+        slot = dedup_uniform_slot(map, dd, value);
+        entry = (dedup_block_t *) hashtable_lookup(&dd->blocks, blk);
+        if (slot != NULL && entry != NULL && entry->slot == slot && !entry->writable)
+            res = true; /* nothing to do */
+        else if (slot != NULL && dedup_map_block(map, dd, blk, slot)) {
+            umbra_set_shadow_bitmap(map, blk);
+            res = true;
+        }
+    }
+    umbra_map_unlock(map);
+    return res;
+}
+
+/* Makes the shared block at blk writable.  The caller must hold the map lock.
+ * Returns false if blk is not a shared block.
+ */
+static bool
+dedup_make_writable(umbra_map_t *map, byte *blk)
+{
+    dedup_state_t *dd = &dedup_state[map->index];
+    dedup_block_t *entry;
+    size_t size = map->shadow_block_size;
+    if (dd->num_readonly == 0)
+        return false;
+    entry = (dedup_block_t *) hashtable_lookup(&dd->blocks, blk);
+    if (entry == NULL || entry->writable)
+        return false;
+    /* Replacing the mapping in one step leaves no window where the block is
+     * missing for other threads.
+     */
+    if (dr_map_file(dd->file, &size, entry->slot->offs, blk,
+                    DR_MEMPROT_READ | DR_MEMPROT_WRITE,
+                    DR_MAP_PRIVATE | DR_MAP_FIXED) != blk) {
+        ASSERT(false, "failed to make shared shadow block writable");
+        return false;
+    }
+    entry->writable = true;
+    dd->num_readonly--;
+    LOG(UMBRA_VERBOSE, "shadow block "PFX" unshared\n", blk);
+    return true;
+}
+
+/* Gives the block at blk its own anonymous memory, independent of the file */
+static void
+dedup_privatize_block(umbra_map_t *map, byte *blk, byte *buf)
+{
+    memcpy(buf, blk, map->shadow_block_size);
+    dr_unmap_file(blk, map->shadow_block_size);
+    if (dr_raw_mem_alloc(map->shadow_block_size, DR_MEMPROT_READ | DR_MEMPROT_WRITE,
+                         blk) != blk) {
+        ASSERT(false, "failed to re-create shadow block");
+        return;
+    }
+    memcpy(blk, buf, map->shadow_block_size);
+}
+
+/* Stops sharing: each block that maps a slot is given back anonymous memory
+ * holding the same values, if privatize, or else is just unmapped.
+ */
+static void
+dedup_unshare_all(umbra_map_t *map, bool privatize)
+{
+    dedup_state_t *dd = &dedup_state[map->index];
+    byte *buf = NULL;
+    uint i;
+    if (!dd->initialized)
+        return;
+    if (privatize)
+        buf = global_alloc(map->shadow_block_size, HEAPSTAT_SHADOW);
+    for (i = 0; i < HASHTABLE_SIZE(dd->blocks.table_bits); i++) {
+        hash_entry_t *he;
+        for (he = dd->blocks.table[i]; he != NULL; he = he->next) {
+            byte *blk = (byte *) he->key;
+            if (privatize)
+                dedup_privatize_block(map, blk, buf);
+            else {
+                umbra_clear_shadow_bitmap(map, blk);
+                dr_unmap_file(blk, map->shadow_block_size);
+            }
+        }
+    }
+    if (buf != NULL)
+        global_free(buf, map->shadow_block_size, HEAPSTAT_SHADOW);
+    hashtable_clear(&dd->blocks);
+    dd->num_readonly = 0;
+    dedup_exit(map, dd);
+}
+
+/* Forgets the block at blk, which is being freed.  Returns whether blk
+ * mapped a slot.  The caller must hold the map lock.
+ */
+static bool
+dedup_forget_block(umbra_map_t *map, byte *blk)
+{
+    dedup_state_t *dd = &dedup_state[map->index];
+    dedup_block_t *entry;
+    if (!dd->initialized)
+        return false;
+    entry = (dedup_block_t *) hashtable_lookup(&dd->blocks, blk);
+    if (entry == NULL)
+        return false;
+    if (!entry->writable)
+        dd->num_readonly--;
+    dedup_release_slot(dd, entry->slot);
+    hashtable_remove(&dd->blocks, blk);
+    return true;
+}
+
+typedef struct _dedup_pass_t {
+    bool uniform_only;
+    uint shared;
+    /* hash => a block not yet shared, awaiting a match */
+    hashtable_t pending;
+} dedup_pass_t;
+
+static bool
+dedup_share_block(umbra_map_t *map, app_segment_t *seg, byte *blk, void *data)
+{
+    dedup_pass_t *pass = (dedup_pass_t *) data;
+    dedup_state_t *dd = &dedup_state[map->index];
+    dedup_block_t *entry = (dedup_block_t *) hashtable_lookup(&dd->blocks, blk);
+    dedup_slot_t *slot;
+    byte *other;
+    uint hash;
+    if (entry != NULL && !entry->writable)
+        return true; /* already shared */
+    if (pass->uniform_only &&
+        umbra_shadow_value_search(blk, map->shadow_block_size, blk[0], 1,
+                                  false/*!equal*/) != NULL)
+        return true;
+    hash = dedup_hash(blk, map->shadow_block_size);
+    slot = dedup_lookup_slot(map, dd, blk, hash);
+    if (slot == NULL) {
+        /* Only contents found in at least two blocks are worth a slot */
+        other = (byte *) hashtable_lookup(&pass->pending, (void *)(ptr_uint_t)hash);
+        if (other == NULL) {
+            hashtable_add(&pass->pending, (void *)(ptr_uint_t)hash, blk);
+            return true;
+        }
+        if (memcmp(other, blk, map->shadow_block_size) != 0)
+            return true; /* hash collision */
+        slot = dedup_new_slot(map, dd, blk, hash);
+        if (slot == NULL)
+            return false;
+        hashtable_remove(&pass->pending, (void *)(ptr_uint_t)hash);
+        if (dedup_map_block(map, dd, other, slot))
+            pass->shared++;
+    }
+    if (dedup_map_block(map, dd, blk, slot))
+        pass->shared++;
+    return true;
+}
+
+static void
+umbra_fork_init(void *drcontext)
+{
+    uint i;
+    /* The parent goes on reusing the slots of the file, so the child copies
+     * its blocks out of it and starts over.  Only this thread exists now, so
+     * no lock is needed.
+     */
+    for (i = 0; i < MAX_NUM_MAPS; i++) {
+        if (dedup_state[i].initialized)
+            dedup_unshare_all(dedup_state[i].map, true/*privatize*/);
+    }
+}
+#endif /* UNIX */
+
+/* Makes the block containing shdw_addr writable if it is shared.  Umbra's
+ * writers call this, as faults in client code are not ours to handle.
+ * On a map that may be shared, the map lock is held until the caller's
+ * umbra_finish_shadow_write(): otherwise a share pass could map the block
+ * read-only again before or during the write.
+ */
+static inline void
+umbra_prepare_shadow_write(umbra_map_t *map, byte *shdw_addr)
+{
+#ifdef UNIX
+    if (!TEST(UMBRA_MAP_SHADOW_SHARED_READONLY, map->options.flags))
+        return;
+    umbra_map_lock(map);
+    dedup_make_writable(map, (byte *)ALIGN_BACKWARD(shdw_addr, map->shadow_block_size));
+#endif
+}
+
+static inline void
+umbra_finish_shadow_write(umbra_map_t *map)
+{
+#ifdef UNIX
+    if (TEST(UMBRA_MAP_SHADOW_SHARED_READONLY, map->options.flags))
+        umbra_map_unlock(map);
+#endif
+}
+
+/* Returns whether the committed block containing shdw_addr is shared */
+static bool
+umbra_shadow_block_shared(umbra_map_t *map, byte *shdw_addr)
+{
+#ifdef UNIX
+    dedup_state_t *dd = &dedup_state[map->index];
+    dedup_block_t *entry;
+    bool shared;
+    if (dd->num_readonly == 0)
+        return false;
+    umbra_map_lock(map);
+    entry = (dedup_block_t *)
+        hashtable_lookup(&dd->blocks, (void *)ALIGN_BACKWARD(shdw_addr,
+                                                             map->shadow_block_size));
+    shared = (entry != NULL && !entry->writable);
+    umbra_map_unlock(map);
+    return shared;
+#else
     return false;
+#endif
+}
+
+/* Frees the committed block at blk.  The caller must hold the map lock. */
+static void
+umbra_free_block(umbra_map_t *map, byte *blk)
+{
+    umbra_clear_shadow_bitmap(map, blk);
+#ifdef UNIX
+    if (dedup_forget_block(map, blk)) {
+        dr_unmap_file(blk, map->shadow_block_size);
+        return;
+    }
+#endif
+    dr_raw_mem_free(blk, map->shadow_block_size);
 }
 
 /***************************************************************************
@@ -728,12 +1379,18 @@ umbra_arch_init()
 #endif
     if (!umbra_address_space_init())
         return DRMF_ERROR;
+#ifdef UNIX
+    dr_register_fork_init_event(umbra_fork_init);
+#endif
     return DRMF_SUCCESS;
 }
 
 void
 umbra_arch_exit()
 {
+#ifdef UNIX
+    dr_unregister_fork_init_event(umbra_fork_init);
+#endif
     memset(&app_segments, 0, sizeof(app_segments));
 }
 
@@ -797,24 +1454,36 @@ void
 umbra_map_arch_exit(umbra_map_t *map)
 {
     uint i;
+#ifdef UNIX
+    dedup_unshare_all(map, false/*just unmap*/);
+#endif
     umbra_iterate_shadow_memory(map, NULL, umbra_map_shadow_free);
     for (i = 0; i < MAX_NUM_APP_SEGMENTS; i++) {
         if (app_segments[i].app_used && app_segments[i].map[map->index] == map) {
-            size_t size;
             app_segment_t *seg = &app_segments[i];
-            size = seg->shadow_end[map->index] - seg->shadow_base[map->index];
-            size = size / map->shadow_block_size / BIT_PER_BYTE;
-            global_free(seg->shadow_bitmap[map->index], size, HEAPSTAT_SHADOW);
+            global_free(seg->shadow_bitmap[map->index],
+                        segment_bitmap_words(map, seg) * sizeof(uint), HEAPSTAT_SHADOW);
+            global_free(seg->shadow_summary[map->index],
+                        segment_summary_words(map, seg) * sizeof(uint),
+                        HEAPSTAT_SHADOW);
             seg->shadow_bitmap[map->index] = NULL;
+            seg->shadow_summary[map->index] = NULL;
             seg->shadow_base[map->index] = NULL;
             seg->shadow_end[map->index] = NULL;
             seg->reserve_base[map->index] = NULL;
             seg->reserve_end[map->index] = NULL;
+            seg->committed_blocks[map->index] = 0;
+            seg->peak_committed_blocks[map->index] = 0;
         }
         /* We never disable the app_used field (except on umbra_arch_exit()). */
     }
 }
 
+static drmf_status_t
+umbra_shadow_fill_range(umbra_map_t *map, app_pc app_addr, size_t app_size,
+                        size_t *shadow_size, ptr_uint_t value, size_t value_size,
+                        bool share_blocks);
+
 drmf_status_t
 umbra_create_shadow_memory_arch(umbra_map_t *map,
                                 uint   flags,
@@ -829,7 +1498,7 @@ umbra_create_shadow_memory_arch(umbra_map_t *map,
     size_t size, iter_size;
     byte  *shadow_blk, *res;
 
-    if (value_size != 1 || value >= UCHAR_MAX)
+    if (value_size != 1 || value > UCHAR_MAX)
         return DRMF_ERROR_FEATURE_NOT_AVAILABLE;
     if (POINTER_OVERFLOW_ON_ADD(app_addr, app_size-1)) /* just hitting top is ok */
         return DRMF_ERROR_INVALID_SIZE;
@@ -839,6 +1508,7 @@ umbra_create_shadow_memory_arch(umbra_map_t *map,
     umbra_map_lock(map);
     APP_RANGE_LOOP(app_addr, app_size, app_blk_base, app_blk_end, app_src_end,
                    start, end, iter_size, {
+        bool fresh = false;
         shadow_blk  = (byte *)umbra_xl8_app_to_shadow(map, app_blk_base);
         if (!umbra_shadow_block_exist(map, shadow_blk)) {
             umbra_map_lock(map);
@@ -854,12 +1524,26 @@ umbra_create_shadow_memory_arch(umbra_map_t *map,
                     umbra_set_shadow_bitmap(map, res);
                     ASSERT(umbra_shadow_block_exist(map, res),
                            "fail to set shadow bitmap");
+                    fresh = true;
                 }
             }
             umbra_map_unlock(map);
         }
-        if (umbra_shadow_set_range_arch(map, start, iter_size, &size,
-                                        value, value_size) != DRMF_SUCCESS) {
+        if (fresh) {
+            /* A new block is zero-filled by the kernel and its pages are not
+             * yet backed.  The part outside of the requested range must hold
+             * the default value, while writing a zero value can be skipped,
+             * which leaves a block that is never touched untouched.
+             */
+            if (iter_size != map->app_block_size && map->options.default_value != 0)
+                memset(shadow_blk, map->options.default_value, map->shadow_block_size);
+            if (value == 0 &&
+                (iter_size == map->app_block_size || map->options.default_value == 0))
+                continue;
+        }
+        /* The caller asked for a normal block, which may replace a shared one */
+        if (umbra_shadow_fill_range(map, start, iter_size, &size, value, value_size,
+                                    false/*!share*/) != DRMF_SUCCESS) {
             umbra_map_unlock(map);
             return DRMF_ERROR;
         }
@@ -873,11 +1557,35 @@ umbra_delete_shadow_memory_arch(umbra_map_t *map,
                                 app_pc       app_addr,
                                 size_t       app_size)
 {
-    size_t shadow_size;
-    return umbra_shadow_set_range_arch(map, app_addr, app_size,
-                                       &shadow_size,
-                                       map->options.default_value,
-                                       map->options.default_value_size);
+    /* i#1260: end pointers are all closed (i.e., inclusive) to handle overflow */
+    app_pc app_blk_base, app_blk_end, app_src_end;
+    app_pc start, end;
+    size_t size, iter_size;
+    byte  *shadow_blk;
+
+    if (POINTER_OVERFLOW_ON_ADD(app_addr, app_size-1)) /* just hitting top is ok */
+        return DRMF_ERROR_INVALID_SIZE;
+    APP_RANGE_LOOP(app_addr, app_size, app_blk_base, app_blk_end, app_src_end,
+                   start, end, iter_size, {
+        shadow_blk = (byte *)umbra_xl8_app_to_shadow(map, app_blk_base);
+        if (iter_size == map->app_block_size &&
+            TEST(UMBRA_MAP_CREATE_SHADOW_ON_TOUCH, map->options.flags)) {
+            /* Free a fully covered block: it is re-created holding the default
+             * value on its next touch, just like a block never created.
+             * Without on-touch creation a later access would find no block,
+             * so we only reset the content below.
+             */
+            umbra_map_lock(map);
+            if (umbra_shadow_block_exist(map, shadow_blk))
+                umbra_free_block(map, shadow_blk);
+            umbra_map_unlock(map);
+        } else if (umbra_shadow_set_range_arch(map, start, iter_size, &size,
+                                               map->options.default_value,
+                                               map->options.default_value_size) !=
+                   DRMF_SUCCESS)
+            return DRMF_ERROR;
+    });
+    return DRMF_SUCCESS;
 }
 
 drmf_status_t
@@ -958,7 +1666,9 @@ umbra_write_shadow_memory_arch(IN    umbra_map_t *map,
                 return res;
         }
         size = umbra_map_scale_app_to_shadow(map, iter_size);
+        umbra_prepare_shadow_write(map, shadow_start);
         memmove(shadow_start, buffer, size);
+        umbra_finish_shadow_write(map);
         shdw_size += size;
         buffer    += size;
     });
@@ -966,13 +1676,14 @@ umbra_write_shadow_memory_arch(IN    umbra_map_t *map,
     return DRMF_SUCCESS;
 }
 
-drmf_status_t
-umbra_shadow_set_range_arch(IN   umbra_map_t *map,
-                            IN   app_pc       app_addr,
-                            IN   size_t       app_size,
-                            OUT  size_t      *shadow_size,
-                            IN   ptr_uint_t   value,
-                            IN   size_t       value_size)
+/* If share_blocks is set, a whole block is filled by mapping the shared block
+ * holding nothing but value (see dedup_map_uniform_block()) rather than by
+ * writing it.
+ */
+static drmf_status_t
+umbra_shadow_fill_range(umbra_map_t *map, app_pc app_addr, size_t app_size,
+                        size_t *shadow_size, ptr_uint_t value, size_t value_size,
+                        bool share_blocks)
 {
     /* i#1260: end pointers are all closed (i.e., inclusive) to handle overflow */
     app_pc app_blk_base, app_blk_end, app_src_end;
@@ -989,25 +1700,56 @@ umbra_shadow_set_range_arch(IN   umbra_map_t *map,
     APP_RANGE_LOOP(app_addr, app_size, app_blk_base, app_blk_end, app_src_end,
                    start, end, iter_size, {
         shadow_start = umbra_xl8_app_to_shadow(map, start);
+        size = umbra_map_scale_app_to_shadow(map, iter_size);
+#ifdef UNIX
+        /* A fresh block already holds zero without being touched, so only a
+         * non-zero value is worth a shared mapping there.
+         */
+        if (share_blocks && iter_size == map->app_block_size &&
+            (value != 0 || umbra_shadow_block_exist(map, shadow_start)) &&
+            umbra_add_app_segment(start, iter_size, map) &&
+            dedup_map_uniform_block(map, shadow_start, (byte)value)) {
+            shdw_size += size;
+            continue;
+        }
+#endif
         if (!umbra_shadow_block_exist(map, shadow_start)) {
             drmf_status_t res;
             if (!TEST(UMBRA_MAP_CREATE_SHADOW_ON_TOUCH, map->options.flags))
                 return DRMF_ERROR_INVALID_PARAMETER;
-            res = umbra_create_shadow_memory_arch(map, 0, app_blk_base,
-                                                  map->app_block_size,
-                                                  map->options.default_value,
-                                                  map->options.default_value_size);
+            /* Creating the block with the value lets a zero value covering
+             * the whole block skip all writes.
+             */
+            res = umbra_create_shadow_memory_arch(map, 0, start, iter_size,
+                                                  value, value_size);
             if (res != DRMF_SUCCESS)
                 return res;
+            shdw_size += size;
+            continue;
         }
-        size = umbra_map_scale_app_to_shadow(map, iter_size);
+        umbra_prepare_shadow_write(map, shadow_start);
         memset(shadow_start, value, size);
+        umbra_finish_shadow_write(map);
         shdw_size += size;
     });
     *shadow_size = shdw_size;
     return DRMF_SUCCESS;
 }
 
+drmf_status_t
+umbra_shadow_set_range_arch(IN   umbra_map_t *map,
+                            IN   app_pc       app_addr,
+                            IN   size_t       app_size,
+                            OUT  size_t      *shadow_size,
+                            IN   ptr_uint_t   value,
+                            IN   size_t       value_size)
+{
+    /* Only a client that expects shared blocks can be handed them */
+    return umbra_shadow_fill_range(map, app_addr, app_size, shadow_size, value,
+                                   value_size, TEST(UMBRA_MAP_SHADOW_SHARED_READONLY,
+                                                    map->options.flags));
+}
+
 drmf_status_t
 umbra_shadow_copy_range_arch(IN  umbra_map_t *map,
                              IN  app_pc  app_src,
@@ -1091,16 +1833,15 @@ umbra_value_in_shadow_memory_arch(IN    umbra_map_t *map,
                                   IN    size_t  app_size,
                                   IN    ptr_uint_t value,
                                   IN    size_t value_size,
+                                  IN    bool equal,
                                   OUT   bool  *found)
 {
     /* i#1260: end pointers are all closed (i.e., inclusive) to handle overflow */
     app_pc app_blk_base, app_blk_end, app_src_end;
     app_pc start, end;
-    byte  *shadow_start, *shadow_addr = NULL;
+    byte  *shadow_start, *shadow_addr;
     size_t shadow_size, iter_size;
 
-    if (value > USHRT_MAX || (value_size != 1 && value_size != 2))
-        return DRMF_ERROR_NOT_IMPLEMENTED;
     if (POINTER_OVERFLOW_ON_ADD(*app_addr, app_size-1)) /* just hitting top is ok */
         return DRMF_ERROR_INVALID_SIZE;
 
@@ -1109,40 +1850,29 @@ umbra_value_in_shadow_memory_arch(IN    umbra_map_t *map,
                    start, end, iter_size, {
         shadow_start = umbra_xl8_app_to_shadow(map, start);
         if (!umbra_shadow_block_exist(map, shadow_start)) {
-            drmf_status_t res;
+            app_pc next;
+            /* A block not yet created reads as the default value, so there
+             * is no need to create it here.
+             */
             if (!TEST(UMBRA_MAP_CREATE_SHADOW_ON_TOUCH, map->options.flags))
                 return DRMF_ERROR_INVALID_PARAMETER;
-            res = umbra_create_shadow_memory_arch(map, 0, app_blk_base,
-                                                  map->app_block_size,
-                                                  map->options.default_value,
-                                                  map->options.default_value_size);
-            if (res != DRMF_SUCCESS)
-                return res;
-            if (value == map->options.default_value &&
-                value_size == map->options.default_value_size) {
+            if (umbra_value_matches_fill(value, value_size,
+                                         map->options.default_value,
+                                         map->options.default_value_size) == equal) {
                 *app_addr = start;
                 *found = true;
                 return DRMF_SUCCESS;
             }
+            /* Skip straight to the next block that exists */
+            next = umbra_next_committed_app_block(map, app_blk_end, app_src_end);
+            if (next == NULL)
+                break;
+            app_blk_end = next - 1;
             continue;
         }
         shadow_size = umbra_map_scale_app_to_shadow(map, iter_size);
-        if (value_size == 1) {
-            shadow_addr = memchr(shadow_start, (int)value, shadow_size);
-        } else if (shadow_size > 0) {
-            byte *first_byte = shadow_start;
-            while (first_byte != NULL) {
-                first_byte = memchr(first_byte, (char)value,
-                                    shadow_size - 1 - (first_byte - shadow_start));
-                if (first_byte != NULL) {
-                    if (*(first_byte + 1) == (char)(value>>8)) {
-                        shadow_addr = first_byte;
-                        break;
-                    } else
-                        first_byte++;
-                }
-            }
-        }
+        shadow_addr = umbra_shadow_value_search(shadow_start, shadow_size,
+                                                value, value_size, equal);
         if (shadow_addr != NULL) {
             app_pc found_addr = start +
                 umbra_map_scale_shadow_to_app(map, shadow_addr - shadow_start);
@@ -1163,6 +1893,26 @@ umbra_num_scratch_regs_for_translation_arch()
     return 0;
 }
 
+/* Adds map->disp to the masked app address in reg and scales the sum */
+static void
+umbra_insert_add_disp_and_shift(void *drcontext, umbra_map_t *map,
+                                instrlist_t *ilist, instr_t *where, reg_id_t reg)
+{
+    PRE(ilist, where, INSTR_CREATE_add(drcontext,
+                                       opnd_create_reg(reg),
+                                       OPND_CREATE_ABSMEM(&map->disp,
+                                                          OPSZ_PTR)));
+    if (map->options.scale == UMBRA_MAP_SCALE_UP_2X) {
+        PRE(ilist, where, INSTR_CREATE_shl(drcontext,
+                                           opnd_create_reg(reg),
+                                           OPND_CREATE_INT8(map->shift)));
+    } else if (map->options.scale <= UMBRA_MAP_SCALE_DOWN_2X) {
+        PRE(ilist, where, INSTR_CREATE_shr(drcontext,
+                                           opnd_create_reg(reg),
+                                           OPND_CREATE_INT8(map->shift)));
+    }
+}
+
 /* code sequence:
  *
  */
@@ -1179,61 +1929,129 @@ umbra_insert_app_to_shadow_arch(void *drcontext,
                                        opnd_create_reg(reg_addr),
                                        OPND_CREATE_ABSMEM(&map->mask,
                                                           OPSZ_PTR)));
-    PRE(ilist, where, INSTR_CREATE_add(drcontext,
+    umbra_insert_add_disp_and_shift(drcontext, map, ilist, where, reg_addr);
+    return DRMF_SUCCESS;
+}
+
+/* Returns the constant difference between the shadow addresses of
+ * maps with the same scale and mask for any one app address.
+ * The disps of such maps differ by whole shadow units (see
+ * umbra_map_arch_init()), so the difference survives the shift exactly.
+ */
+static ptr_int_t
+umbra_shadow_delta(umbra_map_t *map, umbra_map_t *base)
+{
+    ASSERT(map->options.scale == base->options.scale && map->mask == base->mask,
+           "maps must share scale and mask");
+    if (map->disp >= base->disp)
+        return (ptr_int_t)umbra_map_scale_app_to_shadow(map, map->disp - base->disp);
+    return -(ptr_int_t)umbra_map_scale_app_to_shadow(map, base->disp - map->disp);
+}
+
+/* code sequence, when all masks match (always the case on Linux):
+ * %reg_addr      &= mask;
+ * for each map i whose scale differs from maps[0]'s:
+ *   %shadow_reg_i  = %reg_addr;
+ *   %shadow_reg_i += disp_i;  %shadow_reg_i >>= (or <<=) shift_i;
+ * %reg_addr      += disp_0;  %reg_addr >>= (or <<=) shift_0;
+ * for each map i with maps[0]'s scale:
+ *   %shadow_reg_i  = delta_i;
+ *   %shadow_reg_i += %reg_addr;
+ */
+drmf_status_t
+umbra_insert_app_to_shadow_multi_arch(void *drcontext,
+                                      umbra_map_t **maps,
+                                      uint num_maps,
+                                      instrlist_t *ilist,
+                                      instr_t *where,
+                                      reg_id_t reg_addr,
+                                      reg_id_t *shadow_regs,
+                                      reg_id_t *scratch_regs,
+                                      int num_scratch_regs)
+{
+    umbra_map_t *base = maps[0];
+    uint i;
+    for (i = 1; i < num_maps; i++) {
+        if (maps[i]->mask != base->mask)
+            break;
+    }
+    if (i < num_maps) {
+        /* A Windows scale-up map has an extra mask bit: nothing is shared,
+         * so translate a copy of the app address for each map.
+         */
+        for (i = 1; i < num_maps; i++) {
+            PRE(ilist, where, INSTR_CREATE_mov_ld(drcontext,
+                                                  opnd_create_reg(shadow_regs[i-1]),
+                                                  opnd_create_reg(reg_addr)));
+        }
+        for (i = 1; i < num_maps; i++) {
+            umbra_insert_app_to_shadow_arch(drcontext, maps[i], ilist, where,
+                                            shadow_regs[i-1], scratch_regs,
+                                            num_scratch_regs);
+        }
+        return umbra_insert_app_to_shadow_arch(drcontext, base, ilist, where,
+                                               reg_addr, scratch_regs,
+                                               num_scratch_regs);
+    }
+    PRE(ilist, where, INSTR_CREATE_and(drcontext,
                                        opnd_create_reg(reg_addr),
-                                       OPND_CREATE_ABSMEM(&map->disp,
+                                       OPND_CREATE_ABSMEM(&base->mask,
                                                           OPSZ_PTR)));
-    if (map->options.scale == UMBRA_MAP_SCALE_UP_2X) {
-        PRE(ilist, where, INSTR_CREATE_shl(drcontext,
-                                           opnd_create_reg(reg_addr),
-                                           OPND_CREATE_INT8(map->shift)));
-    } else if (map->options.scale <= UMBRA_MAP_SCALE_DOWN_2X) {
-        PRE(ilist, where, INSTR_CREATE_shr(drcontext,
-                                           opnd_create_reg(reg_addr),
-                                           OPND_CREATE_INT8(map->shift)));
+    for (i = 1; i < num_maps; i++) {
+        if (maps[i]->options.scale == base->options.scale)
+            continue;
+        PRE(ilist, where, INSTR_CREATE_mov_ld(drcontext,
+                                              opnd_create_reg(shadow_regs[i-1]),
+                                              opnd_create_reg(reg_addr)));
+        umbra_insert_add_disp_and_shift(drcontext, maps[i], ilist, where,
+                                        shadow_regs[i-1]);
+    }
+    umbra_insert_add_disp_and_shift(drcontext, base, ilist, where, reg_addr);
+    for (i = 1; i < num_maps; i++) {
+        if (maps[i]->options.scale != base->options.scale)
+            continue;
+        PRE(ilist, where, INSTR_CREATE_mov_imm
+            (drcontext, opnd_create_reg(shadow_regs[i-1]),
+             OPND_CREATE_INTPTR(umbra_shadow_delta(maps[i], base))));
+        PRE(ilist, where, INSTR_CREATE_add(drcontext,
+                                           opnd_create_reg(shadow_regs[i-1]),
+                                           opnd_create_reg(reg_addr)));
     }
     return DRMF_SUCCESS;
 }
 
+typedef struct _iterate_shadow_data_t {
+    void *user_data;
+    shadow_iterate_func_t iter_func;
+} iterate_shadow_data_t;
+
+static bool
+umbra_iterate_shadow_block(umbra_map_t *map, app_segment_t *seg, byte *blk,
+                           void *data)
+{
+    iterate_shadow_data_t *iter = (iterate_shadow_data_t *) data;
+    umbra_shadow_memory_info_t info;
+    info.struct_size = sizeof(info);
+    info.app_base = seg->app_base +
+        umbra_map_scale_shadow_to_app(map, blk - seg->shadow_base[map->index]);
+    info.app_size = map->app_block_size;
+    info.shadow_base = blk;
+    info.shadow_size = map->shadow_block_size;
+    info.shadow_type = umbra_shadow_block_shared(map, blk) ?
+        UMBRA_SHADOW_MEMORY_TYPE_SHARED : UMBRA_SHADOW_MEMORY_TYPE_NORMAL;
+    return iter->iter_func(map, &info, iter->user_data);
+}
+
 drmf_status_t
 umbra_iterate_shadow_memory_arch(umbra_map_t *map,
                                  void *user_data,
                                  shadow_iterate_func_t iter_func)
 {
-    uint i;
-    umbra_shadow_memory_info_t info;
-
-    for (i = 0; i < MAX_NUM_APP_SEGMENTS; i++) {
-        byte *shdw_addr;
-        dr_mem_info_t mem_info;
-        if (!app_segments[i].app_used)
-            continue;
-        shdw_addr = app_segments[i].shadow_base[map->index];
-        while (shdw_addr < app_segments[i].shadow_end[map->index] &&
-               dr_query_memory_ex(shdw_addr, &mem_info)) {
-            if (mem_info.type != DR_MEMTYPE_FREE) {
-                ptr_uint_t delta;
-                ASSERT(mem_info.type == DR_MEMTYPE_DATA &&
-                       mem_info.base_pc >=
-                       app_segments[i].shadow_base[map->index],
-                       "wrong shadow memory");
-                delta = mem_info.base_pc -
-                    app_segments[i].shadow_base[map->index];
-                info.app_base = app_segments[i].app_base +
-                    umbra_map_scale_shadow_to_app(map, delta);
-                info.app_size = umbra_map_scale_shadow_to_app(map,
-                                                              mem_info.size);
-                info.shadow_base = mem_info.base_pc;
-                info.shadow_size = mem_info.size;
-                info.shadow_type = UMBRA_SHADOW_MEMORY_TYPE_NORMAL;
-                if (!iter_func(map, &info, user_data))
-                    break;
-            }
-            shdw_addr = mem_info.base_pc + mem_info.size;
-        }
-        ASSERT(shdw_addr >= app_segments[i].shadow_end[map->index],
-               "fail to query shadow memory");
-    }
+    iterate_shadow_data_t iter = {user_data, iter_func};
+    /* Each block is reported on its own, as each is a separate allocation
+     * (which umbra_map_arch_exit() relies on to free them).
+     */
+    umbra_iterate_committed_blocks(map, umbra_iterate_shadow_block, &iter);
     return DRMF_SUCCESS;
 }
 
@@ -1242,7 +2060,10 @@ umbra_shadow_memory_is_shared_arch(IN  umbra_map_t *map,
                                    IN  byte *shadow_addr,
                                    OUT umbra_shadow_memory_type_t *shadow_type)
 {
-    *shadow_type = UMBRA_SHADOW_MEMORY_TYPE_UNKNOWN;
+    if (umbra_shadow_block_shared(map, shadow_addr))
+        *shadow_type = UMBRA_SHADOW_MEMORY_TYPE_SHARED;
+    else
+        *shadow_type = UMBRA_SHADOW_MEMORY_TYPE_UNKNOWN;
     return DRMF_SUCCESS;
 }
 
@@ -1261,7 +2082,9 @@ umbra_get_shadow_memory_type_arch(umbra_map_t *map,
             break;
         } else if (shadow_addr >= app_segments[i].shadow_base[map->index] &&
                    shadow_addr <= app_segments[i].shadow_end[map->index]) {
-            if (umbra_shadow_block_exist(map, shadow_addr))
+            if (umbra_shadow_block_shared(map, shadow_addr))
+                *shadow_type = UMBRA_SHADOW_MEMORY_TYPE_SHARED;
+            else if (umbra_shadow_block_exist(map, shadow_addr))
                 *shadow_type = UMBRA_SHADOW_MEMORY_TYPE_NORMAL;
             else
                 *shadow_type = UMBRA_SHADOW_MEMORY_TYPE_SHADOW_NOT_ALLOC;
@@ -1321,7 +2144,12 @@ umbra_replace_shared_shadow_memory_arch(umbra_map_t *map,
                                         app_pc app_addr,
                                         byte **shadow_addr)
 {
+    /* A shared block is made writable in place.  The client writes to it
+     * later, so it must not run a share pass concurrently.
+     */
     *shadow_addr = umbra_xl8_app_to_shadow(map, app_addr);
+    umbra_prepare_shadow_write(map, *shadow_addr);
+    umbra_finish_shadow_write(map);
     return DRMF_SUCCESS;
 }
 
@@ -1331,7 +2159,27 @@ umbra_create_shared_shadow_block_arch(IN  umbra_map_t *map,
                                       IN  size_t       value_size,
                                       OUT byte       **block)
 {
+#ifdef UNIX
+    dedup_state_t *dd = &dedup_state[map->index];
+    dedup_slot_t *slot = NULL;
+    *block = NULL;
+    if (value_size != 1 || value > UCHAR_MAX ||
+        !TEST(UMBRA_MAP_SHADOW_SHARED_READONLY, map->options.flags))
+        return DRMF_ERROR_FEATURE_NOT_AVAILABLE;
+    umbra_map_lock(map);
+    if (dedup_init(map, dd))
+        slot = dedup_uniform_slot(map, dd, (byte)value);
+    umbra_map_unlock(map);
+    if (slot == NULL)
+        return DRMF_ERROR_NOMEM;
+    /* The slot's read-only view has the same contents as the blocks mapping it */
+    *block = slot->view;
+    return DRMF_SUCCESS;
+#else
+    /* XXX: Windows would need a pagefile-backed section to share pages */
+    *block = NULL;
     return DRMF_ERROR_FEATURE_NOT_AVAILABLE;
+#endif
 }
 
 drmf_status_t
@@ -1340,8 +2188,132 @@ umbra_get_shared_shadow_block_arch(IN  umbra_map_t *map,
                                    IN  size_t       value_size,
                                    OUT byte       **block)
 {
+#ifdef UNIX
+    dedup_state_t *dd = &dedup_state[map->index];
+    *block = NULL;
+    if (value_size != 1 || value > UCHAR_MAX)
+        return DRMF_SUCCESS;
+    umbra_map_lock(map);
+    if (dd->initialized && dd->uniform[value] != NULL)
+        *block = dd->uniform[value]->view;
+    umbra_map_unlock(map);
+    return DRMF_SUCCESS;
+#else
     *block = NULL;
     return DRMF_ERROR_FEATURE_NOT_AVAILABLE;
+#endif
+}
+
+/* Commits count consecutive missing blocks starting at blk, holding the
+ * default value.  Returns how many were created.  The caller must hold the
+ * map lock.
+ */
+static uint
+umbra_create_blocks(umbra_map_t *map, byte *blk, uint count)
+{
+    uint i;
+#ifdef UNIX
+    /* One mapping for the lot: a single block can still be freed on its own */
+    byte *res = dr_raw_mem_alloc(count * map->shadow_block_size,
+                                 DR_MEMPROT_READ | DR_MEMPROT_WRITE, blk);
+    if (res != blk) {
+        if (res != NULL)
+            dr_raw_mem_free(res, count * map->shadow_block_size);
+        return 0;
+    }
+#else
+    /* A Windows allocation can only be freed as a whole, and blocks are freed
+     * one at a time, so we save the faults but not the allocations.
+     */
+    for (i = 0; i < count; i++) {
+        byte *cur = blk + i * map->shadow_block_size;
+        byte *res = dr_raw_mem_alloc(map->shadow_block_size,
+                                     DR_MEMPROT_READ | DR_MEMPROT_WRITE, cur);
+        if (res != cur) {
+            if (res != NULL)
+                dr_raw_mem_free(res, map->shadow_block_size);
+            count = i;
+            break;
+        }
+    }
+#endif
+    for (i = 0; i < count; i++)
+        umbra_set_shadow_bitmap(map, blk + i * map->shadow_block_size);
+    /* new memory is zero-filled */
+    if (map->options.default_value != 0)
+        memset(blk, map->options.default_value, count * map->shadow_block_size);
+    return count;
+}
+
+/* Creates the missing shadow block containing target.  If this fault follows
+ * on from the blocks created for the last one in the same segment, as when
+ * the app streams through a large new region, also creates blocks ahead of
+ * it: twice as many as last time, up to MAX_FAULT_PREFETCH_BLOCKS.
+ */
+static void
+umbra_create_shadow_on_fault(umbra_map_t *map, app_segment_t *seg, byte *target)
+{
+    uint map_idx = map->index;
+    size_t idx = BLOCK_INDEX(map, target, seg->shadow_base[map_idx]);
+    size_t num_blocks = segment_num_blocks(map, seg);
+    byte *blk = seg->shadow_base[map_idx] + idx * map->shadow_block_size;
+    uint want, count, created;
+
+    umbra_map_lock(map);
+    map->num_faults++;
+    if (umbra_shadow_block_exist(map, blk)) {
+        /* Either another thread got here first, or this is a write to a
+         * shared block.
+         */
+        IF_UNIX(dedup_make_writable(map, blk));
+        umbra_map_unlock(map);
+        return;
+    }
+    if (idx == seg->fault_next_block[map_idx] && seg->fault_prefetch[map_idx] > 0)
+        want = MIN(seg->fault_prefetch[map_idx] * 2, MAX_FAULT_PREFETCH_BLOCKS);
+    else
+        want = 1;
+    /* Stop short of any block that exists or the segment end */
+    for (count = 1; count < want && idx + count < num_blocks; count++) {
+        if (umbra_shadow_block_exist(map, blk + count * map->shadow_block_size))
+            break;
+    }
+    created = umbra_create_blocks(map, blk, count);
+    if (created == 0 && count > 1)
+        created = umbra_create_blocks(map, blk, 1);
+    ASSERT(created > 0, "fail to create shadow memory on fault");
+    seg->fault_next_block[map_idx] = idx + created;
+    seg->fault_prefetch[map_idx] = created;
+    map->fault_blocks_created += created;
+    if (created > 1)
+        map->fault_blocks_prefetched += created - 1;
+    LOG(UMBRA_VERBOSE, "shadow fault @"PFX": created %d block(s) at "PFX"\n",
+        target, created, blk);
+    umbra_map_unlock(map);
+}
+
+void
+umbra_get_segment_footprint_arch(umbra_map_t *map,
+                                 umbra_shadow_footprint_t *footprint)
+{
+    uint i, map_idx = map->index;
+    footprint->num_segments = 0;
+    for (i = 0; i < MAX_NUM_APP_SEGMENTS; i++) {
+        app_segment_t *seg = &app_segments[i];
+        umbra_segment_footprint_t *out;
+        if (!seg->app_used || seg->map[map_idx] != map)
+            continue;
+        if (footprint->num_segments >= UMBRA_MAX_FOOTPRINT_SEGMENTS) {
+            ASSERT(false, "too many segments to report");
+            break;
+        }
+        out = &footprint->segments[footprint->num_segments++];
+        out->app_base = seg->app_base;
+        out->app_end = seg->app_end;
+        out->committed_bytes = seg->committed_blocks[map_idx] * map->shadow_block_size;
+        out->peak_committed_bytes =
+            seg->peak_committed_blocks[map_idx] * map->shadow_block_size;
+    }
 }
 
 bool
@@ -1355,14 +2327,8 @@ umbra_handle_fault(void *drcontext, byte *target, dr_mcontext_t *raw_mc,
             if (app_segments[i].map[j] != NULL &&
                 target >= app_segments[i].shadow_base[j] &&
                 target <  app_segments[i].shadow_end[j]) {
-                umbra_map_t *map = app_segments[i].map[j];
-                app_pc app_addr = (app_pc)
-                    app_segments[i].app_base +
-                    umbra_map_scale_shadow_to_app
-                    (map, target - app_segments[i].shadow_base[j]);
-                umbra_create_shadow_memory_arch(map, 0, app_addr, 8,
-                                                map->options.default_value,
-                                                map->options.default_value_size);
+                umbra_create_shadow_on_fault(app_segments[i].map[j], &app_segments[i],
+                                             target);
                 return true;
             }
         }
@@ -1370,9 +2336,90 @@ umbra_handle_fault(void *drcontext, byte *target, dr_mcontext_t *raw_mc,
     return false;
 }
 
+/* Frees the block at blk if it holds nothing but the default value.
+ * The caller must hold the map lock.
+ */
+static bool
+umbra_free_redundant_block(umbra_map_t *map, app_segment_t *seg, byte *blk,
+                           void *data)
+{
+    uint *count = (uint *) data;
+    if (umbra_shadow_value_search(blk, map->shadow_block_size,
+                                  map->options.default_value,
+                                  map->options.default_value_size,
+                                  false/*!equal*/) != NULL)
+        return true;
+    umbra_free_block(map, blk);
+    (*count)++;
+    return true;
+}
+
 drmf_status_t
 umbra_clear_redundant_blocks(umbra_map_t *map, uint *count)
 {
-    /* No operation needed for x64. */
+    uint freed = 0;
+
+    if (map == NULL)
+        return DRMF_ERROR_INVALID_PARAMETER;
+
+    if (count != NULL)
+        *count = 0;
+
+    /* A freed block is re-created holding the default value by
+     * umbra_handle_fault() on its next touch, which requires create-on-touch.
+     */
+    if (!TEST(UMBRA_MAP_CREATE_SHADOW_ON_TOUCH, map->options.flags))
+        return DRMF_ERROR_INVALID_PARAMETER;
+
+    if (!umbra_map_trylock(map))
+        return DRMF_ERROR_ACCESS_DENIED;
+    umbra_iterate_committed_blocks(map, umbra_free_redundant_block, &freed);
+    umbra_map_unlock(map);
+
+    if (count != NULL)
+        *count = freed;
+    return DRMF_SUCCESS;
+}
+
+drmf_status_t
+umbra_share_identical_blocks(umbra_map_t *map, bool uniform_only, uint *count)
+{
+#ifdef UNIX
+    dedup_pass_t pass;
+#endif
+
+    if (map == NULL)
+        return DRMF_ERROR_INVALID_PARAMETER;
+
+    if (count != NULL)
+        *count = 0;
+
+    /* The client must expect shared blocks when it writes shadow memory */
+    if (!TEST(UMBRA_MAP_SHADOW_SHARED_READONLY, map->options.flags))
+        return DRMF_ERROR_INVALID_PARAMETER;
+
+#ifdef UNIX
+    if (!umbra_map_trylock(map))
+        return DRMF_ERROR_ACCESS_DENIED;
+    if (!dedup_init(map, &dedup_state[map->index])) {
+        umbra_map_unlock(map);
+        return DRMF_ERROR_FEATURE_NOT_AVAILABLE;
+    }
+    pass.uniform_only = uniform_only;
+    pass.shared = 0;
+    hashtable_init(&pass.pending, DEDUP_BLOCK_TABLE_BITS, HASH_INTPTR,
+                   false/*!strdup*/);
+    umbra_iterate_committed_blocks(map, dedup_share_block, &pass);
+    hashtable_delete(&pass.pending);
+    LOG(UMBRA_VERBOSE, "shared %d shadow blocks, %d read-only in total\n",
+        pass.shared, dedup_state[map->index].num_readonly);
+    umbra_map_unlock(map);
+
+    if (count != NULL)
+        *count = pass.shared;
+    return DRMF_SUCCESS;
+#else
+    /* XXX: Windows would need a pagefile-backed section to share pages */
     return DRMF_ERROR_FEATURE_NOT_AVAILABLE;
+#endif
 }
@@ -73,6 +73,13 @@ struct _umbra_map_t {
     ptr_uint_t mask;
 #endif
     void *lock;
+    /* shadow creation on fault, updated under the map lock */
+    uint64 num_faults;
+    uint64 fault_blocks_created;
+    uint64 fault_blocks_prefetched;
+    /* normal shadow blocks currently committed, and the most ever committed */
+    size_t committed_blocks;
+    size_t peak_committed_blocks;
 };
 
 
@@ -136,6 +143,20 @@ umbra_map_scale_shadow_to_app(umbra_map_t *map, ptr_uint_t shadow_value);
 bool
 umbra_address_is_app_memory(app_pc addr);
 
+/* Returns the first value_size-byte element in [start, start+size) that is equal
+ * (or if !equal, not equal) to value, or NULL if there is none.
+ */
+byte *
+umbra_shadow_value_search(byte *start, size_t size, ptr_uint_t value,
+                          size_t value_size, bool equal);
+
+/* Returns whether value_size bytes of memory filled with the fill_size-byte
+ * fill (i.e., a special or default shadow value) read back as value.
+ */
+bool
+umbra_value_matches_fill(ptr_uint_t value, size_t value_size,
+                         ptr_uint_t fill, size_t fill_size);
+
 void
 umbra_lock();
 
@@ -148,6 +169,9 @@ umbra_map_lock(umbra_map_t *map);
 void
 umbra_map_unlock(umbra_map_t *map);
 
+bool
+umbra_map_trylock(umbra_map_t *map);
+
 /***************************************************************************
  * ARCHITECTURE SPECIFIC IMPLEMENTATION ROUTINES
  */
@@ -189,6 +213,18 @@ umbra_insert_app_to_shadow_arch(void *drcontext,
                                 reg_id_t *scratch_regs,
                                 int num_scratch_regs);
 
+/* num_maps is at least 2 and the registers have been checked by the caller */
+drmf_status_t
+umbra_insert_app_to_shadow_multi_arch(void *drcontext,
+                                      umbra_map_t **maps,
+                                      uint num_maps,
+                                      instrlist_t *ilist,
+                                      instr_t *where,
+                                      reg_id_t reg_addr,
+                                      reg_id_t *shadow_regs,
+                                      reg_id_t *scratch_regs,
+                                      int num_scratch_regs);
+
 drmf_status_t
 umbra_read_shadow_memory_arch(umbra_map_t *map,
                               app_pc  app_addr,
@@ -245,6 +281,7 @@ umbra_value_in_shadow_memory_arch(umbra_map_t *map,
                                   size_t app_size,
                                   ptr_uint_t value,
                                   size_t value_size,
+                                  bool equal,
                                   bool *found);
 drmf_status_t
 umbra_replace_shared_shadow_memory_arch(umbra_map_t *map,
@@ -263,6 +300,11 @@ umbra_get_shared_shadow_block_arch(IN  umbra_map_t *map,
                                    IN  size_t       value_size,
                                    OUT byte       **block);
 
+/* Fills in footprint->segments and footprint->num_segments */
+void
+umbra_get_segment_footprint_arch(umbra_map_t *map,
+                                 umbra_shadow_footprint_t *footprint);
+
 bool
 umbra_handle_fault(void *drcontext, byte *target, dr_mcontext_t *raw_mc,
                    dr_mcontext_t *mc);